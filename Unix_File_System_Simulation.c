@@ -1,12 +1,107 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// SSE2/AVX2 substring kernels, compiled per function and chosen at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Untorn access to fields one writer updates while server readers load them without its locks
+#ifdef __GNUC__
+#define RELAXED_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define RELAXED_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#else
+#define RELAXED_LOAD(field) (field)
+#define RELAXED_STORE(field, value) ((field) = (value))
+#endif
+
+// Indices of the watch rings: each side publishes its own with a release store and reads the other's with an
+// acquire load, so a slot's contents are visible before the index that hands it over
+#ifdef __GNUC__
+#define ACQUIRE_LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define RELEASE_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#else
+#define ACQUIRE_LOAD(field) (field)
+#define RELEASE_STORE(field, value) ((field) = (value))
+#endif
+
+// Hint that memory is about to be read, so walks over separately allocated chunks overlap their cache misses
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+
 #define MAX_NAME 256
 #define MAX_CONTENT 1024
 #define MAX_PATH_LENGTH 4096
-#define MAX_QUEUE 1000
+#define DIR_INDEX_MIN_CAPACITY 8
+#define NODE_SLAB_SIZE 4096
+#define RECLAIM_BATCH 4096
+#define EXTENT_MIN_SIZE 64
+#define EXTENT_MAX_SIZE (1024 * 1024)
+#define CHUNK_SIZE 4096
+#define CHUNK_COLD_COMMANDS 64
+#define CHUNK_SCAN_SLOTS 256
+#define LZ_TABLE_BITS 12
+#define NAME_BLOCK_SIZE 65536
+#define NODE_NIL 0xFFFFFFFFu
+#define NODE_FOLDER_BIT 0x80000000u
+#define IMAGE_MAGIC "UFSIMAGE"
+#define IMAGE_VERSION 3
+#define JOURNAL_MAGIC "UFSJRNL1"
+#define JOURNAL_CHECKPOINT_BYTES (64L * 1024 * 1024)
+#define LAZY_BUDGET_MB 256
+#define IMAGE_BYTE_ORDER 0x01020304u
+#define MAX_ARGS 64
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define RENDER_BLOCK_SIZE (64 * 1024)
+#define TIME_TEXT_SIZE 20
+#define WATCH_RING_SIZE 1024
+#define WATCH_TAKEN 0x80000000u
+#define CMD_OK 0
+#define CMD_ERROR 1
+#define CMD_EXIT 2
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (61 * HIST_SUB_BUCKETS)
+#define STATS_SAMPLE_ALL 64
+#define STATS_SAMPLE_EVERY 16
+#define PATH_CACHE_SIZE 4096
+#define PATH_CACHE_KEY 112
+#define MAX_WALK_THREADS 64
+#define DIR_LOCK_STRIPES 1024
+#define SERVER_BACKLOG 64
+#define SESSION_BUFFER_SIZE (64 * 1024)
+#define LOAD_DIRS 32
+#define LOAD_FILES 32
+#define LOAD_OWN_FILES 64
 
 typedef enum
 {
@@ -14,797 +109,12848 @@ typedef enum
     TYPE_FOLDER = 1
 } NodeType;
 
+struct FileNode;
+
+// Variable-length run of file bytes; extents of a file form a singly linked chain
+typedef struct Extent
+{
+    struct Extent *next;
+    size_t length;
+    size_t capacity;
+    char data[];
+} Extent;
+
+// A loaded filesystem image kept mapped while file content still points into it
+typedef struct MappedImage
+{
+    struct MappedImage *next;
+    char *base;
+    size_t size;
+    size_t refs;
+} MappedImage;
+
+MappedImage *mappedImages = NULL;
+
+// Immutable run of up to CHUNK_SIZE file bytes, stored once and shared by every file holding the same bytes.
+// A cold chunk may hold its bytes compressed, in which case stored < length.
+typedef struct Chunk
+{
+    uint64_t hash;
+    char *data;
+    size_t refs;
+    uint32_t length;
+    uint32_t stored;
+    uint32_t lastUse;
+    uint32_t compressTried;
+} Chunk;
+
+// Open-addressed table of live chunks keyed by content hash, with the byte totals stats reports
+typedef struct ChunkStore
+{
+    Chunk **slots;
+    size_t slotCapacity;
+    size_t count;
+    size_t logical;
+    size_t unique;
+    size_t stored;
+    size_t compressed;
+    size_t cursor;
+    uint32_t tick;
+    int dedup;
+    int compress;
+} ChunkStore;
+
+ChunkStore chunkStore = {NULL, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0};
+
+// Content of a non-empty file, allocated on first write.
+// The bytes are an optional read-only base inside a mapped image, then sealed chunks, then extents.
+// Writes seal every full CHUNK_SIZE of the extents into chunks, so only the unsealed tail is private.
+// cp shares one content between files; refs counts them and the first write to a shared copy unshares it.
+typedef struct FileContent
+{
+    const char *base;
+    size_t baseLength;
+    MappedImage *image;
+    Chunk **chunks;
+    size_t chunkCount;
+    size_t sealed;
+    Extent *head;
+    Extent *tail;
+    size_t size;
+    size_t refs;
+} FileContent;
+
+// Totals across the content store
+typedef struct ContentStats
+{
+    size_t files;
+    size_t extents;
+    size_t bytes;
+    size_t reserved;
+    size_t mapped;
+    size_t shared;
+} ContentStats;
+
+ContentStats contentStats = {0, 0, 0, 0, 0, 0};
+
+// Image superblock; all offsets are relative to the start of the file
+typedef struct ImageSuperblock
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t nodeCount;
+    uint32_t nameCount;
+    uint64_t nodeOffset;
+    uint64_t nameTableOffset;
+    uint64_t nameOffset;
+    uint64_t nameBytes;
+    uint64_t contentOffset;
+    uint64_t contentBytes;
+    uint64_t fileSize;
+    uint64_t journalSequence;
+    uint64_t totalsOffset;
+    uint64_t folderCount;
+} ImageSuperblock;
+
+// Fixed-size node record, stored in preorder; links are record indices
+typedef struct ImageNode
+{
+    uint32_t parent;
+    uint32_t fChild;
+    uint32_t nSibling;
+    uint32_t name;
+    uint32_t type;
+    uint32_t folder;
+    int64_t createdTime;
+    int64_t modifiedTime;
+    uint64_t contentOffset;
+    uint64_t contentSize;
+} ImageNode;
+
+// Subtree totals of one folder record (version 3), indexed by the record's folder ordinal
+typedef struct ImageTotals
+{
+    uint64_t bytes;
+    uint64_t files;
+    uint64_t folders;
+    int64_t newest;
+} ImageTotals;
+
+// Journaled mutations
+typedef enum
+{
+    OP_MKDIR = 1,
+    OP_TOUCH = 2,
+    OP_REMOVE = 3,
+    OP_WRITE = 4,
+    OP_APPEND = 5,
+    OP_RENAME = 6,
+    OP_MOVE = 7,
+    OP_COPY = 8,
+    OP_COPY_INTO = 9,
+    OP_COPY_TREE = 10,
+    OP_REMOVE_TREE = 11,
+    // The record just before this one failed to apply and is not replayed
+    OP_ABORT = 12
+} JournalOp;
+
+// Append-only operation log with group commit.
+// syncEvery = 0 never fsyncs; syncMillis = 0 disables the time trigger.
+typedef struct Journal
+{
+    FILE *file;
+    const char *path;
+    int syncEvery;
+    int syncMillis;
+    int pending;
+    double firstPending;
+    int replaying;
+    uint64_t sequence;
+    long checkpointBytes;
+    size_t bytes;
+    unsigned long records;
+    unsigned long syncs;
+    unsigned char *buffer;
+    size_t bufferCapacity;
+} Journal;
+
+// A record decoded by replay, held back until the next one shows it was not aborted
+typedef struct JournalRecord
+{
+    uint64_t sequence;
+    JournalOp op;
+    char *a;
+    char *b;
+    char *data;
+    size_t length;
+} JournalRecord;
+
+Journal journal = {NULL, NULL, 1, 0, 0, 0.0, 0, 0, JOURNAL_CHECKPOINT_BYTES, 0, 0, 0, NULL, 0};
+
+// Timer for --sync-ms: a thread that fsyncs a pending group once its first record is syncMillis old, so the
+// trigger fires even when no further command comes. lock guards the journal's file and group between the two.
+typedef struct JournalSyncer
+{
+    int running;
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+} JournalSyncer;
+
+#ifdef _WIN32
+JournalSyncer journalSyncer = {0};
+#else
+JournalSyncer journalSyncer = {0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+#endif
+
+// Log-linear latency histogram in nanoseconds: 16 sub-buckets per power of two (~6% error)
+typedef struct LatencyHistogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sumNs;
+    uint64_t maxNs;
+} LatencyHistogram;
+
+// Shell commands with their own counters; anything else is counted as "other"
+const char *commandNames[] = {"ls", "cd", "pwd", "mkdir", "touch", "rm", "cat", "echo", "cp", "mv",
+                              "rename", "find", "tree", "du", "grep", "save", "load", "checkpoint", "snapshot",
+                              "import", "export", "watch", "unwatch", "events", "stats", "man", "help", "clear", "exit",
+                              "other"};
+#define COMMAND_COUNT (sizeof(commandNames) / sizeof(commandNames[0]))
+
+// Call and error counts per command, with latency timed on a sample of calls
+typedef struct CommandStats
+{
+    uint64_t calls;
+    uint64_t errors;
+    LatencyHistogram latency;
+} CommandStats;
+
+CommandStats commandStats[COMMAND_COUNT];
+
+// Size of the tree from the root's subtree totals, plus its shape when a walk of the node table is asked for
+typedef struct TreeGauges
+{
+    size_t folders;
+    size_t files;
+    size_t bytes;
+    size_t maxDepth;
+    size_t maxFanout;
+    uint32_t widest;
+} TreeGauges;
+
+// Optional periodic dump of the statistics as JSON lines
+typedef struct StatsDump
+{
+    const char *path;
+    long interval;
+    time_t next;
+} StatsDump;
+
+StatsDump statsDump = {NULL, 10, 0};
+
+// Operation kinds generated by the workload benchmark
+typedef enum
+{
+    WL_MKDIR = 0,
+    WL_TOUCH,
+    WL_RM,
+    WL_MV,
+    WL_FIND,
+    WL_CAT,
+    WL_WRITE,
+    WL_OP_COUNT
+} WorkloadOp;
+
+// A synthetic tree shape plus an operation mix to run against it
+typedef struct Workload
+{
+    const char *name;
+    const char *shape;
+    long nodes;
+    long ops;
+    double skew;
+    int mix[WL_OP_COUNT];
+    uint64_t seed;
+} Workload;
+
+// One load-test client of --bench server: a connection, an operation mix and its results
+typedef struct LoadClient
+{
+    const char *socketPath;
+    const char *base;
+    int id;
+    long ops;
+    int readPercent;
+    uint64_t seed;
+    long reads;
+    long writes;
+    long errors;
+    int started;
+    int failed;
+    LatencyHistogram latency;
+} LoadClient;
+
+// What happened to a watched node; an overflow event stands for the events a full ring dropped
+typedef enum
+{
+    WATCH_CREATE,
+    WATCH_DELETE,
+    WATCH_MODIFY,
+    WATCH_MOVE,
+    WATCH_OVERFLOW
+} WatchKind;
+
+// One queued event. count is how many events it stands for (writes folded into it, or events an overflow
+// marker dropped); the consumer sets WATCH_TAKEN in it when it claims the slot, and the producer stops
+// folding into a taken slot.
+typedef struct WatchEvent
+{
+    char *path;
+    uint32_t count;
+    WatchKind kind;
+} WatchEvent;
+
+// A session's watch on a node: events on the node and its children, or with recursive on its whole subtree.
+// Events go through a single-producer/single-consumer ring: the command holding the writer lock produces and
+// advances head, and the owning session consumes and advances tail, without taking any lock. lastNode and
+// lastKind belong to the producer and describe the newest slot, which a further write to the same file folds
+// into while it is still queued. lost counts events dropped after the overflow marker was already claimed.
+typedef struct Watch
+{
+    uint32_t id;
+    int recursive;
+    struct FileNode *target;
+    char *label;
+    WatchEvent *slots;
+    size_t head;
+    size_t tail;
+    size_t lost;
+    struct FileNode *lastNode;
+    WatchKind lastKind;
+    size_t published;
+    size_t folded;
+    size_t dropped;
+    struct Watch *next;
+    struct Watch *ownerNext;
+} Watch;
+
+// Every watch, walked by producers under the writer lock. Mutation sites test count first, so publishing
+// costs one load when nobody is watching.
+typedef struct WatchList
+{
+    Watch *head;
+    size_t count;
+    uint32_t nextId;
+} WatchList;
+
+WatchList watchList = {NULL, 0, 1};
+
+// Session state for the command interpreter
+typedef struct Shell
+{
+    struct FileNode *root;
+    struct FileNode *current;
+    const char *imagePath;
+    FILE *input;
+    int interactive;
+    int stopOnError;
+    Watch *watches;
+} Shell;
+
+// Open-addressing hash index over a directory's children, keyed on fileName
+typedef struct DirIndex
+{
+    struct FileNode **slots;
+    size_t capacity;
+    size_t count;
+} DirIndex;
+
+// Hot per-node fields packed into 16 bytes, four to a cache line.
+// Links are node ids; name holds the interned name id, with NODE_FOLDER_BIT for folders.
+typedef struct NodeHot
+{
+    uint32_t parent;
+    uint32_t fChild;
+    uint32_t nSibling;
+    uint32_t name;
+} NodeHot;
+
+// Contiguous table of hot node records addressed by 32-bit id
+typedef struct NodeTable
+{
+    NodeHot *hot;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t freeHead;
+    uint32_t live;
+} NodeTable;
+
+NodeTable nodeTable = {NULL, 0, 0, NODE_NIL, 0};
+
+// Arena block holding interned name bytes; blocks never move
+typedef struct NameBlock
+{
+    struct NameBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} NameBlock;
+
+// Interned name; free entries chain through hash with str == NULL
+typedef struct InternEntry
+{
+    const char *str;
+    unsigned int hash;
+    unsigned int refs;
+} InternEntry;
+
+// Shared string arena with an open-addressing table of entry ids
+typedef struct NameArena
+{
+    NameBlock *blocks;
+    InternEntry *entries;
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+    uint32_t freeEntry;
+    uint32_t *slots;
+    size_t slotCapacity;
+    size_t liveNames;
+    size_t bytes;
+    size_t deadBytes;
+} NameArena;
+
+NameArena nameArena = {NULL, NULL, 0, 0, NODE_NIL, NULL, 0, 0, 0, 0};
+
+// Everything below a directory: content bytes, files, folders and the newest modification time
+// (the directory's own included). Kept current along the parent chain on every change.
+typedef struct SubtreeTotals
+{
+    size_t bytes;
+    size_t files;
+    size_t folders;
+    time_t newest;
+} SubtreeTotals;
+
+// Set while a tree is built in bulk (image load, cp -r); totalsRebuild then fixes it up in one pass
+int totalsPaused = 0;
+
+// Set by any change to the tree and cleared once it is checkpointed, so a session that only read the
+// tree leaves its image as it was
+int treeDirty = 0;
+
+// Immutable version of a file or directory, shared between snapshots and the live nodes they were taken
+// from. A directory's children are versions too, sorted by name; a file holds a reference on its content.
+typedef struct SnapNode
+{
+    uint32_t nameId;
+    NodeType type;
+    unsigned int refs;
+    uint32_t count;
+    time_t createdTime;
+    time_t modifiedTime;
+    FileContent *content;
+    struct SnapNode **children;
+    struct SnapNode *next;
+} SnapNode;
+
 typedef struct FileNode
 {
-    char fileName[MAX_NAME];
-    char fileContent[MAX_CONTENT];
+    const char *fileName;
+    uint32_t id;
+    uint32_t nameId;
+    FileContent *content;
     NodeType type;
+    uint32_t lazySlot;
     time_t createdTime;
     time_t modifiedTime;
     struct FileNode *parent;
     struct FileNode *fChild;
     struct FileNode *nSibling;
+    struct FileNode *pSibling;
+    struct FileNode *lChild;
+    struct FileNode *nameNext;
+    struct FileNode *namePrev;
+    unsigned int nameHash;
+    int nameIndexed;
+    unsigned int pins;
+    SubtreeTotals totals;
+    DirIndex index;
+    struct FileNode *orderRoot;
+    struct FileNode *orderLeft;
+    struct FileNode *orderRight;
+    struct FileNode *orderUp;
+    SnapNode *snap;
 } FileNode;
 
+// Global name -> nodes index; slots hold the first node of each same-name ring
+DirIndex nameIndex = {NULL, 0, 0};
+
+// Treap links of one distinct name in the global name order, addressed by interned name id
+typedef struct NameOrderEntry
+{
+    const char *str;
+    uint32_t left;
+    uint32_t right;
+    uint32_t up;
+    unsigned int priority;
+} NameOrderEntry;
+
+// Names that have a ring in the name index, ordered so find can seek a glob's literal prefix.
+// Changed with the name index, under the namespace lock; entries never outlive their ring.
+typedef struct NameOrder
+{
+    NameOrderEntry *entries;
+    uint32_t capacity;
+    uint32_t root;
+    size_t count;
+} NameOrder;
+
+NameOrder nameOrder = {NULL, 0, NODE_NIL, 0};
+
+// Resolved directory for a multi-component path prefix, relative to a base directory
+typedef struct PathCacheEntry
+{
+    uint64_t generation;
+    uint32_t base;
+    uint32_t length;
+    struct FileNode *dir;
+    char key[PATH_CACHE_KEY];
+} PathCacheEntry;
+
+// Direct-mapped path cache; bumping generation drops every entry at once
+typedef struct PathCache
+{
+    PathCacheEntry *entries;
+    uint64_t generation;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+} PathCache;
+
+PathCache pathCache = {NULL, 1, 0, 0, 0};
+
+// A directory to expand; bucket tags which top-level entry it came from, and sequence is the preorder
+// position (counting files only) of the first file below it
+typedef struct WalkTask
+{
+    struct FileNode *node;
+    uint32_t bucket;
+    size_t sequence;
+} WalkTask;
+
+// Per-worker deque: the owner pushes and pops at the tail, thieves take from the head
+typedef struct WorkDeque
+{
+    WalkTask *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} WorkDeque;
+
+// One parallel walk: visit is called once per node, from whichever worker expands its parent.
+// A file's sequence is its position among the walk's files in preorder, worked out from the subtree totals.
+typedef struct ParallelWalk
+{
+    int threads;
+    WorkDeque *deques;
+    size_t pending;
+    void (*visit)(struct ParallelWalk *walk, int worker, struct FileNode *node, uint32_t bucket, size_t sequence);
+    void *context;
+} ParallelWalk;
+
+// Persistent worker threads shared by all walks; the caller's thread is worker 0
+typedef struct WorkerPool
+{
+    int threads;
+    int started;
+    unsigned long generation;
+    int active;
+    ParallelWalk *walk;
+#ifndef _WIN32
+    pthread_t *ids;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+#endif
+} WorkerPool;
+
+#ifdef _WIN32
+WorkerPool workerPool = {1, 0, 0, 0, NULL};
+#else
+WorkerPool workerPool = {0, 0, 0, 0, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                         PTHREAD_COND_INITIALIZER};
+#endif
+
+// Server mode: many sessions share one tree. Commands that change the tree (or scan all of it) run one
+// at a time under writerLock; read-only commands run in parallel under striped per-directory rwlocks.
+// A directory's stripe covers its entries and their files' content; find and pwd read names under
+// namespaceLock, which writers hold while names or parent links change.
+typedef struct Server
+{
+    int active;
+    volatile int stopping;
+    int listenFd;
+    size_t sessions;
+    size_t sessionsTotal;
+    size_t writerBackoffs;
+    size_t readerRestarts;
+#ifndef _WIN32
+    pthread_mutex_t writerLock;
+    pthread_mutex_t statsLock;
+    pthread_rwlock_t namespaceLock;
+    pthread_rwlock_t quiesceLock;
+    pthread_rwlock_t dirLocks[DIR_LOCK_STRIPES];
+#endif
+    struct Session *sessionList;
+} Server;
+
+Server server = {0};
+
+// Stripes one writer holds exclusively, and whether it also holds the namespace lock
+typedef struct DirLocks
+{
+    int count;
+    int names;
+    uint32_t stripes[3];
+} DirLocks;
+
+// One client connection: its own shell (and current directory) over the shared tree
+// Sessions are listed (under the writer lock) so rm -r can check their current directories.
+typedef struct Session
+{
+    Shell shell;
+    FILE *input;
+    FILE *output;
+    struct Session *prev;
+    struct Session *next;
+} Session;
+
+// Where shell commands print: stdout, or the connection of the session running on this thread
+THREAD_LOCAL FILE *shellOut;
+
+// Per-thread count of holds on each directory stripe, so nested shared locks take the rwlock once
+THREAD_LOCAL uint32_t heldStripes[DIR_LOCK_STRIPES];
+
+// Output block every render on this thread reuses, grown only for a single oversized piece
+THREAD_LOCAL char *renderBlock;
+THREAD_LOCAL size_t renderBlockSize;
+
+// Text of the minute formatTime last formatted on this thread, which every time in [start, start + 60) shares
+typedef struct TimeCache
+{
+    time_t start;
+    int valid;
+    size_t length;
+    char text[TIME_TEXT_SIZE];
+} TimeCache;
+
+THREAD_LOCAL TimeCache timeCache;
+
+// Fixed-size block of nodes; nodes past 'used' have never been handed out
+typedef struct NodeSlab
+{
+    struct NodeSlab *next;
+    size_t used;
+    FileNode nodes[NODE_SLAB_SIZE];
+} NodeSlab;
+
+// Pooled FileNode allocator; freed nodes are chained through nSibling
+typedef struct NodePool
+{
+    NodeSlab *slabs;
+    FileNode *freeList;
+    size_t slabCount;
+    size_t liveNodes;
+    size_t freeNodes;
+    size_t totalAllocs;
+    size_t totalFrees;
+    int enabled;
+} NodePool;
+
+NodePool nodePool = {NULL, NULL, 0, 0, 0, 0, 0, 1};
+
+// Subtrees unlinked by rm -r, chained through nSibling and freed a batch at a time after later commands
+typedef struct Reclaim
+{
+    FileNode *pending;
+    size_t subtrees;
+    size_t freed;
+    size_t batches;
+    uint64_t maxBatchNs;
+} Reclaim;
+
+Reclaim reclaim = {NULL, 0, 0, 0, 0};
+
+// A point-in-time copy of the whole tree: the root version at the time it was taken
+typedef struct Snapshot
+{
+    struct Snapshot *next;
+    unsigned int id;
+    time_t created;
+    SnapNode *root;
+    SubtreeTotals totals;
+} Snapshot;
+
+// Snapshots oldest first, with counts of the versions alive and built by the last freeze
+typedef struct SnapshotStore
+{
+    Snapshot *head;
+    Snapshot *tail;
+    unsigned int nextId;
+    size_t count;
+    size_t versions;
+    size_t built;
+} SnapshotStore;
+
+SnapshotStore snapshots = {NULL, NULL, 1, 0, 0, 0};
+
+// An image-backed directory of a lazily opened image. A stub has its record's children still on disk;
+// a loaded one is clean while its children match the image, and only clean ones sit on the LRU list.
+typedef struct LazyDir
+{
+    FileNode *dir;
+    uint32_t record;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t loadedChildren;
+    unsigned char loaded;
+    unsigned char dirty;
+} LazyDir;
+
+// The image behind a lazy tree, its directory slots (most recently used first) and the memory budget
+typedef struct LazyImage
+{
+    MappedImage *image;
+    const ImageSuperblock *super;
+    const ImageNode *records;
+    const uint64_t *nameTable;
+    const char *names;
+    const char *content;
+    const ImageTotals *totals;
+    LazyDir *dirs;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t freeSlot;
+    uint32_t used;
+    uint32_t head;
+    uint32_t tail;
+    int loading;
+    size_t budget;
+    size_t loads;
+    size_t evictions;
+} LazyImage;
+
+LazyImage lazy = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, NODE_NIL, 0, NODE_NIL, NODE_NIL, 0, 0, 0, 0};
+
+// One pattern element: the set of bytes it accepts and how often it may repeat
+typedef struct RegexAtom
+{
+    unsigned char set[32];
+    char repeat;
+} RegexAtom;
+
+// Compiled line regex (. [] [^] \ * + ? ^ $) and the longest literal every match must contain
+typedef struct Regex
+{
+    RegexAtom *atoms;
+    size_t count;
+    int anchorStart;
+    int anchorEnd;
+    char *literal;
+    size_t literalLength;
+} Regex;
+
+typedef enum
+{
+    LIST_BY_NAME,
+    LIST_BY_MTIME,
+    LIST_BY_SIZE
+} ListOrder;
+
+// ls options: order, page size (0 = all), exclusive cursor, name prefix and compiled glob
+typedef struct ListOptions
+{
+    int details;
+    ListOrder order;
+    size_t limit;
+    const char *after;
+    const char *prefix;
+    const Regex *glob;
+} ListOptions;
+
+// Command output staged in a per-thread block and written out whole when it fills; entries counts the
+// lines emitted against an optional cap (0 = none), and truncated records that the cap cut a listing short
+typedef struct RenderBuffer
+{
+    FILE *out;
+    char *data;
+    size_t used;
+    size_t capacity;
+    size_t entries;
+    size_t maxEntries;
+    int truncated;
+} RenderBuffer;
+
+// How grep reports: matching lines, a count per file, or just the file's path
+typedef enum
+{
+    GREP_LINES,
+    GREP_COUNT,
+    GREP_FILES
+} GrepMode;
+
+// grep command options
+typedef struct GrepOptions
+{
+    const char *pattern;
+    int recursive;
+    int fixed;
+    GrepMode mode;
+} GrepOptions;
+
+// One listed child with the keys read under its lock
+typedef struct ListEntry
+{
+    FileNode *node;
+    time_t modified;
+    size_t size;
+} ListEntry;
+
+// Entries moved by one import or export, and those it had to leave out
+typedef struct TransferCounts
+{
+    size_t folders;
+    size_t files;
+    size_t bytes;
+    size_t skipped;
+    size_t failed;
+} TransferCounts;
+
 // Function prototypes
 FileNode *createNode(const char *name, const char *content, NodeType type);
+FileNode *createNodeWithName(uint32_t nameId, NodeType type, time_t now);
 FileNode *findNode(FileNode *root, const char *name);
 FileNode *findParent(FileNode *parentFolder, const char *node);
+FileNode *findChild(FileNode *parent, const char *name);
 int insertNode(FileNode *parent, FileNode *newNode);
+int insertNodeAt(FileNode *parent, FileNode *newNode, time_t now);
+void detachNode(FileNode *node);
 int deleteNode(FileNode *root, FileNode *parent, const char *name);
+int renameNode(FileNode *node, const char *newName);
+void nameIndexAdd(FileNode *node);
+void nameIndexAddTree(FileNode *top);
+void nameIndexRemove(FileNode *node);
+FileNode *nameIndexLookup(const char *name);
+int isInSubtree(FileNode *root, FileNode *node);
+FileNode *nodeAlloc(void);
+void nodeFree(FileNode *node);
+void nodePoolDestroy(void);
+void printPoolStats(void);
+int contentAppend(FileNode *node, const char *data, size_t length);
+int contentAppendBytes(FileNode *node, const char *data, size_t length);
+int contentWrite(FileNode *node, const char *data, size_t length);
+void contentShare(FileNode *dst, FileNode *src);
+int contentUnshare(FileNode *node);
+void contentFree(FileNode *node);
+void contentDrop(FileContent *content);
+void contentPrint(const FileNode *node, FILE *out);
+size_t contentSize(const FileNode *node);
+void printContentStats(void);
+void printLazyStats(void);
+void contentSetMapped(FileNode *node, MappedImage *image, const char *base, size_t length);
+MappedImage *imageMap(const char *path);
+void imageRelease(MappedImage *image);
+FileNode *nextPreorder(FileNode *top, FileNode *node);
+size_t contentRead(const FileNode *node, char *out);
+Chunk *chunkIntern(const char *data, size_t length);
+void chunkRelease(Chunk *chunk);
+void chunkDestroy(Chunk *chunk);
+size_t chunkCopy(Chunk *chunk, char *out);
+void chunkCompressStep(size_t slots, uint32_t age);
+void contentSeal(FileContent *content, int all);
+int contentUnseal(FileContent *content);
+int walkThreads(void);
+size_t sharedCounterAdd(size_t *counter, long delta);
+void parallelWalkRun(ParallelWalk *walk, FileNode *top, int splitTop);
+void freeTreeParallel(FileNode *top);
+void workerPoolStart(int threads);
+int diskUsageWalk(FileNode *dir, const char *label, FILE *out);
+void diskUsage(FileNode *dir, const char *label, int summary, FILE *out);
+SubtreeTotals totalsRead(FileNode *dir);
+long grepTree(FileNode *top, const GrepOptions *options, FILE *out);
+int globCompile(Regex *glob, const char *pattern);
+int globMatch(const Regex *glob, const char *name);
+void regexFree(Regex *regex);
+size_t findGlob(FileNode *root, const Regex *glob, RenderBuffer *render);
+void searchKernelSelect(void);
+int saveImage(FileNode *root, const char *path);
+FileNode *loadImage(const char *path);
+int syncFile(FILE *file);
+int nodePath(FileNode *node, char *path, size_t size);
+FileNode *walkPath(FileNode *node, const char *path, size_t length);
+FileNode *resolveDirectory(FileNode *root, FileNode *cwd, const char *path, size_t length);
+FileNode *resolvePath(FileNode *root, FileNode *cwd, const char *path);
+FileNode *resolveParent(FileNode *root, FileNode *cwd, const char *path, char *leaf);
+void pathCacheInvalidate(void);
+void printPathStats(void);
+void dirLockShared(FileNode *dir);
+int dirTryLockShared(FileNode *dir);
+uint32_t dirStripe(FileNode *dir);
+void dirLockSharedOrdered(FileNode *dir, uint32_t highest);
+void dirUnlockShared(FileNode *dir);
+void dirLockExclusive(DirLocks *locks, FileNode *a, FileNode *b, FileNode *c, int names);
+void dirUnlockExclusive(DirLocks *locks);
+void serverLockWriter(void);
+void serverUnlockWriter(void);
+void serverLockStats(void);
+void serverUnlockStats(void);
+void serverLockNamespace(void);
+void serverUnlockNamespace(void);
+void serverLockReader(void);
+void serverUnlockReader(void);
+void serverQuiesceReaders(void);
+void serverResumeReaders(void);
+int sessionInside(FileNode *top);
+void nodePin(FileNode *node, int delta);
+FileNode *resolveShared(FileNode *root, FileNode *cwd, const char *path, FileNode **locked);
+void displayTreeShared(RenderBuffer *render, FileNode *top, int maxDepth);
+int commandExclusive(int argc, char **argv);
+int serverListen(const char *path);
+void serverAccept(Shell *shell, int fd);
+int serverConnect(const char *path);
+long serverRequest(int fd, const char *line, FILE *out, int *error);
+void printServerStats(void);
+Watch *watchAdd(Shell *shell, FileNode *target, int recursive);
+void watchRemove(Shell *shell, Watch *watch);
+void watchRemoveAll(Shell *shell);
+void watchDetachAll(void);
+int watchInside(FileNode *dir);
+int watchCovers(const Watch *watch, FileNode *node, FileNode *parent);
+int watchSlotFold(uint32_t *count);
+uint32_t watchSlotClaim(uint32_t *count);
+void watchPush(Watch *watch, WatchKind kind, FileNode *node, const char *text, size_t length);
+void watchPublish(WatchKind kind, FileNode *node, const char *from, FileNode *fromParent);
+size_t watchDrain(Watch *watch, RenderBuffer *render, size_t max);
+void watchPrint(const Shell *shell);
+int fsCreate(FileNode *dir, const char *name, NodeType type);
+int fsRemove(FileNode *dir, const char *name, int recursive);
+int fsWrite(FileNode *dir, const char *name, const char *data, size_t length, int append);
+int fsRename(FileNode *node, const char *newName);
+int fsMove(FileNode *node, FileNode *dstDir);
+int fsCopy(FileNode *src, FileNode *dstDir, const char *dstName, int recursive);
+int journalOpen(const char *path);
+void journalClose(void);
+int journalLog(JournalOp op, const char *a, const char *b, const char *data, size_t length);
+int journalLogNode(JournalOp op, FileNode *node, const char *name, FileNode *other, const char *data,
+                   size_t length);
+void journalAbort(void);
+void journalCommit(int force);
+void journalCommitLocked(int force);
+void journalLock(void);
+void journalUnlock(void);
+void journalSyncStart(void);
+void journalSyncStop(void);
+int journalReplay(FileNode *root);
+int checkpoint(FileNode *root, const char *imagePath);
+int splitCommand(char **line, char **args, int maxArgs);
+int executeCommand(Shell *shell, int argc, char **argv);
+int runLine(Shell *shell, char *line);
+int stdinIsTerminal(void);
+size_t commandSlot(const char *name);
+void collectTreeGauges(FileNode *root, TreeGauges *gauges, int shape);
+void printCommandStats(void);
+void printTreeStats(FileNode *root);
+void printStatsJson(FILE *out, FileNode *root);
+void statsDumpWrite(FileNode *root);
+char *readLine(FILE *in, size_t *length);
+int readLineBuffer(FILE *in, char **line, size_t *capacity, size_t *length);
+uint32_t internName(const char *name);
+void releaseName(uint32_t nameId);
+uint32_t nodeTableAlloc(void);
+void nodeTableFree(uint32_t id);
+void printNameStats(void);
+const char *nodeTableName(uint32_t id);
+unsigned int hashName(const char *name);
 void freeTree(FileNode *node);
+int freeTreeBatch(FileNode *top, size_t *budget);
+void reclaimPush(FileNode *top);
+void reclaimStep(size_t budget);
+FileNode *copyTree(FileNode *src, const char *name);
+void totalsAdd(FileNode *dir, long long bytes, long files, long folders, time_t when);
+SubtreeTotals totalsOf(FileNode *node);
+void totalsRebuild(FileNode *top);
+void snapInvalidate(FileNode *node);
+void nodeChanged(FileNode *node);
+int lazyStub(const FileNode *node);
+int lazyStubRange(const FileNode *node, uint32_t *first, uint32_t *end);
+int lazyRecordValid(const ImageNode *record);
+void lazyTouch(FileNode *dir);
+void lazyLoadAll(FileNode *top);
+void lazyLoadDepth(FileNode *top, int maxDepth);
+void lazyRelease(FileNode *node);
+void lazyClose(void);
+void lazyTrim(FileNode *root, FileNode *current);
+FileNode *lazyOpen(const char *path);
+size_t lazyResident(void);
+FileContent *contentFromFile(FILE *in, size_t length, ContentStats *stats);
+int importTree(const char *source, FileNode *dest, TransferCounts *counts);
+int exportTree(FileNode *top, const char *target, TransferCounts *counts);
+void snapRelease(SnapNode *snap);
+SnapNode *snapFreeze(FileNode *top);
+void snapDropCache(FileNode *top);
+Snapshot *snapshotCreate(FileNode *root);
+Snapshot *snapshotFind(const char *id);
+void snapshotDelete(Snapshot *snapshot, FileNode *root);
+void snapshotList(void);
+FileNode *snapshotRestore(const Snapshot *snapshot);
+void snapshotDiff(const SnapNode *from, const SnapNode *to, FILE *out);
+void orderInsert(FileNode *dir, FileNode *node);
+void orderRemove(FileNode *dir, FileNode *node);
+FileNode *orderSeek(FileNode *dir, const char *name, int inclusive);
+FileNode *orderNext(FileNode *node);
+int renderBegin(RenderBuffer *render, FILE *out, size_t maxEntries);
+void renderFlush(RenderBuffer *render);
+char *renderReserve(RenderBuffer *render, size_t length);
+void renderBytes(RenderBuffer *render, const char *data, size_t length);
+void renderFill(RenderBuffer *render, char c, size_t count);
+void renderNumber(RenderBuffer *render, size_t value, size_t width);
+int renderEntry(RenderBuffer *render);
+void renderEnd(RenderBuffer *render);
+void renderRelease(void);
+void renderPath(RenderBuffer *render, FileNode *node);
+size_t formatTime(time_t t, char *text);
+void printListEntry(RenderBuffer *render, const ListEntry *entry, int showDetails);
 void listDirectory(FileNode *node, int showDetails);
+long listCollect(FileNode *dir, const ListOptions *options, ListEntry **entries);
+void listOrdered(FileNode *dir, const ListOptions *options);
 void printPath(FileNode *node);
+void renderTreeLine(RenderBuffer *render, int depth, const char *name, int folder);
+void displayTree(RenderBuffer *render, FileNode *node, int maxDepth);
 void displayHelp(void);
-char *getCurrentTime(time_t t);
 int isValidName(const char *name);
+double nowSeconds(void);
+uint64_t nowNanos(void);
+void histRecord(LatencyHistogram *hist, uint64_t ns);
+uint64_t histPercentile(const LatencyHistogram *hist, double fraction);
+int runBenchmark(int argc, char *argv[]);
 
 // Create a new file/folder node
 FileNode *createNode(const char *name, const char *content, NodeType type)
 {
     if (!isValidName(name))
     {
-        printf("Error: Invalid name '%s'\n", name);
+        fprintf(shellOut, "Error: Invalid name '%s'\n", name);
         return NULL;
     }
 
-    FileNode *node = (FileNode *)malloc(sizeof(FileNode));
+    uint32_t nameId = internName(name);
+    FileNode *node = nameId == NODE_NIL ? NULL : createNodeWithName(nameId, type, time(NULL));
     if (!node)
     {
-        printf("Error: Memory allocation failed\n");
+        releaseName(nameId);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
         return NULL;
     }
 
-    strncpy(node->fileName, name, MAX_NAME - 1);
-    node->fileName[MAX_NAME - 1] = '\0';
-
-    if (content)
-    {
-        strncpy(node->fileContent, content, MAX_CONTENT - 1);
-        node->fileContent[MAX_CONTENT - 1] = '\0';
-    }
-    else
+    if (content && content[0] && !contentWrite(node, content, strlen(content)))
     {
-        node->fileContent[0] = '\0';
+        nodeFree(node);
+        return NULL;
     }
 
+    return node;
+}
+
+// Create a node owning a reference the caller already holds on nameId
+FileNode *createNodeWithName(uint32_t nameId, NodeType type, time_t now)
+{
+    FileNode *node = nodeAlloc();
+    if (!node)
+        return NULL;
+
+    node->nameId = nameId;
+    node->fileName = nameArena.entries[nameId].str;
+    node->nameHash = nameArena.entries[nameId].hash;
+    nodeTable.hot[node->id].name = nameId | (type == TYPE_FOLDER ? NODE_FOLDER_BIT : 0);
+
+    node->content = NULL;
     node->type = type;
-    node->createdTime = time(NULL);
-    node->modifiedTime = node->createdTime;
+    node->lazySlot = NODE_NIL;
+    node->createdTime = now;
+    node->modifiedTime = now;
     node->parent = NULL;
     node->fChild = NULL;
     node->nSibling = NULL;
+    node->pSibling = NULL;
+    node->lChild = NULL;
+    node->nameNext = NULL;
+    node->namePrev = NULL;
+    node->nameIndexed = 0;
+    node->pins = 0;
+    memset(&node->totals, 0, sizeof(node->totals));
+    node->totals.newest = now;
+    node->index.slots = NULL;
+    node->index.capacity = 0;
+    node->index.count = 0;
+    node->orderRoot = NULL;
+    node->orderLeft = NULL;
+    node->orderRight = NULL;
+    node->orderUp = NULL;
+    node->snap = NULL;
 
     return node;
 }
 
-// Validate filename
-int isValidName(const char *name)
+// Take a node from the free list, the current slab, or a new slab
+FileNode *nodeAlloc(void)
 {
-    if (!name || strlen(name) == 0 || strlen(name) >= MAX_NAME)
+    FileNode *node;
+
+    if (!nodePool.enabled)
     {
-        return 0;
+        node = (FileNode *)malloc(sizeof(FileNode));
     }
-
-    // Check for invalid characters
-    const char *invalid = "/\\:*?\"<>|";
-    for (int i = 0; name[i]; i++)
+    else if (nodePool.freeList)
     {
-        if (strchr(invalid, name[i]))
+        node = nodePool.freeList;
+        nodePool.freeList = node->nSibling;
+        nodePool.freeNodes--;
+    }
+    else
+    {
+        if (!nodePool.slabs || nodePool.slabs->used == NODE_SLAB_SIZE)
         {
-            return 0;
+            NodeSlab *slab = (NodeSlab *)malloc(sizeof(NodeSlab));
+            if (!slab)
+                return NULL;
+            slab->next = nodePool.slabs;
+            slab->used = 0;
+            nodePool.slabs = slab;
+            nodePool.slabCount++;
         }
+        node = &nodePool.slabs->nodes[nodePool.slabs->used++];
     }
 
-    // Check for reserved names
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    if (node)
     {
-        return 0;
+        node->id = nodeTableAlloc();
+        if (node->id == NODE_NIL)
+        {
+            if (!nodePool.enabled)
+            {
+                free(node);
+            }
+            else
+            {
+                node->nSibling = nodePool.freeList;
+                nodePool.freeList = node;
+                nodePool.freeNodes++;
+            }
+            return NULL;
+        }
+        nodePool.liveNodes++;
+        nodePool.totalAllocs++;
     }
-
-    return 1;
+    return node;
 }
 
-// Find node by name using BFS
-FileNode *findNode(FileNode *root, const char *name)
+// Return a node's memory to the pool
+void nodeFree(FileNode *node)
 {
-    if (!root || !name)
-        return NULL;
+    if (node->type == TYPE_FOLDER)
+        pathCacheInvalidate();
+    // Freed nodes are already off the tree's totals (detachNode), so their content must not count again
+    node->parent = NULL;
+    contentFree(node);
+    snapInvalidate(node);
+    lazyRelease(node);
+    releaseName(node->nameId);
+    nodeTableFree(node->id);
+    node->nameId = NODE_NIL;
+    node->id = NODE_NIL;
+    node->fileName = NULL;
+    free(node->index.slots);
+    node->index.slots = NULL;
+    node->index.capacity = 0;
+    node->index.count = 0;
+    nodePool.liveNodes--;
+    nodePool.totalFrees++;
 
-    FileNode *queue[MAX_QUEUE];
-    int front = 0, rear = 0;
+    if (!nodePool.enabled)
+    {
+        free(node);
+        return;
+    }
 
-    queue[rear++] = root;
+    node->parent = NULL;
+    node->nSibling = nodePool.freeList;
+    nodePool.freeList = node;
+    nodePool.freeNodes++;
+}
 
-    while (front < rear)
+// Release every slab at once; only valid in pool mode once no node is referenced
+void nodePoolDestroy(void)
+{
+    // Snapshots hold names and content, so they go before the arena and the nodes' own versions
+    while (snapshots.head)
     {
-        FileNode *curr = queue[front++];
-
-        if (strcmp(curr->fileName, name) == 0)
-        {
-            return curr;
-        }
+        snapshotDelete(snapshots.head, NULL);
+    }
+    lazyClose();
 
-        // Add first child
-        if (curr->fChild)
+    NodeSlab *slab = nodePool.slabs;
+    while (slab)
+    {
+        NodeSlab *next = slab->next;
+        for (size_t i = 0; i < slab->used; i++)
         {
-            if (rear < MAX_QUEUE)
-                queue[rear++] = curr->fChild;
+            // Recycled slots were already cleared by nodeFree; parents may live in freed slabs
+            slab->nodes[i].parent = NULL;
+            contentFree(&slab->nodes[i]);
+            snapInvalidate(&slab->nodes[i]);
+            free(slab->nodes[i].index.slots);
         }
+        free(slab);
+        slab = next;
+    }
 
-        // Add all siblings
-        FileNode *sibling = curr->nSibling;
-        while (sibling)
-        {
-            if (rear < MAX_QUEUE)
-                queue[rear++] = sibling;
-            sibling = sibling->nSibling;
-        }
+    NameBlock *block = nameArena.blocks;
+    while (block)
+    {
+        NameBlock *next = block->next;
+        free(block);
+        block = next;
     }
+    free(nameArena.entries);
+    free(nameArena.slots);
+    memset(&nameArena, 0, sizeof(nameArena));
+    nameArena.freeEntry = NODE_NIL;
 
-    return NULL;
+    free(nodeTable.hot);
+    memset(&nodeTable, 0, sizeof(nodeTable));
+    nodeTable.freeHead = NODE_NIL;
+
+    free(nameIndex.slots);
+    nameIndex.slots = NULL;
+    nameIndex.capacity = 0;
+    nameIndex.count = 0;
+    free(nameOrder.entries);
+    memset(&nameOrder, 0, sizeof(nameOrder));
+    nameOrder.root = NODE_NIL;
+
+    nodePool.slabs = NULL;
+    nodePool.freeList = NULL;
+    nodePool.slabCount = 0;
+    nodePool.liveNodes = 0;
+    nodePool.freeNodes = 0;
+    reclaim.pending = NULL;
+    reclaim.subtrees = 0;
+    pathCacheInvalidate();
 }
 
-// Find parent of a specific node
-FileNode *findParent(FileNode *parentFolder, const char *name)
+// Print allocator usage and fragmentation
+void printPoolStats(void)
 {
-    if (!parentFolder || !name)
-        return NULL;
+    size_t capacity = nodePool.slabCount * NODE_SLAB_SIZE;
+    size_t neverUsed = nodePool.slabs ? NODE_SLAB_SIZE - nodePool.slabs->used : 0;
+    size_t handedOut = nodePool.liveNodes + nodePool.freeNodes;
 
-    // Check direct children
-    FileNode *child = parentFolder->fChild;
-    FileNode *prev = NULL;
+    fprintf(shellOut, "Node allocator (%s)\n", nodePool.enabled ? "slab pool" : "malloc");
+    fprintf(shellOut, "  node size        : %zu bytes\n", sizeof(FileNode));
+    fprintf(shellOut, "  live nodes       : %zu\n", nodePool.liveNodes);
+    fprintf(shellOut, "  slabs            : %zu x %d nodes (%zu bytes)\n", nodePool.slabCount,
+            NODE_SLAB_SIZE, nodePool.slabCount * sizeof(NodeSlab));
+    fprintf(shellOut, "  free-list nodes  : %zu\n", nodePool.freeNodes);
+    fprintf(shellOut, "  untouched slots  : %zu of %zu\n", neverUsed, capacity);
+    fprintf(shellOut, "  fragmentation    : %.1f%% of handed-out nodes are free\n",
+            handedOut ? 100.0 * nodePool.freeNodes / handedOut : 0.0);
+    fprintf(shellOut, "  allocs / frees   : %zu / %zu\n", nodePool.totalAllocs, nodePool.totalFrees);
+    fprintf(shellOut, "  deferred frees   : %zu subtrees pending, %zu nodes freed in %zu batches (max %.1f us)\n",
+            reclaim.subtrees, reclaim.freed, reclaim.batches, reclaim.maxBatchNs / 1000.0);
+}
 
-    while (child)
+// Hand out a node id, growing the contiguous hot table as needed
+uint32_t nodeTableAlloc(void)
+{
+    uint32_t id = nodeTable.freeHead;
+    if (id != NODE_NIL)
     {
-        if (strcmp(child->fileName, name) == 0)
-        {
-            return prev ? prev : parentFolder;
+        nodeTable.freeHead = nodeTable.hot[id].nSibling;
+    }
+    else
+    {
+        if (nodeTable.count == nodeTable.capacity)
+        {
+            uint32_t capacity = nodeTable.capacity ? nodeTable.capacity * 2 : NODE_SLAB_SIZE;
+            if (capacity <= nodeTable.capacity || capacity >= NODE_FOLDER_BIT)
+                return NODE_NIL;
+            NodeHot *hot = (NodeHot *)realloc(nodeTable.hot, capacity * sizeof(NodeHot));
+            if (!hot)
+                return NODE_NIL;
+            nodeTable.hot = hot;
+            nodeTable.capacity = capacity;
         }
-        prev = child;
-        child = child->nSibling;
+        id = nodeTable.count++;
     }
 
-    return NULL;
+    NodeHot *entry = &nodeTable.hot[id];
+    entry->parent = NODE_NIL;
+    entry->fChild = NODE_NIL;
+    entry->nSibling = NODE_NIL;
+    entry->name = NODE_NIL;
+    nodeTable.live++;
+    return id;
 }
 
-// Insert node into parent directory
-int insertNode(FileNode *parent, FileNode *newNode)
+// Return a node id to the table; free entries keep name == NODE_NIL
+void nodeTableFree(uint32_t id)
 {
-    if (!parent || !newNode)
-        return 0;
+    if (id == NODE_NIL)
+        return;
 
-    if (parent->type != TYPE_FOLDER)
+    NodeHot *entry = &nodeTable.hot[id];
+    entry->parent = NODE_NIL;
+    entry->fChild = NODE_NIL;
+    entry->name = NODE_NIL;
+    entry->nSibling = nodeTable.freeHead;
+    nodeTable.freeHead = id;
+    nodeTable.live--;
+}
+
+// Name of a node, read through the hot table
+const char *nodeTableName(uint32_t id)
+{
+    return nameArena.entries[nodeTable.hot[id].name & ~NODE_FOLDER_BIT].str;
+}
+
+// Copy name bytes into the arena
+const char *nameArenaStore(const char *name, size_t length)
+{
+    NameBlock *block = nameArena.blocks;
+    if (!block || block->size - block->used < length + 1)
     {
-        printf("Error: '%s' is not a directory\n", parent->fileName);
-        return 0;
+        size_t size = length + 1 > NAME_BLOCK_SIZE ? length + 1 : NAME_BLOCK_SIZE;
+        block = (NameBlock *)malloc(sizeof(NameBlock) + size);
+        if (!block)
+            return NULL;
+        block->next = nameArena.blocks;
+        block->used = 0;
+        block->size = size;
+        nameArena.blocks = block;
+    }
+
+    char *str = block->data + block->used;
+    memcpy(str, name, length + 1);
+    block->used += length + 1;
+    nameArena.bytes += length + 1;
+    return str;
+}
+
+// Probe the intern table for a name, returning its slot
+size_t internFindSlot(const char *name, unsigned int hash)
+{
+    size_t mask = nameArena.slotCapacity - 1;
+    size_t slot = hash & mask;
+    while (nameArena.slots[slot] != NODE_NIL)
+    {
+        InternEntry *entry = &nameArena.entries[nameArena.slots[slot]];
+        if (entry->hash == hash && strcmp(entry->str, name) == 0)
+            break;
+        slot = (slot + 1) & mask;
     }
+    return slot;
+}
+
+// Grow the intern table so it stays below 70% load
+int internReserve(void)
+{
+    if ((nameArena.liveNames + 1) * 10 < nameArena.slotCapacity * 7)
+        return 1;
+
+    size_t capacity = nameArena.slotCapacity ? nameArena.slotCapacity * 2 : 1024;
+    uint32_t *slots = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    if (!slots)
+        return 0;
+    memset(slots, 0xFF, capacity * sizeof(uint32_t));
 
-    // Check for duplicate names
-    FileNode *child = parent->fChild;
-    while (child)
+    for (size_t i = 0; i < nameArena.slotCapacity; i++)
     {
-        if (strcmp(child->fileName, newNode->fileName) == 0)
+        uint32_t id = nameArena.slots[i];
+        if (id == NODE_NIL)
+            continue;
+        size_t slot = nameArena.entries[id].hash & (capacity - 1);
+        while (slots[slot] != NODE_NIL)
         {
-            printf("Error: '%s' already exists\n", newNode->fileName);
-            return 0;
+            slot = (slot + 1) & (capacity - 1);
         }
-        child = child->nSibling;
+        slots[slot] = id;
     }
+    free(nameArena.slots);
+    nameArena.slots = slots;
+    nameArena.slotCapacity = capacity;
+    return 1;
+}
 
-    newNode->parent = parent;
+// Intern a name and take a reference to it; returns NODE_NIL on failure
+uint32_t internName(const char *name)
+{
+    if (!internReserve())
+        return NODE_NIL;
 
-    if (!parent->fChild)
+    unsigned int hash = hashName(name);
+    size_t slot = internFindSlot(name, hash);
+    if (nameArena.slots[slot] != NODE_NIL)
     {
-        parent->fChild = newNode;
+        uint32_t id = nameArena.slots[slot];
+        nameArena.entries[id].refs++;
+        return id;
+    }
+
+    uint32_t id = nameArena.freeEntry;
+    if (id != NODE_NIL)
+    {
+        nameArena.freeEntry = nameArena.entries[id].hash;
     }
     else
     {
-        FileNode *temp = parent->fChild;
-        while (temp->nSibling)
+        if (nameArena.entryCount == nameArena.entryCapacity)
         {
-            temp = temp->nSibling;
+            uint32_t capacity = nameArena.entryCapacity ? nameArena.entryCapacity * 2 : 1024;
+            if (capacity >= NODE_FOLDER_BIT)
+                return NODE_NIL;
+            InternEntry *entries = (InternEntry *)realloc(nameArena.entries, capacity * sizeof(InternEntry));
+            if (!entries)
+                return NODE_NIL;
+            nameArena.entries = entries;
+            nameArena.entryCapacity = capacity;
         }
-        temp->nSibling = newNode;
+        id = nameArena.entryCount++;
     }
 
-    parent->modifiedTime = time(NULL);
-    return 1;
+    const char *str = nameArenaStore(name, strlen(name));
+    if (!str)
+    {
+        nameArena.entries[id].str = NULL;
+        nameArena.entries[id].hash = nameArena.freeEntry;
+        nameArena.freeEntry = id;
+        return NODE_NIL;
+    }
+
+    nameArena.entries[id].str = str;
+    nameArena.entries[id].hash = hash;
+    nameArena.entries[id].refs = 1;
+    nameArena.slots[slot] = id;
+    nameArena.liveNames++;
+    return id;
 }
 
-// Delete node from tree
-int deleteNode(FileNode *root, FileNode *parent, const char *name)
+// Drop a reference; unreferenced names leave the table and their bytes become dead
+void releaseName(uint32_t nameId)
 {
-    if (!parent || !name)
-        return 0;
+    if (nameId == NODE_NIL || --nameArena.entries[nameId].refs)
+        return;
 
-    FileNode *child = parent->fChild;
-    FileNode *prev = NULL;
+    InternEntry *entry = &nameArena.entries[nameId];
+    size_t mask = nameArena.slotCapacity - 1;
+    size_t hole = internFindSlot(entry->str, entry->hash);
+    size_t next = (hole + 1) & mask;
 
-    while (child)
+    // Backward-shift delete, as in dirIndexRemoveSlot
+    nameArena.slots[hole] = NODE_NIL;
+    while (nameArena.slots[next] != NODE_NIL)
     {
-        if (strcmp(child->fileName, name) == 0)
+        size_t home = nameArena.entries[nameArena.slots[next]].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
         {
-            // Check if directory is empty
-            if (child->type == TYPE_FOLDER && child->fChild)
-            {
-                printf("Error: Directory '%s' is not empty\n", name);
-                return 0;
-            }
-
-            // Remove from linked list
-            if (prev)
-            {
-                prev->nSibling = child->nSibling;
-            }
-            else
-            {
-                parent->fChild = child->nSibling;
-            }
-
-            free(child);
-            parent->modifiedTime = time(NULL);
-            return 1;
+            nameArena.slots[hole] = nameArena.slots[next];
+            nameArena.slots[next] = NODE_NIL;
+            hole = next;
         }
-        prev = child;
-        child = child->nSibling;
+        next = (next + 1) & mask;
     }
 
-    printf("Error: '%s' not found\n", name);
-    return 0;
+    nameArena.deadBytes += strlen(entry->str) + 1;
+    nameArena.liveNames--;
+    entry->str = NULL;
+    entry->hash = nameArena.freeEntry;
+    nameArena.freeEntry = nameId;
 }
 
-// Free entire tree
-void freeTree(FileNode *node)
+// Print node table and name arena usage
+void printNameStats(void)
 {
-    if (!node)
-        return;
+    fprintf(shellOut, "Node table\n");
+    fprintf(shellOut, "  hot record size  : %zu bytes\n", sizeof(NodeHot));
+    fprintf(shellOut, "  ids live / slots : %u / %u (%zu bytes)\n", nodeTable.live, nodeTable.capacity,
+            (size_t)nodeTable.capacity * sizeof(NodeHot));
+    fprintf(shellOut, "Name arena\n");
+    fprintf(shellOut, "  distinct names   : %zu\n", nameArena.liveNames);
+    fprintf(shellOut, "  arena bytes      : %zu (%zu dead)\n", nameArena.bytes, nameArena.deadBytes);
+}
 
-    // Free all children recursively
-    FileNode *child = node->fChild;
-    while (child)
+// 64-bit hash of a byte run, eight bytes per step
+uint64_t hashBytes(const char *data, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
     {
-        FileNode *next = child->nSibling;
-        freeTree(child);
-        child = next;
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 29;
     }
-
-    free(node);
+    for (; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 0x94D049BB133111EBULL;
+    }
+    hash ^= hash >> 32;
+    hash *= 0xD6E8FEB86659FD93ULL;
+    return hash ^ (hash >> 32);
 }
 
-// List directory contents
-void listDirectory(FileNode *node, int showDetails)
+// Write one LZ sequence: a token (literal count in the high nibble, match length - 4 in the low one, 15
+// meaning more length bytes follow), the literals, then the match as a 2-byte offset and its extra
+// length. A sequence without a match ends the block.
+int lzEmit(unsigned char **out, const unsigned char *end, const unsigned char *literals, size_t literalCount,
+           size_t offset, size_t match)
 {
-    if (!node)
-        return;
+    unsigned char *dst = *out;
+    size_t extra = match ? match - 4 : 0;
+    if ((size_t)(end - dst) < 1 + literalCount / 255 + 1 + literalCount + 2 + extra / 255 + 1)
+        return 0;
 
-    FileNode *child = node->fChild;
+    *dst++ = (unsigned char)((literalCount < 15 ? literalCount : 15) << 4 | (extra < 15 ? extra : 15));
+    if (literalCount >= 15)
+    {
+        size_t rest = literalCount - 15;
+        for (; rest >= 255; rest -= 255)
+            *dst++ = 255;
+        *dst++ = (unsigned char)rest;
+    }
+    memcpy(dst, literals, literalCount);
+    dst += literalCount;
+    if (match)
+    {
+        *dst++ = (unsigned char)(offset & 0xFF);
+        *dst++ = (unsigned char)(offset >> 8);
+        if (extra >= 15)
+        {
+            size_t rest = extra - 15;
+            for (; rest >= 255; rest -= 255)
+                *dst++ = 255;
+            *dst++ = (unsigned char)rest;
+        }
+    }
+    *out = dst;
+    return 1;
+}
 
-    if (!child)
+// Compress up to CHUNK_SIZE bytes with a greedy LZ77 pass over 4-byte matches.
+// Returns the compressed size, or 0 when it would not fit in capacity.
+size_t lzCompress(const char *in, size_t length, char *out, size_t capacity)
+{
+    // Position + 1 of the last 4-byte sequence seen with each hash; 0 when none
+    uint16_t table[1 << LZ_TABLE_BITS];
+    memset(table, 0, sizeof(table));
+    const unsigned char *src = (const unsigned char *)in;
+    unsigned char *dst = (unsigned char *)out;
+    const unsigned char *end = dst + capacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + 4 <= length)
     {
-        return;
+        uint32_t word;
+        memcpy(&word, src + pos, 4);
+        uint32_t slot = (word * 2654435761u) >> (32 - LZ_TABLE_BITS);
+        size_t candidate = table[slot];
+        table[slot] = (uint16_t)(pos + 1);
+        if (!candidate || memcmp(src + candidate - 1, src + pos, 4) != 0)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t from = candidate - 1;
+        size_t match = 4;
+        while (pos + match < length && src[from + match] == src[pos + match])
+            match++;
+        if (!lzEmit(&dst, end, src + anchor, pos - anchor, pos - from, match))
+            return 0;
+        pos += match;
+        anchor = pos;
     }
+    if (!lzEmit(&dst, end, src + anchor, length - anchor, 0, 0))
+        return 0;
+    return (size_t)(dst - (unsigned char *)out);
+}
 
-    while (child)
+// Expand an lzCompress block into out, which holds length bytes. Returns the bytes produced, 0 if malformed.
+size_t lzDecompress(const char *in, size_t stored, char *out, size_t length)
+{
+    const unsigned char *src = (const unsigned char *)in;
+    const unsigned char *end = src + stored;
+    size_t pos = 0;
+    while (src < end)
     {
-        if (showDetails)
+        unsigned int token = *src++;
+        size_t literalCount = token >> 4;
+        if (literalCount == 15)
         {
-            char typeChar = (child->type == TYPE_FOLDER) ? 'd' : '-';
-            char *modTime = getCurrentTime(child->modifiedTime);
-            printf("%c  %s  %s\n", typeChar, modTime, child->fileName);
-            free(modTime);
+            unsigned char more = 255;
+            while (more == 255 && src < end)
+            {
+                more = *src++;
+                literalCount += more;
+            }
         }
+        if (literalCount > (size_t)(end - src) || literalCount > length - pos)
+            return 0;
+        // Short runs copy a fixed 16 bytes when both sides have room; the excess is overwritten later
+        if (literalCount <= 16 && end - src >= 16 && length - pos >= 16)
+            memcpy(out + pos, src, 16);
         else
+            memcpy(out + pos, src, literalCount);
+        src += literalCount;
+        pos += literalCount;
+        if (src == end)
+            break;
+
+        if (end - src < 2)
+            return 0;
+        size_t offset = (size_t)src[0] | (size_t)src[1] << 8;
+        src += 2;
+        size_t match = (token & 15) + 4;
+        if ((token & 15) == 15)
         {
-            if (child->type == TYPE_FOLDER)
+            unsigned char more = 255;
+            while (more == 255 && src < end)
             {
-                printf("%s/\n", child->fileName);
+                more = *src++;
+                match += more;
             }
-            else
+        }
+        if (!offset || offset > pos || match > length - pos)
+            return 0;
+
+        if (match <= 16 && offset >= 16 && length - pos >= 16)
+        {
+            memcpy(out + pos, out + pos - offset, 16);
+            pos += match;
+            continue;
+        }
+        // A match may overlap its own output; it then repeats the last offset bytes, copied a period at a time
+        while (match)
+        {
+            size_t piece = match < offset ? match : offset;
+            memcpy(out + pos, out + pos - offset, piece);
+            pos += piece;
+            match -= piece;
+        }
+    }
+    return pos;
+}
+
+// Note a read of chunk, which keeps compression away from it for a while
+void chunkTouch(Chunk *chunk)
+{
+    if (chunkStore.compress)
+        RELAXED_STORE(chunk->lastUse, chunkStore.tick);
+}
+
+// Copy a chunk's bytes into out, expanding them if compressed; returns its length
+size_t chunkCopy(Chunk *chunk, char *out)
+{
+    chunkTouch(chunk);
+    if (chunk->stored == chunk->length)
+    {
+        memcpy(out, chunk->data, chunk->length);
+        return chunk->length;
+    }
+    return lzDecompress(chunk->data, chunk->stored, out, chunk->length);
+}
+
+// Slot holding the chunk with these bytes, or the empty slot that ends its probe sequence.
+// Hashes are only a filter: a candidate's bytes are compared before it counts as a match.
+size_t chunkFindSlot(const char *data, size_t length, uint64_t hash)
+{
+    size_t mask = chunkStore.slotCapacity - 1;
+    size_t slot = (size_t)hash & mask;
+    char expanded[CHUNK_SIZE];
+    while (chunkStore.slots[slot])
+    {
+        Chunk *chunk = chunkStore.slots[slot];
+        if (chunk->hash == hash && chunk->length == length)
+        {
+            const char *bytes = chunk->data;
+            if (chunk->stored != chunk->length)
             {
-                printf("%s\n", child->fileName);
+                lzDecompress(chunk->data, chunk->stored, expanded, length);
+                bytes = expanded;
             }
+            if (memcmp(bytes, data, length) == 0)
+                break;
         }
-        child = child->nSibling;
+        slot = (slot + 1) & mask;
     }
+    return slot;
 }
 
-// Print full path from root
-void printPath(FileNode *node)
+// Grow the chunk table so it stays below 70% load
+int chunkReserve(void)
 {
-    if (!node)
-        return;
+    if ((chunkStore.count + 1) * 10 < chunkStore.slotCapacity * 7)
+        return 1;
+
+    size_t capacity = chunkStore.slotCapacity ? chunkStore.slotCapacity * 2 : 1024;
+    Chunk **slots = (Chunk **)calloc(capacity, sizeof(Chunk *));
+    if (!slots)
+        return 0;
+    for (size_t i = 0; i < chunkStore.slotCapacity; i++)
+    {
+        Chunk *chunk = chunkStore.slots[i];
+        if (!chunk)
+            continue;
+        size_t slot = (size_t)chunk->hash & (capacity - 1);
+        while (slots[slot])
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = chunk;
+    }
+    free(chunkStore.slots);
+    chunkStore.slots = slots;
+    chunkStore.slotCapacity = capacity;
+    chunkStore.cursor = 0;
+    return 1;
+}
+
+// Take a reference to the chunk holding these bytes, storing them first if no chunk does; NULL on failure
+Chunk *chunkIntern(const char *data, size_t length)
+{
+    if (!chunkReserve())
+        return NULL;
 
-    char path[MAX_PATH_LENGTH] = "";
-    FileNode *stack[100];
-    int top = -1;
+    uint64_t hash = hashBytes(data, length);
+    size_t slot = chunkFindSlot(data, length, hash);
+    Chunk *chunk = chunkStore.slots[slot];
+    if (!chunk)
+    {
+        chunk = (Chunk *)malloc(sizeof(Chunk));
+        char *bytes = (char *)malloc(length);
+        if (!chunk || !bytes)
+        {
+            free(chunk);
+            free(bytes);
+            return NULL;
+        }
+        memcpy(bytes, data, length);
+        chunk->hash = hash;
+        chunk->data = bytes;
+        chunk->refs = 0;
+        chunk->length = (uint32_t)length;
+        chunk->stored = (uint32_t)length;
+        chunk->compressTried = 0;
+        chunkStore.slots[slot] = chunk;
+        chunkStore.count++;
+        chunkStore.unique += length;
+        chunkStore.stored += length;
+    }
+    chunk->refs++;
+    chunk->lastUse = chunkStore.tick;
+    chunkStore.logical += length;
+    return chunk;
+}
 
-    // Build stack of nodes from current to root
-    FileNode *temp = node;
-    while (temp)
+// Remove an unreferenced chunk from the table and free it
+void chunkDestroy(Chunk *chunk)
+{
+    size_t mask = chunkStore.slotCapacity - 1;
+    size_t hole = (size_t)chunk->hash & mask;
+    while (chunkStore.slots[hole] != chunk)
     {
-        stack[++top] = temp;
-        temp = temp->parent;
+        hole = (hole + 1) & mask;
     }
 
-    // Print path from root to current
-    while (top >= 0)
+    // Backward-shift delete, as in dirIndexRemoveSlot
+    size_t next = (hole + 1) & mask;
+    chunkStore.slots[hole] = NULL;
+    while (chunkStore.slots[next])
     {
-        strcat(path, stack[top]->fileName);
-        if (top > 0)
-            strcat(path, "/");
-        top--;
+        size_t home = (size_t)chunkStore.slots[next]->hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            chunkStore.slots[hole] = chunkStore.slots[next];
+            chunkStore.slots[next] = NULL;
+            hole = next;
+        }
+        next = (next + 1) & mask;
     }
 
-    printf("%s\n", path);
+    chunkStore.count--;
+    chunkStore.unique -= chunk->length;
+    chunkStore.stored -= chunk->stored;
+    if (chunk->stored != chunk->length)
+        chunkStore.compressed--;
+    free(chunk->data);
+    free(chunk);
 }
 
-// Get formatted time string
-char *getCurrentTime(time_t t)
+// Drop one reference to a chunk, freeing it with the last
+void chunkRelease(Chunk *chunk)
 {
-    char *timeStr = (char *)malloc(20);
-    struct tm *tm_info = localtime(&t);
-    strftime(timeStr, 20, "%b %d %H:%M", tm_info);
-    return timeStr;
+    chunkStore.logical -= chunk->length;
+    if (--chunk->refs == 0)
+        chunkDestroy(chunk);
 }
 
-// Display help information
-void displayHelp(void)
+// Compress the cold chunks found in the next slots of the table, resuming where the last step stopped.
+// A chunk is cold once age commands have run since it was last written or read; one that does not
+// shrink by an eighth is left as it is and not tried again.
+void chunkCompressStep(size_t slots, uint32_t age)
 {
-    printf("\n=== File System Commands ===\n");
-    printf("  man              - Display this help message\n");
-    printf("  ls [-l]          - List directory contents (-l for details)\n");
-    printf("  pwd              - Print working directory\n");
-    printf("  cd <dir>         - Change directory\n");
-    printf("  mkdir <name>     - Create directory\n");
-    printf("  touch <name>     - Create file\n");
-    printf("  rm <name>        - Remove file/empty directory\n");
-    printf("  cat <file>       - Display file content\n");
-    printf("  echo > <file>    - Write to file\n");
-    printf("  cp <src> <dst>   - Copy file\n");
-    printf("  mv <src> <dst>   - Move file/directory\n");
-    printf("  rename <old> <new> - Rename file/directory\n");
-    printf("  find <name>      - Find file/directory path\n");
-    printf("  tree             - Display directory tree\n");
-    printf("  clear            - Clear screen\n");
-    printf("  exit             - Exit program\n");
-    printf("============================\n\n");
-}
-
-// Display tree structure
-void displayTree(FileNode *node, int depth)
+    char packed[CHUNK_SIZE];
+    for (size_t i = 0; i < slots && i < chunkStore.slotCapacity; i++)
+    {
+        Chunk *chunk = chunkStore.slots[chunkStore.cursor];
+        chunkStore.cursor = (chunkStore.cursor + 1) & (chunkStore.slotCapacity - 1);
+        if (!chunk || chunk->compressTried || chunkStore.tick - chunk->lastUse < age)
+            continue;
+
+        chunk->compressTried = 1;
+        size_t size = lzCompress(chunk->data, chunk->length, packed, chunk->length - chunk->length / 8);
+        char *data = size ? (char *)malloc(size) : NULL;
+        if (!data)
+            continue;
+        memcpy(data, packed, size);
+        free(chunk->data);
+        chunk->data = data;
+        chunkStore.stored -= chunk->length - size;
+        chunk->stored = (uint32_t)size;
+        chunkStore.compressed++;
+    }
+}
+
+// Copy count bytes of a file's extents, from *extent at *offset on, into buffer and advance past them.
+// Returns the bytes in place when they lie within one extent.
+const char *contentGather(Extent **extent, size_t *offset, char *buffer, size_t count)
 {
-    if (!node)
-        return;
+    if (*extent && (*extent)->length - *offset >= count)
+    {
+        const char *bytes = (*extent)->data + *offset;
+        *offset += count;
+        if (*offset == (*extent)->length)
+        {
+            *extent = (*extent)->next;
+            *offset = 0;
+        }
+        return bytes;
+    }
 
-    for (int i = 0; i < depth; i++)
+    size_t copied = 0;
+    while (copied < count && *extent)
     {
-        printf("  ");
+        size_t piece = (*extent)->length - *offset;
+        if (piece > count - copied)
+            piece = count - copied;
+        memcpy(buffer + copied, (*extent)->data + *offset, piece);
+        copied += piece;
+        *offset += piece;
+        if (*offset == (*extent)->length)
+        {
+            *extent = (*extent)->next;
+            *offset = 0;
+        }
     }
+    return buffer;
+}
 
-    if (node->type == TYPE_FOLDER)
+// Move the bytes in content's extents into shared chunks, CHUNK_SIZE at a time. With all set the
+// last partial chunk is sealed too; otherwise it stays behind in one extent that appends continue.
+// Sealing only saves memory, so when it fails the extents are left as they were.
+void contentSeal(FileContent *content, int all)
+{
+    size_t pending = content->size - content->baseLength - content->sealed;
+    size_t count = all ? (pending + CHUNK_SIZE - 1) / CHUNK_SIZE : pending / CHUNK_SIZE;
+    size_t rest = all ? 0 : pending % CHUNK_SIZE;
+    if (!chunkStore.dedup || !count)
+        return;
+
+    Chunk **chunks = (Chunk **)realloc(content->chunks, (content->chunkCount + count) * sizeof(Chunk *));
+    if (!chunks)
+        return;
+    content->chunks = chunks;
+    chunks += content->chunkCount;
+    size_t capacity = rest < EXTENT_MIN_SIZE ? EXTENT_MIN_SIZE : rest;
+    Extent *tail = rest ? (Extent *)malloc(sizeof(Extent) + capacity) : NULL;
+    if (rest && !tail)
+        return;
+
+    char buffer[CHUNK_SIZE];
+    Extent *extent = content->head;
+    size_t offset = 0;
+    size_t made = 0;
+    for (; made < count; made++)
     {
-        printf("[DIR] %s/\n", node->fileName);
+        size_t length = pending - made * CHUNK_SIZE < CHUNK_SIZE ? pending - made * CHUNK_SIZE : CHUNK_SIZE;
+        chunks[made] = chunkIntern(contentGather(&extent, &offset, buffer, length), length);
+        if (!chunks[made])
+            break;
     }
-    else
+    if (made < count)
     {
-        printf("     %s\n", node->fileName);
+        while (made)
+            chunkRelease(chunks[--made]);
+        free(tail);
+        return;
     }
 
-    FileNode *child = node->fChild;
-    while (child)
+    if (tail)
+    {
+        tail->next = NULL;
+        tail->length = rest;
+        tail->capacity = capacity;
+        const char *bytes = contentGather(&extent, &offset, tail->data, rest);
+        if (bytes != tail->data)
+            memcpy(tail->data, bytes, rest);
+        contentStats.extents++;
+        contentStats.reserved += capacity;
+    }
+    for (extent = content->head; extent;)
     {
-        displayTree(child, depth + 1);
-        child = child->nSibling;
+        Extent *next = extent->next;
+        contentStats.extents--;
+        contentStats.reserved -= extent->capacity;
+        free(extent);
+        extent = next;
     }
+    content->head = tail;
+    content->tail = tail;
+    content->chunkCount += count;
+    content->sealed += pending - rest;
 }
 
-int main(void)
+// Turn a sealed final chunk shorter than CHUNK_SIZE back into an extent that appends continue
+int contentUnseal(FileContent *content)
 {
-    // Create root directory
-    FileNode *root = createNode("root", "", TYPE_FOLDER);
-    if (!root)
+    Chunk *last = content->chunks[content->chunkCount - 1];
+    size_t capacity = last->length < EXTENT_MIN_SIZE ? EXTENT_MIN_SIZE : last->length;
+    Extent *extent = (Extent *)malloc(sizeof(Extent) + capacity);
+    if (!extent)
     {
-        printf("Failed to create root directory\n");
-        return 1;
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
     }
+    extent->next = NULL;
+    extent->length = chunkCopy(last, extent->data);
+    extent->capacity = capacity;
+    content->head = extent;
+    content->tail = extent;
+    content->chunkCount--;
+    content->sealed -= last->length;
+    chunkRelease(last);
+    contentStats.extents++;
+    contentStats.reserved += capacity;
+    return 1;
+}
 
-    FileNode *current = root;
-    char prompt[MAX_PATH_LENGTH];
-    char input[MAX_PATH_LENGTH];
+// Append bytes after the file's last extent, growing the chain geometrically
+int contentAppend(FileNode *node, const char *data, size_t length)
+{
+    size_t before = contentSize(node);
+    int ok = contentAppendBytes(node, data, length);
+    totalsAdd(node->parent, (long long)(contentSize(node) - before), 0, 0, 0);
+    return ok;
+}
 
-    printf("Welcome to Enhanced File System Simulator\n");
-    printf("Type 'man' for help, 'exit' to quit\n\n");
+// contentAppend without the totals update
+int contentAppendBytes(FileNode *node, const char *data, size_t length)
+{
+    nodeChanged(node);
+    if (!length)
+        return 1;
 
-    while (1)
+    FileContent *content = node->content;
+    if (!content)
     {
-        // Build prompt
-        snprintf(prompt, MAX_PATH_LENGTH, "user@filesystem:~/%s$ ", current->fileName);
-        printf("%s", prompt);
-        fflush(stdout);
-
-        if (!fgets(input, MAX_PATH_LENGTH, stdin))
+        content = (FileContent *)calloc(1, sizeof(FileContent));
+        if (!content)
         {
-            break;
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            return 0;
         }
+        content->refs = 1;
+        node->content = content;
+        contentStats.files++;
+    }
+    else if (content->refs > 1)
+    {
+        if (!contentUnshare(node))
+            return 0;
+        content = node->content;
+    }
+    if (!content->head && content->chunkCount && content->chunks[content->chunkCount - 1]->length < CHUNK_SIZE)
+    {
+        if (!contentUnseal(content))
+            return 0;
+    }
 
-        // Remove newline
-        input[strcspn(input, "\n")] = 0;
-
-        if (strlen(input) == 0)
-            continue;
+    // Fill whatever room the tail extent has left; a mapped base is never written
+    Extent *tail = content->tail;
+    if (tail && tail->length < tail->capacity)
+    {
+        size_t room = tail->capacity - tail->length;
+        size_t chunk = length < room ? length : room;
+        memcpy(tail->data + tail->length, data, chunk);
+        tail->length += chunk;
+        content->size += chunk;
+        contentStats.bytes += chunk;
+        data += chunk;
+        length -= chunk;
+    }
 
-        char *cmd = strtok(input, " ");
+    if (length)
+    {
+        // New extent sized for the rest, and at least double the previous one
+        size_t capacity = tail ? tail->capacity * 2 : EXTENT_MIN_SIZE;
+        if (capacity > EXTENT_MAX_SIZE)
+            capacity = EXTENT_MAX_SIZE;
+        if (capacity < length)
+            capacity = length;
 
-        if (strcmp(cmd, "exit") == 0)
+        Extent *extent = (Extent *)malloc(sizeof(Extent) + capacity);
+        if (!extent)
         {
-            break;
-        }
-        else if (strcmp(cmd, "man") == 0 || strcmp(cmd, "help") == 0)
-        {
-            displayHelp();
-        }
-        else if (strcmp(cmd, "clear") == 0)
-        {
-#ifdef _WIN32
-            system("cls");
-#else
-            system("clear");
-#endif
-        }
-        else if (strcmp(cmd, "ls") == 0)
-        {
-            char *flag = strtok(NULL, " ");
-            listDirectory(current, flag && strcmp(flag, "-l") == 0);
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            return 0;
         }
-        else if (strcmp(cmd, "pwd") == 0)
+        extent->next = NULL;
+        extent->length = length;
+        extent->capacity = capacity;
+        memcpy(extent->data, data, length);
+
+        if (tail)
+            tail->next = extent;
+        else
+            content->head = extent;
+        content->tail = extent;
+        content->size += length;
+        contentStats.extents++;
+        contentStats.bytes += length;
+        contentStats.reserved += capacity;
+    }
+    contentSeal(content, 0);
+    return 1;
+}
+
+// Replace the file's content
+int contentWrite(FileNode *node, const char *data, size_t length)
+{
+    // One walk up the totals for the net change instead of one for the free and one for the append
+    size_t before = contentSize(node);
+    totalsPaused++;
+    contentFree(node);
+    int ok = contentAppendBytes(node, data, length);
+    if (ok && node->content)
+        contentSeal(node->content, 1);
+    totalsPaused--;
+    totalsAdd(node->parent, (long long)contentSize(node) - (long long)before, 0, 0, 0);
+    return ok;
+}
+
+// Make dst share src's content; the bytes are copied only when either file is next written
+void contentShare(FileNode *dst, FileNode *src)
+{
+    contentFree(dst);
+    nodeChanged(dst);
+    if (!src->content)
+        return;
+    totalsAdd(dst->parent, (long long)src->content->size, 0, 0, 0);
+    src->content->refs++;
+    contentStats.shared += src->content->size;
+    dst->content = src->content;
+}
+
+// Give node private content in place of content it shares with other files. The mapped base and
+// sealed chunks are immutable, so the copy takes references to them and copies only the extents.
+int contentUnshare(FileNode *node)
+{
+    FileContent *shared = node->content;
+    if (!shared || shared->refs < 2)
+        return 1;
+
+    size_t pending = shared->size - shared->baseLength - shared->sealed;
+    FileContent *content = (FileContent *)calloc(1, sizeof(FileContent));
+    Extent *extent = pending ? (Extent *)malloc(sizeof(Extent) + pending) : NULL;
+    Chunk **chunks = shared->chunkCount ? (Chunk **)malloc(shared->chunkCount * sizeof(Chunk *)) : NULL;
+    if (!content || (pending && !extent) || (shared->chunkCount && !chunks))
+    {
+        free(content);
+        free(extent);
+        free(chunks);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    if (extent)
+    {
+        extent->next = NULL;
+        extent->length = 0;
+        extent->capacity = pending;
+        for (Extent *from = shared->head; from; from = from->next)
         {
-            printPath(current);
+            memcpy(extent->data + extent->length, from->data, from->length);
+            extent->length += from->length;
         }
-        else if (strcmp(cmd, "cd") == 0)
-        {
-            char *dir = strtok(NULL, " ");
-            if (!dir)
-            {
-                printf("Usage: cd <directory>\n");
-            }
-            else if (strcmp(dir, "..") == 0)
-            {
-                if (current->parent)
-                {
-                    current = current->parent;
-                }
-            }
-            else if (strcmp(dir, "~") == 0 || strcmp(dir, "/") == 0)
-            {
-                current = root;
-            }
-            else
-            {
-                FileNode *target = NULL;
-                FileNode *child = current->fChild;
-                while (child)
-                {
-                    if (strcmp(child->fileName, dir) == 0)
-                    {
-                        target = child;
-                        break;
-                    }
-                    child = child->nSibling;
-                }
-
-                if (target && target->type == TYPE_FOLDER)
+        contentStats.extents++;
+        contentStats.reserved += pending;
+    }
+    for (size_t i = 0; i < shared->chunkCount; i++)
+    {
+        chunks[i] = shared->chunks[i];
+        chunks[i]->refs++;
+        chunkStore.logical += chunks[i]->length;
+    }
+    if (shared->image)
+    {
+        shared->image->refs++;
+        contentStats.mapped += shared->baseLength;
+    }
+    content->base = shared->base;
+    content->baseLength = shared->baseLength;
+    content->image = shared->image;
+    content->chunks = chunks;
+    content->chunkCount = shared->chunkCount;
+    content->sealed = shared->sealed;
+    content->head = extent;
+    content->tail = extent;
+    content->size = shared->size;
+    content->refs = 1;
+
+    shared->refs--;
+    node->content = content;
+    contentStats.shared -= shared->size;
+    contentStats.files++;
+    contentStats.bytes += content->size;
+    return 1;
+}
+
+// Copy a file's bytes (mapped base, chunks, then extents) into out, which holds contentSize bytes
+size_t contentRead(const FileNode *node, char *out)
+{
+    if (!node->content)
+        return 0;
+
+    size_t offset = node->content->baseLength;
+    if (offset)
+        memcpy(out, node->content->base, offset);
+    for (size_t i = 0; i < node->content->chunkCount; i++)
+    {
+        offset += chunkCopy(node->content->chunks[i], out + offset);
+    }
+    for (Extent *extent = node->content->head; extent; extent = extent->next)
+    {
+        memcpy(out + offset, extent->data, extent->length);
+        offset += extent->length;
+    }
+    return offset;
+}
+
+// Release all extents of a file
+void contentFree(FileNode *node)
+{
+    FileContent *content = node->content;
+    if (!content)
+        return;
+    nodeChanged(node);
+    node->content = NULL;
+    totalsAdd(node->parent, -(long long)content->size, 0, 0, 0);
+    contentDrop(content);
+}
+
+// Drop one reference to content, releasing its extents, chunks and image with the last one
+void contentDrop(FileContent *content)
+{
+    if (content->refs > 1)
+    {
+        content->refs--;
+        contentStats.shared -= content->size;
+        return;
+    }
+
+    for (size_t i = 0; i < content->chunkCount; i++)
+    {
+        chunkRelease(content->chunks[i]);
+    }
+    free(content->chunks);
+
+    Extent *extent = content->head;
+    while (extent)
+    {
+        Extent *next = extent->next;
+        contentStats.extents--;
+        contentStats.reserved -= extent->capacity;
+        free(extent);
+        extent = next;
+    }
+    if (content->image)
+    {
+        contentStats.mapped -= content->baseLength;
+        imageRelease(content->image);
+    }
+    contentStats.bytes -= content->size;
+    contentStats.files--;
+    free(content);
+}
+
+// Point a file's content at bytes inside a mapped image without copying them
+void contentSetMapped(FileNode *node, MappedImage *image, const char *base, size_t length)
+{
+    contentFree(node);
+    if (!length)
+        return;
+
+    FileContent *content = (FileContent *)calloc(1, sizeof(FileContent));
+    if (!content)
+        return;
+    content->base = base;
+    content->baseLength = length;
+    content->image = image;
+    content->size = length;
+    content->refs = 1;
+    totalsAdd(node->parent, (long long)length, 0, 0, 0);
+    image->refs++;
+    node->content = content;
+
+    contentStats.files++;
+    contentStats.bytes += length;
+    contentStats.mapped += length;
+}
+
+// Stream the file's bytes to out, expanding compressed chunks through a chunk-sized buffer
+void contentPrint(const FileNode *node, FILE *out)
+{
+    if (!node->content)
+        return;
+
+    if (node->content->baseLength)
+        fwrite(node->content->base, 1, node->content->baseLength, out);
+    char expanded[CHUNK_SIZE];
+    for (size_t i = 0; i < node->content->chunkCount; i++)
+    {
+        Chunk *chunk = node->content->chunks[i];
+        if (chunk->stored != chunk->length)
+        {
+            fwrite(expanded, 1, chunkCopy(chunk, expanded), out);
+            continue;
+        }
+        chunkTouch(chunk);
+        fwrite(chunk->data, 1, chunk->length, out);
+    }
+    for (Extent *extent = node->content->head; extent; extent = extent->next)
+    {
+        fwrite(extent->data, 1, extent->length, out);
+    }
+}
+
+// Size of the file's content in bytes
+size_t contentSize(const FileNode *node)
+{
+    return node->content ? node->content->size : 0;
+}
+
+// Print content store usage
+void printContentStats(void)
+{
+    fprintf(shellOut, "Content store\n");
+    fprintf(shellOut, "  files with data  : %zu\n", contentStats.files);
+    fprintf(shellOut, "  extents          : %zu\n", contentStats.extents);
+    fprintf(shellOut, "  content bytes    : %zu\n", contentStats.bytes);
+    fprintf(shellOut, "  reserved bytes   : %zu\n", contentStats.reserved);
+    fprintf(shellOut, "  mapped in place  : %zu\n", contentStats.mapped);
+    fprintf(shellOut, "  shared by copies : %zu\n", contentStats.shared);
+    fprintf(shellOut, "  chunks           : %zu (%zu compressed)\n", chunkStore.count, chunkStore.compressed);
+    fprintf(shellOut, "  chunk bytes      : %zu in files, %zu distinct, %zu held\n", chunkStore.logical,
+            chunkStore.unique, chunkStore.stored);
+    fprintf(shellOut, "  dedup ratio      : %.2f\n",
+            chunkStore.unique ? (double)chunkStore.logical / (double)chunkStore.unique : 1.0);
+    fprintf(shellOut, "  compression ratio: %.2f\n",
+            chunkStore.stored ? (double)chunkStore.unique / (double)chunkStore.stored : 1.0);
+}
+
+// Print the resident part of a lazily opened image against its budget
+void printLazyStats(void)
+{
+    fprintf(shellOut, "Lazy image\n");
+    fprintf(shellOut, "  nodes in image   : %u\n", lazy.super->nodeCount);
+    fprintf(shellOut, "  resident nodes   : %zu\n", nodePool.liveNodes);
+    fprintf(shellOut, "  resident bytes   : %zu (budget %zu)\n", lazyResident(), lazy.budget);
+    fprintf(shellOut, "  directory loads  : %zu\n", lazy.loads);
+    fprintf(shellOut, "  evictions        : %zu\n", lazy.evictions);
+}
+
+// Read one line of any length into a reusable buffer, dropping the line ending
+int readLineBuffer(FILE *in, char **line, size_t *capacity, size_t *length)
+{
+    size_t used = 0;
+    if (!*line)
+    {
+        *capacity = MAX_CONTENT;
+        *line = (char *)malloc(*capacity);
+        if (!*line)
+            return 0;
+    }
+
+    while (fgets(*line + used, (int)(*capacity - used), in))
+    {
+        used += strlen(*line + used);
+        if (used && (*line)[used - 1] == '\n')
+            break;
+        if (used + 1 == *capacity)
+        {
+            char *grown = (char *)realloc(*line, *capacity * 2);
+            if (!grown)
+                return 0;
+            *line = grown;
+            *capacity *= 2;
+        }
+    }
+
+    if (!used)
+        return 0;
+    if ((*line)[used - 1] == '\n')
+        used--;
+    if (used && (*line)[used - 1] == '\r')
+        used--;
+    (*line)[used] = '\0';
+    *length = used;
+    return 1;
+}
+
+// Read one line of any length; the caller frees the result
+char *readLine(FILE *in, size_t *length)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    if (!readLineBuffer(in, &line, &capacity, length))
+    {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+// FNV-1a hash of a file name
+unsigned int hashName(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Place node in the first free slot of its probe sequence
+void dirIndexPlace(DirIndex *index, FileNode *node)
+{
+    size_t mask = index->capacity - 1;
+    size_t slot = node->nameHash & mask;
+    while (index->slots[slot])
+    {
+        slot = (slot + 1) & mask;
+    }
+    index->slots[slot] = node;
+}
+
+// Grow the index so it stays below 70% load
+int dirIndexReserve(DirIndex *index, size_t needed)
+{
+    if (needed * 10 < index->capacity * 7)
+        return 1;
+
+    size_t capacity = index->capacity ? index->capacity * 2 : DIR_INDEX_MIN_CAPACITY;
+    while (needed * 10 >= capacity * 7)
+    {
+        capacity *= 2;
+    }
+
+    FileNode **slots = (FileNode **)calloc(capacity, sizeof(FileNode *));
+    if (!slots)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+
+    FileNode **old = index->slots;
+    size_t oldCapacity = index->capacity;
+    index->slots = slots;
+    index->capacity = capacity;
+    for (size_t i = 0; i < oldCapacity; i++)
+    {
+        if (old[i])
+            dirIndexPlace(index, old[i]);
+    }
+    free(old);
+    return 1;
+}
+
+// Locate the slot holding a name, or -1
+long dirIndexFind(const DirIndex *index, const char *name, unsigned int hash)
+{
+    if (!index->count)
+        return -1;
+
+    size_t mask = index->capacity - 1;
+    size_t slot = hash & mask;
+    while (index->slots[slot])
+    {
+        FileNode *node = index->slots[slot];
+        if (node->nameHash == hash && strcmp(node->fileName, name) == 0)
+        {
+            return (long)slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Remove a slot, shifting later entries of the cluster back (no tombstones)
+void dirIndexRemoveSlot(DirIndex *index, size_t slot)
+{
+    size_t mask = index->capacity - 1;
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+
+    index->slots[hole] = NULL;
+    while (index->slots[next])
+    {
+        size_t home = index->slots[next]->nameHash & mask;
+        // Move the entry back if its home slot is not in (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            index->slots[hole] = index->slots[next];
+            index->slots[next] = NULL;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    index->count--;
+}
+
+// Look up a direct child by name
+FileNode *findChild(FileNode *parent, const char *name)
+{
+    if (!parent || !name || parent->type != TYPE_FOLDER)
+        return NULL;
+
+    if (parent->lazySlot != NODE_NIL)
+        lazyTouch(parent);
+    long slot = dirIndexFind(&parent->index, name, hashName(name));
+    return slot < 0 ? NULL : parent->index.slots[slot];
+}
+
+// Remix a name hash so similar names get unrelated treap priorities
+unsigned int hashMix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Treap priority of a child
+unsigned int orderPriority(const FileNode *node)
+{
+    return hashMix(node->nameHash);
+}
+
+// Rotate node above its parent in dir's name-ordered treap
+void orderRotateUp(FileNode *dir, FileNode *node)
+{
+    FileNode *up = node->orderUp;
+    FileNode *grand = up->orderUp;
+
+    if (up->orderLeft == node)
+    {
+        up->orderLeft = node->orderRight;
+        if (node->orderRight)
+            node->orderRight->orderUp = up;
+        node->orderRight = up;
+    }
+    else
+    {
+        up->orderRight = node->orderLeft;
+        if (node->orderLeft)
+            node->orderLeft->orderUp = up;
+        node->orderLeft = up;
+    }
+    up->orderUp = node;
+    node->orderUp = grand;
+
+    if (!grand)
+        dir->orderRoot = node;
+    else if (grand->orderLeft == up)
+        grand->orderLeft = node;
+    else
+        grand->orderRight = node;
+}
+
+// Add a child to dir's name-ordered treap
+void orderInsert(FileNode *dir, FileNode *node)
+{
+    node->orderLeft = NULL;
+    node->orderRight = NULL;
+    node->orderUp = NULL;
+
+    FileNode **link = &dir->orderRoot;
+    while (*link)
+    {
+        node->orderUp = *link;
+        link = strcmp(node->fileName, (*link)->fileName) < 0 ? &(*link)->orderLeft : &(*link)->orderRight;
+    }
+    *link = node;
+
+    unsigned int priority = orderPriority(node);
+    while (node->orderUp && priority > orderPriority(node->orderUp))
+    {
+        orderRotateUp(dir, node);
+    }
+}
+
+// Remove a child from dir's name-ordered treap by rotating it down to a leaf
+void orderRemove(FileNode *dir, FileNode *node)
+{
+    while (node->orderLeft || node->orderRight)
+    {
+        FileNode *child = node->orderLeft;
+        if (!child || (node->orderRight && orderPriority(node->orderRight) > orderPriority(child)))
+            child = node->orderRight;
+        orderRotateUp(dir, child);
+    }
+
+    FileNode *up = node->orderUp;
+    if (!up)
+        dir->orderRoot = NULL;
+    else if (up->orderLeft == node)
+        up->orderLeft = NULL;
+    else
+        up->orderRight = NULL;
+    node->orderUp = NULL;
+}
+
+// First child whose name is >= name (inclusive) or > name, in O(log n)
+FileNode *orderSeek(FileNode *dir, const char *name, int inclusive)
+{
+    FileNode *node = dir->orderRoot;
+    FileNode *found = NULL;
+    while (node)
+    {
+        int cmp = strcmp(node->fileName, name);
+        if (cmp > 0 || (cmp == 0 && inclusive))
+        {
+            found = node;
+            node = node->orderLeft;
+        }
+        else
+        {
+            node = node->orderRight;
+        }
+    }
+    return found;
+}
+
+// Next child in name order
+FileNode *orderNext(FileNode *node)
+{
+    if (node->orderRight)
+    {
+        node = node->orderRight;
+        while (node->orderLeft)
+        {
+            node = node->orderLeft;
+        }
+        return node;
+    }
+    while (node->orderUp && node->orderUp->orderRight == node)
+    {
+        node = node->orderUp;
+    }
+    return node->orderUp;
+}
+
+// Validate filename
+int isValidName(const char *name)
+{
+    if (!name || strlen(name) == 0 || strlen(name) >= MAX_NAME)
+    {
+        return 0;
+    }
+
+    // Check for invalid characters
+    const char *invalid = "/\\:*?\"<>|";
+    for (int i = 0; name[i]; i++)
+    {
+        if (strchr(invalid, name[i]))
+        {
+            return 0;
+        }
+    }
+
+    // Check for reserved names
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Find first node with the given name inside root's subtree
+FileNode *findNode(FileNode *root, const char *name)
+{
+    if (!root || !name)
+        return NULL;
+
+    FileNode *head = nameIndexLookup(name);
+    FileNode *node = head;
+    while (node)
+    {
+        if (isInSubtree(root, node))
+        {
+            return node;
+        }
+        node = node->nameNext == head ? NULL : node->nameNext;
+    }
+
+    // Trees outside the indexed hierarchy only match at their root
+    if (!root->nameIndexed && strcmp(root->fileName, name) == 0)
+        return root;
+
+    return NULL;
+}
+
+// Check whether node lies in the subtree rooted at root
+int isInSubtree(FileNode *root, FileNode *node)
+{
+    uint32_t id = node ? node->id : NODE_NIL;
+    while (id != NODE_NIL && id != root->id)
+    {
+        id = nodeTable.hot[id].parent;
+    }
+    return id != NODE_NIL;
+}
+
+// First node of the ring of nodes sharing a name, or NULL
+FileNode *nameIndexLookup(const char *name)
+{
+    long slot = dirIndexFind(&nameIndex, name, hashName(name));
+    return slot < 0 ? NULL : nameIndex.slots[slot];
+}
+
+// The root or child link that points at id in the name order
+uint32_t *nameOrderLink(uint32_t id)
+{
+    NameOrderEntry *entries = nameOrder.entries;
+    uint32_t up = entries[id].up;
+    if (up == NODE_NIL)
+        return &nameOrder.root;
+    return entries[up].left == id ? &entries[up].left : &entries[up].right;
+}
+
+// Rotate a name above its parent in the name order
+void nameOrderRotateUp(uint32_t id)
+{
+    NameOrderEntry *entries = nameOrder.entries;
+    uint32_t up = entries[id].up;
+    uint32_t *link = nameOrderLink(up);
+
+    if (entries[up].left == id)
+    {
+        entries[up].left = entries[id].right;
+        if (entries[id].right != NODE_NIL)
+            entries[entries[id].right].up = up;
+        entries[id].right = up;
+    }
+    else
+    {
+        entries[up].right = entries[id].left;
+        if (entries[id].left != NODE_NIL)
+            entries[entries[id].left].up = up;
+        entries[id].left = up;
+    }
+    entries[id].up = entries[up].up;
+    entries[up].up = id;
+    *link = id;
+}
+
+// Add the name carried by node to the name order; returns 0 if the table cannot grow
+int nameOrderInsert(FileNode *node)
+{
+    uint32_t id = node->nameId;
+    if (id >= nameOrder.capacity)
+    {
+        uint32_t capacity = nameOrder.capacity ? nameOrder.capacity : 1024;
+        while (capacity <= id)
+        {
+            capacity *= 2;
+        }
+        NameOrderEntry *entries = (NameOrderEntry *)realloc(nameOrder.entries, capacity * sizeof(NameOrderEntry));
+        if (!entries)
+            return 0;
+        nameOrder.entries = entries;
+        nameOrder.capacity = capacity;
+    }
+
+    NameOrderEntry *entries = nameOrder.entries;
+    entries[id].str = node->fileName;
+    entries[id].left = NODE_NIL;
+    entries[id].right = NODE_NIL;
+    entries[id].up = NODE_NIL;
+    entries[id].priority = hashMix(node->nameHash);
+
+    uint32_t *link = &nameOrder.root;
+    while (*link != NODE_NIL)
+    {
+        entries[id].up = *link;
+        link = strcmp(node->fileName, entries[*link].str) < 0 ? &entries[*link].left : &entries[*link].right;
+    }
+    *link = id;
+    while (entries[id].up != NODE_NIL && entries[id].priority > entries[entries[id].up].priority)
+    {
+        nameOrderRotateUp(id);
+    }
+    nameOrder.count++;
+    return 1;
+}
+
+// Remove a name from the name order by rotating it down to a leaf
+void nameOrderRemove(uint32_t id)
+{
+    NameOrderEntry *entries = nameOrder.entries;
+    while (entries[id].left != NODE_NIL || entries[id].right != NODE_NIL)
+    {
+        uint32_t child = entries[id].left;
+        if (child == NODE_NIL ||
+            (entries[id].right != NODE_NIL && entries[entries[id].right].priority > entries[child].priority))
+            child = entries[id].right;
+        nameOrderRotateUp(child);
+    }
+    *nameOrderLink(id) = NODE_NIL;
+    entries[id].up = NODE_NIL;
+    nameOrder.count--;
+}
+
+// First indexed name >= prefix, or NODE_NIL
+uint32_t nameOrderSeek(const char *prefix)
+{
+    uint32_t id = nameOrder.root;
+    uint32_t found = NODE_NIL;
+    while (id != NODE_NIL)
+    {
+        if (strcmp(nameOrder.entries[id].str, prefix) >= 0)
+        {
+            found = id;
+            id = nameOrder.entries[id].left;
+        }
+        else
+        {
+            id = nameOrder.entries[id].right;
+        }
+    }
+    return found;
+}
+
+// Next indexed name in order, or NODE_NIL
+uint32_t nameOrderNext(uint32_t id)
+{
+    NameOrderEntry *entries = nameOrder.entries;
+    if (entries[id].right != NODE_NIL)
+    {
+        id = entries[id].right;
+        while (entries[id].left != NODE_NIL)
+        {
+            id = entries[id].left;
+        }
+        return id;
+    }
+    while (entries[id].up != NODE_NIL && entries[entries[id].up].right == id)
+    {
+        id = entries[id].up;
+    }
+    return entries[id].up;
+}
+
+// Add node to the global name index
+void nameIndexAdd(FileNode *node)
+{
+    if (node->nameIndexed)
+        return;
+
+    long slot = dirIndexFind(&nameIndex, node->fileName, node->nameHash);
+    if (slot >= 0)
+    {
+        // Append to the tail of the existing ring
+        FileNode *head = nameIndex.slots[slot];
+        node->nameNext = head;
+        node->namePrev = head->namePrev;
+        head->namePrev->nameNext = node;
+        head->namePrev = node;
+    }
+    else
+    {
+        if (!dirIndexReserve(&nameIndex, nameIndex.count + 1) || !nameOrderInsert(node))
+            return;
+        node->nameNext = node;
+        node->namePrev = node;
+        dirIndexPlace(&nameIndex, node);
+        nameIndex.count++;
+    }
+    node->nameIndexed = 1;
+}
+
+// Add the nodes below top, which were linked while it was detached, to the global name index
+void nameIndexAddTree(FileNode *top)
+{
+    for (FileNode *node = nextPreorder(top, top); node; node = nextPreorder(top, node))
+    {
+        nameIndexAdd(node);
+    }
+}
+
+// Remove node from the global name index
+void nameIndexRemove(FileNode *node)
+{
+    if (!node->nameIndexed)
+        return;
+
+    long slot = dirIndexFind(&nameIndex, node->fileName, node->nameHash);
+    if (slot >= 0 && nameIndex.slots[slot] == node)
+    {
+        if (node->nameNext == node)
+        {
+            dirIndexRemoveSlot(&nameIndex, (size_t)slot);
+            nameOrderRemove(node->nameId);
+        }
+        else
+            nameIndex.slots[slot] = node->nameNext;
+    }
+
+    node->namePrev->nameNext = node->nameNext;
+    node->nameNext->namePrev = node->namePrev;
+    node->nameNext = NULL;
+    node->namePrev = NULL;
+    node->nameIndexed = 0;
+}
+
+// Find parent of a specific node
+FileNode *findParent(FileNode *parentFolder, const char *name)
+{
+    if (!parentFolder || !name)
+        return NULL;
+
+    FileNode *child = findChild(parentFolder, name);
+    if (!child)
+        return NULL;
+
+    return child->pSibling ? child->pSibling : parentFolder;
+}
+
+// A directory's totals, safe to read while the writer updates them
+SubtreeTotals totalsRead(FileNode *dir)
+{
+    SubtreeTotals totals;
+    totals.bytes = RELAXED_LOAD(dir->totals.bytes);
+    totals.files = RELAXED_LOAD(dir->totals.files);
+    totals.folders = RELAXED_LOAD(dir->totals.folders);
+    totals.newest = RELAXED_LOAD(dir->totals.newest);
+    return totals;
+}
+
+// What node adds to its parent's totals
+SubtreeTotals totalsOf(FileNode *node)
+{
+    SubtreeTotals totals = {contentSize(node), 1, 0, node->modifiedTime};
+    if (node->type == TYPE_FOLDER)
+    {
+        totals = totalsRead(node);
+        totals.folders++;
+    }
+    return totals;
+}
+
+// Add a change below dir to the totals of dir and every directory above it; when is the change's
+// modification time, or 0. Only the writer updates totals, so it reads them plainly.
+void totalsAdd(FileNode *dir, long long bytes, long files, long folders, time_t when)
+{
+    if (totalsPaused)
+        return;
+    for (; dir; dir = dir->parent)
+    {
+        SubtreeTotals *totals = &dir->totals;
+        // A directory is never newer than its parent, so a time-only change stops at the first one it misses
+        if (!bytes && !files && !folders && when <= totals->newest)
+            break;
+        if (bytes)
+            RELAXED_STORE(totals->bytes, totals->bytes + (size_t)bytes);
+        if (files)
+            RELAXED_STORE(totals->files, totals->files + (size_t)files);
+        if (folders)
+            RELAXED_STORE(totals->folders, totals->folders + (size_t)folders);
+        if (when > totals->newest)
+            RELAXED_STORE(totals->newest, when);
+    }
+}
+
+// Recompute the totals of every directory under top in one pass, children before parents
+void totalsRebuild(FileNode *top)
+{
+    FileNode *node = top;
+    FileNode *next = top;
+    while (1)
+    {
+        // Descend to a leaf, starting each directory over from its own modification time; a stub keeps
+        // the totals saved for it
+        while (next)
+        {
+            node = next;
+            next = NULL;
+            if (lazyStub(node))
+                continue;
+            memset(&node->totals, 0, sizeof(node->totals));
+            node->totals.newest = node->modifiedTime;
+            next = node->fChild;
+        }
+
+        // Fold finished nodes into their parents until one has a sibling left to visit
+        while (node != top)
+        {
+            SubtreeTotals add = totalsOf(node);
+            SubtreeTotals *totals = &node->parent->totals;
+            totals->bytes += add.bytes;
+            totals->files += add.files;
+            totals->folders += add.folders;
+            if (add.newest > totals->newest)
+                totals->newest = add.newest;
+            if (node->nSibling)
+                break;
+            node = node->parent;
+        }
+        if (node == top)
+            return;
+        next = node->nSibling;
+    }
+}
+
+// Insert node into parent directory
+int insertNode(FileNode *parent, FileNode *newNode)
+{
+    return insertNodeAt(parent, newNode, time(NULL));
+}
+
+// insertNode, stamping parent with the given modification time
+int insertNodeAt(FileNode *parent, FileNode *newNode, time_t now)
+{
+    if (!parent || !newNode)
+        return 0;
+
+    if (parent->type != TYPE_FOLDER)
+    {
+        fprintf(shellOut, "Error: '%s' is not a directory\n", parent->fileName);
+        return 0;
+    }
+
+    // Check for duplicate names, among the entries still on disk too
+    if (parent->lazySlot != NODE_NIL)
+        lazyTouch(parent);
+    if (dirIndexFind(&parent->index, newNode->fileName, newNode->nameHash) >= 0)
+    {
+        fprintf(shellOut, "Error: '%s' already exists\n", newNode->fileName);
+        return 0;
+    }
+
+    if (!dirIndexReserve(&parent->index, parent->index.count + 1))
+        return 0;
+    dirIndexPlace(&parent->index, newNode);
+    parent->index.count++;
+    orderInsert(parent, newNode);
+
+    if (parent->nameIndexed)
+        nameIndexAdd(newNode);
+
+    newNode->parent = parent;
+    newNode->nSibling = NULL;
+    newNode->pSibling = parent->lChild;
+
+    NodeHot *hot = nodeTable.hot;
+    hot[newNode->id].parent = parent->id;
+    hot[newNode->id].nSibling = NODE_NIL;
+
+    if (!parent->fChild)
+    {
+        parent->fChild = newNode;
+        hot[parent->id].fChild = newNode->id;
+    }
+    else
+    {
+        parent->lChild->nSibling = newNode;
+        hot[parent->lChild->id].nSibling = newNode->id;
+    }
+    parent->lChild = newNode;
+
+    nodeChanged(parent);
+    parent->modifiedTime = now;
+    SubtreeTotals added = totalsOf(newNode);
+    totalsAdd(parent, (long long)added.bytes, (long)added.files, (long)added.folders,
+              added.newest > parent->modifiedTime ? added.newest : parent->modifiedTime);
+    return 1;
+}
+
+// Unlink node from its parent's child list and index
+void detachNode(FileNode *node)
+{
+    FileNode *parent = node ? node->parent : NULL;
+    if (!parent)
+        return;
+    if (node->type == TYPE_FOLDER)
+        pathCacheInvalidate();
+
+    long slot = dirIndexFind(&parent->index, node->fileName, node->nameHash);
+    if (slot >= 0)
+    {
+        dirIndexRemoveSlot(&parent->index, (size_t)slot);
+    }
+    orderRemove(parent, node);
+    nameIndexRemove(node);
+
+    NodeHot *hot = nodeTable.hot;
+    uint32_t nextId = node->nSibling ? node->nSibling->id : NODE_NIL;
+    if (node->pSibling)
+    {
+        node->pSibling->nSibling = node->nSibling;
+        hot[node->pSibling->id].nSibling = nextId;
+    }
+    else
+    {
+        parent->fChild = node->nSibling;
+        hot[parent->id].fChild = nextId;
+    }
+
+    if (node->nSibling)
+        node->nSibling->pSibling = node->pSibling;
+    else
+        parent->lChild = node->pSibling;
+
+    node->parent = NULL;
+    node->nSibling = NULL;
+    node->pSibling = NULL;
+    hot[node->id].parent = NODE_NIL;
+    hot[node->id].nSibling = NODE_NIL;
+    nodeChanged(parent);
+    parent->modifiedTime = time(NULL);
+    SubtreeTotals removed = totalsOf(node);
+    totalsAdd(parent, -(long long)removed.bytes, -(long)removed.files, -(long)removed.folders, parent->modifiedTime);
+}
+
+// Rename node in place, keeping its parent's index in sync
+int renameNode(FileNode *node, const char *newName)
+{
+    if (!isValidName(newName))
+    {
+        fprintf(shellOut, "Error: Invalid name '%s'\n", newName);
+        return 0;
+    }
+
+    FileNode *parent = node->parent;
+    if (node->type == TYPE_FOLDER)
+        pathCacheInvalidate();
+    if (parent)
+    {
+        FileNode *existing = findChild(parent, newName);
+        if (existing && existing != node)
+        {
+            fprintf(shellOut, "Error: '%s' already exists\n", newName);
+            return 0;
+        }
+
+        long slot = dirIndexFind(&parent->index, node->fileName, node->nameHash);
+        if (slot >= 0)
+        {
+            dirIndexRemoveSlot(&parent->index, (size_t)slot);
+        }
+        orderRemove(parent, node);
+    }
+
+    int indexed = node->nameIndexed;
+    nameIndexRemove(node);
+
+    uint32_t nameId = internName(newName);
+    if (nameId == NODE_NIL)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+    }
+    else
+    {
+        releaseName(node->nameId);
+        node->nameId = nameId;
+        node->fileName = nameArena.entries[nameId].str;
+        node->nameHash = nameArena.entries[nameId].hash;
+        nodeTable.hot[node->id].name = nameId | (node->type == TYPE_FOLDER ? NODE_FOLDER_BIT : 0);
+    }
+    nodeChanged(node);
+    node->modifiedTime = time(NULL);
+    totalsAdd(node->type == TYPE_FOLDER ? node : parent, 0, 0, 0, node->modifiedTime);
+
+    if (indexed)
+        nameIndexAdd(node);
+
+    if (parent)
+    {
+        // Removing a slot never shrinks the table, so there is room
+        dirIndexPlace(&parent->index, node);
+        parent->index.count++;
+        orderInsert(parent, node);
+    }
+    return 1;
+}
+
+// Delete node from tree
+int deleteNode(FileNode *root, FileNode *parent, const char *name)
+{
+    if (!parent || !name)
+        return 0;
+
+    FileNode *child = findChild(parent, name);
+    if (!child)
+    {
+        fprintf(shellOut, "Error: '%s' not found\n", name);
+        return 0;
+    }
+
+    // Check if directory is empty
+    if (child->type == TYPE_FOLDER && (child->fChild || child->totals.files || child->totals.folders))
+    {
+        fprintf(shellOut, "Error: Directory '%s' is not empty\n", name);
+        return 0;
+    }
+
+    detachNode(child);
+    freeTree(child);
+    return 1;
+}
+
+// Free a detached subtree iteratively, returning its nodes to the pool
+void freeTree(FileNode *top)
+{
+    size_t budget = SIZE_MAX;
+    if (top)
+        freeTreeBatch(top, &budget);
+}
+
+// Free up to *budget nodes of a detached subtree, leaves first, taking them off *budget.
+// Returns 1 once top itself is freed; otherwise the rest stays linked for the next call.
+int freeTreeBatch(FileNode *top, size_t *budget)
+{
+    FileNode *node = top;
+    while (node)
+    {
+        // Descend to a leaf, then unlink it from its parent so each directory ends up as a leaf
+        if (node->fChild)
+        {
+            node = node->fChild;
+            continue;
+        }
+        if (!*budget)
+            return 0;
+
+        FileNode *up = node == top ? NULL : node->parent;
+        if (up)
+            up->fChild = node->nSibling;
+        nameIndexRemove(node);
+        nodeFree(node);
+        (*budget)--;
+        node = up;
+    }
+    return 1;
+}
+
+// Queue a subtree rm -r has unlinked; reclaimStep frees it between commands
+void reclaimPush(FileNode *top)
+{
+    top->nSibling = reclaim.pending;
+    reclaim.pending = top;
+    reclaim.subtrees++;
+}
+
+// Free up to budget nodes of queued subtrees. Their names are still in the global name index, which
+// find reads under the namespace lock.
+void reclaimStep(size_t budget)
+{
+    if (!reclaim.pending)
+        return;
+
+    uint64_t began = nowNanos();
+    DirLocks locks;
+    dirLockExclusive(&locks, NULL, NULL, NULL, 1);
+    size_t start = budget;
+    while (reclaim.pending && budget)
+    {
+        FileNode *top = reclaim.pending;
+        FileNode *next = top->nSibling;
+        if (!freeTreeBatch(top, &budget))
+            break;
+        reclaim.pending = next;
+        reclaim.subtrees--;
+    }
+    dirUnlockExclusive(&locks);
+    reclaim.freed += start - budget;
+    reclaim.batches++;
+    uint64_t elapsed = nowNanos() - began;
+    if (elapsed > reclaim.maxBatchNs)
+        reclaim.maxBatchNs = elapsed;
+}
+
+// Build a detached copy of the subtree at src named name. Files share src's content, so the copy
+// costs one node per entry and no content bytes until one side is written.
+FileNode *copyTree(FileNode *src, const char *name)
+{
+    lazyLoadAll(src);
+    FileNode *top = createNode(name, NULL, src->type);
+    if (!top)
+        return NULL;
+    contentShare(top, src);
+
+    // Totals are filled in once at the end rather than pushed up the copy per node
+    time_t now = time(NULL);
+    FileNode *from = src;
+    FileNode *to = top;
+    totalsPaused++;
+    while (top)
+    {
+        FileNode *next = from->fChild;
+        FileNode *into = to;
+        if (!next)
+        {
+            // Climb to the nearest entry with a next sibling, staying inside src
+            while (from != src && !from->nSibling)
+            {
+                from = from->parent;
+                to = to->parent;
+            }
+            if (from == src)
+                break;
+            next = from->nSibling;
+            into = to->parent;
+        }
+
+        nameArena.entries[next->nameId].refs++;
+        FileNode *copy = createNodeWithName(next->nameId, next->type, now);
+        if (!copy)
+        {
+            releaseName(next->nameId);
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            freeTree(top);
+            top = NULL;
+            break;
+        }
+        contentShare(copy, next);
+        if (!insertNode(into, copy))
+        {
+            freeTree(copy);
+            freeTree(top);
+            top = NULL;
+            break;
+        }
+        from = next;
+        to = copy;
+    }
+    totalsPaused--;
+    if (top)
+        totalsRebuild(top);
+    return top;
+}
+
+// Drop the cached versions of node and every directory above it, so the next snapshot rebuilds that path.
+// A directory only has a version while everything below it does, so this stops at the first node without one.
+void snapInvalidate(FileNode *node)
+{
+    for (; node && node->snap; node = node->parent)
+    {
+        snapRelease(node->snap);
+        node->snap = NULL;
+    }
+}
+
+// Drop one reference to a version, freeing it and whatever it alone kept alive, without recursion
+void snapRelease(SnapNode *snap)
+{
+    if (!snap || --snap->refs)
+        return;
+
+    // Unreferenced versions wait on a list threaded through next until their children are released
+    snap->next = NULL;
+    SnapNode *pending = snap;
+    while (pending)
+    {
+        SnapNode *dead = pending;
+        pending = dead->next;
+        for (uint32_t i = 0; i < dead->count; i++)
+        {
+            SnapNode *child = dead->children[i];
+            if (--child->refs)
+                continue;
+            child->next = pending;
+            pending = child;
+        }
+        if (dead->content)
+            contentDrop(dead->content);
+        releaseName(dead->nameId);
+        free(dead->children);
+        free(dead);
+        snapshots.versions--;
+    }
+}
+
+// Build node's version from the versions of its children, in name order. Child directories must
+// already have one; files get theirs here.
+SnapNode *snapBuild(FileNode *node)
+{
+    uint32_t count = node->type == TYPE_FOLDER ? (uint32_t)node->index.count : 0;
+    SnapNode *snap = (SnapNode *)malloc(sizeof(SnapNode));
+    SnapNode **children = count ? (SnapNode **)malloc(count * sizeof(SnapNode *)) : NULL;
+    if (!snap || (count && !children))
+    {
+        free(snap);
+        free(children);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+
+    uint32_t filled = 0;
+    for (FileNode *child = count ? orderSeek(node, "", 1) : NULL; child; child = orderNext(child))
+    {
+        if (!child->snap && !(child->snap = snapBuild(child)))
+        {
+            while (filled)
+            {
+                snapRelease(children[--filled]);
+            }
+            free(children);
+            free(snap);
+            return NULL;
+        }
+        child->snap->refs++;
+        children[filled++] = child->snap;
+    }
+
+    nameArena.entries[node->nameId].refs++;
+    snap->nameId = node->nameId;
+    snap->type = node->type;
+    snap->refs = 1;
+    snap->count = count;
+    snap->createdTime = node->createdTime;
+    snap->modifiedTime = node->modifiedTime;
+    snap->content = node->content;
+    snap->children = children;
+    snap->next = NULL;
+    if (snap->content)
+    {
+        // Held like a cp copy, so the next write to the live file copies it first
+        snap->content->refs++;
+        contentStats.shared += snap->content->size;
+    }
+    snapshots.versions++;
+    snapshots.built++;
+    return snap;
+}
+
+// Version of top, building new versions only for the nodes changed since their last one, children first.
+// That is the path from each change up to top, so the cost follows the changes, not the size of the tree.
+SnapNode *snapFreeze(FileNode *top)
+{
+    snapshots.built = 0;
+    FileNode *node = top;
+    if (!top->snap)
+        lazyTouch(top);
+    FileNode *resume = top->type == TYPE_FOLDER ? top->fChild : NULL;
+    while (!top->snap)
+    {
+        // Descend into the next child directory without a version, if any is left
+        FileNode *child = resume;
+        while (child && (child->snap || child->type != TYPE_FOLDER))
+        {
+            child = child->nSibling;
+        }
+        if (child)
+        {
+            node = child;
+            lazyTouch(child);
+            resume = child->fChild;
+            continue;
+        }
+
+        node->snap = snapBuild(node);
+        if (!node->snap)
+            return NULL;
+        resume = node->nSibling;
+        node = node->parent;
+    }
+    return top->snap;
+}
+
+// Release the versions cached on every node under top, so writes stop copying content held by them
+void snapDropCache(FileNode *top)
+{
+    for (FileNode *node = top; node; node = nextPreorder(top, node))
+    {
+        snapRelease(node->snap);
+        node->snap = NULL;
+    }
+}
+
+// Take a snapshot of the tree at root; O(1) when nothing changed since the last one
+Snapshot *snapshotCreate(FileNode *root)
+{
+    Snapshot *snapshot = (Snapshot *)calloc(1, sizeof(Snapshot));
+    if (!snapshot)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    snapshot->root = snapFreeze(root);
+    if (!snapshot->root)
+    {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->root->refs++;
+    snapshot->id = snapshots.nextId++;
+    snapshot->created = time(NULL);
+    snapshot->totals = totalsRead(root);
+
+    if (snapshots.tail)
+        snapshots.tail->next = snapshot;
+    else
+        snapshots.head = snapshot;
+    snapshots.tail = snapshot;
+    snapshots.count++;
+    return snapshot;
+}
+
+// Snapshot with the given decimal id, or NULL
+Snapshot *snapshotFind(const char *id)
+{
+    char *end;
+    unsigned long value = id ? strtoul(id, &end, 10) : 0;
+    if (!id || !*id || *end)
+        return NULL;
+    for (Snapshot *snapshot = snapshots.head; snapshot; snapshot = snapshot->next)
+    {
+        if (snapshot->id == value)
+            return snapshot;
+    }
+    return NULL;
+}
+
+// Forget a snapshot, freeing the versions only it used. Once none is left, the versions cached on the
+// tree at root (NULL to keep them) are dropped too.
+void snapshotDelete(Snapshot *snapshot, FileNode *root)
+{
+    Snapshot **link = &snapshots.head;
+    Snapshot *previous = NULL;
+    while (*link != snapshot)
+    {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    *link = snapshot->next;
+    if (snapshots.tail == snapshot)
+        snapshots.tail = previous;
+    snapshots.count--;
+
+    snapRelease(snapshot->root);
+    free(snapshot);
+    if (!snapshots.count && root)
+        snapDropCache(root);
+}
+
+// Print every snapshot with the totals of the tree when it was taken
+void snapshotList(void)
+{
+    for (Snapshot *snapshot = snapshots.head; snapshot; snapshot = snapshot->next)
+    {
+        char created[TIME_TEXT_SIZE];
+        formatTime(snapshot->created, created);
+        fprintf(shellOut, "%4u  %s  %zu files, %zu folders, %zu bytes\n", snapshot->id, created,
+                snapshot->totals.files, snapshot->totals.folders, snapshot->totals.bytes);
+    }
+    fprintf(shellOut, "%zu snapshots sharing %zu versions\n", snapshots.count, snapshots.versions);
+}
+
+// Live node for a version, sharing its content
+FileNode *snapMaterialize(SnapNode *snap)
+{
+    nameArena.entries[snap->nameId].refs++;
+    FileNode *node = createNodeWithName(snap->nameId, snap->type, snap->createdTime);
+    if (!node)
+    {
+        releaseName(snap->nameId);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    node->modifiedTime = snap->modifiedTime;
+    if (snap->content)
+    {
+        snap->content->refs++;
+        contentStats.shared += snap->content->size;
+        node->content = snap->content;
+    }
+    return node;
+}
+
+// A directory being rebuilt by snapshotRestore: its version, its new node and the next child to create
+typedef struct RestoreFrame
+{
+    SnapNode *from;
+    FileNode *to;
+    uint32_t next;
+} RestoreFrame;
+
+// Build a detached tree from a snapshot. Files share the snapshot's content and every node starts with
+// its version cached, so snapshotting the restored tree again costs nothing.
+FileNode *snapshotRestore(const Snapshot *snapshot)
+{
+    size_t capacity = 64;
+    size_t depth = 0;
+    RestoreFrame *frames = (RestoreFrame *)malloc(capacity * sizeof(RestoreFrame));
+    FileNode *top = frames ? snapMaterialize(snapshot->root) : NULL;
+    if (!top)
+    {
+        if (!frames)
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+        free(frames);
+        return NULL;
+    }
+    nameIndexAdd(top);
+
+    // Totals are filled in once at the end, as for cp -r
+    totalsPaused++;
+    frames[0].from = snapshot->root;
+    frames[0].to = top;
+    frames[0].next = 0;
+    depth = 1;
+    int ok = 1;
+    while (depth)
+    {
+        RestoreFrame *frame = &frames[depth - 1];
+        if (frame->next == frame->from->count)
+        {
+            // With every child in place, inserts no longer stamp the directory or drop its version
+            frame->to->modifiedTime = frame->from->modifiedTime;
+            frame->to->snap = frame->from;
+            frame->from->refs++;
+            depth--;
+            continue;
+        }
+
+        SnapNode *from = frame->from->children[frame->next++];
+        FileNode *node = snapMaterialize(from);
+        if (!node || !insertNode(frame->to, node))
+        {
+            if (node)
+                freeTree(node);
+            ok = 0;
+            break;
+        }
+        if (from->type != TYPE_FOLDER)
+        {
+            node->snap = from;
+            from->refs++;
+            continue;
+        }
+
+        if (depth == capacity)
+        {
+            RestoreFrame *grown = (RestoreFrame *)realloc(frames, capacity * 2 * sizeof(RestoreFrame));
+            if (!grown)
+            {
+                fprintf(shellOut, "Error: Memory allocation failed\n");
+                ok = 0;
+                break;
+            }
+            frames = grown;
+            capacity *= 2;
+        }
+        frames[depth].from = from;
+        frames[depth].to = node;
+        frames[depth].next = 0;
+        depth++;
+    }
+    totalsPaused--;
+    free(frames);
+
+    if (!ok)
+    {
+        freeTree(top);
+        return NULL;
+    }
+    totalsRebuild(top);
+    return top;
+}
+
+// A directory pair being compared by snapshotDiff: the next child of each and the length of its path
+typedef struct DiffFrame
+{
+    const SnapNode *from;
+    const SnapNode *to;
+    uint32_t i;
+    uint32_t j;
+    size_t pathLength;
+} DiffFrame;
+
+// Print what changed between two versions of a tree as A (added), D (removed) and M (modified) lines.
+// Both sides list children by name, so each changed directory is one merge; a child whose version is
+// shared is unchanged and skipped whole, and an added or removed directory is reported as one line.
+void snapshotDiff(const SnapNode *from, const SnapNode *to, FILE *out)
+{
+    size_t capacity = 64;
+    size_t depth = 0;
+    size_t pathCapacity = MAX_PATH_LENGTH;
+    DiffFrame *frames = (DiffFrame *)malloc(capacity * sizeof(DiffFrame));
+    char *path = (char *)malloc(pathCapacity);
+    if (!frames || !path)
+    {
+        free(frames);
+        free(path);
+        fprintf(out, "Error: Memory allocation failed\n");
+        return;
+    }
+
+    size_t added = 0, removed = 0, modified = 0, compared = 0;
+    if (from != to)
+    {
+        frames[0].from = from;
+        frames[0].to = to;
+        frames[0].i = 0;
+        frames[0].j = 0;
+        frames[0].pathLength = 0;
+        depth = 1;
+    }
+    while (depth)
+    {
+        DiffFrame *frame = &frames[depth - 1];
+        const SnapNode *a = frame->i < frame->from->count ? frame->from->children[frame->i] : NULL;
+        const SnapNode *b = frame->j < frame->to->count ? frame->to->children[frame->j] : NULL;
+        if (!a && !b)
+        {
+            depth--;
+            continue;
+        }
+
+        int cmp = !a ? 1 : !b ? -1 : a->nameId == b->nameId ? 0
+                                   : strcmp(nameArena.entries[a->nameId].str, nameArena.entries[b->nameId].str);
+        frame->i += cmp <= 0;
+        frame->j += cmp >= 0;
+        compared++;
+        if (a == b)
+            continue;
+
+        const char *name = nameArena.entries[cmp > 0 ? b->nameId : a->nameId].str;
+        size_t nameLength = strlen(name);
+        size_t length = frame->pathLength + 1 + nameLength;
+        if (length + 2 > pathCapacity)
+        {
+            char *grown = (char *)realloc(path, length * 2);
+            if (!grown)
+                break;
+            path = grown;
+            pathCapacity = length * 2;
+        }
+        path[frame->pathLength] = '/';
+        memcpy(path + frame->pathLength + 1, name, nameLength + 1);
+
+        if (cmp == 0 && a->type == b->type)
+        {
+            if (a->type == TYPE_FILE)
+            {
+                if (a->content != b->content || a->modifiedTime != b->modifiedTime)
+                {
+                    fprintf(out, "M  %s\n", path);
+                    modified++;
+                }
+                continue;
+            }
+
+            if (depth == capacity)
+            {
+                DiffFrame *grown = (DiffFrame *)realloc(frames, capacity * 2 * sizeof(DiffFrame));
+                if (!grown)
+                    break;
+                frames = grown;
+                capacity *= 2;
+            }
+            frames[depth].from = a;
+            frames[depth].to = b;
+            frames[depth].i = 0;
+            frames[depth].j = 0;
+            frames[depth].pathLength = length;
+            depth++;
+            continue;
+        }
+
+        if (cmp <= 0)
+        {
+            fprintf(out, "D  %s%s\n", path, a->type == TYPE_FOLDER ? "/" : "");
+            removed++;
+        }
+        if (cmp >= 0)
+        {
+            fprintf(out, "A  %s%s\n", path, b->type == TYPE_FOLDER ? "/" : "");
+            added++;
+        }
+    }
+    if (depth)
+        fprintf(out, "Error: Memory allocation failed\n");
+    fprintf(out, "%zu added, %zu removed, %zu modified (%zu entries compared)\n", added, removed, modified, compared);
+    free(frames);
+    free(path);
+}
+
+// Read a child's listing keys with its parent locked; a folder's own times change under its lock,
+// not its parent's, and its size is its subtree's total
+ListEntry listEntryOf(FileNode *child)
+{
+    ListEntry entry;
+    entry.node = child;
+    if (child->type == TYPE_FOLDER)
+    {
+        dirLockSharedOrdered(child, dirStripe(child->parent));
+        entry.modified = child->modifiedTime;
+        entry.size = totalsRead(child).bytes;
+        dirUnlockShared(child);
+    }
+    else
+    {
+        entry.modified = child->modifiedTime;
+        entry.size = contentSize(child);
+    }
+    return entry;
+}
+
+// Start staging output for out, stopping after maxEntries lines (0 = no cap); 0 when no block is available
+int renderBegin(RenderBuffer *render, FILE *out, size_t maxEntries)
+{
+    if (!renderBlock)
+    {
+        renderBlock = (char *)malloc(RENDER_BLOCK_SIZE);
+        renderBlockSize = renderBlock ? RENDER_BLOCK_SIZE : 0;
+    }
+    render->out = out;
+    render->data = renderBlock;
+    render->used = 0;
+    render->capacity = renderBlockSize;
+    render->entries = 0;
+    render->maxEntries = maxEntries;
+    render->truncated = 0;
+    if (!renderBlock)
+    {
+        fprintf(out, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Write out what is staged
+void renderFlush(RenderBuffer *render)
+{
+    if (render->used)
+        fwrite(render->data, 1, render->used, render->out);
+    render->used = 0;
+}
+
+// Room for length contiguous bytes, flushing first and growing the block if one piece needs more than it
+// holds; the caller fills them and advances used. NULL when the block cannot grow.
+char *renderReserve(RenderBuffer *render, size_t length)
+{
+    if (render->capacity - render->used >= length)
+        return render->data + render->used;
+
+    renderFlush(render);
+    if (length > render->capacity)
+    {
+        char *grown = (char *)realloc(renderBlock, length);
+        if (!grown)
+            return NULL;
+        renderBlock = render->data = grown;
+        renderBlockSize = render->capacity = length;
+    }
+    return render->data;
+}
+
+// Append length bytes, writing straight through when they are larger than the block
+void renderBytes(RenderBuffer *render, const char *data, size_t length)
+{
+    if (render->capacity - render->used < length)
+    {
+        renderFlush(render);
+        if (length > render->capacity)
+        {
+            fwrite(data, 1, length, render->out);
+            return;
+        }
+    }
+    memcpy(render->data + render->used, data, length);
+    render->used += length;
+}
+
+// Append count copies of c; tree indentation grows with depth, so it is filled a block at a time
+void renderFill(RenderBuffer *render, char c, size_t count)
+{
+    while (count)
+    {
+        if (render->used == render->capacity)
+            renderFlush(render);
+        size_t part = render->capacity - render->used;
+        if (part > count)
+            part = count;
+        memset(render->data + render->used, c, part);
+        render->used += part;
+        count -= part;
+    }
+}
+
+// Append value in decimal, right-aligned in width columns like %*zu
+void renderNumber(RenderBuffer *render, size_t value, size_t width)
+{
+    char digits[24];
+    size_t pos = sizeof(digits);
+    do
+    {
+        digits[--pos] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    size_t length = sizeof(digits) - pos;
+    if (length < width)
+        renderFill(render, ' ', width - length);
+    renderBytes(render, digits + pos, length);
+}
+
+// Count one more line; 0 once the cap is reached, after which the caller stops emitting
+int renderEntry(RenderBuffer *render)
+{
+    if (render->maxEntries && render->entries == render->maxEntries)
+    {
+        render->truncated = 1;
+        return 0;
+    }
+    render->entries++;
+    return 1;
+}
+
+// Flush what is staged, noting where a capped listing stopped
+void renderEnd(RenderBuffer *render)
+{
+    renderFlush(render);
+    if (render->truncated)
+        fprintf(render->out, "... (stopped after %zu entries)\n", render->entries);
+}
+
+// Free this thread's output block, for threads that end before the process does
+void renderRelease(void)
+{
+    free(renderBlock);
+    renderBlock = NULL;
+    renderBlockSize = 0;
+}
+
+// Append node's path from the root ("root/a/b") and a newline. The length is measured first so the path
+// is filled from its end straight into the block: O(depth), with no limit on depth.
+void renderPath(RenderBuffer *render, FileNode *node)
+{
+    size_t length = 0;
+    for (FileNode *temp = node; temp; temp = temp->parent)
+    {
+        length += strlen(temp->fileName) + 1;
+    }
+
+    char *path = renderReserve(render, length);
+    if (!path)
+    {
+        fprintf(render->out, "Error: Memory allocation failed\n");
+        return;
+    }
+    size_t pos = length;
+    path[--pos] = '\n';
+    for (FileNode *temp = node; temp; temp = temp->parent)
+    {
+        size_t part = strlen(temp->fileName);
+        pos -= part;
+        memcpy(path + pos, temp->fileName, part);
+        if (pos)
+            path[--pos] = '/';
+    }
+    render->used += length;
+}
+
+// Format t as "Mon dd HH:MM" into text (TIME_TEXT_SIZE bytes) and return its length. Listings stamp many
+// entries within the same minute, so localtime and strftime only run when the minute changes.
+size_t formatTime(time_t t, char *text)
+{
+    TimeCache *cache = &timeCache;
+    if (!cache->valid || t < cache->start || t - cache->start >= 60)
+    {
+        struct tm tm_info;
+#ifdef _WIN32
+        localtime_s(&tm_info, &t);
+#else
+        localtime_r(&t, &tm_info);
+#endif
+        cache->length = strftime(cache->text, sizeof(cache->text), "%b %d %H:%M", &tm_info);
+        cache->start = t - tm_info.tm_sec;
+        cache->valid = 1;
+    }
+    memcpy(text, cache->text, cache->length + 1);
+    return cache->length;
+}
+
+// Render one ls line
+void printListEntry(RenderBuffer *render, const ListEntry *entry, int showDetails)
+{
+    FileNode *child = entry->node;
+    if (showDetails)
+    {
+        char modTime[TIME_TEXT_SIZE];
+        size_t timeLength = formatTime(entry->modified, modTime);
+        renderBytes(render, child->type == TYPE_FOLDER ? "d  " : "-  ", 3);
+        renderNumber(render, entry->size, 10);
+        renderBytes(render, "  ", 2);
+        renderBytes(render, modTime, timeLength);
+        renderBytes(render, "  ", 2);
+        renderBytes(render, child->fileName, strlen(child->fileName));
+        renderBytes(render, "\n", 1);
+    }
+    else
+    {
+        renderBytes(render, child->fileName, strlen(child->fileName));
+        renderBytes(render, child->type == TYPE_FOLDER ? "/\n" : "\n", child->type == TYPE_FOLDER ? 2 : 1);
+    }
+}
+
+// List directory contents in insertion order
+void listDirectory(FileNode *node, int showDetails)
+{
+    if (!node)
+        return;
+    lazyTouch(node);
+
+    RenderBuffer render;
+    if (!renderBegin(&render, shellOut, 0))
+        return;
+    for (FileNode *child = node->fChild; child; child = child->nSibling)
+    {
+        ListEntry entry = {child, 0, 0};
+        if (showDetails)
+            entry = listEntryOf(child);
+        printListEntry(&render, &entry, showDetails);
+    }
+    renderEnd(&render);
+}
+
+// Newest first, then by name
+int compareListByMtime(const void *a, const void *b)
+{
+    const ListEntry *x = (const ListEntry *)a;
+    const ListEntry *y = (const ListEntry *)b;
+    if (x->modified != y->modified)
+        return x->modified > y->modified ? -1 : 1;
+    return strcmp(x->node->fileName, y->node->fileName);
+}
+
+// Largest first, then by name
+int compareListBySize(const void *a, const void *b)
+{
+    const ListEntry *x = (const ListEntry *)a;
+    const ListEntry *y = (const ListEntry *)b;
+    if (x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    return strcmp(x->node->fileName, y->node->fileName);
+}
+
+// Restore the max-heap (last entry in list order on top) below slot
+void listHeapDown(ListEntry *heap, size_t count, size_t slot, int (*compare)(const void *, const void *))
+{
+    for (;;)
+    {
+        size_t largest = slot;
+        size_t left = slot * 2 + 1;
+        size_t right = left + 1;
+        if (left < count && compare(&heap[left], &heap[largest]) > 0)
+            largest = left;
+        if (right < count && compare(&heap[right], &heap[largest]) > 0)
+            largest = right;
+        if (largest == slot)
+            return;
+        ListEntry swap = heap[slot];
+        heap[slot] = heap[largest];
+        heap[largest] = swap;
+        slot = largest;
+    }
+}
+
+// Collect one page of dir's children in the requested order into a malloc'd array; returns the count or -1.
+// Name order seeks the cursor or prefix in the treap and walks forward: O(log n + page).
+// Times and sizes change on every write below a child, so those orders scan the name range once,
+// keeping the best page in a bounded heap: O(range * log page).
+long listCollect(FileNode *dir, const ListOptions *options, ListEntry **entries)
+{
+    const char *prefix = options->prefix ? options->prefix : "";
+    size_t prefixLength = strlen(prefix);
+    int (*compare)(const void *, const void *) =
+        options->order == LIST_BY_MTIME ? compareListByMtime : compareListBySize;
+
+    // Walk the range of the longer of --prefix and the glob's literal prefix; the other is checked per entry
+    const char *range = prefix;
+    if (options->glob && options->glob->literalLength > prefixLength)
+        range = options->glob->literal;
+    size_t rangeLength = strlen(range);
+
+    lazyTouch(dir);
+    ListEntry cursor = {NULL, 0, 0};
+    FileNode *node = orderSeek(dir, range, 1);
+    if (options->after && options->order == LIST_BY_NAME)
+    {
+        if (strcmp(options->after, range) >= 0)
+            node = orderSeek(dir, options->after, 0);
+    }
+    else if (options->after)
+    {
+        FileNode *mark = findChild(dir, options->after);
+        if (!mark)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", options->after);
+            return -1;
+        }
+        cursor = listEntryOf(mark);
+    }
+
+    ListEntry *list = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    for (; node && strncmp(node->fileName, range, rangeLength) == 0; node = orderNext(node))
+    {
+        if (strncmp(node->fileName, prefix, prefixLength) != 0 ||
+            (options->glob && !globMatch(options->glob, node->fileName)))
+            continue;
+        if (options->order == LIST_BY_NAME && options->limit && count == options->limit)
+            break;
+
+        ListEntry entry = {node, 0, 0};
+        if (options->order != LIST_BY_NAME || options->details)
+            entry = listEntryOf(node);
+        if (options->order != LIST_BY_NAME)
+        {
+            if (cursor.node && compare(&entry, &cursor) <= 0)
+                continue;
+            if (options->limit && count == options->limit)
+            {
+                // Full page: the entry replaces the current last one if it sorts before it
+                if (compare(&entry, &list[0]) < 0)
+                {
+                    list[0] = entry;
+                    listHeapDown(list, count, 0, compare);
+                }
+                continue;
+            }
+        }
+
+        if (count == capacity)
+        {
+            size_t grown = capacity ? capacity * 2 : 64;
+            if (options->limit && grown > options->limit)
+                grown = options->limit;
+            ListEntry *bigger = (ListEntry *)realloc(list, grown * sizeof(ListEntry));
+            if (!bigger)
+            {
+                free(list);
+                fprintf(shellOut, "Error: Memory allocation failed\n");
+                return -1;
+            }
+            list = bigger;
+            capacity = grown;
+        }
+        list[count++] = entry;
+
+        if (options->order != LIST_BY_NAME && options->limit && count == options->limit)
+        {
+            for (size_t slot = count / 2; slot-- > 0;)
+            {
+                listHeapDown(list, count, slot, compare);
+            }
+        }
+    }
+
+    if (options->order != LIST_BY_NAME)
+        qsort(list, count, sizeof(ListEntry), compare);
+    *entries = list;
+    return (long)count;
+}
+
+// ls with an order, page size, cursor or prefix
+void listOrdered(FileNode *dir, const ListOptions *options)
+{
+    ListEntry *entries;
+    long count = listCollect(dir, options, &entries);
+    RenderBuffer render;
+    if (count > 0 && renderBegin(&render, shellOut, 0))
+    {
+        for (long i = 0; i < count; i++)
+        {
+            printListEntry(&render, &entries[i], options->details);
+        }
+        renderEnd(&render);
+    }
+    if (count >= 0)
+        free(entries);
+}
+
+// Print full path from root
+void printPath(FileNode *node)
+{
+    RenderBuffer render;
+    if (!node || !renderBegin(&render, shellOut, 0))
+        return;
+    renderPath(&render, node);
+    renderEnd(&render);
+}
+
+// Display help information
+void displayHelp(void)
+{
+    fprintf(shellOut, "\n=== File System Commands ===\n");
+    fprintf(shellOut, "  man              - Display this help message\n");
+    fprintf(shellOut, "  ls [-l] [path]   - List directory contents (-l for details); path may end in a glob\n");
+    fprintf(shellOut, "     [--sort name|mtime|size] [--limit N] [--after name] [--prefix text]\n");
+    fprintf(shellOut, "                   - Ordered listing, one page after a cursor, names with a prefix\n");
+    fprintf(shellOut, "  pwd              - Print working directory\n");
+    fprintf(shellOut, "  cd <path>        - Change directory\n");
+    fprintf(shellOut, "  mkdir <path>     - Create directory\n");
+    fprintf(shellOut, "  touch <path>     - Create file\n");
+    fprintf(shellOut, "  rm [-r] <path>   - Remove file/empty directory (-r: with everything below it)\n");
+    fprintf(shellOut, "  cat <path>       - Display file content\n");
+    fprintf(shellOut, "  echo [text] > <path>  - Write text (or the next line) to file\n");
+    fprintf(shellOut, "  echo [text] >> <path> - Append to file\n");
+    fprintf(shellOut, "  cp [-r] <src> <dst> - Copy file (-r: directory tree) into a directory or to a new name\n");
+    fprintf(shellOut, "  mv <src> <dir>   - Move file/directory into a directory\n");
+    fprintf(shellOut, "  rename <path> <new> - Rename file/directory\n");
+    fprintf(shellOut, "  find [--max N] <name|glob>\n");
+    fprintf(shellOut, "                   - Find all paths with this name or matching a glob (* ? [...]), at most N\n");
+    fprintf(shellOut, "  tree [-L depth] [--max N] [path]\n");
+    fprintf(shellOut, "                   - Display directory tree, depth levels deep and at most N lines\n");
+    fprintf(shellOut, "  du [-s] [path]   - Bytes, files, folders and newest change per entry (-s: total)\n");
+    fprintf(shellOut, "  grep [-rclF] <pattern> [path] - Matching lines as path:line:text (-r: subtree, -c: counts,\n");
+    fprintf(shellOut, "                   -l: file names, -F: pattern is literal; else . [] * + ? ^ $ are special)\n");
+    fprintf(shellOut, "  save [image]     - Save the filesystem to a binary image\n");
+    fprintf(shellOut, "  load <image>     - Replace the filesystem with a saved image\n");
+    fprintf(shellOut, "  checkpoint       - Fold the journal into the image\n");
+    fprintf(shellOut, "  snapshot create | list | delete <id> - Take, list or drop an in-memory snapshot\n");
+    fprintf(shellOut, "  snapshot restore <id> - Replace the filesystem with a snapshot\n");
+    fprintf(shellOut, "  snapshot diff <id> [id] - Paths added, removed or changed since a snapshot, or between two\n");
+    fprintf(shellOut, "  import <host-dir|file.tar> [dir] - Copy a host directory or tar archive into dir\n");
+    fprintf(shellOut, "  export <path> <host-dir|file.tar> - Write path out to a host directory or tar archive\n");
+    fprintf(shellOut, "  watch [<path> [-r]] - Queue changes to path and its children (-r: subtree); alone, list\n");
+    fprintf(shellOut, "  unwatch <id|all> - Stop watching\n");
+    fprintf(shellOut, "  events [--max N] - Take the changes queued for this session's watches\n");
+    fprintf(shellOut, "  stats [--json]   - Show command counters, tree and memory statistics\n");
+    fprintf(shellOut, "  clear            - Clear screen\n");
+    fprintf(shellOut, "  exit             - Exit program\n");
+    fprintf(shellOut, "  Paths may be absolute or relative (a/b/../c); separate commands with ';'\n");
+    fprintf(shellOut, "============================\n\n");
+}
+
+// Render one tree line: two spaces per level, then the name marked as a folder or indented as a file
+void renderTreeLine(RenderBuffer *render, int depth, const char *name, int folder)
+{
+    renderFill(render, ' ', (size_t)depth * 2);
+    renderBytes(render, folder ? "[DIR] " : "     ", folder ? 6 : 5);
+    renderBytes(render, name, strlen(name));
+    renderBytes(render, folder ? "/\n" : "\n", folder ? 2 : 1);
+}
+
+// Display tree structure, walking the compact node table without recursion. Folders at maxDepth (-1 = no
+// limit) are shown but not opened, and the walk stops when the render's entry cap is reached.
+void displayTree(RenderBuffer *render, FileNode *node, int maxDepth)
+{
+    if (!node)
+        return;
+
+    const NodeHot *hot = nodeTable.hot;
+    uint32_t top = node->id;
+    uint32_t id = top;
+    int depth = 0;
+
+    while (renderEntry(render))
+    {
+        renderTreeLine(render, depth, nodeTableName(id), (hot[id].name & NODE_FOLDER_BIT) != 0);
+
+        if (hot[id].fChild != NODE_NIL && depth != maxDepth)
+        {
+            id = hot[id].fChild;
+            depth++;
+            continue;
+        }
+
+        // Climb until a node with a next sibling, stopping at the walk's root
+        while (id != top && hot[id].nSibling == NODE_NIL)
+        {
+            id = hot[id].parent;
+            depth--;
+        }
+        if (id == top)
+            break;
+        id = hot[id].nSibling;
+    }
+}
+
+// Display tree structure for a server session over FileNode links, since the node table may be
+// regrown by the writer. Shared locks are held from top (locked by the caller) down to the folder
+// being listed and dropped as each subtree is finished, or all at once when the entry cap stops the walk.
+// Each folder's stripe is taken in stripe order against the chain already held (dirLockSharedOrdered).
+void displayTreeShared(RenderBuffer *render, FileNode *top, int maxDepth)
+{
+    FileNode *node = top;
+    int depth = 0;
+
+    while (1)
+    {
+        if (!renderEntry(render))
+        {
+            for (FileNode *held = node == top ? top : node->parent; held != top; held = held->parent)
+            {
+                dirUnlockShared(held);
+            }
+            break;
+        }
+        renderTreeLine(render, depth, node->fileName, node->type == TYPE_FOLDER);
+
+        FileNode *first = NULL;
+        if (node->type == TYPE_FOLDER && depth != maxDepth)
+        {
+            if (node != top)
+            {
+                uint32_t highest = 0;
+                for (FileNode *held = node->parent;; held = held->parent)
+                {
+                    if (dirStripe(held) > highest)
+                        highest = dirStripe(held);
+                    if (held == top)
+                        break;
+                }
+                dirLockSharedOrdered(node, highest);
+            }
+            first = node->fChild;
+            if (!first && node != top)
+                dirUnlockShared(node);
+        }
+        if (first)
+        {
+            node = first;
+            depth++;
+            continue;
+        }
+
+        // Climb until a node with a next sibling, releasing each finished folder
+        while (node != top && !node->nSibling)
+        {
+            node = node->parent;
+            depth--;
+            if (node != top)
+                dirUnlockShared(node);
+        }
+        if (node == top)
+            break;
+        node = node->nSibling;
+    }
+}
+
+// Next node of a preorder walk bounded by top, or NULL when the walk is done
+FileNode *nextPreorder(FileNode *top, FileNode *node)
+{
+    if (node->fChild)
+        return node->fChild;
+
+    while (node != top && !node->nSibling)
+    {
+        node = node->parent;
+    }
+    return node == top ? NULL : node->nSibling;
+}
+
+// Number of threads whole-tree walks use: --threads, or one per online CPU
+int walkThreads(void)
+{
+#ifndef _WIN32
+    if (!workerPool.threads)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workerPool.threads = cpus < 1 ? 1 : cpus > MAX_WALK_THREADS ? MAX_WALK_THREADS : (int)cpus;
+    }
+#endif
+    return workerPool.threads;
+}
+
+// Adjust a counter shared between threads
+size_t sharedCounterAdd(size_t *counter, long delta)
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    return __atomic_add_fetch(counter, (size_t)delta, __ATOMIC_ACQ_REL);
+#else
+    *counter += (size_t)delta;
+    return *counter;
+#endif
+}
+
+// Push a task at the owner's end
+int dequePush(WorkDeque *deque, WalkTask task)
+{
+    int ok = 1;
+#ifndef _WIN32
+    pthread_mutex_lock(&deque->lock);
+#endif
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head)
+        {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(WalkTask));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+            WalkTask *items = (WalkTask *)realloc(deque->items, capacity * sizeof(WalkTask));
+            if (items)
+            {
+                deque->items = items;
+                deque->capacity = capacity;
+            }
+            else
+            {
+                ok = 0;
+            }
+        }
+    }
+    if (ok)
+        deque->items[deque->tail++] = task;
+#ifndef _WIN32
+    pthread_mutex_unlock(&deque->lock);
+#endif
+    return ok;
+}
+
+// Take a task from the owner's end (stealing = 0) or the opposite end (stealing = 1)
+int dequeTake(WorkDeque *deque, WalkTask *task, int stealing)
+{
+    int found = 0;
+#ifndef _WIN32
+    pthread_mutex_lock(&deque->lock);
+#endif
+    if (deque->head < deque->tail)
+    {
+        *task = stealing ? deque->items[deque->head++] : deque->items[--deque->tail];
+        if (deque->head == deque->tail)
+            deque->head = deque->tail = 0;
+        found = 1;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&deque->lock);
+#endif
+    return found;
+}
+
+// Visit a directory's children; subdirectories become tasks others can steal
+void walkExpand(ParallelWalk *walk, int worker, WalkTask task)
+{
+    size_t sequence = task.sequence;
+    for (FileNode *child = task.node->fChild; child; child = child->nSibling)
+    {
+        walk->visit(walk, worker, child, task.bucket, sequence);
+        if (child->type != TYPE_FOLDER)
+        {
+            sequence++;
+        }
+        else if (child->fChild)
+        {
+            WalkTask next = {child, task.bucket, sequence};
+            sequence += totalsRead(child).files;
+            sharedCounterAdd(&walk->pending, 1);
+            if (!dequePush(&walk->deques[worker], next))
+            {
+                // Out of memory for the queue: expand in place instead
+                sharedCounterAdd(&walk->pending, -1);
+                walkExpand(walk, worker, next);
+            }
+        }
+    }
+}
+
+// Run tasks until every deque is empty and no worker is still expanding
+void walkWorker(ParallelWalk *walk, int worker)
+{
+    WalkTask task;
+    while (1)
+    {
+        int found = dequeTake(&walk->deques[worker], &task, 0);
+        for (int i = 1; !found && i < walk->threads; i++)
+        {
+            found = dequeTake(&walk->deques[(worker + i) % walk->threads], &task, 1);
+        }
+
+        if (found)
+        {
+            walkExpand(walk, worker, task);
+            sharedCounterAdd(&walk->pending, -1);
+        }
+        else if (sharedCounterAdd(&walk->pending, 0) == 0)
+        {
+            break;
+        }
+        else
+        {
+#ifndef _WIN32
+            sched_yield();
+#endif
+        }
+    }
+}
+
+#ifndef _WIN32
+// Body of a pool thread: wait for a walk, help run it, report back
+void *walkThreadMain(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    // The pool starts before the first walk is posted, so generation 0 is the only one already handled
+    unsigned long seen = 0;
+    pthread_mutex_lock(&workerPool.lock);
+    while (1)
+    {
+        while (workerPool.generation == seen)
+            pthread_cond_wait(&workerPool.wake, &workerPool.lock);
+        seen = workerPool.generation;
+        ParallelWalk *walk = workerPool.walk;
+        pthread_mutex_unlock(&workerPool.lock);
+
+        if (worker < walk->threads)
+            walkWorker(walk, worker);
+
+        pthread_mutex_lock(&workerPool.lock);
+        if (--workerPool.active == 0)
+            pthread_cond_signal(&workerPool.done);
+    }
+    return NULL;
+}
+#endif
+
+// Start the pool's helper threads once; threads that fail to start just shrink it
+void workerPoolStart(int threads)
+{
+#ifndef _WIN32
+    if (threads <= 1 || workerPool.ids)
+        return;
+    workerPool.ids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    for (int i = 1; workerPool.ids && i < threads; i++)
+    {
+        if (pthread_create(&workerPool.ids[i], NULL, walkThreadMain, (void *)(intptr_t)i) != 0)
+            break;
+        pthread_detach(workerPool.ids[i]);
+        workerPool.started++;
+    }
+#else
+    (void)threads;
+#endif
+}
+
+// Walk top's subtree on all workers; with splitTop, each child of top gets its own bucket (1..n)
+void parallelWalkRun(ParallelWalk *walk, FileNode *top, int splitTop)
+{
+    walk->threads = walkThreads();
+    walk->pending = 0;
+    walk->deques = (WorkDeque *)calloc((size_t)walk->threads, sizeof(WorkDeque));
+    if (!walk->deques)
+        walk->threads = 1;
+#ifndef _WIN32
+    for (int i = 0; walk->deques && i < walk->threads; i++)
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+    workerPoolStart(walk->threads);
+    if (walk->threads > workerPool.started + 1)
+        walk->threads = workerPool.started + 1;
+#endif
+
+    // Seed: top itself, then its children spread round-robin over the deques
+    walk->visit(walk, 0, top, 0, 0);
+    uint32_t bucket = 0;
+    size_t sequence = 0;
+    for (FileNode *child = top->fChild; splitTop && child; child = child->nSibling)
+    {
+        bucket++;
+        walk->visit(walk, 0, child, bucket, sequence);
+        if (child->type != TYPE_FOLDER)
+        {
+            sequence++;
+        }
+        else if (child->fChild)
+        {
+            WalkTask task = {child, bucket, sequence};
+            sequence += totalsRead(child).files;
+            walk->pending++;
+            if (!walk->deques || !dequePush(&walk->deques[bucket % walk->threads], task))
+            {
+                walk->pending--;
+                walkExpand(walk, 0, task);
+            }
+        }
+    }
+    if (!splitTop && top->fChild)
+    {
+        WalkTask task = {top, 0, 0};
+        if (walk->deques && dequePush(&walk->deques[0], task))
+            walk->pending++;
+        else
+            walkExpand(walk, 0, task);
+    }
+
+    if (walk->deques && walk->pending)
+    {
+#ifndef _WIN32
+        int helpers = walk->threads - 1;
+        if (helpers > 0)
+        {
+            pthread_mutex_lock(&workerPool.lock);
+            workerPool.walk = walk;
+            workerPool.active = workerPool.started;
+            workerPool.generation++;
+            pthread_cond_broadcast(&workerPool.wake);
+            pthread_mutex_unlock(&workerPool.lock);
+        }
+        walkWorker(walk, 0);
+        if (helpers > 0)
+        {
+            pthread_mutex_lock(&workerPool.lock);
+            while (workerPool.active > 0)
+                pthread_cond_wait(&workerPool.done, &workerPool.lock);
+            pthread_mutex_unlock(&workerPool.lock);
+        }
+#else
+        walkWorker(walk, 0);
+#endif
+    }
+
+    for (int i = 0; walk->deques && i < walk->threads; i++)
+    {
+        free(walk->deques[i].items);
+#ifndef _WIN32
+        pthread_mutex_destroy(&walk->deques[i].lock);
+#endif
+    }
+    free(walk->deques);
+    walk->deques = NULL;
+}
+
+// Content-store totals released by one teardown worker, and the chunks whose last reference it dropped
+typedef struct TeardownCounts
+{
+    size_t files;
+    size_t extents;
+    size_t bytes;
+    size_t reserved;
+    size_t chunkBytes;
+    Chunk **dead;
+    size_t deadCount;
+    size_t deadCapacity;
+} TeardownCounts;
+
+// Release a node's heap-only parts (extents, child index) so the serial pass is pure bookkeeping
+void teardownVisit(ParallelWalk *walk, int worker, FileNode *node, uint32_t bucket, size_t sequence)
+{
+    TeardownCounts *counts = &((TeardownCounts *)walk->context)[worker];
+    (void)bucket;
+    (void)sequence;
+
+    free(node->index.slots);
+    node->index.slots = NULL;
+    node->index.capacity = 0;
+    node->index.count = 0;
+
+    // Mapped content holds an image reference and shared content is counted, so the serial pass drops both
+    FileContent *content = node->content;
+    if (!content || content->image || content->refs > 1)
+        return;
+
+    // Chunks may be shared with files outside the subtree: drop references here, unlink dead ones serially
+    if (counts->deadCount + content->chunkCount > counts->deadCapacity)
+    {
+        size_t capacity = counts->deadCapacity ? counts->deadCapacity * 2 : 256;
+        while (capacity < counts->deadCount + content->chunkCount)
+            capacity *= 2;
+        Chunk **dead = (Chunk **)realloc(counts->dead, capacity * sizeof(Chunk *));
+        if (!dead)
+            return;
+        counts->dead = dead;
+        counts->deadCapacity = capacity;
+    }
+    for (size_t i = 0; i < content->chunkCount; i++)
+    {
+        Chunk *chunk = content->chunks[i];
+        counts->chunkBytes += chunk->length;
+        if (sharedCounterAdd(&chunk->refs, -1) == 0)
+            counts->dead[counts->deadCount++] = chunk;
+    }
+    free(content->chunks);
+    for (Extent *extent = content->head; extent;)
+    {
+        Extent *next = extent->next;
+        counts->extents++;
+        counts->reserved += extent->capacity;
+        free(extent);
+        extent = next;
+    }
+    counts->bytes += content->size;
+    counts->files++;
+    free(content);
+    node->content = NULL;
+}
+
+// Free a detached subtree, releasing content and indexes on all workers first
+void freeTreeParallel(FileNode *top)
+{
+    if (!top)
+        return;
+
+    TeardownCounts *counts = (TeardownCounts *)calloc(MAX_WALK_THREADS, sizeof(TeardownCounts));
+    if (counts)
+    {
+        ParallelWalk walk = {0, NULL, 0, teardownVisit, counts};
+        parallelWalkRun(&walk, top, 0);
+        for (int i = 0; i < MAX_WALK_THREADS; i++)
+        {
+            contentStats.files -= counts[i].files;
+            contentStats.extents -= counts[i].extents;
+            contentStats.bytes -= counts[i].bytes;
+            contentStats.reserved -= counts[i].reserved;
+            chunkStore.logical -= counts[i].chunkBytes;
+            for (size_t j = 0; j < counts[i].deadCount; j++)
+            {
+                chunkDestroy(counts[i].dead[j]);
+            }
+            free(counts[i].dead);
+        }
+        free(counts);
+    }
+    freeTree(top);
+}
+
+// Per-worker, per-bucket byte and file totals for du
+typedef struct UsageTotals
+{
+    size_t buckets;
+    size_t *bytes;
+    size_t *files;
+} UsageTotals;
+
+// Add one node to its worker's running totals
+void usageVisit(ParallelWalk *walk, int worker, FileNode *node, uint32_t bucket, size_t sequence)
+{
+    UsageTotals *totals = (UsageTotals *)walk->context;
+    size_t slot = (size_t)worker * totals->buckets + bucket;
+    (void)sequence;
+    totals->bytes[slot] += contentSize(node);
+    totals->files[slot] += node->type == TYPE_FILE;
+}
+
+// Content bytes and file count under each entry of dir, then the total, by walking the subtree on the
+// worker pool. The du command reads the maintained totals instead; --bench parallel times this walk.
+int diskUsageWalk(FileNode *dir, const char *label, FILE *out)
+{
+    size_t buckets = 1;
+    for (FileNode *child = dir->fChild; child; child = child->nSibling)
+        buckets++;
+
+    UsageTotals totals = {buckets, NULL, NULL};
+    totals.bytes = (size_t *)calloc(buckets * MAX_WALK_THREADS, sizeof(size_t));
+    totals.files = (size_t *)calloc(buckets * MAX_WALK_THREADS, sizeof(size_t));
+    if (!totals.bytes || !totals.files)
+    {
+        free(totals.bytes);
+        free(totals.files);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+
+    ParallelWalk walk = {0, NULL, 0, usageVisit, &totals};
+    parallelWalkRun(&walk, dir, 1);
+
+    // Fold worker rows into row 0, then print in directory order
+    for (int worker = 1; worker < MAX_WALK_THREADS; worker++)
+    {
+        for (size_t bucket = 0; bucket < buckets; bucket++)
+        {
+            totals.bytes[bucket] += totals.bytes[(size_t)worker * buckets + bucket];
+            totals.files[bucket] += totals.files[(size_t)worker * buckets + bucket];
+        }
+    }
+    size_t allBytes = totals.bytes[0];
+    size_t allFiles = totals.files[0];
+    size_t bucket = 1;
+    for (FileNode *child = dir->fChild; child; child = child->nSibling, bucket++)
+    {
+        fprintf(out, "%10zu  %8zu  %s%s\n", totals.bytes[bucket], totals.files[bucket], child->fileName,
+                child->type == TYPE_FOLDER ? "/" : "");
+        allBytes += totals.bytes[bucket];
+        allFiles += totals.files[bucket];
+    }
+    fprintf(out, "%10zu  %8zu  %s (total)\n", allBytes, allFiles, label);
+
+    free(totals.bytes);
+    free(totals.files);
+    return 1;
+}
+
+// One du line: bytes, files and folders below name, and the newest modification time there
+void printUsageLine(FILE *out, const SubtreeTotals *totals, const char *name, const char *suffix)
+{
+    char newest[TIME_TEXT_SIZE];
+    formatTime(totals->newest, newest);
+    fprintf(out, "%10zu  %8zu  %8zu  %s  %s%s\n", totals->bytes, totals->files, totals->folders, newest, name,
+            suffix);
+}
+
+// du: the totals of each entry of dir, then of dir itself (only that line with summary). Reads the
+// maintained totals, so it costs one line per entry however large the subtrees below them are.
+void diskUsage(FileNode *dir, const char *label, int summary, FILE *out)
+{
+    if (!summary)
+        lazyTouch(dir);
+    for (FileNode *child = summary ? NULL : dir->fChild; child; child = child->nSibling)
+    {
+        SubtreeTotals totals = child->type == TYPE_FOLDER ? totalsRead(child) : totalsOf(child);
+        printUsageLine(out, &totals, child->fileName, child->type == TYPE_FOLDER ? "/" : "");
+    }
+    SubtreeTotals totals = totalsRead(dir);
+    printUsageLine(out, &totals, label, " (total)");
+}
+
+// A matching line found by grep
+// Per-worker output for the file being searched, flushed whole so files never interleave
+typedef struct GrepWorker
+{
+    char *scratch;
+    size_t scratchCapacity;
+    char *out;
+    size_t outUsed;
+    size_t outCapacity;
+    char path[MAX_PATH_LENGTH];
+    size_t pathLength;
+    size_t lines;
+    int failed;
+} GrepWorker;
+
+// Files [first, end) in preorder that finished while an earlier file was still being searched
+typedef struct GrepRun
+{
+    size_t first;
+    size_t end;
+} GrepRun;
+
+// Output of a finished file, held until every file before it in preorder is done
+typedef struct GrepHeld
+{
+    size_t sequence;
+    char *out;
+    size_t length;
+} GrepHeld;
+
+// Reorder window of grep -r: files are written in preorder, each as soon as all files before it are done.
+// next is the first file not yet written; runs and held are sorted by sequence.
+typedef struct GrepOrder
+{
+    size_t next;
+    GrepRun *runs;
+    size_t runCount;
+    size_t runCapacity;
+    GrepHeld *held;
+    size_t heldCount;
+    size_t heldCapacity;
+} GrepOrder;
+
+// Shared state of one grep
+typedef struct GrepSearch
+{
+    const GrepOptions *options;
+    const char *needle;
+    size_t needleLength;
+    Regex *regex;
+    FILE *out;
+    GrepWorker *workers;
+    GrepOrder order;
+#ifndef _WIN32
+    pthread_mutex_t outputLock;
+#endif
+} GrepSearch;
+
+typedef const char *(*FindBytesFn)(const char *haystack, size_t length, const char *needle, size_t needleLength);
+
+// First occurrence of needle in haystack, or NULL: memchr for the first byte, then compare
+const char *findBytesScalar(const char *haystack, size_t length, const char *needle, size_t needleLength)
+{
+    if (!needleLength)
+        return haystack;
+    while (length >= needleLength)
+    {
+        const char *hit = (const char *)memchr(haystack, needle[0], length - needleLength + 1);
+        if (!hit)
+            return NULL;
+        if (memcmp(hit, needle, needleLength) == 0)
+            return hit;
+        length -= (size_t)(hit - haystack) + 1;
+        haystack = hit + 1;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+// SSE2 kernel: compare the needle's first and last bytes against 16 positions at once and
+// only memcmp where both agree; single bytes and the tail go to the scalar kernel
+__attribute__((target("sse2"))) const char *findBytesSse2(const char *haystack, size_t length, const char *needle,
+                                                          size_t needleLength)
+{
+    if (needleLength < 2 || length < needleLength)
+        return findBytesScalar(haystack, length, needle, needleLength);
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+    for (; i + needleLength - 1 + 16 <= length; i += 16)
+    {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i *)(haystack + i + needleLength - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+        while (mask)
+        {
+            unsigned int bit = (unsigned int)__builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findBytesScalar(haystack + i, length - i, needle, needleLength);
+}
+
+// AVX2 kernel: the SSE2 filter over 32 positions per step
+__attribute__((target("avx2"))) const char *findBytesAvx2(const char *haystack, size_t length, const char *needle,
+                                                          size_t needleLength)
+{
+    if (needleLength < 2 || length < needleLength)
+        return findBytesScalar(haystack, length, needle, needleLength);
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+    for (; i + needleLength - 1 + 32 <= length; i += 32)
+    {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i *)(haystack + i + needleLength - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask)
+        {
+            unsigned int bit = (unsigned int)__builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0)
+                return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findBytesScalar(haystack + i, length - i, needle, needleLength);
+}
+#endif
+
+// Substring kernels, slowest first; searchKernelSelect picks the last one the CPU supports
+typedef struct SearchKernel
+{
+    const char *name;
+    FindBytesFn find;
+} SearchKernel;
+
+SearchKernel searchKernels[] = {
+    {"scalar", findBytesScalar},
+#ifdef SEARCH_X86
+    {"sse2", findBytesSse2},
+    {"avx2", findBytesAvx2},
+#endif
+};
+
+#define SEARCH_KERNEL_COUNT (sizeof(searchKernels) / sizeof(searchKernels[0]))
+
+FindBytesFn findBytes = findBytesScalar;
+const char *searchKernelName = "scalar";
+
+// Whether this CPU (and OS) can run kernel i
+int searchKernelSupported(size_t kernel)
+{
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (searchKernels[kernel].find == findBytesSse2)
+        return __builtin_cpu_supports("sse2");
+    if (searchKernels[kernel].find == findBytesAvx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return kernel == 0;
+}
+
+// Choose the widest supported kernel; called once at startup
+void searchKernelSelect(void)
+{
+    for (size_t i = 0; i < SEARCH_KERNEL_COUNT; i++)
+    {
+        if (searchKernelSupported(i))
+        {
+            findBytes = searchKernels[i].find;
+            searchKernelName = searchKernels[i].name;
+        }
+    }
+}
+
+// The one byte an atom accepts, or -1 if it accepts several
+int regexAtomByte(const RegexAtom *atom)
+{
+    int byte = -1;
+    for (int c = 0; c < 256; c++)
+    {
+        if (atom->set[c / 8] & (1u << (c % 8)))
+        {
+            if (byte >= 0)
+                return -1;
+            byte = c;
+        }
+    }
+    return byte;
+}
+
+// Parse a [...] class body starting after the '['; negators lists the bytes that negate it when first.
+// Returns the position after the closing ']', or NULL (after printing why) if there is none.
+const unsigned char *parseByteClass(RegexAtom *atom, const unsigned char *p, const char *negators)
+{
+    int negate = *p && strchr(negators, *p) != NULL;
+    if (negate)
+        p++;
+    // A ']' right after '[' or the negator is a member, not the end
+    const unsigned char *first = p;
+    while (*p && (*p != ']' || p == first))
+    {
+        unsigned char from = *p == '\\' && p[1] ? *++p : *p;
+        unsigned char to = from;
+        if (p[1] == '-' && p[2] && p[2] != ']')
+        {
+            p += 2;
+            to = *p == '\\' && p[1] ? *++p : *p;
+        }
+        for (unsigned int c = from; c <= to; c++)
+            atom->set[c / 8] |= (unsigned char)(1u << (c % 8));
+        p++;
+    }
+    if (!*p)
+    {
+        fprintf(shellOut, "Error: Unterminated '[' in pattern\n");
+        return NULL;
+    }
+    if (negate)
+    {
+        for (size_t i = 0; i < sizeof(atom->set); i++)
+            atom->set[i] = (unsigned char)~atom->set[i];
+        atom->set['\n' / 8] &= (unsigned char)~(1u << ('\n' % 8));
+    }
+    return p + 1;
+}
+
+// Compile pattern; returns 0 (after printing why) if it is malformed
+int regexCompile(Regex *regex, const char *pattern)
+{
+    size_t length = strlen(pattern);
+    memset(regex, 0, sizeof(*regex));
+    regex->atoms = (RegexAtom *)calloc(length + 1, sizeof(RegexAtom));
+    regex->literal = (char *)malloc(length + 1);
+    if (!regex->atoms || !regex->literal)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+
+    const unsigned char *p = (const unsigned char *)pattern;
+    if (*p == '^')
+    {
+        regex->anchorStart = 1;
+        p++;
+    }
+    while (*p)
+    {
+        if (p[0] == '$' && !p[1])
+        {
+            regex->anchorEnd = 1;
+            break;
+        }
+
+        RegexAtom *atom = &regex->atoms[regex->count];
+        if (*p == '*' || *p == '+' || *p == '?')
+        {
+            fprintf(shellOut, "Error: Nothing to repeat before '%c'\n", *p);
+            return 0;
+        }
+        else if (*p == '.')
+        {
+            memset(atom->set, 0xFF, sizeof(atom->set));
+            atom->set['\n' / 8] &= (unsigned char)~(1u << ('\n' % 8));
+            p++;
+        }
+        else if (*p == '[')
+        {
+            if (!(p = parseByteClass(atom, p + 1, "^")))
+                return 0;
+        }
+        else
+        {
+            if (*p == '\\' && !*++p)
+            {
+                fprintf(shellOut, "Error: Trailing '\\' in pattern\n");
+                return 0;
+            }
+            atom->set[*p / 8] |= (unsigned char)(1u << (*p % 8));
+            p++;
+        }
+
+        atom->repeat = (*p == '*' || *p == '+' || *p == '?') ? (char)*p++ : 0;
+        regex->count++;
+    }
+
+    // The longest run of single-byte atoms that must appear once each, in order
+    size_t run = 0;
+    size_t runEnd = 0;
+    for (size_t i = 0, length = 0; i < regex->count; i++)
+    {
+        length = !regex->atoms[i].repeat && regexAtomByte(&regex->atoms[i]) >= 0 ? length + 1 : 0;
+        if (length > run)
+        {
+            run = length;
+            runEnd = i + 1;
+        }
+    }
+    for (size_t i = 0; i < run; i++)
+    {
+        regex->literal[i] = (char)regexAtomByte(&regex->atoms[runEnd - run + i]);
+    }
+    regex->literal[run] = '\0';
+    regex->literalLength = run;
+    return 1;
+}
+
+// Compile a name glob (* ? [...] [!...] and \ escapes) into atoms; a '*' atom matches any run of bytes.
+// literal holds the leading literal run, the prefix every matching name starts with.
+int globCompile(Regex *glob, const char *pattern)
+{
+    size_t length = strlen(pattern);
+    memset(glob, 0, sizeof(*glob));
+    glob->atoms = (RegexAtom *)calloc(length + 1, sizeof(RegexAtom));
+    glob->literal = (char *)malloc(length + 1);
+    if (!glob->atoms || !glob->literal)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    glob->anchorStart = 1;
+    glob->anchorEnd = 1;
+
+    const unsigned char *p = (const unsigned char *)pattern;
+    int prefix = 1;
+    while (*p)
+    {
+        RegexAtom *atom = &glob->atoms[glob->count++];
+        if (*p == '*' || *p == '?')
+        {
+            memset(atom->set, 0xFF, sizeof(atom->set));
+            atom->repeat = *p == '*' ? '*' : 0;
+            prefix = 0;
+            p++;
+        }
+        else if (*p == '[')
+        {
+            if (!(p = parseByteClass(atom, p + 1, "!^")))
+                return 0;
+            prefix = 0;
+        }
+        else
+        {
+            if (*p == '\\' && p[1])
+                p++;
+            atom->set[*p / 8] |= (unsigned char)(1u << (*p % 8));
+            if (prefix)
+                glob->literal[glob->literalLength++] = (char)*p;
+            p++;
+        }
+    }
+    glob->literal[glob->literalLength] = '\0';
+    return 1;
+}
+
+// Whether a whole name matches a compiled glob; on a mismatch the last '*' absorbs one more byte
+int globMatch(const Regex *glob, const char *name)
+{
+    const RegexAtom *atoms = glob->atoms;
+    size_t atom = 0;
+    size_t star = SIZE_MAX;
+    const char *starText = NULL;
+    while (*name)
+    {
+        unsigned char c = (unsigned char)*name;
+        if (atom < glob->count && atoms[atom].repeat == '*')
+        {
+            star = atom++;
+            starText = name;
+        }
+        else if (atom < glob->count && (atoms[atom].set[c / 8] & (1u << (c % 8))))
+        {
+            atom++;
+            name++;
+        }
+        else if (star != SIZE_MAX)
+        {
+            atom = star + 1;
+            name = ++starText;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while (atom < glob->count && atoms[atom].repeat == '*')
+    {
+        atom++;
+    }
+    return atom == glob->count;
+}
+
+// Render (or, with no render, just count) every node under root whose name matches glob, up to the
+// render's entry cap. With a literal prefix, only names in that range of the name order are visited, in
+// name order, each distinct name is tested once and its nodes come from the name index ring. Without one
+// every name is a candidate and the slab-ordered preorder walk beats visiting the name order at random,
+// so root's subtree is walked instead. The caller holds the namespace lock.
+size_t findGlob(FileNode *root, const Regex *glob, RenderBuffer *render)
+{
+    size_t matches = 0;
+    if (!glob->literalLength)
+    {
+        for (FileNode *node = root; node; node = nextPreorder(root, node))
+        {
+            if (!globMatch(glob, node->fileName))
+                continue;
+            if (render && !renderEntry(render))
+                break;
+            if (render)
+                renderPath(render, node);
+            matches++;
+        }
+        return matches;
+    }
+
+    uint32_t id = nameOrderSeek(glob->literal);
+    for (; id != NODE_NIL; id = nameOrderNext(id))
+    {
+        const char *name = nameOrder.entries[id].str;
+        if (strncmp(name, glob->literal, glob->literalLength) != 0)
+            break;
+        if (!globMatch(glob, name))
+            continue;
+
+        FileNode *head = nameIndexLookup(name);
+        for (FileNode *found = head; found; found = found->nameNext == head ? NULL : found->nameNext)
+        {
+            if (!isInSubtree(root, found))
+                continue;
+            if (render && !renderEntry(render))
+                return matches;
+            if (render)
+                renderPath(render, found);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// Release a compiled regex
+void regexFree(Regex *regex)
+{
+    free(regex->atoms);
+    free(regex->literal);
+}
+
+// Match atoms against text starting exactly at text; repeats are greedy and backtrack
+int regexMatchHere(const Regex *regex, size_t atom, const char *text, const char *end)
+{
+    for (; atom < regex->count; atom++)
+    {
+        const RegexAtom *current = &regex->atoms[atom];
+        if (!current->repeat)
+        {
+            if (text == end || !(current->set[(unsigned char)*text / 8] & (1u << ((unsigned char)*text % 8))))
+                return 0;
+            text++;
+            continue;
+        }
+
+        size_t most = 0;
+        size_t least = current->repeat == '+' ? 1 : 0;
+        while (text + most < end && (current->repeat != '?' || most < 1) &&
+               (current->set[(unsigned char)text[most] / 8] & (1u << ((unsigned char)text[most] % 8))))
+        {
+            most++;
+        }
+        for (size_t taken = most + 1; taken-- > least;)
+        {
+            if (regexMatchHere(regex, atom + 1, text + taken, end))
+                return 1;
+        }
+        return 0;
+    }
+    return !regex->anchorEnd || text == end;
+}
+
+// Whether any part of the line [start, end) matches
+int regexMatchLine(const Regex *regex, const char *start, const char *end)
+{
+    if (regex->anchorStart)
+        return regexMatchHere(regex, 0, start, end);
+
+    // A match must start on a byte the first atom accepts unless that atom may be skipped
+    const RegexAtom *first = regex->count ? &regex->atoms[0] : NULL;
+    int mustStart = first && (!first->repeat || first->repeat == '+');
+    for (const char *at = start; at <= end; at++)
+    {
+        if (mustStart && (at == end || !(first->set[(unsigned char)*at / 8] & (1u << ((unsigned char)*at % 8)))))
+            continue;
+        if (regexMatchHere(regex, 0, at, end))
+            return 1;
+    }
+    return 0;
+}
+
+// Append bytes to the worker's pending output
+int grepEmit(GrepWorker *state, const char *data, size_t length)
+{
+    if (state->outUsed + length > state->outCapacity)
+    {
+        size_t capacity = state->outCapacity ? state->outCapacity * 2 : 4096;
+        while (capacity < state->outUsed + length)
+        {
+            capacity *= 2;
+        }
+        char *out = (char *)realloc(state->out, capacity);
+        if (!out)
+        {
+            state->failed = 1;
+            return 0;
+        }
+        state->out = out;
+        state->outCapacity = capacity;
+    }
+    memcpy(state->out + state->outUsed, data, length);
+    state->outUsed += length;
+    return 1;
+}
+
+// A file's bytes when they sit in one piece (mapped base, one uncompressed chunk or one extent), else NULL
+const char *contentContiguous(const FileNode *node)
+{
+    const FileContent *content = node->content;
+    if (!content)
+        return NULL;
+    size_t pieces = (content->baseLength != 0) + content->chunkCount + (content->head != NULL);
+    if (pieces != 1 || content->head != content->tail)
+        return NULL;
+    if (content->baseLength)
+        return content->base;
+    if (content->head)
+        return content->head->data;
+    Chunk *chunk = content->chunks[0];
+    if (chunk->stored != chunk->length)
+        return NULL;
+    chunkTouch(chunk);
+    return chunk->data;
+}
+
+// Walk over a file's bytes one stored piece at a time: the base, each chunk, then each extent
+typedef struct ContentPieces
+{
+    const FileContent *content;
+    int baseDone;
+    size_t chunk;
+    const Extent *extent;
+    char expanded[CHUNK_SIZE];
+} ContentPieces;
+
+// Start a walk over node's content
+void contentPiecesStart(ContentPieces *pieces, const FileNode *node)
+{
+    pieces->content = node->content;
+    pieces->baseDone = 0;
+    pieces->chunk = 0;
+    pieces->extent = node->content ? node->content->head : NULL;
+}
+
+// Next non-empty piece and its length, or NULL at the end.
+// Uncompressed pieces are returned in place; a compressed chunk is expanded into the walk's own buffer.
+const char *contentPiecesNext(ContentPieces *pieces, size_t *length)
+{
+    const FileContent *content = pieces->content;
+    if (!content)
+        return NULL;
+    if (!pieces->baseDone)
+    {
+        pieces->baseDone = 1;
+        if (content->baseLength)
+        {
+            *length = content->baseLength;
+            return content->base;
+        }
+    }
+    if (pieces->chunk < content->chunkCount)
+    {
+        // Fetch the next chunk's first bytes and the header of the one after while this chunk is scanned
+        Chunk *chunk = content->chunks[pieces->chunk++];
+        if (pieces->chunk < content->chunkCount)
+            PREFETCH(content->chunks[pieces->chunk]->data);
+        if (pieces->chunk + 1 < content->chunkCount)
+            PREFETCH(content->chunks[pieces->chunk + 1]);
+        chunkTouch(chunk);
+        if (chunk->stored == chunk->length)
+        {
+            *length = chunk->length;
+            return chunk->data;
+        }
+        *length = lzDecompress(chunk->data, chunk->stored, pieces->expanded, chunk->length);
+        return pieces->expanded;
+    }
+    while (pieces->extent)
+    {
+        const Extent *extent = pieces->extent;
+        pieces->extent = extent->next;
+        if (extent->length)
+        {
+            *length = extent->length;
+            return extent->data;
+        }
+    }
+    return NULL;
+}
+
+// Search the lines in [data, end), numbering them on from *line and adding matches to *matched.
+// Unless last is set, a final line without its newline is left for the next piece: *rest is set to its start
+// (end if there is none) and every line before it is counted so the numbering carries on.
+// Returns nonzero once the file needs no more searching (-l after its first match).
+int grepLines(GrepSearch *search, GrepWorker *state, FileNode *node, const char *data, const char *end, int last,
+              const char **rest, size_t *line, size_t *matched)
+{
+    // Find the needle, widen the hit to its line, check the regex if any, then skip past that line
+    GrepMode mode = search->options->mode;
+    const char *lineStart = data;
+    while (lineStart < end)
+    {
+        const char *hit = lineStart;
+        if (search->needleLength)
+        {
+            hit = findBytes(lineStart, (size_t)(end - lineStart), search->needle, search->needleLength);
+            if (!hit)
+                break;
+            for (const char *at = lineStart; (at = (const char *)memchr(at, '\n', (size_t)(hit - at))); at++)
+            {
+                (*line)++;
+                lineStart = at + 1;
+            }
+        }
+        const char *lineEnd = (const char *)memchr(hit, '\n', (size_t)(end - hit));
+        if (!lineEnd)
+        {
+            if (!last)
+            {
+                *rest = lineStart;
+                return 0;
+            }
+            lineEnd = end;
+        }
+
+        if (!search->regex || regexMatchLine(search->regex, lineStart, lineEnd))
+        {
+            if (!*matched)
+            {
+                if (nodePath(node, state->path, sizeof(state->path)) < 0)
+                    strcpy(state->path, "...");
+                state->pathLength = strlen(state->path);
+            }
+            (*matched)++;
+            if (mode == GREP_FILES)
+                return 1;
+            if (mode == GREP_LINES)
+            {
+                char number[32];
+                int digits = snprintf(number, sizeof(number), ":%zu:", *line);
+                grepEmit(state, state->path, state->pathLength);
+                grepEmit(state, number, (size_t)digits);
+                grepEmit(state, lineStart, (size_t)(lineEnd - lineStart));
+                grepEmit(state, "\n", 1);
+            }
+        }
+        lineStart = lineEnd + 1;
+        (*line)++;
+    }
+    if (last)
+        return 0;
+
+    // No more hits: find the unfinished line only now, once the search has brought the piece into cache
+    const char *tail = end;
+    while (tail > lineStart && tail[-1] != '\n')
+    {
+        tail--;
+    }
+    *rest = tail;
+    if (mode == GREP_LINES)
+    {
+        for (const char *at = lineStart; (at = (const char *)memchr(at, '\n', (size_t)(tail - at))); at++)
+        {
+            (*line)++;
+        }
+    }
+    return 0;
+}
+
+// Append bytes to the line carried over between pieces in the worker's scratch buffer
+int grepCarry(GrepWorker *state, size_t *carried, const char *data, size_t length)
+{
+    if (*carried + length > state->scratchCapacity)
+    {
+        size_t capacity = state->scratchCapacity ? state->scratchCapacity * 2 : 4096;
+        while (capacity < *carried + length)
+        {
+            capacity *= 2;
+        }
+        char *scratch = (char *)realloc(state->scratch, capacity);
+        if (!scratch)
+        {
+            state->failed = 1;
+            return 0;
+        }
+        state->scratch = scratch;
+        state->scratchCapacity = capacity;
+    }
+    memcpy(state->scratch + *carried, data, length);
+    *carried += length;
+    return 1;
+}
+
+// Search one file, leaving its results in the worker's output buffer
+void grepFile(GrepSearch *search, GrepWorker *state, FileNode *node)
+{
+    size_t size = contentSize(node);
+    state->outUsed = 0;
+    if (node->type != TYPE_FILE || !size || size < search->needleLength || state->failed)
+        return;
+
+    GrepMode mode = search->options->mode;
+    size_t line = 1;
+    size_t matched = 0;
+    const char *data = contentContiguous(node);
+    if (data)
+    {
+        grepLines(search, state, node, data, data + size, 1, NULL, &line, &matched);
+    }
+    else
+    {
+        // Search each piece in place; only a line split across pieces is copied, into the scratch buffer,
+        // and searched there once its newline turns up
+        ContentPieces pieces;
+        contentPiecesStart(&pieces, node);
+        size_t carried = 0;
+        size_t length;
+        int done = 0;
+        const char *piece;
+        const char *rest;
+        while (!done && (piece = contentPiecesNext(&pieces, &length)))
+        {
+            const char *end = piece + length;
+            if (carried)
+            {
+                const char *newline = (const char *)memchr(piece, '\n', length);
+                const char *next = newline ? newline + 1 : end;
+                if (!grepCarry(state, &carried, piece, (size_t)(next - piece)))
+                    return;
+                piece = next;
+                if (!newline)
+                    continue;
+                done = grepLines(search, state, node, state->scratch, state->scratch + carried, 0, &rest, &line,
+                                 &matched);
+                carried = 0;
+            }
+            if (!done)
+                done = grepLines(search, state, node, piece, end, 0, &rest, &line, &matched);
+            if (!done && rest < end && !grepCarry(state, &carried, rest, (size_t)(end - rest)))
+                return;
+        }
+        if (!done && carried)
+            grepLines(search, state, node, state->scratch, state->scratch + carried, 1, NULL, &line, &matched);
+    }
+    if (!matched)
+        return;
+
+    if (mode == GREP_COUNT)
+    {
+        char number[32];
+        int digits = snprintf(number, sizeof(number), ":%zu\n", matched);
+        grepEmit(state, state->path, state->pathLength);
+        grepEmit(state, number, (size_t)digits);
+    }
+    else if (mode == GREP_FILES)
+    {
+        grepEmit(state, state->path, state->pathLength);
+        grepEmit(state, "\n", 1);
+    }
+    state->lines += matched;
+}
+
+// Write out every held file before search->order.next, in preorder
+void grepWriteHeld(GrepSearch *search)
+{
+    GrepOrder *order = &search->order;
+    size_t written = 0;
+    while (written < order->heldCount && order->held[written].sequence < order->next)
+    {
+        fwrite(order->held[written].out, 1, order->held[written].length, search->out);
+        free(order->held[written].out);
+        written++;
+    }
+    if (!written)
+        return;
+    order->heldCount -= written;
+    memmove(order->held, order->held + written, order->heldCount * sizeof(GrepHeld));
+}
+
+// Record file sequence as finished with the worker's output: write it now if every earlier file is done,
+// else hold it. Runs of finished files merge as they meet, so the window stays as small as the gaps in it.
+// Returns 0 if the window could not grow; the output is then written at once, out of order.
+int grepOrderAdd(GrepSearch *search, GrepWorker *state, size_t sequence)
+{
+    GrepOrder *order = &search->order;
+    if (sequence <= order->next)
+    {
+        fwrite(state->out, 1, state->outUsed, search->out);
+        if (sequence == order->next)
+            order->next++;
+        while (order->runCount && order->runs[0].first <= order->next)
+        {
+            if (order->runs[0].end > order->next)
+                order->next = order->runs[0].end;
+            order->runCount--;
+            memmove(order->runs, order->runs + 1, order->runCount * sizeof(GrepRun));
+        }
+        grepWriteHeld(search);
+        return 1;
+    }
+
+    // Find the first run that starts past sequence
+    size_t low = 0;
+    size_t high = order->runCount;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (order->runs[middle].first <= sequence)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // Extend the run just before sequence or the one just after, or insert a new run between them.
+    // A stale subtree total can give two files one sequence, and then the run before already covers it.
+    GrepRun *before = low ? &order->runs[low - 1] : NULL;
+    GrepRun *after = low < order->runCount ? &order->runs[low] : NULL;
+    if (before && before->end == sequence)
+    {
+        before->end++;
+        if (after && after->first == before->end)
+        {
+            before->end = after->end;
+            order->runCount--;
+            memmove(after, after + 1, (order->runCount - low) * sizeof(GrepRun));
+        }
+    }
+    else if (after && after->first == sequence + 1 && (!before || before->end < sequence))
+    {
+        after->first = sequence;
+    }
+    else if (!before || before->end < sequence)
+    {
+        if (order->runCount == order->runCapacity)
+        {
+            size_t capacity = order->runCapacity ? order->runCapacity * 2 : 64;
+            GrepRun *runs = (GrepRun *)realloc(order->runs, capacity * sizeof(GrepRun));
+            if (!runs)
+                return 0;
+            order->runs = runs;
+            order->runCapacity = capacity;
+        }
+        memmove(order->runs + low + 1, order->runs + low, (order->runCount - low) * sizeof(GrepRun));
+        order->runs[low].first = sequence;
+        order->runs[low].end = sequence + 1;
+        order->runCount++;
+    }
+    if (!state->outUsed)
+        return 1;
+
+    // Hold a copy of the output, sorted in by sequence (usually at the end)
+    if (order->heldCount == order->heldCapacity)
+    {
+        size_t capacity = order->heldCapacity ? order->heldCapacity * 2 : 64;
+        GrepHeld *held = (GrepHeld *)realloc(order->held, capacity * sizeof(GrepHeld));
+        if (!held)
+            return 0;
+        order->held = held;
+        order->heldCapacity = capacity;
+    }
+    char *out = (char *)malloc(state->outUsed);
+    if (!out)
+        return 0;
+    memcpy(out, state->out, state->outUsed);
+    size_t at = order->heldCount;
+    while (at && order->held[at - 1].sequence > sequence)
+    {
+        at--;
+    }
+    memmove(order->held + at + 1, order->held + at, (order->heldCount - at) * sizeof(GrepHeld));
+    order->held[at].sequence = sequence;
+    order->held[at].out = out;
+    order->held[at].length = state->outUsed;
+    order->heldCount++;
+    return 1;
+}
+
+// Walk callback: search each file in the subtree and pass its results through the reorder window
+void grepVisit(ParallelWalk *walk, int worker, FileNode *node, uint32_t bucket, size_t sequence)
+{
+    GrepSearch *search = (GrepSearch *)walk->context;
+    GrepWorker *state = &search->workers[worker];
+    (void)bucket;
+    if (node->type != TYPE_FILE)
+        return;
+    grepFile(search, state, node);
+#ifndef _WIN32
+    pthread_mutex_lock(&search->outputLock);
+#endif
+    if (!grepOrderAdd(search, state, sequence))
+    {
+        state->failed = 1;
+        fwrite(state->out, 1, state->outUsed, search->out);
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&search->outputLock);
+#endif
+}
+
+// grep: stream matches under top one file's results at a time, in preorder whatever the thread count.
+// Literal patterns (or -F) go straight to the substring kernel; a regex is only tried on lines that
+// contain its longest required literal. Returns the number of matching lines, or -1 on error.
+long grepTree(FileNode *top, const GrepOptions *options, FILE *out)
+{
+    Regex regex;
+#ifdef _WIN32
+    GrepSearch search = {options, options->pattern, strlen(options->pattern), NULL, out, NULL,
+                         {0, NULL, 0, 0, NULL, 0, 0}};
+#else
+    GrepSearch search = {options, options->pattern, strlen(options->pattern), NULL, out, NULL,
+                         {0, NULL, 0, 0, NULL, 0, 0}, PTHREAD_MUTEX_INITIALIZER};
+#endif
+    if (!options->fixed && strpbrk(options->pattern, ".[]*+?^$\\"))
+    {
+        if (!regexCompile(&regex, options->pattern))
+        {
+            regexFree(&regex);
+            return -1;
+        }
+        search.regex = &regex;
+        search.needle = regex.literal;
+        search.needleLength = regex.literalLength;
+    }
+
+    int threads = options->recursive && top->type == TYPE_FOLDER ? MAX_WALK_THREADS : 1;
+    search.workers = (GrepWorker *)calloc((size_t)threads, sizeof(GrepWorker));
+    if (!search.workers)
+    {
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        if (search.regex)
+            regexFree(&regex);
+        return -1;
+    }
+
+    if (top->type != TYPE_FOLDER)
+    {
+        grepFile(&search, &search.workers[0], top);
+        fwrite(search.workers[0].out, 1, search.workers[0].outUsed, out);
+    }
+    else if (!options->recursive)
+    {
+        for (FileNode *child = top->fChild; child; child = child->nSibling)
+        {
+            grepFile(&search, &search.workers[0], child);
+            fwrite(search.workers[0].out, 1, search.workers[0].outUsed, out);
+        }
+    }
+    else
+    {
+        // Anything still held sits behind a gap that stale totals left; it goes out in order at the end
+        ParallelWalk walk = {0, NULL, 0, grepVisit, &search};
+        parallelWalkRun(&walk, top, 0);
+        search.order.next = (size_t)-1;
+        grepWriteHeld(&search);
+        free(search.order.runs);
+        free(search.order.held);
+    }
+
+    long lines = 0;
+    int failed = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        lines += (long)search.workers[i].lines;
+        failed |= search.workers[i].failed;
+        free(search.workers[i].out);
+        free(search.workers[i].scratch);
+    }
+    if (failed)
+        fprintf(shellOut, "Error: Memory allocation failed, results are incomplete\n");
+
+#ifndef _WIN32
+    pthread_mutex_destroy(&search.outputLock);
+#endif
+    free(search.workers);
+    if (search.regex)
+        regexFree(&regex);
+    return failed ? -1 : lines;
+}
+
+// Flush a stream and force it to stable storage
+int syncFile(FILE *file)
+{
+    if (fflush(file) != 0)
+        return 0;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Map an image file read-only; the caller holds one reference
+MappedImage *imageMap(const char *path)
+{
+    MappedImage *image = (MappedImage *)calloc(1, sizeof(MappedImage));
+    if (!image)
+        return NULL;
+
+#ifdef _WIN32
+    FILE *file = fopen(path, "rb");
+    long size = -1;
+    if (file && fseek(file, 0, SEEK_END) == 0)
+        size = ftell(file);
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        image->base = (char *)malloc((size_t)size);
+        if (image->base && fread(image->base, 1, (size_t)size, file) != (size_t)size)
+        {
+            free(image->base);
+            image->base = NULL;
+        }
+        image->size = (size_t)size;
+    }
+    if (file)
+        fclose(file);
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void *base = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED)
+        {
+            image->base = (char *)base;
+            image->size = (size_t)info.st_size;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    if (!image->base)
+    {
+        free(image);
+        return NULL;
+    }
+
+    image->refs = 1;
+    image->next = mappedImages;
+    mappedImages = image;
+    return image;
+}
+
+// Drop a reference to a mapped image, unmapping it with the last one
+void imageRelease(MappedImage *image)
+{
+    if (--image->refs)
+        return;
+
+    MappedImage **link = &mappedImages;
+    while (*link != image)
+    {
+        link = &(*link)->next;
+    }
+    *link = image->next;
+
+#ifdef _WIN32
+    free(image->base);
+#else
+    munmap(image->base, image->size);
+#endif
+    free(image);
+}
+
+// Round an image offset up to 8 bytes
+uint64_t imageAlign(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Write zero bytes up to an aligned offset
+void imagePad(FILE *file, uint64_t from, uint64_t to)
+{
+    static const char zeros[8] = {0};
+    if (to > from)
+        fwrite(zeros, 1, (size_t)(to - from), file);
+}
+
+// Write the tree under root as a binary image, replacing path atomically. The unloaded part of a lazily
+// opened image is copied record by record from the old mapping, so saving does not load it.
+int saveImage(FileNode *root, const char *path)
+{
+    uint32_t imageNames = lazy.image ? lazy.super->nameCount : 0;
+    uint32_t *recordOf = (uint32_t *)malloc((size_t)nodeTable.count * sizeof(uint32_t));
+    uint32_t *ordinalOf = (uint32_t *)malloc((size_t)nameArena.entryCount * sizeof(uint32_t));
+    uint32_t *imageOrdinal = (uint32_t *)malloc(((size_t)imageNames + 1) * sizeof(uint32_t));
+    const char **nameOrder =
+        (const char **)malloc(((size_t)nameArena.entryCount + imageNames) * sizeof(const char *));
+    if (!recordOf || !ordinalOf || !imageOrdinal || !nameOrder)
+    {
+        free(recordOf);
+        free(ordinalOf);
+        free(imageOrdinal);
+        free(nameOrder);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return 0;
+    }
+    memset(ordinalOf, 0xFF, (size_t)nameArena.entryCount * sizeof(uint32_t));
+    memset(imageOrdinal, 0xFF, (size_t)imageNames * sizeof(uint32_t));
+
+    // Pass 1: number records in preorder, collect distinct names and sizes
+    ImageSuperblock super;
+    memset(&super, 0, sizeof(super));
+    memcpy(super.magic, IMAGE_MAGIC, sizeof(super.magic));
+    super.version = IMAGE_VERSION;
+    super.byteOrder = IMAGE_BYTE_ORDER;
+    super.journalSequence = journal.sequence;
+
+    const char *error = NULL;
+    for (FileNode *node = root; node && !error; node = nextPreorder(root, node))
+    {
+        recordOf[node->id] = super.nodeCount++;
+        if (ordinalOf[node->nameId] == NODE_NIL)
+        {
+            ordinalOf[node->nameId] = super.nameCount;
+            nameOrder[super.nameCount++] = node->fileName;
+            super.nameBytes += strlen(node->fileName) + 1;
+        }
+        super.contentBytes += contentSize(node);
+        super.folderCount += node->type == TYPE_FOLDER;
+
+        // A stub's subtree is the contiguous record range after its own record
+        uint32_t first, end;
+        int stub = lazyStubRange(node, &first, &end);
+        if (stub < 0)
+            error = "bad node record in the open image";
+        if (stub <= 0)
+            continue;
+        for (uint32_t i = first + 1; i < end; i++)
+        {
+            const ImageNode *record = &lazy.records[i];
+            if (!lazyRecordValid(record) || record->parent < first || record->parent >= i ||
+                (record->fChild != NODE_NIL && (record->fChild <= i || record->fChild >= end)) ||
+                (record->nSibling != NODE_NIL && (record->nSibling <= i || record->nSibling >= end)))
+            {
+                error = "bad node record in the open image";
+                break;
+            }
+            if (imageOrdinal[record->name] == NODE_NIL)
+            {
+                const char *name = lazy.names + lazy.nameTable[record->name];
+                imageOrdinal[record->name] = super.nameCount;
+                nameOrder[super.nameCount++] = name;
+                super.nameBytes += strlen(name) + 1;
+            }
+            super.contentBytes += record->contentSize;
+            super.folderCount += record->type == TYPE_FOLDER;
+        }
+        super.nodeCount += end - first - 1;
+    }
+
+    super.nodeOffset = imageAlign(sizeof(super));
+    super.nameTableOffset = super.nodeOffset + (uint64_t)super.nodeCount * sizeof(ImageNode);
+    super.nameOffset = super.nameTableOffset + (uint64_t)super.nameCount * sizeof(uint64_t);
+    super.totalsOffset = imageAlign(super.nameOffset + super.nameBytes);
+    super.contentOffset = super.totalsOffset + super.folderCount * sizeof(ImageTotals);
+    super.fileSize = super.contentOffset + super.contentBytes;
+
+    char tmpPath[MAX_PATH_LENGTH];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *file = error ? NULL : fopen(tmpPath, "wb");
+    if (!file)
+    {
+        if (error)
+            fprintf(shellOut, "Error: Cannot save '%s': %s\n", path, error);
+        else
+            fprintf(shellOut, "Error: Cannot write '%s'\n", tmpPath);
+        free(recordOf);
+        free(ordinalOf);
+        free(imageOrdinal);
+        free(nameOrder);
+        return 0;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    fwrite(&super, sizeof(super), 1, file);
+    imagePad(file, sizeof(super), super.nodeOffset);
+
+    // Pass 2: node records; copied records keep their offsets relative to the stub's own record
+    uint64_t contentOffset = 0;
+    uint32_t folders = 0;
+    for (FileNode *node = root; node; node = nextPreorder(root, node))
+    {
+        uint32_t first, end;
+        int stub = lazyStubRange(node, &first, &end);
+        uint32_t base = recordOf[node->id] - first;
+        ImageNode record;
+        memset(&record, 0, sizeof(record));
+        record.parent = node == root ? NODE_NIL : recordOf[node->parent->id];
+        if (stub)
+            record.fChild = lazy.records[first].fChild == NODE_NIL ? NODE_NIL : base + lazy.records[first].fChild;
+        else
+            record.fChild = node->fChild ? recordOf[node->fChild->id] : NODE_NIL;
+        record.nSibling = node != root && node->nSibling ? recordOf[node->nSibling->id] : NODE_NIL;
+        record.name = ordinalOf[node->nameId];
+        record.type = (uint32_t)node->type;
+        record.folder = node->type == TYPE_FOLDER ? folders++ : 0;
+        record.createdTime = (int64_t)node->createdTime;
+        record.modifiedTime = (int64_t)node->modifiedTime;
+        record.contentOffset = contentOffset;
+        record.contentSize = contentSize(node);
+        contentOffset += record.contentSize;
+        fwrite(&record, sizeof(record), 1, file);
+
+        for (uint32_t i = first + 1; i < end; i++)
+        {
+            record = lazy.records[i];
+            record.parent += base;
+            record.fChild = record.fChild == NODE_NIL ? NODE_NIL : base + record.fChild;
+            record.nSibling = record.nSibling == NODE_NIL ? NODE_NIL : base + record.nSibling;
+            record.name = imageOrdinal[record.name];
+            record.folder = record.type == TYPE_FOLDER ? folders++ : 0;
+            record.contentOffset = contentOffset;
+            contentOffset += record.contentSize;
+            fwrite(&record, sizeof(record), 1, file);
+        }
+    }
+
+    // Name table and name bytes
+    uint64_t nameOffset = 0;
+    for (uint32_t i = 0; i < super.nameCount; i++)
+    {
+        fwrite(&nameOffset, sizeof(nameOffset), 1, file);
+        nameOffset += strlen(nameOrder[i]) + 1;
+    }
+    for (uint32_t i = 0; i < super.nameCount; i++)
+    {
+        fwrite(nameOrder[i], 1, strlen(nameOrder[i]) + 1, file);
+    }
+    imagePad(file, super.nameOffset + super.nameBytes, super.totalsOffset);
+
+    // Pass 3: folder totals, in the same order as the folder ordinals
+    for (FileNode *node = root; node; node = nextPreorder(root, node))
+    {
+        if (node->type == TYPE_FOLDER)
+        {
+            SubtreeTotals live = totalsRead(node);
+            ImageTotals totals = {live.bytes, live.files, live.folders, (int64_t)live.newest};
+            fwrite(&totals, sizeof(totals), 1, file);
+        }
+        uint32_t first, end;
+        lazyStubRange(node, &first, &end);
+        for (uint32_t i = first + 1; i < end; i++)
+        {
+            if (lazy.records[i].type == TYPE_FOLDER)
+                fwrite(&lazy.totals[lazy.records[i].folder], sizeof(ImageTotals), 1, file);
+        }
+    }
+
+    // Pass 4: content region
+    for (FileNode *node = root; node; node = nextPreorder(root, node))
+    {
+        contentPrint(node, file);
+        uint32_t first, end;
+        lazyStubRange(node, &first, &end);
+        for (uint32_t i = first + 1; i < end; i++)
+        {
+            const ImageNode *record = &lazy.records[i];
+            fwrite(lazy.content + record->contentOffset, 1, (size_t)record->contentSize, file);
+        }
+    }
+
+    int ok = !ferror(file) && syncFile(file);
+    ok = fclose(file) == 0 && ok;
+    free(recordOf);
+    free(ordinalOf);
+    free(imageOrdinal);
+    free(nameOrder);
+
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmpPath, path) != 0)
+    {
+        remove(tmpPath);
+        fprintf(shellOut, "Error: Failed to write image '%s'\n", path);
+        return 0;
+    }
+
+    fprintf(shellOut, "Saved %u nodes to '%s'\n", super.nodeCount, path);
+    return 1;
+}
+
+// Check that a region lies inside the image
+int imageRangeValid(const ImageSuperblock *super, uint64_t offset, uint64_t length)
+{
+    return offset <= super->fileSize && length <= super->fileSize - offset;
+}
+
+// The superblock of a mapped image if its header and regions are consistent, otherwise NULL
+const ImageSuperblock *imageHeader(const MappedImage *image)
+{
+    const ImageSuperblock *super = (const ImageSuperblock *)image->base;
+    if (image->size < sizeof(*super) || memcmp(super->magic, IMAGE_MAGIC, sizeof(super->magic)) != 0 ||
+        super->version < 1 || super->version > IMAGE_VERSION || super->byteOrder != IMAGE_BYTE_ORDER ||
+        super->fileSize != image->size || super->nodeCount == 0 ||
+        !imageRangeValid(super, super->nodeOffset, (uint64_t)super->nodeCount * sizeof(ImageNode)) ||
+        !imageRangeValid(super, super->nameTableOffset, (uint64_t)super->nameCount * sizeof(uint64_t)) ||
+        !imageRangeValid(super, super->nameOffset, super->nameBytes) ||
+        !imageRangeValid(super, super->contentOffset, super->contentBytes) || super->nodeOffset % 8 ||
+        super->nameTableOffset % 8)
+        return NULL;
+
+    // Version 3 adds the folder totals table
+    if (super->version >= 3 && (super->totalsOffset % 8 || super->folderCount > super->nodeCount ||
+                                !imageRangeValid(super, super->totalsOffset,
+                                                 super->folderCount * sizeof(ImageTotals))))
+        return NULL;
+    return super;
+}
+
+// Map an image and build a tree from it; returns the new root or NULL
+FileNode *loadImage(const char *path)
+{
+    double start = nowSeconds();
+    MappedImage *image = imageMap(path);
+    if (!image)
+    {
+        fprintf(shellOut, "Error: Cannot open image '%s'\n", path);
+        return NULL;
+    }
+
+    const ImageSuperblock *super = imageHeader(image);
+    if (!super)
+    {
+        fprintf(shellOut, "Error: '%s' is not a valid image (version %d expected)\n", path, IMAGE_VERSION);
+        imageRelease(image);
+        return NULL;
+    }
+
+    const ImageNode *records = (const ImageNode *)(image->base + super->nodeOffset);
+    const uint64_t *nameTable = (const uint64_t *)(image->base + super->nameTableOffset);
+    const char *names = image->base + super->nameOffset;
+    const char *content = image->base + super->contentOffset;
+
+    uint32_t *nameIds = (uint32_t *)malloc((size_t)super->nameCount * sizeof(uint32_t));
+    FileNode **built = (FileNode **)calloc(super->nodeCount, sizeof(FileNode *));
+    FileNode *root = NULL;
+    uint32_t internedNames = 0;
+    const char *error = NULL;
+
+    // Intern each distinct name once
+    for (uint32_t i = 0; nameIds && built && i < super->nameCount; i++)
+    {
+        // Check the offset before forming a pointer from it
+        uint64_t offset = nameTable[i];
+        if (offset >= super->nameBytes)
+        {
+            error = "bad name table";
+            break;
+        }
+        const char *name = names + offset;
+        if (!memchr(name, '\0', (size_t)(super->nameBytes - offset)) || !isValidName(name))
+        {
+            error = "bad name table";
+            break;
+        }
+        nameIds[i] = internName(name);
+        if (nameIds[i] == NODE_NIL)
+        {
+            error = "out of memory";
+            break;
+        }
+        internedNames++;
+    }
+    if (!nameIds || !built)
+        error = "out of memory";
+
+    // One pass over the fixed-size records; parents always precede children
+    totalsPaused++;
+    for (uint32_t i = 0; !error && i < super->nodeCount; i++)
+    {
+        const ImageNode *record = &records[i];
+        int isRoot = i == 0;
+        if (record->name >= super->nameCount || record->type > TYPE_FOLDER ||
+            (isRoot ? record->parent != NODE_NIL || record->type != TYPE_FOLDER
+                    : record->parent >= i || built[record->parent]->type != TYPE_FOLDER) ||
+            (record->contentSize && (record->type != TYPE_FILE ||
+                                     record->contentOffset > super->contentBytes ||
+                                     record->contentSize > super->contentBytes - record->contentOffset)))
+        {
+            error = "bad node record";
+            break;
+        }
+
+        uint32_t nameId = nameIds[record->name];
+        nameArena.entries[nameId].refs++;
+        FileNode *node = createNodeWithName(nameId, (NodeType)record->type, (time_t)record->createdTime);
+        if (!node)
+        {
+            releaseName(nameId);
+            error = "out of memory";
+            break;
+        }
+        if (record->contentSize)
+        {
+            contentSetMapped(node, image, content + record->contentOffset, (size_t)record->contentSize);
+        }
+        built[i] = node;
+
+        if (isRoot)
+        {
+            root = node;
+            nameIndexAdd(root);
+        }
+        else if (!insertNode(built[record->parent], node))
+        {
+            freeTree(node);
+            built[i] = NULL;
+            error = "duplicate entry";
+            break;
+        }
+    }
+
+    // insertNode stamps parents with the current time; restore saved times
+    for (uint32_t i = 0; !error && i < super->nodeCount; i++)
+    {
+        built[i]->modifiedTime = (time_t)records[i].modifiedTime;
+    }
+    totalsPaused--;
+    if (!error && root)
+        totalsRebuild(root);
+
+    for (uint32_t i = 0; i < internedNames; i++)
+    {
+        releaseName(nameIds[i]);
+    }
+    free(nameIds);
+    free(built);
+
+    if (error)
+    {
+        fprintf(shellOut, "Error: Cannot load '%s': %s\n", path, error);
+        if (root)
+            freeTree(root);
+        root = NULL;
+    }
+    else
+    {
+        // Version 1 images predate the journal sequence field
+        journal.sequence = super->version >= 2 ? super->journalSequence : 0;
+        fprintf(shellOut, "Loaded %u nodes from '%s' in %.1f ms\n", super->nodeCount, path,
+                (nowSeconds() - start) * 1000);
+    }
+
+    imageRelease(image);
+    return root;
+}
+
+// Estimated memory held by resident nodes: the node, its hot record and its share of index slots
+size_t lazyResident(void)
+{
+    return nodePool.liveNodes * (sizeof(FileNode) + sizeof(NodeHot) + 2 * sizeof(FileNode *));
+}
+
+// Check one record of the lazy image: a valid name, a known type and content inside the image
+int lazyRecordValid(const ImageNode *record)
+{
+    const ImageSuperblock *super = lazy.super;
+    if (record->name >= super->nameCount || record->type > TYPE_FOLDER ||
+        (record->type == TYPE_FOLDER && record->folder >= super->folderCount) ||
+        (record->contentSize && (record->type != TYPE_FILE || record->contentOffset > super->contentBytes ||
+                                 record->contentSize > super->contentBytes - record->contentOffset)))
+        return 0;
+
+    uint64_t offset = lazy.nameTable[record->name];
+    if (offset >= super->nameBytes)
+        return 0;
+    const char *name = lazy.names + offset;
+    return memchr(name, '\0', (size_t)(super->nameBytes - offset)) && isValidName(name);
+}
+
+// For a stub, the image records [first, end) of its subtree: 1, or -1 if the links are inconsistent.
+// Records are in preorder, so the subtree ends at the next sibling of the stub or of its nearest ancestor.
+int lazyStubRange(const FileNode *node, uint32_t *first, uint32_t *end)
+{
+    *first = *end = 0;
+    if (!lazyStub(node))
+        return 0;
+
+    uint32_t record = lazy.dirs[node->lazySlot].record;
+    uint32_t stop = lazy.super->nodeCount;
+    for (uint32_t i = record; i != NODE_NIL; i = lazy.records[i].parent)
+    {
+        if (lazy.records[i].nSibling != NODE_NIL)
+        {
+            stop = lazy.records[i].nSibling;
+            break;
+        }
+    }
+    uint32_t child = lazy.records[record].fChild;
+    if (stop <= record || stop > lazy.super->nodeCount ||
+        (child != NODE_NIL && (child != record + 1 || child >= stop)))
+        return -1;
+    *first = record;
+    *end = stop;
+    return 1;
+}
+
+// Whether node is a directory of the lazy image whose children are still on disk
+int lazyStub(const FileNode *node)
+{
+    return node->lazySlot != NODE_NIL && lazy.dirs && !lazy.dirs[node->lazySlot].loaded;
+}
+
+// Start a stub folder off with the subtree totals saved for its record
+void lazySetTotals(FileNode *dir, const ImageNode *record)
+{
+    const ImageTotals *totals = &lazy.totals[record->folder];
+    dir->totals.bytes = (size_t)totals->bytes;
+    dir->totals.files = (size_t)totals->files;
+    dir->totals.folders = (size_t)totals->folders;
+    dir->totals.newest = (time_t)totals->newest;
+}
+
+// Take a clean, loaded directory off the LRU list
+void lazyUnlink(uint32_t slot)
+{
+    LazyDir *entry = &lazy.dirs[slot];
+    if (entry->prev != NODE_NIL)
+        lazy.dirs[entry->prev].next = entry->next;
+    else
+        lazy.head = entry->next;
+    if (entry->next != NODE_NIL)
+        lazy.dirs[entry->next].prev = entry->prev;
+    else
+        lazy.tail = entry->prev;
+    entry->prev = entry->next = NODE_NIL;
+}
+
+// Put a clean, loaded directory at the most recently used end of the LRU list
+void lazyPushFront(uint32_t slot)
+{
+    LazyDir *entry = &lazy.dirs[slot];
+    entry->prev = NODE_NIL;
+    entry->next = lazy.head;
+    if (lazy.head != NODE_NIL)
+        lazy.dirs[lazy.head].prev = slot;
+    else
+        lazy.tail = slot;
+    lazy.head = slot;
+}
+
+// Back dir with image record as a stub; returns 0 when out of memory
+int lazyAttach(FileNode *dir, uint32_t record)
+{
+    uint32_t slot = lazy.freeSlot;
+    if (slot != NODE_NIL)
+    {
+        lazy.freeSlot = lazy.dirs[slot].next;
+    }
+    else
+    {
+        if (lazy.count == lazy.capacity)
+        {
+            uint32_t capacity = lazy.capacity ? lazy.capacity * 2 : 1024;
+            LazyDir *dirs = (LazyDir *)realloc(lazy.dirs, (size_t)capacity * sizeof(LazyDir));
+            if (!dirs)
+                return 0;
+            lazy.dirs = dirs;
+            lazy.capacity = capacity;
+        }
+        slot = lazy.count++;
+    }
+
+    LazyDir *entry = &lazy.dirs[slot];
+    memset(entry, 0, sizeof(*entry));
+    entry->dir = dir;
+    entry->record = record;
+    entry->prev = entry->next = NODE_NIL;
+    dir->lazySlot = slot;
+    lazy.used++;
+    return 1;
+}
+
+// Forget the lazy image once no directory refers to it any more
+void lazyClose(void)
+{
+    if (lazy.image)
+        imageRelease(lazy.image);
+    free(lazy.dirs);
+    size_t budget = lazy.budget;
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.freeSlot = lazy.head = lazy.tail = NODE_NIL;
+    lazy.budget = budget;
+}
+
+// Release the slot of a node being freed
+void lazyRelease(FileNode *node)
+{
+    uint32_t slot = node->lazySlot;
+    if (slot == NODE_NIL || !lazy.dirs)
+        return;
+
+    LazyDir *entry = &lazy.dirs[slot];
+    if (entry->loaded && !entry->dirty)
+        lazyUnlink(slot);
+    entry->dir = NULL;
+    entry->next = lazy.freeSlot;
+    lazy.freeSlot = slot;
+    node->lazySlot = NODE_NIL;
+    if (!--lazy.used)
+        lazyClose();
+}
+
+// Mark node's directory and those above it as changed since loading: they are no longer evictable.
+// Directories above a changed one are already marked, so the walk stops at the first of them.
+void lazyDirty(FileNode *node)
+{
+    if (!lazy.dirs || !node)
+        return;
+    for (FileNode *dir = node->type == TYPE_FOLDER ? node : node->parent; dir; dir = dir->parent)
+    {
+        uint32_t slot = dir->lazySlot;
+        if (slot == NODE_NIL)
+            continue;
+        if (lazy.dirs[slot].dirty)
+            return;
+        if (lazy.dirs[slot].loaded)
+            lazyUnlink(slot);
+        lazy.dirs[slot].dirty = 1;
+    }
+}
+
+// A change to node, for the snapshot versions and lazy directories that depend on it. Loading and
+// evicting are not changes: they leave the tree as it was on disk.
+void nodeChanged(FileNode *node)
+{
+    if (lazy.loading)
+        return;
+    treeDirty = 1;
+    snapInvalidate(node);
+    lazyDirty(node);
+}
+
+// Free every child of a loaded directory, leaving its totals and modification time as they were
+void lazyUnload(FileNode *dir)
+{
+    time_t modified = dir->modifiedTime;
+    lazy.loading++;
+    totalsPaused++;
+    while (dir->fChild)
+    {
+        FileNode *child = dir->fChild;
+        detachNode(child);
+        freeTree(child);
+    }
+    totalsPaused--;
+    lazy.loading--;
+    dir->modifiedTime = modified;
+}
+
+// Build the children of a stub from its image record. A bad record leaves the stub and returns 0.
+int lazyLoad(FileNode *dir)
+{
+    uint32_t slot = dir->lazySlot;
+    uint32_t record = lazy.dirs[slot].record;
+    time_t modified = dir->modifiedTime;
+    const char *error = NULL;
+    size_t built = 0;
+
+    // Loaded first, so inserting the children does not come back here
+    lazy.dirs[slot].loaded = 1;
+    if (!lazy.dirs[slot].dirty)
+        lazyPushFront(slot);
+    lazy.loading++;
+    totalsPaused++;
+    uint32_t previous = record;
+    for (uint32_t i = lazy.records[record].fChild; i != NODE_NIL; i = lazy.records[i].nSibling)
+    {
+        const ImageNode *child = &lazy.records[i];
+        if (i <= previous || i >= lazy.super->nodeCount || child->parent != record || !lazyRecordValid(child))
+        {
+            error = "bad node record";
+            break;
+        }
+        previous = i;
+
+        uint32_t nameId = internName(lazy.names + lazy.nameTable[child->name]);
+        FileNode *node = nameId == NODE_NIL ? NULL
+                                            : createNodeWithName(nameId, (NodeType)child->type,
+                                                                 (time_t)child->createdTime);
+        if (!node)
+        {
+            if (nameId != NODE_NIL)
+                releaseName(nameId);
+            error = "out of memory";
+            break;
+        }
+        if (child->contentSize)
+        {
+            contentSetMapped(node, lazy.image, lazy.content + child->contentOffset, (size_t)child->contentSize);
+        }
+        if (child->type == TYPE_FOLDER)
+        {
+            lazySetTotals(node, child);
+            if (!lazyAttach(node, i))
+            {
+                freeTree(node);
+                error = "out of memory";
+                break;
+            }
+        }
+        if (!insertNode(dir, node))
+        {
+            freeTree(node);
+            error = "duplicate entry";
+            break;
+        }
+        node->modifiedTime = (time_t)child->modifiedTime;
+        built++;
+    }
+    totalsPaused--;
+    lazy.loading--;
+    dir->modifiedTime = modified;
+
+    if (error)
+    {
+        char path[MAX_PATH_LENGTH];
+        if (nodePath(dir, path, sizeof(path)) < 0)
+            strcpy(path, "...");
+        fprintf(shellOut, "Error: Cannot load '%s' from the image: %s\n", path, error);
+        lazyUnload(dir);
+        if (!lazy.dirs[slot].dirty)
+            lazyUnlink(slot);
+        lazy.dirs[slot].loaded = 0;
+        return 0;
+    }
+
+    FileNode *parent = dir->parent;
+    if (parent && parent->lazySlot != NODE_NIL)
+        lazy.dirs[parent->lazySlot].loadedChildren++;
+    lazy.loads++;
+    return 1;
+}
+
+// Load a stub on first touch; otherwise make a clean directory the most recently used
+void lazyTouch(FileNode *dir)
+{
+    uint32_t slot = dir->lazySlot;
+    if (slot == NODE_NIL)
+        return;
+    if (!lazy.dirs[slot].loaded)
+    {
+        lazyLoad(dir);
+    }
+    else if (!lazy.dirs[slot].dirty && lazy.head != slot)
+    {
+        lazyUnlink(slot);
+        lazyPushFront(slot);
+    }
+}
+
+// Load every stub under top, for commands that walk the whole subtree
+void lazyLoadAll(FileNode *top)
+{
+    if (!lazy.dirs || !top)
+        return;
+    for (FileNode *node = top; node; node = nextPreorder(top, node))
+    {
+        if (lazyStub(node))
+            lazyLoad(node);
+    }
+}
+
+// Load the stubs under top that a walk opening maxDepth levels below it will list
+void lazyLoadDepth(FileNode *top, int maxDepth)
+{
+    if (!lazy.dirs || !top)
+        return;
+    FileNode *node = top;
+    int depth = 0;
+    while (node)
+    {
+        if (depth < maxDepth && lazyStub(node))
+            lazyLoad(node);
+        if (node->fChild && depth < maxDepth)
+        {
+            node = node->fChild;
+            depth++;
+            continue;
+        }
+        while (node != top && !node->nSibling)
+        {
+            node = node->parent;
+            depth--;
+        }
+        node = node == top ? NULL : node->nSibling;
+    }
+}
+
+// Turn a clean, loaded directory back into a stub
+void lazyEvict(FileNode *dir)
+{
+    uint32_t slot = dir->lazySlot;
+    lazyUnlink(slot);
+    lazyUnload(dir);
+    lazy.dirs[slot].loaded = 0;
+
+    // Counts of a changed parent may be stale; they only matter while it is clean
+    FileNode *parent = dir->parent;
+    if (parent && parent->lazySlot != NODE_NIL && lazy.dirs[parent->lazySlot].loadedChildren)
+        lazy.dirs[parent->lazySlot].loadedChildren--;
+    lazy.evictions++;
+}
+
+// Evict the least recently used clean directories until the resident nodes fit the budget. Only
+// directories whose subdirectories are all stubs go, so each pass works up from the leaves of the
+// loaded tree; the current directory, watched nodes and the directories above them stay.
+void lazyTrim(FileNode *root, FileNode *current)
+{
+    int progress = 1;
+    while (lazy.dirs && lazy.budget && progress && lazyResident() > lazy.budget)
+    {
+        progress = 0;
+        uint32_t slot = lazy.tail;
+        while (slot != NODE_NIL && lazyResident() > lazy.budget)
+        {
+            uint32_t prev = lazy.dirs[slot].prev;
+            FileNode *dir = lazy.dirs[slot].dir;
+            if (!lazy.dirs[slot].loadedChildren && !isInSubtree(dir, current) && isInSubtree(root, dir) &&
+                !(watchList.count && watchInside(dir)))
+            {
+                lazyEvict(dir);
+                progress = 1;
+            }
+            slot = prev;
+        }
+    }
+}
+
+// Open a version 3 image lazily: only the root is built, as a stub. Older images are loaded in full.
+FileNode *lazyOpen(const char *path)
+{
+    double start = nowSeconds();
+    if (lazy.image)
+    {
+        fprintf(shellOut, "Error: An image is already open lazily\n");
+        return NULL;
+    }
+    MappedImage *image = imageMap(path);
+    if (!image)
+    {
+        fprintf(shellOut, "Error: Cannot open image '%s'\n", path);
+        return NULL;
+    }
+    const ImageSuperblock *super = imageHeader(image);
+    if (!super)
+    {
+        fprintf(shellOut, "Error: '%s' is not a valid image (version %d expected)\n", path, IMAGE_VERSION);
+        imageRelease(image);
+        return NULL;
+    }
+    if (super->version < 3)
+    {
+        fprintf(shellOut, "'%s' is a version %u image without folder totals; loading it in full\n", path,
+                super->version);
+        imageRelease(image);
+        return loadImage(path);
+    }
+
+    lazy.image = image;
+    lazy.super = super;
+    lazy.records = (const ImageNode *)(image->base + super->nodeOffset);
+    lazy.nameTable = (const uint64_t *)(image->base + super->nameTableOffset);
+    lazy.names = image->base + super->nameOffset;
+    lazy.content = image->base + super->contentOffset;
+    lazy.totals = (const ImageTotals *)(image->base + super->totalsOffset);
+
+    const ImageNode *record = &lazy.records[0];
+    uint32_t nameId = NODE_NIL;
+    FileNode *root = NULL;
+    if (record->parent == NODE_NIL && record->type == TYPE_FOLDER && lazyRecordValid(record))
+        nameId = internName(lazy.names + lazy.nameTable[record->name]);
+    if (nameId != NODE_NIL)
+        root = createNodeWithName(nameId, TYPE_FOLDER, (time_t)record->createdTime);
+    if (!root || !lazyAttach(root, 0))
+    {
+        fprintf(shellOut, "Error: Cannot load '%s': %s\n", path,
+                nameId == NODE_NIL ? "bad node record" : "out of memory");
+        if (root)
+            freeTree(root);
+        else if (nameId != NODE_NIL)
+            releaseName(nameId);
+        lazyClose();
+        return NULL;
+    }
+
+    lazySetTotals(root, record);
+    root->modifiedTime = (time_t)record->modifiedTime;
+    nameIndexAdd(root);
+
+    journal.sequence = super->journalSequence;
+    fprintf(shellOut, "Opened %u nodes in '%s' lazily in %.1f ms\n", super->nodeCount, path,
+            (nowSeconds() - start) * 1000);
+    return root;
+}
+
+// Per-worker results of reading imported files: their content-store totals and the files that failed
+typedef struct ImportCounts
+{
+    ContentStats stats;
+    size_t failed;
+} ImportCounts;
+
+// A host directory being read into a detached tree on the walk pool
+typedef struct HostImport
+{
+    const char *hostRoot;
+    FileNode *top;
+    ImportCounts *workers;
+} HostImport;
+
+// Host path of node: hostRoot followed by the names from below top down to node. Returns its length or -1.
+int hostPathOf(const char *hostRoot, const FileNode *top, const FileNode *node, char *path, size_t size)
+{
+    size_t pos = size - 1;
+    path[pos] = '\0';
+    for (; node && node != top; node = node->parent)
+    {
+        size_t length = strlen(node->fileName);
+        if (length + 1 > pos)
+            return -1;
+        pos -= length;
+        memcpy(path + pos, node->fileName, length);
+        path[--pos] = '/';
+    }
+
+    size_t rootLength = strlen(hostRoot);
+    while (rootLength > 1 && hostRoot[rootLength - 1] == '/')
+        rootLength--;
+    if (rootLength > pos)
+        return -1;
+    pos -= rootLength;
+    memcpy(path + pos, hostRoot, rootLength);
+    memmove(path, path + pos, size - pos);
+    return (int)(size - 1 - pos);
+}
+
+// Read up to length bytes of in straight into a new content of one extent, counted in stats.
+// Returns NULL when nothing could be read.
+FileContent *contentFromFile(FILE *in, size_t length, ContentStats *stats)
+{
+    if (!length)
+        return NULL;
+    FileContent *content = (FileContent *)calloc(1, sizeof(FileContent));
+    Extent *extent = (Extent *)malloc(sizeof(Extent) + length);
+    size_t got = content && extent ? fread(extent->data, 1, length, in) : 0;
+    if (!got)
+    {
+        free(content);
+        free(extent);
+        return NULL;
+    }
+
+    extent->next = NULL;
+    extent->length = got;
+    extent->capacity = length;
+    content->head = content->tail = extent;
+    content->size = got;
+    content->refs = 1;
+    stats->files++;
+    stats->extents++;
+    stats->bytes += got;
+    stats->reserved += length;
+    return content;
+}
+
+// Create an entry of a detached import tree, keeping dir's own modification time
+FileNode *importEntry(FileNode *dir, const char *name, NodeType type, time_t now)
+{
+    uint32_t nameId = internName(name);
+    FileNode *node = nameId == NODE_NIL ? NULL : createNodeWithName(nameId, type, now);
+    if (!node)
+    {
+        if (nameId != NODE_NIL)
+            releaseName(nameId);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    if (!insertNodeAt(dir, node, dir->modifiedTime))
+    {
+        freeTree(node);
+        return NULL;
+    }
+    return node;
+}
+
+// Move the entries of a detached import tree into dest. New names move over whole, folders merge into
+// folders and files replace files of the same name; a name taken by the other type is skipped.
+void importMerge(FileNode *from, FileNode *dest, TransferCounts *counts)
+{
+    size_t depth = 0;
+    size_t capacity = 16;
+    FileNode **stack = (FileNode **)malloc(capacity * 2 * sizeof(FileNode *));
+    if (!stack)
+        return;
+    stack[depth * 2] = from;
+    stack[depth * 2 + 1] = dest;
+    depth++;
+
+    while (depth)
+    {
+        depth--;
+        FileNode *source = stack[depth * 2];
+        FileNode *into = stack[depth * 2 + 1];
+        FileNode *next;
+        for (FileNode *child = source->fChild; child; child = next)
+        {
+            next = child->nSibling;
+            FileNode *existing = findChild(into, child->fileName);
+            if (existing && existing->type != child->type)
+            {
+                char path[MAX_PATH_LENGTH];
+                if (nodePath(existing, path, sizeof(path)) < 0)
+                    strcpy(path, existing->fileName);
+                fprintf(shellOut, "Error: '%s' exists and is not a %s\n", path,
+                        child->type == TYPE_FOLDER ? "directory" : "file");
+                counts->skipped++;
+                continue;
+            }
+            if (existing && existing->type == TYPE_FOLDER)
+            {
+                if (depth == capacity)
+                {
+                    FileNode **grown = (FileNode **)realloc(stack, capacity * 4 * sizeof(FileNode *));
+                    if (!grown)
+                    {
+                        counts->skipped++;
+                        continue;
+                    }
+                    stack = grown;
+                    capacity *= 2;
+                }
+                stack[depth * 2] = child;
+                stack[depth * 2 + 1] = existing;
+                depth++;
+                continue;
+            }
+            if (existing)
+            {
+                if (watchList.count)
+                    watchPublish(WATCH_DELETE, existing, NULL, NULL);
+                detachNode(existing);
+                freeTree(existing);
+            }
+            detachNode(child);
+            if (!insertNode(into, child))
+            {
+                freeTree(child);
+                counts->skipped++;
+                continue;
+            }
+            if (into->nameIndexed)
+                nameIndexAddTree(child);
+            if (watchList.count)
+                watchPublish(WATCH_CREATE, child, NULL, NULL);
+        }
+    }
+    free(stack);
+}
+
+#ifndef _WIN32
+// Read one imported file from the host into its node
+void importVisit(ParallelWalk *walk, int worker, FileNode *node, uint32_t bucket, size_t sequence)
+{
+    HostImport *import = (HostImport *)walk->context;
+    (void)bucket;
+    (void)sequence;
+    if (node->type != TYPE_FILE)
+        return;
+
+    char path[MAX_PATH_LENGTH];
+    FILE *in = hostPathOf(import->hostRoot, import->top, node, path, sizeof(path)) < 0 ? NULL : fopen(path, "rb");
+    struct stat info;
+    if (!in || fstat(fileno(in), &info) != 0)
+    {
+        import->workers[worker].failed++;
+        if (in)
+            fclose(in);
+        return;
+    }
+    node->modifiedTime = info.st_mtime;
+    node->content = contentFromFile(in, (size_t)info.st_size, &import->workers[worker].stats);
+    fclose(in);
+}
+
+// Mirror the directories under hostRoot into the detached tree top as folders and empty files.
+// Symbolic links, special files and names the simulator does not allow are skipped.
+int importScan(const char *hostRoot, FileNode *top, time_t now, TransferCounts *counts)
+{
+    size_t depth = 0;
+    size_t capacity = 64;
+    FileNode **stack = (FileNode **)malloc(capacity * sizeof(FileNode *));
+    if (!stack)
+        return 0;
+    stack[depth++] = top;
+
+    int ok = 1;
+    char path[MAX_PATH_LENGTH];
+    while (ok && depth)
+    {
+        FileNode *dir = stack[--depth];
+        int length = hostPathOf(hostRoot, top, dir, path, sizeof(path));
+        DIR *handle = length < 0 ? NULL : opendir(path);
+        struct stat info;
+        if (!handle)
+        {
+            counts->failed++;
+            continue;
+        }
+        if (fstat(dirfd(handle), &info) == 0)
+            dir->modifiedTime = info.st_mtime;
+
+        struct dirent *entry;
+        while (ok && (entry = readdir(handle)) != NULL)
+        {
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            int type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                snprintf(path + length, sizeof(path) - (size_t)length, "/%s", name);
+                type = lstat(path, &info) != 0 ? DT_UNKNOWN : S_ISDIR(info.st_mode) ? DT_DIR
+                                                            : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if ((type != DT_DIR && type != DT_REG) || !isValidName(name))
+            {
+                counts->skipped++;
+                continue;
+            }
+
+            FileNode *node = importEntry(dir, name, type == DT_DIR ? TYPE_FOLDER : TYPE_FILE, now);
+            if (!node)
+            {
+                ok = 0;
+            }
+            else if (type == DT_DIR)
+            {
+                if (depth == capacity)
+                {
+                    FileNode **grown = (FileNode **)realloc(stack, capacity * 2 * sizeof(FileNode *));
+                    if (!grown)
+                    {
+                        ok = 0;
+                        break;
+                    }
+                    stack = grown;
+                    capacity *= 2;
+                }
+                stack[depth++] = node;
+            }
+        }
+        closedir(handle);
+    }
+    free(stack);
+    return ok;
+}
+#endif
+
+// Value of a numeric tar header field: octal digits, or big-endian binary when the top bit is set
+uint64_t tarNumber(const char *field, size_t size)
+{
+    uint64_t value = 0;
+    if ((unsigned char)field[0] & 0x80)
+    {
+        for (size_t i = 1; i < size; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i]; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = value * 8 + (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// Whether a 512-byte block is a tar header with a matching checksum
+int tarHeaderValid(const unsigned char *block)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : block[i];
+    return sum == tarNumber((const char *)block + 148, 8);
+}
+
+// Skip past the data of a tar entry: the padding after the length bytes already read, or all of
+// it, with its padding, when skipWhole is set
+int tarSkip(FILE *in, uint64_t length, int skipWhole)
+{
+    char block[512];
+    uint64_t left = skipWhole ? (length + 511) / 512 * 512 : (512 - length % 512) % 512;
+    while (left)
+    {
+        size_t chunk = left < sizeof(block) ? (size_t)left : sizeof(block);
+        if (fread(block, 1, chunk, in) != chunk)
+            return 0;
+        left -= chunk;
+    }
+    return 1;
+}
+
+// Folder for the directory part of a tar entry's path under top, creating missing folders.
+// *leaf is set to the last component; NULL when the path climbs with ".." or crosses a file.
+FileNode *tarDirectory(FileNode *top, char *path, char **leaf, time_t now)
+{
+    FileNode *dir = top;
+    char *component = path;
+    *leaf = NULL;
+    for (const char *scan = path; *scan; scan++)
+    {
+        if ((scan == path || scan[-1] == '/') && strncmp(scan, "..", 2) == 0 && (scan[2] == '/' || !scan[2]))
+            return NULL;
+    }
+
+    while (dir && *component)
+    {
+        char *slash = strchr(component, '/');
+        if (slash)
+            *slash = '\0';
+        if (!slash || !slash[1])
+        {
+            // The last component; "dir/" names the folder itself
+            *leaf = strcmp(component, ".") == 0 ? NULL : component;
+            return dir;
+        }
+        if (*component && strcmp(component, ".") != 0)
+        {
+            FileNode *child = findChild(dir, component);
+            if (!child && isValidName(component))
+                child = importEntry(dir, component, TYPE_FOLDER, now);
+            dir = child && child->type == TYPE_FOLDER ? child : NULL;
+        }
+        component = slash + 1;
+    }
+    return dir;
+}
+
+// Read a tar stream into the detached tree top: regular files and folders, with GNU long names and
+// pax paths. Links and special files are skipped. Returns 0 on a malformed or truncated stream.
+int importTar(FILE *in, FileNode *top, time_t now, TransferCounts *counts)
+{
+    unsigned char block[512];
+    char longName[MAX_PATH_LENGTH];
+    char path[MAX_PATH_LENGTH];
+    longName[0] = '\0';
+
+    while (fread(block, 1, 512, in) == 512)
+    {
+        int empty = 1;
+        for (int i = 0; i < 512 && empty; i++)
+            empty = !block[i];
+        if (empty)
+            return 1;
+        if (!tarHeaderValid(block))
+        {
+            fprintf(shellOut, "Error: Bad tar header\n");
+            return 0;
+        }
+
+        uint64_t size = tarNumber((const char *)block + 124, 12);
+        time_t mtime = (time_t)tarNumber((const char *)block + 136, 12);
+        char type = (char)block[156];
+
+        // Long names arrive as an entry of their own before the one they name
+        if (type == 'L' || type == 'x')
+        {
+            char *data = size < (1 << 20) ? (char *)malloc((size_t)size + 1) : NULL;
+            size_t got = data ? fread(data, 1, (size_t)size, in) : 0;
+            if (!data || got != size || !tarSkip(in, size, 0))
+            {
+                free(data);
+                fprintf(shellOut, "Error: Truncated tar stream\n");
+                return 0;
+            }
+            data[size] = '\0';
+            const char *name = data;
+            size_t length = strlen(data);
+            if (type == 'x')
+            {
+                // Records are "<length> <key>=<value>\n"; only path matters here
+                const char *found = strstr(data, " path=");
+                name = found ? found + 6 : "";
+                length = strcspn(name, "\n");
+            }
+            if (length && length < sizeof(longName))
+            {
+                memcpy(longName, name, length);
+                longName[length] = '\0';
+            }
+            free(data);
+            continue;
+        }
+
+        if (longName[0])
+        {
+            strcpy(path, longName);
+            longName[0] = '\0';
+        }
+        else if (memcmp(block + 257, "ustar", 5) == 0 && block[345])
+        {
+            snprintf(path, sizeof(path), "%.155s/%.100s", (const char *)block + 345, (const char *)block);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%.100s", (const char *)block);
+        }
+
+        int isFile = type == '0' || type == '\0' || type == '7';
+        char *leaf;
+        char *start = path;
+        while (*start == '/')
+            start++;
+        FileNode *dir = isFile || type == '5' ? tarDirectory(top, start, &leaf, now) : NULL;
+        FileNode *node = dir && leaf ? findChild(dir, leaf) : dir;
+        if (dir && leaf && !node && isValidName(leaf))
+            node = importEntry(dir, leaf, isFile ? TYPE_FILE : TYPE_FOLDER, now);
+
+        if (!node || node->type != (isFile ? TYPE_FILE : TYPE_FOLDER))
+        {
+            counts->skipped++;
+            if (!tarSkip(in, size, 1))
+                break;
+            continue;
+        }
+        if (isFile)
+        {
+            // A later entry for the same path replaces the earlier one, as tar does
+            contentFree(node);
+            node->content = contentFromFile(in, (size_t)size, &contentStats);
+            if (contentSize(node) != size || !tarSkip(in, size, 0))
+                break;
+        }
+        else if (!tarSkip(in, size, 1))
+        {
+            break;
+        }
+        node->modifiedTime = mtime;
+    }
+    fprintf(shellOut, "Error: Truncated tar stream\n");
+    return 0;
+}
+
+// Import a host directory or tar file into dest (a folder). The entries are built as a detached tree,
+// host files read on the walk pool, then merged into dest.
+int importTree(const char *source, FileNode *dest, TransferCounts *counts)
+{
+    double start = nowSeconds();
+    time_t now = time(NULL);
+    FileNode *top = createNode("import", "", TYPE_FOLDER);
+    if (!top)
+        return 0;
+
+    int ok;
+    totalsPaused++;
+#ifndef _WIN32
+    struct stat info;
+    if (stat(source, &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        ok = importScan(source, top, now, counts);
+        ImportCounts *workers = (ImportCounts *)calloc(MAX_WALK_THREADS, sizeof(ImportCounts));
+        HostImport import = {source, top, workers};
+        if (ok && workers)
+        {
+            ParallelWalk walk = {0, NULL, 0, importVisit, &import};
+            parallelWalkRun(&walk, top, 0);
+            for (int i = 0; i < MAX_WALK_THREADS; i++)
+            {
+                contentStats.files += workers[i].stats.files;
+                contentStats.extents += workers[i].stats.extents;
+                contentStats.bytes += workers[i].stats.bytes;
+                contentStats.reserved += workers[i].stats.reserved;
+                counts->failed += workers[i].failed;
+            }
+        }
+        ok = ok && workers;
+        free(workers);
+    }
+    else
+#endif
+    {
+        FILE *in = fopen(source, "rb");
+        if (in)
+        {
+            setvbuf(in, NULL, _IOFBF, 1 << 20);
+            ok = importTar(in, top, now, counts);
+            fclose(in);
+        }
+        else
+        {
+            fprintf(shellOut, "Error: Cannot open '%s'\n", source);
+            ok = 0;
+        }
+    }
+    totalsPaused--;
+
+    if (ok)
+    {
+        // The chunk table is not shared between threads, so files are sealed after the reads
+        for (FileNode *node = top; node; node = nextPreorder(top, node))
+        {
+            if (node->content)
+                contentSeal(node->content, 1);
+        }
+        totalsRebuild(top);
+        counts->folders = top->totals.folders;
+        counts->files = top->totals.files;
+        counts->bytes = top->totals.bytes;
+        importMerge(top, dest, counts);
+        fprintf(shellOut, "Imported %zu folders and %zu files (%zu bytes) from '%s' in %.1f ms", counts->folders,
+                counts->files, counts->bytes, source, (nowSeconds() - start) * 1000);
+        if (counts->skipped || counts->failed)
+            fprintf(shellOut, "; %zu skipped, %zu unreadable", counts->skipped, counts->failed);
+        fprintf(shellOut, "\n");
+    }
+    freeTree(top);
+    return ok;
+}
+
+// Store value in a numeric tar header field as zero-padded octal followed by a NUL
+void tarPutNumber(char *field, size_t size, uint64_t value)
+{
+    field[size - 1] = '\0';
+    for (size_t i = size - 1; i > 0; i--)
+    {
+        field[i - 1] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+// Write a ustar header block for one entry; names longer than the header holds get a GNU long-name entry
+int tarWriteHeader(FILE *out, const char *name, char type, uint64_t size, time_t mtime)
+{
+    unsigned char block[512];
+    size_t length = strlen(name);
+    if (length > 100)
+    {
+        if (!tarWriteHeader(out, "././@LongLink", 'L', length + 1, 0))
+            return 0;
+        char padding[512] = {0};
+        fwrite(name, 1, length + 1, out);
+        fwrite(padding, 1, (512 - (length + 1) % 512) % 512, out);
+    }
+    if (size > 077777777777ULL)
+        return 0;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, name, length < 100 ? length : 100);
+    tarPutNumber((char *)block + 100, 8, type == '5' ? 0755 : 0644);
+    tarPutNumber((char *)block + 108, 8, 0);
+    tarPutNumber((char *)block + 116, 8, 0);
+    tarPutNumber((char *)block + 124, 12, size);
+    tarPutNumber((char *)block + 136, 12, mtime > 0 && (uint64_t)mtime <= 077777777777ULL ? (uint64_t)mtime : 0);
+    block[156] = (unsigned char)type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    unsigned long sum = 0;
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < 512; i++)
+        sum += block[i];
+    tarPutNumber((char *)block + 148, 7, sum);
+    return fwrite(block, 1, 512, out) == 512;
+}
+
+// Export top (a folder's contents, or one file) as a tar stream; content is streamed extent by extent
+int exportTar(FileNode *top, FILE *out, TransferCounts *counts)
+{
+    static const char padding[512] = {0};
+    FileNode *base = top->type == TYPE_FOLDER ? top : top->parent;
+    char path[MAX_PATH_LENGTH];
+    for (FileNode *node = top; node; node = nextPreorder(top, node))
+    {
+        if (node == base)
+            continue;
+        int length = hostPathOf("", base, node, path, sizeof(path) - 1);
+        if (length < 0)
+        {
+            counts->skipped++;
+            continue;
+        }
+
+        // Drop the leading '/'; folders end in one instead
+        memmove(path, path + 1, (size_t)length);
+        if (node->type == TYPE_FOLDER)
+        {
+            strcat(path, "/");
+            if (!tarWriteHeader(out, path, '5', 0, node->modifiedTime))
+                return 0;
+            counts->folders++;
+            continue;
+        }
+        size_t size = contentSize(node);
+        if (!tarWriteHeader(out, path, '0', size, node->modifiedTime))
+            return 0;
+        contentPrint(node, out);
+        fwrite(padding, 1, (512 - size % 512) % 512, out);
+        counts->files++;
+        counts->bytes += size;
+    }
+    fwrite(padding, 1, sizeof(padding), out);
+    fwrite(padding, 1, sizeof(padding), out);
+    return !ferror(out);
+}
+
+#ifndef _WIN32
+// Export top (a folder's contents, or one file) into a host directory, created if missing.
+// Files keep their modification times.
+int exportHost(FileNode *top, const char *hostRoot, TransferCounts *counts)
+{
+    FileNode *base = top->type == TYPE_FOLDER ? top : top->parent;
+    if (mkdir(hostRoot, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(shellOut, "Error: Cannot create '%s'\n", hostRoot);
+        return 0;
+    }
+
+    char path[MAX_PATH_LENGTH];
+    for (FileNode *node = top; node; node = nextPreorder(top, node))
+    {
+        if (node == base)
+            continue;
+        if (hostPathOf(hostRoot, base, node, path, sizeof(path)) < 0)
+        {
+            counts->skipped++;
+            continue;
+        }
+        if (node->type == TYPE_FOLDER)
+        {
+            if (mkdir(path, 0755) != 0 && errno != EEXIST)
+                counts->failed++;
+            else
+                counts->folders++;
+            continue;
+        }
+
+        FILE *out = fopen(path, "wb");
+        if (!out)
+        {
+            counts->failed++;
+            continue;
+        }
+        contentPrint(node, out);
+        if (fclose(out) != 0)
+        {
+            counts->failed++;
+            continue;
+        }
+        struct timeval times[2] = {{node->modifiedTime, 0}, {node->modifiedTime, 0}};
+        utimes(path, times);
+        counts->files++;
+        counts->bytes += contentSize(node);
+    }
+    return 1;
+}
+#endif
+
+// Export top to a host directory, or to a tar file when target ends in ".tar"
+int exportTree(FileNode *top, const char *target, TransferCounts *counts)
+{
+    double start = nowSeconds();
+    lazyLoadAll(top);
+    size_t length = strlen(target);
+    int ok;
+    if (length > 4 && strcmp(target + length - 4, ".tar") == 0)
+    {
+        FILE *out = fopen(target, "wb");
+        if (!out)
+        {
+            fprintf(shellOut, "Error: Cannot write '%s'\n", target);
+            return 0;
+        }
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+        ok = exportTar(top, out, counts);
+        ok = fclose(out) == 0 && ok;
+    }
+    else
+    {
+#ifdef _WIN32
+        fprintf(shellOut, "Error: Only .tar targets are supported on Windows builds\n");
+        return 0;
+#else
+        ok = exportHost(top, target, counts);
+#endif
+    }
+    if (!ok)
+    {
+        fprintf(shellOut, "Error: Failed to write '%s'\n", target);
+        return 0;
+    }
+
+    fprintf(shellOut, "Exported %zu folders and %zu files (%zu bytes) to '%s' in %.1f ms", counts->folders,
+            counts->files, counts->bytes, target, (nowSeconds() - start) * 1000);
+    if (counts->skipped || counts->failed)
+        fprintf(shellOut, "; %zu skipped, %zu failed", counts->skipped, counts->failed);
+    fprintf(shellOut, "\n");
+    return 1;
+}
+
+// Write node's absolute path ("/" for the root) into path; returns its length or -1
+int nodePath(FileNode *node, char *path, size_t size)
+{
+    // Fill from the end of the buffer, then slide the result to the front
+    size_t pos = size - 1;
+    path[pos] = '\0';
+    for (; node && node->parent; node = node->parent)
+    {
+        size_t length = strlen(node->fileName);
+        if (length + 1 > pos)
+            return -1;
+        pos -= length;
+        memcpy(path + pos, node->fileName, length);
+        path[--pos] = '/';
+    }
+
+    if (pos == size - 1)
+        path[--pos] = '/';
+    memmove(path, path + pos, size - pos);
+    return (int)(size - 1 - pos);
+}
+
+// Walk length bytes of a '/'-separated path from node, one hash probe per component
+FileNode *walkPath(FileNode *node, const char *path, size_t length)
+{
+    char component[MAX_NAME];
+    const char *end = path + length;
+
+    while (node && path < end)
+    {
+        while (path < end && *path == '/')
+            path++;
+        size_t size = 0;
+        while (path + size < end && path[size] != '/')
+            size++;
+        if (!size)
+            break;
+        if (size >= MAX_NAME || node->type != TYPE_FOLDER)
+            return NULL;
+
+        // Only directories are crossed, so a cached prefix never depends on a file
+        if (size == 2 && path[0] == '.' && path[1] == '.')
+        {
+            node = node->parent ? node->parent : node;
+        }
+        else if (size != 1 || path[0] != '.')
+        {
+            memcpy(component, path, size);
+            component[size] = '\0';
+            node = findChild(node, component);
+        }
+        path += size;
+    }
+    return node;
+}
+
+// Directory named by the first length bytes of path, through the path cache
+FileNode *resolveDirectory(FileNode *root, FileNode *cwd, const char *path, size_t length)
+{
+    FileNode *base = cwd;
+    if (length && path[0] == '/')
+    {
+        base = root;
+    }
+    else if (length && path[0] == '~' && (length == 1 || path[1] == '/'))
+    {
+        base = root;
+        path++;
+        length--;
+    }
+    if (!length)
+        return base;
+    if (length > PATH_CACHE_KEY)
+        return walkPath(base, path, length);
+
+    if (!pathCache.entries)
+    {
+        pathCache.entries = (PathCacheEntry *)calloc(PATH_CACHE_SIZE, sizeof(PathCacheEntry));
+        if (!pathCache.entries)
+            return walkPath(base, path, length);
+    }
+
+    // FNV-1a over the base id and the prefix picks the slot
+    uint32_t hash = 2166136261u ^ base->id;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    }
+    PathCacheEntry *entry = &pathCache.entries[hash & (PATH_CACHE_SIZE - 1)];
+    if (entry->generation == pathCache.generation && entry->base == base->id && entry->length == length &&
+        memcmp(entry->key, path, length) == 0)
+    {
+        pathCache.hits++;
+        return entry->dir;
+    }
+
+    pathCache.misses++;
+    FileNode *dir = walkPath(base, path, length);
+    if (dir && dir->type == TYPE_FOLDER)
+    {
+        entry->generation = pathCache.generation;
+        entry->base = base->id;
+        entry->length = (uint32_t)length;
+        entry->dir = dir;
+        memcpy(entry->key, path, length);
+    }
+    return dir;
+}
+
+// Resolve an absolute or cwd-relative path ("a/b/../c", "/x", "~/y"); NULL if any part is missing
+FileNode *resolvePath(FileNode *root, FileNode *cwd, const char *path)
+{
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+
+    // Only directories are cached, so the last component is always probed fresh
+    size_t split = length;
+    while (split && path[split - 1] != '/')
+        split--;
+    const char *leaf = path + split;
+    size_t leafLength = length - split;
+
+    if (split == 0 && leafLength == 1 && leaf[0] == '~')
+        return root;
+
+    FileNode *dir = resolveDirectory(root, cwd, path, split);
+    if (!dir || !leafLength)
+        return dir;
+    return walkPath(dir, leaf, leafLength);
+}
+
+// Resolve every component but the last, which is copied into leaf (MAX_NAME bytes)
+FileNode *resolveParent(FileNode *root, FileNode *cwd, const char *path, char *leaf)
+{
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+
+    size_t split = length;
+    while (split && path[split - 1] != '/')
+        split--;
+    if (length - split >= MAX_NAME)
+        return NULL;
+    memcpy(leaf, path + split, length - split);
+    leaf[length - split] = '\0';
+
+    FileNode *dir = resolveDirectory(root, cwd, path, split);
+    return dir && dir->type == TYPE_FOLDER ? dir : NULL;
+}
+
+// Forget every cached path; called whenever a directory is renamed, moved or freed
+void pathCacheInvalidate(void)
+{
+    pathCache.generation++;
+    pathCache.invalidations++;
+}
+
+// Path cache counters
+void printPathStats(void)
+{
+    unsigned long lookups = pathCache.hits + pathCache.misses;
+    fprintf(shellOut, "Path cache\n");
+    fprintf(shellOut, "  entries          : %d x %zu bytes\n", PATH_CACHE_SIZE, sizeof(PathCacheEntry));
+    fprintf(shellOut, "  hits / misses    : %lu / %lu (%.1f%% hit rate)\n", pathCache.hits, pathCache.misses,
+            lookups ? 100.0 * pathCache.hits / lookups : 0.0);
+    fprintf(shellOut, "  invalidations    : %lu\n", pathCache.invalidations);
+}
+
+// Take dir's stripe shared; a stripe this thread already holds is only counted
+void dirLockShared(FileNode *dir)
+{
+#ifndef _WIN32
+    if (!server.active || !dir)
+        return;
+    uint32_t stripe = dir->id % DIR_LOCK_STRIPES;
+    if (heldStripes[stripe]++ == 0)
+        pthread_rwlock_rdlock(&server.dirLocks[stripe]);
+#else
+    (void)dir;
+#endif
+}
+
+// Like dirLockShared, but gives up instead of waiting
+int dirTryLockShared(FileNode *dir)
+{
+#ifndef _WIN32
+    if (!server.active || !dir)
+        return 1;
+    uint32_t stripe = dir->id % DIR_LOCK_STRIPES;
+    if (!heldStripes[stripe] && pthread_rwlock_tryrdlock(&server.dirLocks[stripe]) != 0)
+        return 0;
+    heldStripes[stripe]++;
+#else
+    (void)dir;
+#endif
+    return 1;
+}
+
+// Index of dir's lock stripe
+uint32_t dirStripe(FileNode *dir)
+{
+    return dir->id % DIR_LOCK_STRIPES;
+}
+
+// Take dir's stripe shared while this thread holds stripes no higher than highest. A reader waits only
+// for a higher stripe and just retries a lower one between yields, so readers holding several stripes
+// never wait on each other in a cycle through a queued writer.
+void dirLockSharedOrdered(FileNode *dir, uint32_t highest)
+{
+#ifndef _WIN32
+    if (!server.active || !dir)
+        return;
+    if (dirStripe(dir) > highest)
+    {
+        dirLockShared(dir);
+        return;
+    }
+    while (!dirTryLockShared(dir))
+    {
+        sched_yield();
+    }
+#else
+    (void)dir;
+    (void)highest;
+#endif
+}
+
+// Drop one shared hold on dir's stripe
+void dirUnlockShared(FileNode *dir)
+{
+#ifndef _WIN32
+    if (!server.active || !dir)
+        return;
+    uint32_t stripe = dir->id % DIR_LOCK_STRIPES;
+    if (--heldStripes[stripe] == 0)
+        pthread_rwlock_unlock(&server.dirLocks[stripe]);
+#else
+    (void)dir;
+#endif
+}
+
+// Lock up to three directories (NULLs skipped) for the writer, then the namespace if names is set.
+// The writer waits for its first stripe alone and only tries the others, backing off when one is busy,
+// so whatever order its stripes come in it waits only for readers. Readers wait for stripes in
+// ascending order and take none under the namespace lock, so they always finish and let it through.
+void dirLockExclusive(DirLocks *locks, FileNode *a, FileNode *b, FileNode *c, int names)
+{
+    locks->count = 0;
+    locks->names = names;
+#ifndef _WIN32
+    if (!server.active)
+        return;
+
+    FileNode *dirs[3] = {a, b, c};
+    for (int i = 0; i < 3; i++)
+    {
+        if (!dirs[i])
+            continue;
+        uint32_t stripe = dirs[i]->id % DIR_LOCK_STRIPES;
+        int seen = 0;
+        for (int j = 0; j < locks->count; j++)
+        {
+            seen |= locks->stripes[j] == stripe;
+        }
+        if (!seen)
+            locks->stripes[locks->count++] = stripe;
+    }
+
+    while (locks->count)
+    {
+        pthread_rwlock_wrlock(&server.dirLocks[locks->stripes[0]]);
+        int held = 1;
+        while (held < locks->count && pthread_rwlock_trywrlock(&server.dirLocks[locks->stripes[held]]) == 0)
+        {
+            held++;
+        }
+        if (held == locks->count)
+            break;
+        while (held > 0)
+        {
+            pthread_rwlock_unlock(&server.dirLocks[locks->stripes[--held]]);
+        }
+        server.writerBackoffs++;
+        sched_yield();
+    }
+    if (names)
+        pthread_rwlock_wrlock(&server.namespaceLock);
+#else
+    (void)a;
+    (void)b;
+    (void)c;
+#endif
+}
+
+// Release what dirLockExclusive took
+void dirUnlockExclusive(DirLocks *locks)
+{
+#ifndef _WIN32
+    if (!server.active)
+        return;
+    if (locks->names)
+        pthread_rwlock_unlock(&server.namespaceLock);
+    for (int i = 0; i < locks->count; i++)
+    {
+        pthread_rwlock_unlock(&server.dirLocks[locks->stripes[i]]);
+    }
+#else
+    (void)locks;
+#endif
+}
+
+// Serialize commands that change the tree or walk all of it
+void serverLockWriter(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_mutex_lock(&server.writerLock);
+#endif
+}
+
+void serverUnlockWriter(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_mutex_unlock(&server.writerLock);
+#endif
+}
+
+// Guard the per-command counters every session updates
+void serverLockStats(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_mutex_lock(&server.statsLock);
+#endif
+}
+
+void serverUnlockStats(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_mutex_unlock(&server.statsLock);
+#endif
+}
+
+// Hold names, parent links and the global name index steady while reading them
+void serverLockNamespace(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_rdlock(&server.namespaceLock);
+#endif
+}
+
+void serverUnlockNamespace(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_unlock(&server.namespaceLock);
+#endif
+}
+
+// Held shared by every read-only command, so rm -r can wait until no reader is inside the tree
+void serverLockReader(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_rdlock(&server.quiesceLock);
+#endif
+}
+
+void serverUnlockReader(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_unlock(&server.quiesceLock);
+#endif
+}
+
+// Wait for read-only commands in flight and hold off new ones. The writer holds no directory lock
+// here, so the readers it waits for can always finish.
+void serverQuiesceReaders(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_wrlock(&server.quiesceLock);
+#endif
+}
+
+void serverResumeReaders(void)
+{
+#ifndef _WIN32
+    if (server.active)
+        pthread_rwlock_unlock(&server.quiesceLock);
+#endif
+}
+
+// Whether some session's current directory lies in top's subtree; the caller holds the writer lock
+int sessionInside(FileNode *top)
+{
+#ifndef _WIN32
+    for (Session *session = server.sessionList; session; session = session->next)
+    {
+        if (isInSubtree(top, session->shell.current))
+            return 1;
+    }
+#else
+    (void)top;
+#endif
+    return 0;
+}
+
+// Count a session's current directory on node, which keeps rm from freeing it
+void nodePin(FileNode *node, int delta)
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    __atomic_add_fetch(&node->pins, (unsigned int)delta, __ATOMIC_RELAXED);
+#else
+    node->pins += (unsigned int)delta;
+#endif
+}
+
+// Resolve path (NULL for cwd) for a read-only command. In server mode the walk takes shared locks
+// parent before child and returns with *locked, the directory holding the result (the result itself
+// for folders), still locked; the caller releases it with dirUnlockShared.
+FileNode *resolveShared(FileNode *root, FileNode *cwd, const char *path, FileNode **locked)
+{
+    *locked = NULL;
+    if (!server.active)
+        return path ? resolvePath(root, cwd, path) : cwd;
+
+    FileNode *base = cwd;
+    if (!path)
+    {
+        path = "";
+    }
+    else if (path[0] == '/')
+    {
+        base = root;
+    }
+    else if (path[0] == '~' && (path[1] == '\0' || path[1] == '/'))
+    {
+        base = root;
+        path++;
+    }
+
+    while (1)
+    {
+        FileNode *dir = base;
+        FileNode *node = base;
+        const char *part = path;
+        int restart = 0;
+        dirLockShared(dir);
+
+        while (node)
+        {
+            while (*part == '/')
+                part++;
+            size_t size = strcspn(part, "/");
+            if (!size)
+                break;
+            if (size >= MAX_NAME || node->type != TYPE_FOLDER)
+            {
+                node = NULL;
+                break;
+            }
+
+            if (size == 2 && part[0] == '.' && part[1] == '.')
+            {
+                // Climbing runs against the lock order, so only try the parent and start over if busy
+                FileNode *up = dir->parent;
+                if (up && !dirTryLockShared(up))
+                {
+                    restart = 1;
+                    break;
+                }
+                if (up)
+                {
+                    dirUnlockShared(dir);
+                    dir = node = up;
+                }
+            }
+            else if (size != 1 || part[0] != '.')
+            {
+                char component[MAX_NAME];
+                memcpy(component, part, size);
+                component[size] = '\0';
+                node = findChild(dir, component);
+                if (node && node->type == TYPE_FOLDER)
+                {
+                    dirLockSharedOrdered(node, dirStripe(dir));
+                    dirUnlockShared(dir);
+                    dir = node;
+                }
+            }
+            part += size;
+        }
+
+        if (restart)
+        {
+            dirUnlockShared(dir);
+            sharedCounterAdd(&server.readerRestarts, 1);
+#ifndef _WIN32
+            sched_yield();
+#endif
+            continue;
+        }
+        if (!node)
+        {
+            dirUnlockShared(dir);
+            return NULL;
+        }
+        *locked = dir;
+        return node;
+    }
+}
+
+// CRC-32 (IEEE) used to detect torn journal records
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t length)
+{
+    static uint32_t table[256];
+    if (!table[1])
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (length--)
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Open (or create) the journal for appending
+int journalOpen(const char *path)
+{
+    FILE *file = fopen(path, "ab");
+    if (!file)
+    {
+        fprintf(shellOut, "Error: Cannot open journal '%s'\n", path);
+        return 0;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    if (size == 0)
+    {
+        fwrite(JOURNAL_MAGIC, 1, 8, file);
+        syncFile(file);
+        size = 8;
+    }
+
+    journalLock();
+    journal.file = file;
+    journal.path = path;
+    journal.bytes = (size_t)size;
+    journal.pending = 0;
+    journalUnlock();
+    journalSyncStart();
+    return 1;
+}
+
+// Commit outstanding records and close the journal
+void journalClose(void)
+{
+    if (!journal.file)
+        return;
+    journalSyncStop();
+    journalCommit(1);
+    fclose(journal.file);
+    journal.file = NULL;
+    free(journal.buffer);
+    journal.buffer = NULL;
+    journal.bufferCapacity = 0;
+}
+
+// Append a field (length + bytes) to the record being built
+size_t journalPut(size_t used, const void *data, size_t length)
+{
+    uint32_t length32 = (uint32_t)length;
+    memcpy(journal.buffer + used, &length32, sizeof(length32));
+    if (length)
+        memcpy(journal.buffer + used + sizeof(length32), data, length);
+    return used + sizeof(length32) + length;
+}
+
+// Log one mutation ahead of applying it; a no-op without a journal or during replay
+int journalLog(JournalOp op, const char *a, const char *b, const char *data, size_t length)
+{
+    if (!journal.file || journal.replaying)
+        return 1;
+
+    size_t lengthA = a ? strlen(a) : 0;
+    size_t lengthB = b ? strlen(b) : 0;
+    // Record: payload length, CRC of payload, then sequence, op and three fields
+    size_t needed = 8 + 8 + 1 + 12 + lengthA + lengthB + length;
+    if (needed > journal.bufferCapacity)
+    {
+        unsigned char *buffer = (unsigned char *)realloc(journal.buffer, needed);
+        if (!buffer)
+        {
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            return 0;
+        }
+        journal.buffer = buffer;
+        journal.bufferCapacity = needed;
+    }
+
+    uint64_t sequence = journal.sequence + 1;
+    size_t used = 8;
+    memcpy(journal.buffer + used, &sequence, sizeof(sequence));
+    used += sizeof(sequence);
+    journal.buffer[used++] = (unsigned char)op;
+    used = journalPut(used, a, lengthA);
+    used = journalPut(used, b, lengthB);
+    used = journalPut(used, data, length);
+
+    uint32_t payload = (uint32_t)(used - 8);
+    uint32_t crc = crc32Update(0, journal.buffer + 8, payload);
+    memcpy(journal.buffer, &payload, sizeof(payload));
+    memcpy(journal.buffer + 4, &crc, sizeof(crc));
+
+    // Hand each record to the OS at once, so it survives a crash of this process even when fsync waits
+    journalLock();
+    if (fwrite(journal.buffer, 1, used, journal.file) != used || fflush(journal.file) != 0)
+    {
+        journalUnlock();
+        fprintf(shellOut, "Error: Journal write failed\n");
+        return 0;
+    }
+
+    journal.sequence = sequence;
+    journal.bytes += used;
+    journal.records++;
+    if (!journal.pending++)
+    {
+        journal.firstPending = nowSeconds();
+#ifndef _WIN32
+        pthread_cond_signal(&journalSyncer.wake);
+#endif
+    }
+    journalCommitLocked(0);
+    journalUnlock();
+    return 1;
+}
+
+// Log a mutation on node (by path) with either a name or a second node's path.
+// Paths are only formatted when a journal is recording.
+int journalLogNode(JournalOp op, FileNode *node, const char *name, FileNode *other, const char *data,
+                   size_t length)
+{
+    if (!journal.file || journal.replaying)
+        return 1;
+
+    char a[MAX_PATH_LENGTH];
+    char b[MAX_PATH_LENGTH];
+    if (nodePath(node, a, sizeof(a)) < 0 || (other && nodePath(other, b, sizeof(b)) < 0))
+    {
+        fprintf(shellOut, "Error: Path too long to journal\n");
+        return 0;
+    }
+    return journalLog(op, a, other ? b : name, data, length);
+}
+
+// Cancel the record just logged when applying it failed, so replay does not redo a change the session
+// reported as an error
+void journalAbort(void)
+{
+    if (journal.file && !journal.replaying)
+        journalLog(OP_ABORT, NULL, NULL, NULL, 0);
+}
+
+// Group commit: fsync once enough records or time have accumulated
+void journalCommit(int force)
+{
+    journalLock();
+    journalCommitLocked(force);
+    journalUnlock();
+}
+
+// Group commit with the journal lock held
+void journalCommitLocked(int force)
+{
+    if (!journal.file || !journal.pending)
+        return;
+
+    int due = force ||
+              (journal.syncEvery > 0 && journal.pending >= journal.syncEvery) ||
+              (journal.syncMillis > 0 && (nowSeconds() - journal.firstPending) * 1000 >= journal.syncMillis);
+    if (!due)
+        return;
+
+    if (journal.syncEvery > 0 || journal.syncMillis > 0)
+    {
+        syncFile(journal.file);
+        journal.syncs++;
+    }
+    journal.pending = 0;
+}
+
+// Serialize the journal's file and pending group between commands and the sync thread
+void journalLock(void)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&journalSyncer.lock);
+#endif
+}
+
+void journalUnlock(void)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&journalSyncer.lock);
+#endif
+}
+
+#ifndef _WIN32
+// Sync thread: sleep until a group is pending, then until it is syncMillis old, and commit it if still due
+void *journalSyncMain(void *arg)
+{
+    (void)arg;
+    journalLock();
+    while (journalSyncer.running)
+    {
+        if (!journal.pending)
+        {
+            pthread_cond_wait(&journalSyncer.wake, &journalSyncer.lock);
+            continue;
+        }
+        double due = journal.firstPending + journal.syncMillis / 1000.0;
+        if (nowSeconds() < due)
+        {
+            // nowSeconds reads the realtime clock that pthread_cond_timedwait expects
+            struct timespec until;
+            until.tv_sec = (time_t)due;
+            until.tv_nsec = (long)((due - (double)until.tv_sec) * 1e9);
+            pthread_cond_timedwait(&journalSyncer.wake, &journalSyncer.lock, &until);
+            continue;
+        }
+        journalCommitLocked(0);
+    }
+    journalUnlock();
+    return NULL;
+}
+#endif
+
+// Start the sync thread when --sync-ms is set; without threads the trigger is only checked between commands
+void journalSyncStart(void)
+{
+#ifndef _WIN32
+    if (journalSyncer.running || journal.syncMillis <= 0)
+        return;
+    journalSyncer.running = 1;
+    if (pthread_create(&journalSyncer.thread, NULL, journalSyncMain, NULL) != 0)
+    {
+        journalSyncer.running = 0;
+        fprintf(shellOut, "Warning: cannot start the journal sync thread; --sync-ms is checked between commands\n");
+    }
+#endif
+}
+
+// Stop and join the sync thread
+void journalSyncStop(void)
+{
+#ifndef _WIN32
+    if (!journalSyncer.running)
+        return;
+    journalLock();
+    journalSyncer.running = 0;
+    pthread_cond_signal(&journalSyncer.wake);
+    journalUnlock();
+    pthread_join(journalSyncer.thread, NULL);
+#endif
+}
+
+// Read a length-prefixed journal field
+const unsigned char *journalField(const unsigned char *at, const unsigned char *end, char **out,
+                                  size_t *length)
+{
+    uint32_t length32;
+    if (end - at < (long)sizeof(length32))
+        return NULL;
+    memcpy(&length32, at, sizeof(length32));
+    at += sizeof(length32);
+    if ((size_t)(end - at) < length32)
+        return NULL;
+
+    *out = (char *)malloc(length32 + 1);
+    if (!*out)
+        return NULL;
+    memcpy(*out, at, length32);
+    (*out)[length32] = '\0';
+    *length = length32;
+    return at + length32;
+}
+
+// Apply a decoded record with journaling suppressed
+int journalApply(FileNode *root, JournalOp op, const char *a, const char *b, const char *data,
+                 size_t length)
+{
+    FileNode *dir = resolvePath(root, root, a);
+    switch (op)
+    {
+    case OP_MKDIR:
+        return dir && fsCreate(dir, b, TYPE_FOLDER);
+    case OP_TOUCH:
+        return dir && fsCreate(dir, b, TYPE_FILE);
+    case OP_REMOVE:
+        return dir && fsRemove(dir, b, 0);
+    case OP_REMOVE_TREE:
+        return dir && fsRemove(dir, b, 1);
+    case OP_WRITE:
+    case OP_APPEND:
+        return dir && fsWrite(dir, b, data, length, op == OP_APPEND);
+    case OP_RENAME:
+        return dir && fsRename(dir, b);
+    case OP_MOVE:
+    {
+        FileNode *dst = resolvePath(root, root, b);
+        return dir && dst && fsMove(dir, dst);
+    }
+    case OP_COPY:
+        return dir && fsCopy(findChild(dir, b), dir, data, 0);
+    case OP_COPY_INTO:
+    {
+        FileNode *dst = resolvePath(root, root, b);
+        return dir && dst && fsCopy(dir, dst, data, 0);
+    }
+    case OP_COPY_TREE:
+    {
+        FileNode *dst = resolvePath(root, root, b);
+        return dir && dst && fsCopy(dir, dst, data, 1);
+    }
+    case OP_ABORT:
+        break;
+    }
+    return 0;
+}
+
+// Apply a replayed record unless a checkpoint already folded it into the image, then free its fields
+void journalReplayRecord(FileNode *root, JournalRecord *record, unsigned long *applied, unsigned long *skipped)
+{
+    if (record->sequence > journal.sequence)
+    {
+        if (!journalApply(root, record->op, record->a, record->b, record->data, record->length))
+            fprintf(shellOut, "Warning: journal record %llu could not be applied\n",
+                    (unsigned long long)record->sequence);
+        journal.sequence = record->sequence;
+        (*applied)++;
+    }
+    else
+    {
+        (*skipped)++;
+    }
+    free(record->a);
+    free(record->b);
+    free(record->data);
+}
+
+// Replay records newer than the loaded image, then truncate any torn tail
+int journalReplay(FileNode *root)
+{
+    FILE *file = fopen(journal.path, "rb");
+    if (!file)
+        return 1;
+
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, JOURNAL_MAGIC, 8) != 0)
+    {
+        fclose(file);
+        fprintf(shellOut, "Error: '%s' is not a journal\n", journal.path);
+        return 0;
+    }
+
+    double start = nowSeconds();
+    unsigned long applied = 0;
+    unsigned long skipped = 0;
+    unsigned long aborted = 0;
+    JournalRecord held;
+    int holding = 0;
+    long good = 8;
+    unsigned char header[8];
+    unsigned char *payload = NULL;
+
+    journal.replaying = 1;
+    while (fread(header, 1, 8, file) == 8)
+    {
+        uint32_t length;
+        uint32_t crc;
+        memcpy(&length, header, sizeof(length));
+        memcpy(&crc, header + 4, sizeof(crc));
+
+        unsigned char *grown = (unsigned char *)realloc(payload, length ? length : 1);
+        if (!grown)
+            break;
+        payload = grown;
+        if (length < 9 || fread(payload, 1, length, file) != length || crc32Update(0, payload, length) != crc)
+            break;
+
+        uint64_t sequence;
+        memcpy(&sequence, payload, sizeof(sequence));
+        JournalOp op = (JournalOp)payload[8];
+        const unsigned char *at = payload + 9;
+        const unsigned char *end = payload + length;
+        char *a = NULL;
+        char *b = NULL;
+        char *data = NULL;
+        size_t lengthA, lengthB, dataLength;
+
+        at = journalField(at, end, &a, &lengthA);
+        at = at ? journalField(at, end, &b, &lengthB) : NULL;
+        at = at ? journalField(at, end, &data, &dataLength) : NULL;
+        if (!at)
+        {
+            free(a);
+            free(b);
+            free(data);
+            break;
+        }
+
+        // The record before an abort failed in the session that logged it, so it is dropped unapplied
+        if (holding && op == OP_ABORT && held.sequence + 1 == sequence)
+        {
+            free(held.a);
+            free(held.b);
+            free(held.data);
+            aborted++;
+        }
+        else if (holding)
+        {
+            journalReplayRecord(root, &held, &applied, &skipped);
+        }
+        holding = op != OP_ABORT;
+        if (holding)
+        {
+            JournalRecord record = {sequence, op, a, b, data, dataLength};
+            held = record;
+        }
+        else
+        {
+            if (sequence > journal.sequence)
+                journal.sequence = sequence;
+            free(a);
+            free(b);
+            free(data);
+        }
+        good = ftell(file);
+    }
+    if (holding)
+        journalReplayRecord(root, &held, &applied, &skipped);
+    journal.replaying = 0;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    free(payload);
+
+    if (size > good)
+    {
+        // Drop the torn tail so new records follow the last intact one
+        fprintf(shellOut, "Journal: discarding %ld bytes of incomplete records\n", size - good);
+#ifdef _WIN32
+        FILE *trim = fopen(journal.path, "r+b");
+        if (trim)
+        {
+            _chsize(_fileno(trim), good);
+            fclose(trim);
+        }
+#else
+        if (truncate(journal.path, good) != 0)
+            fprintf(shellOut, "Warning: cannot truncate journal '%s'\n", journal.path);
+#endif
+    }
+
+    if (applied || skipped || aborted)
+    {
+        fprintf(shellOut, "Journal: replayed %lu records (%lu already in image, %lu aborted) in %.1f ms\n", applied,
+                skipped, aborted, (nowSeconds() - start) * 1000);
+    }
+    return 1;
+}
+
+// Fold the journal into a fresh image so replay starts from empty
+int checkpoint(FileNode *root, const char *imagePath)
+{
+    if (!imagePath)
+    {
+        fprintf(shellOut, "Error: checkpoint needs --image\n");
+        return 0;
+    }
+
+    journalCommit(1);
+    if (!saveImage(root, imagePath))
+        return 0;
+    treeDirty = 0;
+
+    if (journal.file)
+    {
+        // The image carries the sequence, so a crash before this truncation is harmless
+        journalLock();
+        fclose(journal.file);
+        journal.file = NULL;
+        journalUnlock();
+        FILE *file = fopen(journal.path, "wb");
+        if (file)
+            fclose(file);
+        return journalOpen(journal.path);
+    }
+    return 1;
+}
+
+// Register a watch on target for shell's session. The caller holds the writer lock, which producers hold too.
+Watch *watchAdd(Shell *shell, FileNode *target, int recursive)
+{
+    char path[MAX_PATH_LENGTH];
+    if (nodePath(target, path, sizeof(path)) < 0)
+        strcpy(path, target->fileName);
+    Watch *watch = (Watch *)calloc(1, sizeof(Watch));
+    size_t length = strlen(path) + 1;
+    char *label = (char *)malloc(length);
+    WatchEvent *slots = (WatchEvent *)calloc(WATCH_RING_SIZE, sizeof(WatchEvent));
+    if (!watch || !label || !slots)
+    {
+        free(watch);
+        free(label);
+        free(slots);
+        fprintf(shellOut, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    memcpy(label, path, length);
+    watch->id = watchList.nextId++;
+    watch->recursive = recursive;
+    watch->target = target;
+    watch->label = label;
+    watch->slots = slots;
+    watch->next = watchList.head;
+    watchList.head = watch;
+    watchList.count++;
+
+    // Keep the session's list in id order, which is the order events prints them in
+    Watch **link = &shell->watches;
+    while (*link)
+    {
+        link = &(*link)->ownerNext;
+    }
+    *link = watch;
+    return watch;
+}
+
+// Unregister one of shell's watches and free its ring with any events still queued
+void watchRemove(Shell *shell, Watch *watch)
+{
+    for (Watch **link = &watchList.head; *link; link = &(*link)->next)
+    {
+        if (*link == watch)
+        {
+            *link = watch->next;
+            watchList.count--;
+            break;
+        }
+    }
+    for (Watch **link = &shell->watches; *link; link = &(*link)->ownerNext)
+    {
+        if (*link == watch)
+        {
+            *link = watch->ownerNext;
+            break;
+        }
+    }
+    for (size_t i = watch->tail; i != watch->head; i++)
+    {
+        free(watch->slots[i % WATCH_RING_SIZE].path);
+    }
+    free(watch->slots);
+    free(watch->label);
+    free(watch);
+}
+
+// Unregister all of a session's watches, when it ends
+void watchRemoveAll(Shell *shell)
+{
+    while (shell->watches)
+    {
+        watchRemove(shell, shell->watches);
+    }
+}
+
+// The whole tree is about to be replaced (load, snapshot restore): every watch gets a delete for its
+// target and ends
+void watchDetachAll(void)
+{
+    for (Watch *watch = watchList.head; watch; watch = watch->next)
+    {
+        char path[MAX_PATH_LENGTH];
+        if (!watch->target)
+            continue;
+        if (nodePath(watch->target, path, sizeof(path)) < 0)
+            strcpy(path, watch->target->fileName);
+        watchPush(watch, WATCH_DELETE, watch->target, path, strlen(path));
+        watch->target = NULL;
+        watch->lastNode = NULL;
+    }
+}
+
+// Whether a watched node lies strictly below dir, so a lazy image must not turn dir back into a stub
+int watchInside(FileNode *dir)
+{
+    for (Watch *watch = watchList.head; watch; watch = watch->next)
+    {
+        if (watch->target && watch->target != dir && isInSubtree(dir, watch->target))
+            return 1;
+    }
+    return 0;
+}
+
+// Whether an event on node, whose folder is parent, falls in watch's scope
+int watchCovers(const Watch *watch, FileNode *node, FileNode *parent)
+{
+    FileNode *target = watch->target;
+    if (!target)
+        return 0;
+    if (node == target || parent == target)
+        return 1;
+    return watch->recursive && parent && isInSubtree(target, parent);
+}
+
+// Fold one more event into a queued slot, unless the consumer has already claimed it
+int watchSlotFold(uint32_t *count)
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    uint32_t seen = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+    while (!(seen & WATCH_TAKEN))
+    {
+        if (__atomic_compare_exchange_n(count, &seen, seen + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+#else
+    if (*count & WATCH_TAKEN)
+        return 0;
+    (*count)++;
+    return 1;
+#endif
+}
+
+// Claim a queued slot for reading, returning the number of events it stands for
+uint32_t watchSlotClaim(uint32_t *count)
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    return __atomic_fetch_or(count, WATCH_TAKEN, __ATOMIC_ACQ_REL) & ~WATCH_TAKEN;
+#else
+    uint32_t seen = *count;
+    *count |= WATCH_TAKEN;
+    return seen;
+#endif
+}
+
+// Producer side of a watch's ring. A write to the file whose creation or write is the newest queued slot
+// folds into it. The last free slot is kept for an overflow marker, which every event dropped while the
+// ring stays full folds into, so the consumer learns where the gap is; once it has claimed the marker,
+// drops are only counted in lost.
+void watchPush(Watch *watch, WatchKind kind, FileNode *node, const char *text, size_t length)
+{
+    size_t head = watch->head;
+    WatchEvent *last = &watch->slots[(head - 1) % WATCH_RING_SIZE];
+    if (kind == WATCH_MODIFY && head && watch->lastNode == node &&
+        (watch->lastKind == WATCH_MODIFY || watch->lastKind == WATCH_CREATE) && watchSlotFold(&last->count))
+    {
+        watch->folded++;
+        return;
+    }
+
+    size_t used = head - ACQUIRE_LOAD(watch->tail);
+    char *path = used < WATCH_RING_SIZE - 1 ? (char *)malloc(length + 1) : NULL;
+    if (!path)
+    {
+        watch->dropped++;
+        if (head && watch->lastKind == WATCH_OVERFLOW && watchSlotFold(&last->count))
+            return;
+        if (used != WATCH_RING_SIZE - 1)
+        {
+            sharedCounterAdd(&watch->lost, 1);
+            return;
+        }
+        kind = WATCH_OVERFLOW;
+        node = NULL;
+    }
+    else
+    {
+        memcpy(path, text, length);
+        path[length] = '\0';
+    }
+
+    WatchEvent *slot = &watch->slots[head % WATCH_RING_SIZE];
+    slot->path = path;
+    slot->kind = kind;
+    slot->count = 1;
+    watch->lastNode = node;
+    watch->lastKind = kind;
+    watch->published += kind != WATCH_OVERFLOW;
+    RELEASE_STORE(watch->head, head + 1);
+}
+
+// Queue an event on node with every watch whose scope it falls in; a move also reaches the watches of
+// where it came from (from is its old path, fromParent its old folder). Called after the change, except
+// for deletes, which are published while the node is still linked; watches on anything below a deleted
+// node end there. The text is built once, on the first match. Callers test watchList.count first.
+void watchPublish(WatchKind kind, FileNode *node, const char *from, FileNode *fromParent)
+{
+    char text[2 * MAX_PATH_LENGTH + 8];
+    size_t length = 0;
+    for (Watch *watch = watchList.head; watch; watch = watch->next)
+    {
+        FileNode *target = watch->target;
+        int inside = kind == WATCH_DELETE && target && isInSubtree(node, target);
+        if (!inside && !watchCovers(watch, node, node->parent) &&
+            !(kind == WATCH_MOVE && watchCovers(watch, node, fromParent)))
+            continue;
+
+        if (!length)
+        {
+            if (kind == WATCH_MOVE)
+            {
+                length = strlen(from);
+                memcpy(text, from, length);
+                memcpy(text + length, " -> ", 4);
+                length += 4;
+            }
+            int written = nodePath(node, text + length, MAX_PATH_LENGTH);
+            if (written < 0)
+            {
+                strcpy(text + length, node->fileName);
+                written = (int)strlen(node->fileName);
+            }
+            length += (size_t)written;
+        }
+        watchPush(watch, kind, node, text, length);
+        if (inside)
+        {
+            watch->target = NULL;
+            watch->lastNode = NULL;
+        }
+    }
+}
+
+// Consumer side: render up to max queued events of watch (0 = all) as "id KIND path", taking them in one
+// batch and handing the slots back with a single release of tail. Returns the number of lines rendered.
+size_t watchDrain(Watch *watch, RenderBuffer *render, size_t max)
+{
+    static const char *kindNames[] = {"CREATE", "DELETE", "MODIFY", "MOVE", "OVERFLOW"};
+    char number[24];
+    size_t tail = watch->tail;
+    size_t head = ACQUIRE_LOAD(watch->head);
+    size_t lines = 0;
+    for (; tail != head && (!max || lines < max); tail++, lines++)
+    {
+        WatchEvent *slot = &watch->slots[tail % WATCH_RING_SIZE];
+        uint32_t count = watchSlotClaim(&slot->count);
+        int length = snprintf(number, sizeof(number), "%u ", watch->id);
+        renderBytes(render, number, (size_t)length);
+        renderBytes(render, kindNames[slot->kind], strlen(kindNames[slot->kind]));
+        if (slot->kind == WATCH_OVERFLOW)
+        {
+            length = snprintf(number, sizeof(number), " %u", count);
+            renderBytes(render, number, (size_t)length);
+            renderBytes(render, " events dropped\n", 16);
+            continue;
+        }
+        renderBytes(render, " ", 1);
+        renderBytes(render, slot->path, strlen(slot->path));
+        if (count > 1)
+        {
+            length = snprintf(number, sizeof(number), " (%u events)", count);
+            renderBytes(render, number, (size_t)length);
+        }
+        renderBytes(render, "\n", 1);
+        free(slot->path);
+        slot->path = NULL;
+    }
+    RELEASE_STORE(watch->tail, tail);
+
+    // Drops after the consumer claimed the overflow marker come last, once the ring is empty
+    size_t lost = tail == head ? RELAXED_LOAD(watch->lost) : 0;
+    if (lost && (!max || lines < max))
+    {
+        sharedCounterAdd(&watch->lost, -(long)lost);
+        int length = snprintf(number, sizeof(number), "%u ", watch->id);
+        renderBytes(render, number, (size_t)length);
+        length = snprintf(number, sizeof(number), "OVERFLOW %zu", lost);
+        renderBytes(render, number, (size_t)length);
+        renderBytes(render, " events dropped\n", 16);
+        lines++;
+    }
+    return lines;
+}
+
+// List shell's watches with their queue state
+void watchPrint(const Shell *shell)
+{
+    for (const Watch *watch = shell->watches; watch; watch = watch->ownerNext)
+    {
+        char path[MAX_PATH_LENGTH];
+        const char *shown = watch->label;
+        if (watch->target && nodePath(watch->target, path, sizeof(path)) >= 0)
+            shown = path;
+        size_t pending = ACQUIRE_LOAD(watch->head) - watch->tail;
+        fprintf(shellOut, "%4u  %s%s%s  %zu pending, %zu published, %zu folded, %zu dropped\n", watch->id, shown,
+                watch->recursive ? " -r" : "", watch->target ? "" : " (gone)", pending, watch->published,
+                watch->folded, watch->dropped);
+    }
+}
+
+// Create an empty file or folder in dir
+int fsCreate(FileNode *dir, const char *name, NodeType type)
+{
+    if (!isValidName(name))
+    {
+        fprintf(shellOut, "Error: Invalid name '%s'\n", name);
+        return 0;
+    }
+    if (findChild(dir, name))
+    {
+        fprintf(shellOut, "Error: '%s' already exists\n", name);
+        return 0;
+    }
+
+    // Allocate before logging, and cancel the record if inserting still fails
+    FileNode *node = createNode(name, "", type);
+    if (!node)
+        return 0;
+    if (!journalLogNode(type == TYPE_FOLDER ? OP_MKDIR : OP_TOUCH, dir, name, NULL, NULL, 0))
+    {
+        freeTree(node);
+        return 0;
+    }
+    DirLocks locks;
+    dirLockExclusive(&locks, dir, NULL, NULL, 1);
+    int ok = insertNode(dir, node);
+    dirUnlockExclusive(&locks);
+    if (!ok)
+    {
+        freeTree(node);
+        journalAbort();
+    }
+    else if (watchList.count)
+        watchPublish(WATCH_CREATE, node, NULL, NULL);
+    return ok;
+}
+
+// Remove a file or empty folder from dir; with recursive, a folder and everything below it.
+// A subtree is only unlinked here and freed in batches after later commands (reclaimStep).
+int fsRemove(FileNode *dir, const char *name, int recursive)
+{
+    FileNode *child = findChild(dir, name);
+    if (!child)
+    {
+        fprintf(shellOut, "Error: '%s' not found\n", name);
+        return 0;
+    }
+    // A stub's entries are still on disk, so its totals tell whether it is empty
+    int subtree = child->type == TYPE_FOLDER && (child->fChild || child->totals.files || child->totals.folders);
+    if (subtree && !recursive)
+    {
+        fprintf(shellOut, "Error: Directory '%s' is not empty (use rm -r)\n", name);
+        return 0;
+    }
+
+    // Sessions pin their current directory under its shared lock, so check pins with it held. A
+    // reader may be anywhere below a subtree, so unlinking one also waits for readers to drain.
+    if (subtree)
+        serverQuiesceReaders();
+    DirLocks locks;
+    dirLockExclusive(&locks, dir, child->type == TYPE_FOLDER ? child : NULL, NULL, 1);
+    int ok = 0;
+    if (child->pins || (subtree && sessionInside(child)))
+    {
+        fprintf(shellOut, "Error: Directory '%s' is in use\n", name);
+    }
+    else if (journalLogNode(subtree ? OP_REMOVE_TREE : OP_REMOVE, dir, name, NULL, NULL, 0))
+    {
+        ok = 1;
+        if (watchList.count)
+            watchPublish(WATCH_DELETE, child, NULL, NULL);
+        if (subtree)
+        {
+            detachNode(child);
+            reclaimPush(child);
+        }
+        else
+        {
+            ok = deleteNode(NULL, dir, name);
+            if (!ok)
+                journalAbort();
+        }
+    }
+    dirUnlockExclusive(&locks);
+    if (subtree)
+        serverResumeReaders();
+    return ok;
+}
+
+// Overwrite or append to a file in dir, creating it if needed
+int fsWrite(FileNode *dir, const char *name, const char *data, size_t length, int append)
+{
+    FileNode *child = findChild(dir, name);
+    if (child && child->type != TYPE_FILE)
+    {
+        fprintf(shellOut, "Error: '%s' is a directory\n", name);
+        return 0;
+    }
+    if (!child && !isValidName(name))
+    {
+        fprintf(shellOut, "Error: Invalid name '%s'\n", name);
+        return 0;
+    }
+
+    // Allocate before logging; if the write still fails, a file it created goes again and the record
+    // is cancelled
+    FileNode *created = child ? NULL : createNode(name, NULL, TYPE_FILE);
+    if (!child && !created)
+        return 0;
+    if (!journalLogNode(append ? OP_APPEND : OP_WRITE, dir, name, NULL, data, length))
+    {
+        if (created)
+            freeTree(created);
+        return 0;
+    }
+    DirLocks locks;
+    dirLockExclusive(&locks, dir, NULL, NULL, created != NULL);
+    int ok = 1;
+    if (created)
+    {
+        ok = insertNode(dir, created);
+        child = created;
+    }
+    if (ok)
+    {
+        ok = append ? contentAppend(child, data, length) : contentWrite(child, data, length);
+        child->modifiedTime = time(NULL);
+        totalsAdd(dir, 0, 0, 0, child->modifiedTime);
+    }
+    if (!ok && created)
+        detachNode(created);
+    dirUnlockExclusive(&locks);
+    if (!ok)
+        journalAbort();
+    if (created && !created->parent)
+        freeTree(created);
+    else if (ok && watchList.count)
+        watchPublish(created ? WATCH_CREATE : WATCH_MODIFY, child, NULL, NULL);
+    return ok;
+}
+
+// Rename node within its directory
+int fsRename(FileNode *node, const char *newName)
+{
+    if (!isValidName(newName))
+    {
+        fprintf(shellOut, "Error: Invalid name '%s'\n", newName);
+        return 0;
+    }
+    FileNode *existing = node->parent ? findChild(node->parent, newName) : NULL;
+    if (existing && existing != node)
+    {
+        fprintf(shellOut, "Error: '%s' already exists\n", newName);
+        return 0;
+    }
+
+    if (!journalLogNode(OP_RENAME, node, newName, NULL, NULL, 0))
+        return 0;
+
+    char from[MAX_PATH_LENGTH];
+    if (watchList.count && nodePath(node, from, sizeof(from)) < 0)
+        strcpy(from, node->fileName);
+    DirLocks locks;
+    dirLockExclusive(&locks, node->parent, NULL, NULL, 1);
+    int ok = renameNode(node, newName);
+    dirUnlockExclusive(&locks);
+    if (!ok)
+        journalAbort();
+    else if (watchList.count)
+        watchPublish(WATCH_MOVE, node, from, node->parent);
+    return ok;
+}
+
+// Move node into dstDir
+int fsMove(FileNode *node, FileNode *dstDir)
+{
+    if (!node->parent)
+    {
+        fprintf(shellOut, "Error: Cannot move the root directory\n");
+        return 0;
+    }
+    if (dstDir->type != TYPE_FOLDER)
+    {
+        fprintf(shellOut, "Error: '%s' is not a valid directory\n", dstDir->fileName);
+        return 0;
+    }
+    if (findChild(dstDir, node->fileName))
+    {
+        fprintf(shellOut, "Error: '%s' already exists\n", node->fileName);
+        return 0;
+    }
+    if (isInSubtree(node, dstDir))
+    {
+        fprintf(shellOut, "Error: Cannot move '%s' into itself\n", node->fileName);
+        return 0;
+    }
+
+    if (!journalLogNode(OP_MOVE, node, NULL, dstDir, NULL, 0))
+        return 0;
+
+    // Remove from old location, then insert in new location. A moved folder is locked too:
+    // readers climbing out of it with ".." read its parent link under its own lock.
+    char from[MAX_PATH_LENGTH];
+    FileNode *fromParent = node->parent;
+    if (watchList.count && nodePath(node, from, sizeof(from)) < 0)
+        strcpy(from, node->fileName);
+    DirLocks locks;
+    dirLockExclusive(&locks, node->parent, dstDir, node->type == TYPE_FOLDER ? node : NULL, 1);
+    detachNode(node);
+    int ok = insertNode(dstDir, node);
+    if (!ok)
+        insertNode(fromParent, node);
+    dirUnlockExclusive(&locks);
+    if (!ok)
+        journalAbort();
+    else if (watchList.count)
+        watchPublish(WATCH_MOVE, node, from, fromParent);
+    return ok;
+}
+
+// Copy src into dstDir as dstName; folders need recursive and are copied with everything below them
+int fsCopy(FileNode *src, FileNode *dstDir, const char *dstName, int recursive)
+{
+    if (!src)
+    {
+        fprintf(shellOut, "Error: Source not found\n");
+        return 0;
+    }
+    if (src->type != TYPE_FILE && !recursive)
+    {
+        fprintf(shellOut, "Error: '%s' is a directory (use cp -r)\n", src->fileName);
+        return 0;
+    }
+    if (!dstDir || dstDir->type != TYPE_FOLDER)
+    {
+        fprintf(shellOut, "Error: Destination is not a directory\n");
+        return 0;
+    }
+    if (!isValidName(dstName))
+    {
+        fprintf(shellOut, "Error: Invalid name '%s'\n", dstName);
+        return 0;
+    }
+    if (findChild(dstDir, dstName))
+    {
+        fprintf(shellOut, "Error: '%s' already exists\n", dstName);
+        return 0;
+    }
+    if (src->type == TYPE_FOLDER && isInSubtree(src, dstDir))
+    {
+        fprintf(shellOut, "Error: Cannot copy '%s' into itself\n", src->fileName);
+        return 0;
+    }
+
+    // The copy is built detached before logging, so readers only ever see it whole and a failed
+    // allocation leaves no record behind
+    FileNode *copy = copyTree(src, dstName);
+    if (!copy)
+        return 0;
+    JournalOp op = src->type == TYPE_FOLDER ? OP_COPY_TREE : OP_COPY_INTO;
+    if (!journalLogNode(op, src, NULL, dstDir, dstName, strlen(dstName)))
+    {
+        freeTree(copy);
+        return 0;
+    }
+    DirLocks locks;
+    dirLockExclusive(&locks, dstDir, NULL, NULL, 1);
+    int ok = insertNode(dstDir, copy);
+    if (ok && dstDir->nameIndexed)
+        nameIndexAddTree(copy);
+    dirUnlockExclusive(&locks);
+    if (!ok)
+    {
+        freeTree(copy);
+        journalAbort();
+    }
+    else if (watchList.count)
+        watchPublish(WATCH_CREATE, copy, NULL, NULL);
+    return ok;
+}
+
+// Monotonic-enough wall clock in seconds for benchmarks
+double nowSeconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Insert rate into a single directory as it grows
+void benchDirInsert(long total)
+{
+    FileNode *dir = createNode("bench", "", TYPE_FOLDER);
+    if (!dir)
+        return;
+
+    char name[32];
+    long inserted = 0;
+    long mark = 1000;
+
+    printf("%-24s %14s\n", "directory size", "inserts/sec");
+    double start = nowSeconds();
+    while (inserted < total)
+    {
+        snprintf(name, sizeof(name), "f%ld", inserted);
+        FileNode *file = createNode(name, "", TYPE_FILE);
+        if (!file || !insertNode(dir, file))
+        {
+            if (file)
+                freeTree(file);
+            break;
+        }
+        inserted++;
+
+        if (inserted == mark || inserted == total)
+        {
+            double elapsed = nowSeconds() - start;
+            long from = mark > 1000 ? mark / 10 : 0;
+            if (inserted == total && inserted != mark)
+                from = mark / 10;
+            printf("%10ld - %-11ld %14.0f\n", from, inserted,
+                   elapsed > 0 ? (inserted - from) / elapsed : 0.0);
+            mark *= 10;
+            start = nowSeconds();
+        }
+    }
+
+    // Lookups of every entry, now that the directory is full
+    double lookupStart = nowSeconds();
+    long hits = 0;
+    for (long i = 0; i < inserted; i++)
+    {
+        snprintf(name, sizeof(name), "f%ld", i);
+        hits += findChild(dir, name) != NULL;
+    }
+    double lookupElapsed = nowSeconds() - lookupStart;
+    printf("lookups in %ld-entry dir: %.0f/sec (%ld hits)\n", inserted,
+           lookupElapsed > 0 ? inserted / lookupElapsed : 0.0, hits);
+
+    // 100-entry pages after random cursors, in name order and (scanning every entry) in size order
+    ListOptions options = {0, LIST_BY_NAME, 100, name, NULL, NULL};
+    for (int order = 0; order < 2 && inserted; order++)
+    {
+        long pages = order ? 10 : 10000;
+        size_t listed = 0;
+        options.order = order ? LIST_BY_SIZE : LIST_BY_NAME;
+        double pageStart = nowSeconds();
+        for (long i = 0; i < pages; i++)
+        {
+            snprintf(name, sizeof(name), "f%ld", (long)(((uint64_t)i * 2654435761u) % (uint64_t)inserted));
+            ListEntry *entries;
+            long count = listCollect(dir, &options, &entries);
+            if (count >= 0)
+            {
+                listed += (size_t)count;
+                free(entries);
+            }
+        }
+        double pageElapsed = nowSeconds() - pageStart;
+        printf("%s pages of 100: %.1f us/page (%zu entries)\n", order ? "size-ordered" : "name-ordered",
+               pageElapsed * 1e6 / pages, listed);
+    }
+
+    freeTree(dir);
+}
+
+// Build dirs x filesPerDir nodes under top, returning the number created
+long benchFillTree(FileNode *top, long dirs, long filesPerDir)
+{
+    char name[32];
+    long created = 0;
+    for (long d = 0; d < dirs; d++)
+    {
+        snprintf(name, sizeof(name), "d%ld", d);
+        FileNode *dir = createNode(name, "", TYPE_FOLDER);
+        if (!dir || !insertNode(top, dir))
+            return created;
+        created++;
+        for (long f = 0; f < filesPerDir; f++)
+        {
+            snprintf(name, sizeof(name), "f%ld", f);
+            FileNode *file = createNode(name, "", TYPE_FILE);
+            if (!file || !insertNode(dir, file))
+                return created;
+            created++;
+        }
+    }
+    return created;
+}
+
+// Delete every node under top one at a time through deleteNode
+void benchEmptyTree(FileNode *top, long dirs, long filesPerDir)
+{
+    char name[32];
+    for (long d = 0; d < dirs; d++)
+    {
+        snprintf(name, sizeof(name), "d%ld", d);
+        FileNode *dir = findChild(top, name);
+        for (long f = 0; f < filesPerDir; f++)
+        {
+            snprintf(name, sizeof(name), "f%ld", f);
+            deleteNode(NULL, dir, name);
+        }
+        snprintf(name, sizeof(name), "d%ld", d);
+        deleteNode(NULL, top, name);
+    }
+}
+
+// Create and delete a large tree with malloc and with the slab pool
+void benchAlloc(long total)
+{
+    long filesPerDir = 1000;
+    long dirs = total / (filesPerDir + 1);
+    if (dirs < 1)
+        dirs = 1;
+
+    double rates[2][4];
+    long created = 0;
+    for (int pooled = 0; pooled <= 1; pooled++)
+    {
+        nodePool.enabled = pooled;
+        nodePool.totalAllocs = 0;
+        nodePool.totalFrees = 0;
+        FileNode *top = createNode("bench", "", TYPE_FOLDER);
+        if (!top)
+            return;
+
+        double t0 = nowSeconds();
+        created = benchFillTree(top, dirs, filesPerDir);
+        double t1 = nowSeconds();
+        benchEmptyTree(top, dirs, filesPerDir);
+        double t2 = nowSeconds();
+        benchFillTree(top, dirs, filesPerDir);
+        double t3 = nowSeconds();
+        if (pooled)
+        {
+            printf("Pool state before teardown:\n");
+            printPoolStats();
+            nodePoolDestroy();
+        }
+        else
+        {
+            freeTree(top);
+        }
+        double t4 = nowSeconds();
+
+        rates[pooled][0] = created / (t1 - t0);
+        rates[pooled][1] = created / (t2 - t1);
+        rates[pooled][2] = created / (t3 - t2);
+        rates[pooled][3] = (t4 - t3) * 1000;
+    }
+    nodePool.enabled = 1;
+
+    printf("\n%ld nodes\n", created);
+    printf("%-10s %14s %14s %14s %14s\n", "allocator", "create/sec", "delete/sec",
+           "recreate/sec", "teardown ms");
+    for (int pooled = 0; pooled <= 1; pooled++)
+    {
+        printf("%-10s %14.0f %14.0f %14.0f %14.1f\n", pooled ? "slab pool" : "malloc",
+               rates[pooled][0], rates[pooled][1], rates[pooled][2], rates[pooled][3]);
+    }
+}
+
+// Walk a subtree through FileNode pointers, touching each name
+size_t benchWalkPointers(FileNode *top, const char *target, size_t *matches)
+{
+    size_t visited = 0;
+    FileNode *node = top;
+    while (node)
+    {
+        visited++;
+        if (target && strcmp(node->fileName, target) == 0)
+            (*matches)++;
+        else if (!target)
+            *matches += (unsigned char)node->fileName[0];
+
+        if (node->fChild)
+        {
+            node = node->fChild;
+            continue;
+        }
+        while (node != top && !node->nSibling)
+        {
+            node = node->parent;
+        }
+        if (node == top)
+            break;
+        node = node->nSibling;
+    }
+    return visited;
+}
+
+// Walk a subtree through the hot node table, touching each name
+size_t benchWalkTable(uint32_t top, size_t *matches)
+{
+    const NodeHot *hot = nodeTable.hot;
+    size_t visited = 0;
+    uint32_t id = top;
+    while (1)
+    {
+        visited++;
+        *matches += (unsigned char)nodeTableName(id)[0];
+
+        if (hot[id].fChild != NODE_NIL)
+        {
+            id = hot[id].fChild;
+            continue;
+        }
+        while (id != top && hot[id].nSibling == NODE_NIL)
+        {
+            id = hot[id].parent;
+        }
+        if (id == top)
+            break;
+        id = hot[id].nSibling;
+    }
+    return visited;
+}
+
+// tree and find-by-scan throughput: FileNode pointers vs. the compact table
+void benchTraverse(long total)
+{
+    long leaves = total / 10000;
+    if (leaves < 1)
+        leaves = 1;
+
+    FileNode *top = createNode("bench", "", TYPE_FOLDER);
+    if (!top)
+        return;
+
+    double t0 = nowSeconds();
+    char name[32];
+    long created = 1;
+    for (long a = 0; a < 100; a++)
+    {
+        snprintf(name, sizeof(name), "d%ld", a);
+        FileNode *dir = createNode(name, "", TYPE_FOLDER);
+        if (!dir || !insertNode(top, dir))
+            break;
+        created += benchFillTree(dir, 100, leaves) + 1;
+    }
+    printf("built %ld nodes in %.2f s\n", created, nowSeconds() - t0);
+
+    size_t sink = 0;
+    size_t matches = 0;
+    const char *target = "f7";
+    uint32_t targetId = internName(target);
+
+    printf("%-28s %14s\n", "walk", "Mnodes/sec");
+
+    double start = nowSeconds();
+    size_t visited = benchWalkPointers(top, NULL, &sink);
+    printf("%-28s %14.1f\n", "tree, FileNode pointers", visited / (nowSeconds() - start) / 1e6);
+
+    start = nowSeconds();
+    visited = benchWalkTable(top->id, &sink);
+    printf("%-28s %14.1f\n", "tree, node table", visited / (nowSeconds() - start) / 1e6);
+
+    start = nowSeconds();
+    visited = benchWalkPointers(top, target, &matches);
+    printf("%-28s %14.1f  (%zu matches)\n", "find scan, FileNode strcmp", visited / (nowSeconds() - start) / 1e6,
+           matches);
+
+    // Interned names compare as integers; the table is scanned linearly
+    start = nowSeconds();
+    matches = 0;
+    for (uint32_t id = 0; id < nodeTable.count; id++)
+    {
+        matches += (nodeTable.hot[id].name & ~NODE_FOLDER_BIT) == targetId;
+    }
+    printf("%-28s %14.1f  (%zu matches)\n", "find scan, node table", nodeTable.count / (nowSeconds() - start) / 1e6,
+           matches);
+
+    if (sink == 42)
+        printf("\n");
+    releaseName(targetId);
+    nodePoolDestroy();
+}
+
+// Save a synthetic tree to an image and time loading it back
+void benchImage(long total, const char *path)
+{
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    if (!top)
+        return;
+    nameIndexAdd(top);
+
+    long filesPerDir = 100;
+    long dirs = total / (filesPerDir + 1);
+    double start = nowSeconds();
+    long created = benchFillTree(top, dirs > 0 ? dirs : 1, filesPerDir) + 1;
+    printf("built %ld nodes in %.2f s\n", created, nowSeconds() - start);
+
+    start = nowSeconds();
+    int saved = saveImage(top, path);
+    printf("save: %.1f ms\n", (nowSeconds() - start) * 1000);
+    freeTree(top);
+
+    if (saved)
+    {
+        start = nowSeconds();
+        FileNode *loaded = loadImage(path);
+        printf("load: %.1f ms (%.0f nodes/sec)\n", (nowSeconds() - start) * 1000,
+               created / (nowSeconds() - start));
+        if (loaded)
+            freeTree(loaded);
+        remove(path);
+    }
+    nodePoolDestroy();
+}
+
+// Mutation throughput at each journal durability level
+void benchJournal(long ops, const char *path)
+{
+    struct
+    {
+        const char *label;
+        int journaled;
+        int syncEvery;
+        int syncMillis;
+    } levels[] = {
+        {"no journal", 0, 0, 0},
+        {"journal, no fsync", 1, 0, 0},
+        {"group commit 10 ms", 1, 0, 10},
+        {"group commit 64 ops", 1, 64, 0},
+        {"fsync every op", 1, 1, 0},
+    };
+
+    printf("%-22s %12s %10s %10s\n", "durability", "ops/sec", "fsyncs", "ops");
+    for (size_t level = 0; level < sizeof(levels) / sizeof(levels[0]); level++)
+    {
+        FileNode *top = createNode("root", "", TYPE_FOLDER);
+        if (!top)
+            return;
+        nameIndexAdd(top);
+
+        remove(path);
+        journal.syncEvery = levels[level].syncEvery;
+        journal.syncMillis = levels[level].syncMillis;
+        journal.syncs = 0;
+        if (levels[level].journaled && !journalOpen(path))
+            return;
+
+        // fsync-per-op is slow enough that a smaller run says the same thing
+        long count = levels[level].syncEvery == 1 && ops > 2000 ? 2000 : ops;
+        char name[32];
+        double start = nowSeconds();
+        for (long i = 0; i < count; i++)
+        {
+            snprintf(name, sizeof(name), "f%ld", i / 2);
+            if (i % 2 == 0)
+                fsCreate(top, name, TYPE_FILE);
+            else
+                fsWrite(top, name, "payload", 7, 1);
+        }
+        journalClose();
+        double elapsed = nowSeconds() - start;
+
+        printf("%-22s %12.0f %10lu %10ld\n", levels[level].label, count / elapsed, journal.syncs, count);
+        freeTree(top);
+    }
+    remove(path);
+    nodePoolDestroy();
+}
+
+// Resolve a deep path repeatedly, walking every component vs. through the path cache
+void benchPaths(long depth, long lookups)
+{
+    FileNode *root = createNode("root", "", TYPE_FOLDER);
+    if (!root)
+        return;
+    nameIndexAdd(root);
+
+    // A chain /d0/d1/.../f with a few siblings at each level so lookups are real probes
+    char name[32];
+    char *path = (char *)malloc((size_t)depth * 16 + 32);
+    size_t length = 0;
+    FileNode *dir = root;
+    for (long level = 0; path && level < depth; level++)
+    {
+        for (int sibling = 0; sibling < 8; sibling++)
+        {
+            snprintf(name, sizeof(name), "d%ld_%d", level, sibling);
+            fsCreate(dir, name, TYPE_FOLDER);
+        }
+        snprintf(name, sizeof(name), "d%ld_0", level);
+        dir = findChild(dir, name);
+        length += (size_t)sprintf(path + length, "/%s", name);
+    }
+    if (!path || !dir || !fsCreate(dir, "f", TYPE_FILE))
+    {
+        free(path);
+        freeTree(root);
+        return;
+    }
+    strcpy(path + length, "/f");
+
+    printf("%-18s %14s %14s %14s\n", "mode", "lookups/sec", "ns/lookup", "ns/component");
+    for (int cached = 0; cached <= 1; cached++)
+    {
+        long hits = 0;
+        size_t pathLength = strlen(path);
+        double start = nowSeconds();
+        for (long i = 0; i < lookups; i++)
+        {
+            FileNode *found = cached ? resolvePath(root, root, path) : walkPath(root, path, pathLength);
+            hits += found != NULL;
+        }
+        double elapsed = nowSeconds() - start;
+        printf("%-18s %14.0f %14.1f %14.1f%s\n", cached ? "path cache" : "per component", lookups / elapsed,
+               elapsed * 1e9 / lookups, elapsed * 1e9 / lookups / (depth + 1), hits == lookups ? "" : " (misses!)");
+    }
+    printf("path depth %ld, %zu bytes\n", depth + 1, strlen(path));
+
+    free(path);
+    freeTree(root);
+    nodePoolDestroy();
+}
+
+// du, grep and teardown time at 1, 2, 4 ... maxThreads workers
+void benchParallel(long total, int maxThreads)
+{
+    long filesPerDir = 100;
+    long dirs = total / (filesPerDir + 1);
+    if (dirs < 1)
+        dirs = 1;
+    if (maxThreads < 1)
+        maxThreads = walkThreads();
+    if (maxThreads > MAX_WALK_THREADS)
+        maxThreads = MAX_WALK_THREADS;
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    if (!sink)
+        return;
+
+    // Start the pool at full size once; smaller runs leave the extra workers idle
+    workerPoolStart(maxThreads);
+
+    printf("%8s %12s %12s %12s   (%ld nodes, %d workers available)\n", "threads", "du ms", "grep ms",
+           "teardown ms", dirs * (filesPerDir + 1), workerPool.started + 1);
+    for (int threads = 1;; threads *= 2)
+    {
+        if (threads > maxThreads)
+            threads = maxThreads;
+        workerPool.threads = threads;
+
+        FileNode *top = createNode("root", "", TYPE_FOLDER);
+        if (!top)
+            break;
+        nameIndexAdd(top);
+        benchFillTree(top, dirs, filesPerDir);
+        for (FileNode *dir = top->fChild; dir; dir = dir->nSibling)
+        {
+            for (FileNode *file = dir->fChild; file; file = file->nSibling)
+            {
+                contentAppend(file, "lorem ipsum dolor sit amet\nconsectetur adipiscing elit\n", 55);
+                if (file->nameHash % 1000 == 0)
+                    contentAppend(file, "needle in the haystack\n", 23);
+            }
+        }
+
+        double start = nowSeconds();
+        diskUsageWalk(top, "/", sink);
+        double duTime = nowSeconds() - start;
+        start = nowSeconds();
+        GrepOptions grep = {"needle", 1, 1, GREP_LINES};
+        grepTree(top, &grep, sink);
+        double grepTime = nowSeconds() - start;
+        start = nowSeconds();
+        freeTreeParallel(top);
+        double teardownTime = nowSeconds() - start;
+
+        printf("%8d %12.1f %12.1f %12.1f\n", threads, duTime * 1e3, grepTime * 1e3, teardownTime * 1e3);
+        if (threads == maxThreads)
+            break;
+    }
+    fclose(sink);
+    nodePoolDestroy();
+}
+
+// Nanosecond clock for per-operation latency; monotonic where the platform offers one
+uint64_t nowNanos(void)
+{
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Count one latency sample
+void histRecord(LatencyHistogram *hist, uint64_t ns)
+{
+    size_t bucket = (size_t)ns;
+    if (ns >= HIST_SUB_BUCKETS)
+    {
+#if defined(__GNUC__)
+        int bits = 63 - __builtin_clzll(ns);
+#else
+        int bits = 63;
+        while (!(ns >> bits))
+            bits--;
+#endif
+        bucket = (size_t)(bits - 3) * HIST_SUB_BUCKETS + (size_t)((ns >> (bits - 4)) & (HIST_SUB_BUCKETS - 1));
+    }
+    hist->counts[bucket]++;
+    hist->total++;
+    hist->sumNs += ns;
+    if (ns > hist->maxNs)
+        hist->maxNs = ns;
+}
+
+// Latency below which the given fraction of samples fall (bucket midpoint)
+uint64_t histPercentile(const LatencyHistogram *hist, double fraction)
+{
+    if (!hist->total)
+        return 0;
+
+    uint64_t rank = (uint64_t)(fraction * (double)hist->total);
+    if (rank >= hist->total)
+        rank = hist->total - 1;
+
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket++)
+    {
+        seen += hist->counts[bucket];
+        if (seen > rank)
+        {
+            if (bucket < HIST_SUB_BUCKETS)
+                return bucket;
+            int bits = (int)(bucket / HIST_SUB_BUCKETS) + 3;
+            uint64_t low = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (bits - 4);
+            uint64_t value = low + ((uint64_t)1 << (bits - 4)) / 2;
+            return value < hist->maxNs ? value : hist->maxNs;
+        }
+    }
+    return hist->maxNs;
+}
+
+// xorshift64* generator, so workloads are reproducible from a seed
+uint64_t benchRandom(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Pick an index in [0, count); with skew Z, a fraction Z of picks land in the hottest 1 - Z of entries
+size_t benchPick(uint64_t *state, size_t count, double skew)
+{
+    double u = (double)(benchRandom(state) >> 11) / 9007199254740992.0;
+    size_t range = count;
+    if (skew > 0.0 && u < skew)
+    {
+        // Rescale u so the hot draw is still uniform within the hot set
+        u /= skew;
+        range = (size_t)((double)count * (1.0 - skew));
+        if (range < 1)
+            range = 1;
+    }
+    size_t index = (size_t)(u * (double)range);
+    return index < count ? index : count - 1;
+}
+
+// Growable array of live nodes the generator draws targets from
+typedef struct NodeList
+{
+    FileNode **items;
+    size_t count;
+    size_t capacity;
+} NodeList;
+
+// Append a node, growing the array geometrically
+int nodeListPush(NodeList *list, FileNode *node)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        FileNode **items = (FileNode **)realloc(list->items, capacity * sizeof(FileNode *));
+        if (!items)
+            return 0;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = node;
+    return 1;
+}
+
+// Build the initial tree for a workload shape; returns 0 on allocation failure
+int workloadPopulate(const Workload *load, FileNode *root, NodeList *dirs, NodeList *files, uint64_t *rng,
+                     unsigned long *serial)
+{
+    char name[32];
+    FileNode *parent = root;
+
+    if (strcmp(load->shape, "wide") == 0)
+    {
+        // Every file in one directory
+        if (!fsCreate(root, "wide", TYPE_FOLDER))
+            return 0;
+        parent = findChild(root, "wide");
+        if (!nodeListPush(dirs, parent))
+            return 0;
+    }
+
+    for (long i = 0; i < load->nodes; i++)
+    {
+        // deep: a chain of directories with a file at each level; tree: 1 in 8 nodes is a directory
+        int folder = 0;
+        if (strcmp(load->shape, "deep") == 0)
+        {
+            folder = i % 2 == 0;
+            parent = dirs->items[dirs->count - 1];
+        }
+        else if (strcmp(load->shape, "tree") == 0)
+        {
+            folder = benchRandom(rng) % 8 == 0;
+            parent = dirs->items[benchPick(rng, dirs->count, 0.0)];
+        }
+
+        snprintf(name, sizeof(name), "%c%lu", folder ? 'd' : 'f', (*serial)++);
+        if (!fsCreate(parent, name, folder ? TYPE_FOLDER : TYPE_FILE))
+            return 0;
+        if (!nodeListPush(folder ? dirs : files, findChild(parent, name)))
+            return 0;
+    }
+    return 1;
+}
+
+// Run one workload and report throughput and latency percentiles per operation type
+int benchWorkload(const Workload *load, const char *format)
+{
+    static const char *opNames[WL_OP_COUNT] = {"mkdir", "touch", "rm", "mv", "find", "cat", "write"};
+    static const char payload[] = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+
+    LatencyHistogram *hists = (LatencyHistogram *)calloc(WL_OP_COUNT + 1, sizeof(LatencyHistogram));
+    NodeList dirs = {NULL, 0, 0};
+    NodeList files = {NULL, 0, 0};
+    FileNode *root = createNode("root", "", TYPE_FOLDER);
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    uint64_t rng = load->seed ? load->seed : 1;
+    unsigned long serial = 0;
+    long errors = 0;
+    int ok = 0;
+
+    if (!hists || !root || !sink)
+        goto done;
+    nameIndexAdd(root);
+    if (!nodeListPush(&dirs, root))
+        goto done;
+
+    double buildStart = nowSeconds();
+    if (!workloadPopulate(load, root, &dirs, &files, &rng, &serial))
+        goto done;
+    double buildSeconds = nowSeconds() - buildStart;
+
+    // Directories that anchor the shape are never removed
+    size_t pinnedDirs = dirs.count;
+    int totalWeight = 0;
+    for (int op = 0; op < WL_OP_COUNT; op++)
+        totalWeight += load->mix[op];
+    if (totalWeight <= 0)
+        goto done;
+
+    char name[32];
+    char path[MAX_PATH_LENGTH];
+    double start = nowSeconds();
+    for (long i = 0; i < load->ops; i++)
+    {
+        int roll = (int)(benchRandom(&rng) % (uint64_t)totalWeight);
+        int op = 0;
+        while (roll >= load->mix[op])
+            roll -= load->mix[op++];
+
+        // Operations on files fall back to creating one when none are left
+        if (!files.count && op != WL_MKDIR)
+            op = WL_TOUCH;
+
+        size_t slot = files.count ? benchPick(&rng, files.count, load->skew) : 0;
+        FileNode *file = files.count ? files.items[slot] : NULL;
+        FileNode *dir = dirs.items[benchPick(&rng, dirs.count, load->skew)];
+        int result = 1;
+        uint64_t began = nowNanos();
+
+        switch (op)
+        {
+        case WL_MKDIR:
+        case WL_TOUCH:
+            snprintf(name, sizeof(name), "%c%lu", op == WL_MKDIR ? 'd' : 'f', serial++);
+            began = nowNanos();
+            result = fsCreate(dir, name, op == WL_MKDIR ? TYPE_FOLDER : TYPE_FILE);
+            break;
+        case WL_RM:
+            // An empty unpinned directory goes instead of the file one time in four
+            if (dirs.count > pinnedDirs && benchRandom(&rng) % 4 == 0)
+            {
+                size_t dirSlot = pinnedDirs + benchPick(&rng, dirs.count - pinnedDirs, load->skew);
+                if (!dirs.items[dirSlot]->fChild)
+                {
+                    dir = dirs.items[dirSlot];
+                    began = nowNanos();
+                    result = fsRemove(dir->parent, dir->fileName, 0);
+                    if (result)
+                        dirs.items[dirSlot] = dirs.items[--dirs.count];
+                    break;
+                }
+            }
+            result = fsRemove(file->parent, file->fileName, 0);
+            if (result)
+                files.items[slot] = files.items[--files.count];
+            break;
+        case WL_MV:
+            result = dir == file->parent || fsMove(file, dir);
+            break;
+        case WL_FIND:
+        {
+            // Same work as the find command: walk the name ring and build each path
+            FileNode *head = nameIndexLookup(file->fileName);
+            for (FileNode *found = head; found; found = found->nameNext == head ? NULL : found->nameNext)
+                nodePath(found, path, sizeof(path));
+            result = head != NULL;
+            break;
+        }
+        case WL_CAT:
+            contentPrint(file, sink);
+            break;
+        case WL_WRITE:
+            result = fsWrite(file->parent, file->fileName, payload, sizeof(payload) - 1, 1);
+            break;
+        }
+
+        uint64_t elapsed = nowNanos() - began;
+        histRecord(&hists[op], elapsed);
+        histRecord(&hists[WL_OP_COUNT], elapsed);
+        errors += !result;
+
+        // New nodes join the target pools
+        if (result && (op == WL_MKDIR || op == WL_TOUCH))
+        {
+            FileNode *created = findChild(dir, name);
+            if (!nodeListPush(op == WL_MKDIR ? &dirs : &files, created))
+                goto done;
+        }
+    }
+    double seconds = nowSeconds() - start;
+    ok = 1;
+
+    // One row per operation type plus an "all" row; latencies in nanoseconds
+    if (strcmp(format, "text") == 0)
+    {
+        printf("workload %s: shape=%s nodes=%ld ops=%ld skew=%.2f build=%.3fs run=%.3fs errors=%ld\n",
+               load->name, load->shape, load->nodes, load->ops, load->skew, buildSeconds, seconds, errors);
+        printf("  %-6s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/sec", "p50 us", "p99 us",
+               "p999 us", "max us");
+    }
+    for (int op = 0; op <= WL_OP_COUNT; op++)
+    {
+        const LatencyHistogram *hist = &hists[op];
+        if (!hist->total)
+            continue;
+
+        const char *label = op == WL_OP_COUNT ? "all" : opNames[op];
+        double rate = op == WL_OP_COUNT ? hist->total / seconds : hist->total / (hist->sumNs / 1e9);
+        uint64_t p50 = histPercentile(hist, 0.50);
+        uint64_t p99 = histPercentile(hist, 0.99);
+        uint64_t p999 = histPercentile(hist, 0.999);
+
+        if (strcmp(format, "csv") == 0)
+        {
+            printf("%s,%s,%lu,%.0f,%lu,%lu,%lu,%lu\n", load->name, label, (unsigned long)hist->total, rate,
+                   (unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)hist->maxNs);
+        }
+        else if (strcmp(format, "json") == 0)
+        {
+            printf("{\"workload\":\"%s\",\"shape\":\"%s\",\"nodes\":%ld,\"skew\":%.2f,\"op\":\"%s\","
+                   "\"count\":%lu,\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+                   "\"max_ns\":%lu}\n",
+                   load->name, load->shape, load->nodes, load->skew, label, (unsigned long)hist->total, rate,
+                   (unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)hist->maxNs);
+        }
+        else
+        {
+            printf("  %-6s %10lu %12.0f %10.2f %10.2f %10.2f %10.2f\n", label, (unsigned long)hist->total, rate,
+                   p50 / 1e3, p99 / 1e3, p999 / 1e3, hist->maxNs / 1e3);
+        }
+    }
+    fflush(stdout);
+
+done:
+    if (!ok)
+        printf("Error: Workload '%s' could not run\n", load->name);
+    if (sink)
+        fclose(sink);
+    if (root)
+        freeTree(root);
+    free(dirs.items);
+    free(files.items);
+    free(hists);
+    nodePoolDestroy();
+    return ok;
+}
+
+// Parse "mkdir=5,touch=20,..." into operation weights
+int parseMix(const char *spec, int mix[WL_OP_COUNT])
+{
+    static const char *opNames[WL_OP_COUNT] = {"mkdir", "touch", "rm", "mv", "find", "cat", "write"};
+
+    for (int op = 0; op < WL_OP_COUNT; op++)
+        mix[op] = 0;
+
+    while (*spec)
+    {
+        size_t length = strcspn(spec, "=");
+        int op = 0;
+        while (op < WL_OP_COUNT && (strlen(opNames[op]) != length || strncmp(spec, opNames[op], length) != 0))
+            op++;
+        if (op == WL_OP_COUNT || spec[length] != '=')
+        {
+            printf("Error: Bad mix entry '%s'\n", spec);
+            return 0;
+        }
+        mix[op] = atoi(spec + length + 1);
+        spec += length + 1;
+        spec += strcspn(spec, ",");
+        if (*spec == ',')
+            spec++;
+    }
+    return 1;
+}
+
+// --bench workload|suite [options]: synthetic trees and operation mixes with latency percentiles
+int benchWorkloads(int suite, int argc, char *argv[])
+{
+    Workload custom = {"custom", "tree", 100000, 1000000, 0.0, {5, 20, 15, 10, 20, 20, 10}, 42};
+    const char *format = "text";
+    long nodes = 0;
+    long ops = 0;
+    int skewSet = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value)
+        {
+            printf("Error: Missing value for '%s'\n", argv[i]);
+            return 1;
+        }
+        else if (strcmp(argv[i], "--shape") == 0)
+        {
+            custom.shape = value;
+        }
+        else if (strcmp(argv[i], "--nodes") == 0)
+        {
+            nodes = atol(value);
+        }
+        else if (strcmp(argv[i], "--ops") == 0)
+        {
+            ops = atol(value);
+        }
+        else if (strcmp(argv[i], "--skew") == 0)
+        {
+            custom.skew = atof(value);
+            skewSet = 1;
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            custom.seed = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--mix") == 0)
+        {
+            if (!parseMix(value, custom.mix))
+                return 1;
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            format = value;
+        }
+        else
+        {
+            printf("Error: Unknown workload option '%s'\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (strcmp(custom.shape, "wide") != 0 && strcmp(custom.shape, "deep") != 0 && strcmp(custom.shape, "tree") != 0)
+    {
+        printf("Error: Shape must be wide, deep or tree\n");
+        return 1;
+    }
+    if (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)
+    {
+        printf("Error: Format must be text, csv or json\n");
+        return 1;
+    }
+    if (custom.skew < 0.0 || custom.skew >= 1.0)
+    {
+        printf("Error: Skew must be in [0, 1)\n");
+        return 1;
+    }
+
+    if (strcmp(format, "csv") == 0)
+        printf("workload,op,count,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+    if (!suite)
+    {
+        if (nodes > 0)
+            custom.nodes = nodes;
+        if (ops > 0)
+            custom.ops = ops;
+        return benchWorkload(&custom, format) ? 0 : 1;
+    }
+
+    // The standard suite; --nodes/--ops/--skew/--seed override every entry
+    Workload suiteLoads[] = {
+        {"wide-lookup", "wide", 1000000, 1000000, 0.0, {0, 10, 10, 0, 40, 40, 0}, 42},
+        {"wide-churn", "wide", 100000, 1000000, 0.0, {0, 45, 45, 0, 5, 5, 0}, 42},
+        {"deep-chain", "deep", 20000, 200000, 0.0, {5, 20, 15, 10, 20, 20, 10}, 42},
+        {"tree-uniform", "tree", 200000, 1000000, 0.0, {5, 20, 15, 10, 20, 20, 10}, 42},
+        {"tree-skewed", "tree", 200000, 1000000, 0.99, {5, 20, 15, 10, 20, 20, 10}, 42},
+        {"tree-writes", "tree", 200000, 1000000, 0.9, {0, 5, 5, 0, 0, 30, 60}, 42},
+    };
+    int status = 0;
+    for (size_t i = 0; i < sizeof(suiteLoads) / sizeof(suiteLoads[0]); i++)
+    {
+        Workload load = suiteLoads[i];
+        if (nodes > 0)
+            load.nodes = nodes;
+        if (ops > 0)
+            load.ops = ops;
+        if (skewSet)
+            load.skew = custom.skew;
+        load.seed = custom.seed;
+        if (!benchWorkload(&load, format))
+            status = 1;
+    }
+    return status;
+}
+
+#ifndef _WIN32
+// Body of one load-test client: reads hit shared files, writes mix overwrites of shared files with
+// create/remove/move of the client's own files, so a correct server answers every request without error
+void *benchServerClient(void *arg)
+{
+    LoadClient *client = (LoadClient *)arg;
+    int fd = serverConnect(client->socketPath);
+    if (fd < 0)
+    {
+        client->failed = 1;
+        return NULL;
+    }
+
+    const char *base = client->base;
+    long ownSeq[LOAD_OWN_FILES];
+    int ownDir[LOAD_OWN_FILES];
+    int ownHead = 0;
+    int ownCount = 0;
+    long nextSeq = 0;
+    char line[512];
+
+    for (long i = 0; i < client->ops; i++)
+    {
+        uint64_t r = benchRandom(&client->seed);
+        int dir = (int)(r % LOAD_DIRS);
+        int file = (int)((r >> 8) % LOAD_FILES);
+        int kind = (int)((r >> 16) % 10);
+        int read = (int)((r >> 24) % 100) < client->readPercent;
+
+        if (read)
+        {
+            if (kind < 4)
+                snprintf(line, sizeof(line), "cat %s/d%d/f%d\n", base, dir, file);
+            else if (kind < 7)
+                snprintf(line, sizeof(line), "ls -l %s/d%d\n", base, dir);
+            else if (kind < 9)
+                snprintf(line, sizeof(line), "find f%d\n", file);
+            else
+                snprintf(line, sizeof(line), "tree %s/d%d\n", base, dir);
+        }
+        else if (kind < 4)
+        {
+            snprintf(line, sizeof(line), "echo client %d wrote %ld > %s/d%d/f%d\n", client->id, i, base, dir, file);
+        }
+        else if ((kind < 7 && ownCount < LOAD_OWN_FILES) || !ownCount)
+        {
+            int slot = (ownHead + ownCount++) % LOAD_OWN_FILES;
+            ownSeq[slot] = nextSeq++;
+            ownDir[slot] = dir;
+            snprintf(line, sizeof(line), "touch %s/d%d/c%d_%ld\n", base, dir, client->id, ownSeq[slot]);
+        }
+        else if (kind < 9)
+        {
+            snprintf(line, sizeof(line), "rm %s/d%d/c%d_%ld\n", base, ownDir[ownHead], client->id, ownSeq[ownHead]);
+            ownHead = (ownHead + 1) % LOAD_OWN_FILES;
+            ownCount--;
+        }
+        else
+        {
+            if (dir == ownDir[ownHead])
+                dir = (dir + 1) % LOAD_DIRS;
+            snprintf(line, sizeof(line), "mv %s/d%d/c%d_%ld %s/d%d\n", base, ownDir[ownHead], client->id,
+                     ownSeq[ownHead], base, dir);
+            ownDir[ownHead] = dir;
+        }
+
+        int error = 0;
+        uint64_t began = nowNanos();
+        if (serverRequest(fd, line, NULL, &error) < 0)
+        {
+            client->failed = 1;
+            break;
+        }
+        histRecord(&client->latency, nowNanos() - began);
+        client->reads += read;
+        client->writes += !read;
+        client->errors += error;
+    }
+    close(fd);
+    return NULL;
+}
+
+// Accept loop of the in-process server started by --bench server
+void *benchServerThread(void *arg)
+{
+    Shell *shell = (Shell *)arg;
+    shellOut = stdout;
+    serverAccept(shell, server.listenFd);
+    return NULL;
+}
+#endif
+
+// Aggregate throughput of 1, 2, 4 ... maxClients concurrent sessions. Without a socket path the
+// benchmark serves a fresh tree in-process; with one it drives an already running --server.
+int benchServer(int maxClients, long ops, int readPercent, const char *socketPath)
+{
+#ifdef _WIN32
+    (void)maxClients;
+    (void)ops;
+    (void)readPercent;
+    (void)socketPath;
+    printf("Error: --bench server needs Unix domain sockets\n");
+    return 1;
+#else
+    if (maxClients < 1)
+        maxClients = 1;
+    if (readPercent < 0 || readPercent > 100)
+        readPercent = 80;
+
+    char path[108];
+    char base[64];
+    Shell shell;
+    pthread_t acceptThread;
+    int local = !socketPath;
+    snprintf(base, sizeof(base), local ? "/load" : "/load%ld", (long)getpid());
+    if (local)
+    {
+        snprintf(path, sizeof(path), "/tmp/ufs-bench-%ld.sock", (long)getpid());
+        socketPath = path;
+        memset(&shell, 0, sizeof(shell));
+        shell.root = createNode("root", "", TYPE_FOLDER);
+        if (!shell.root)
+            return 1;
+        nameIndexAdd(shell.root);
+        shell.current = shell.root;
+        if (serverListen(socketPath) < 0)
+            return 1;
+        if (pthread_create(&acceptThread, NULL, benchServerThread, &shell) != 0)
+            return 1;
+    }
+
+    // Lay out the shared directories and files over one connection
+    int fd = serverConnect(socketPath);
+    if (fd < 0)
+    {
+        printf("Error: Cannot connect to '%s'\n", socketPath);
+        return 1;
+    }
+    char line[256];
+    int error = 0;
+    snprintf(line, sizeof(line), "mkdir %s", base);
+    serverRequest(fd, line, NULL, &error);
+    for (int d = 0; d < LOAD_DIRS && !error; d++)
+    {
+        snprintf(line, sizeof(line), "mkdir %s/d%d", base, d);
+        serverRequest(fd, line, NULL, &error);
+        for (int f = 0; f < LOAD_FILES && !error; f++)
+        {
+            snprintf(line, sizeof(line), "echo shared file %d of directory %d > %s/d%d/f%d", f, d, base, d, f);
+            serverRequest(fd, line, NULL, &error);
+        }
+    }
+    close(fd);
+    if (error)
+    {
+        printf("Error: Cannot set up %s on the server\n", base);
+        return 1;
+    }
+
+    printf("%8s %12s %12s %12s %10s %10s %8s   (%d%% reads, %d x %d shared files)\n", "clients", "ops/s",
+           "reads/s", "writes/s", "p50 us", "p99 us", "errors", readPercent, LOAD_DIRS, LOAD_FILES);
+    LoadClient *clients = (LoadClient *)calloc((size_t)maxClients, sizeof(LoadClient));
+    pthread_t *threads = (pthread_t *)calloc((size_t)maxClients, sizeof(pthread_t));
+    int status = clients && threads ? 0 : 1;
+    for (int count = 1; !status; count *= 2)
+    {
+        if (count > maxClients)
+            count = maxClients;
+
+        memset(clients, 0, (size_t)count * sizeof(LoadClient));
+        double start = nowSeconds();
+        for (int i = 0; i < count; i++)
+        {
+            clients[i].socketPath = socketPath;
+            clients[i].base = base;
+            clients[i].id = i;
+            clients[i].ops = ops / count;
+            clients[i].readPercent = readPercent;
+            clients[i].seed = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1) + (uint64_t)count;
+            clients[i].started = pthread_create(&threads[i], NULL, benchServerClient, &clients[i]) == 0;
+            clients[i].failed = !clients[i].started;
+        }
+
+        LatencyHistogram latency;
+        memset(&latency, 0, sizeof(latency));
+        long reads = 0;
+        long writes = 0;
+        long errors = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (clients[i].started)
+                pthread_join(threads[i], NULL);
+            status |= clients[i].failed;
+            reads += clients[i].reads;
+            writes += clients[i].writes;
+            errors += clients[i].errors;
+            for (int b = 0; b < HIST_BUCKETS; b++)
+            {
+                latency.counts[b] += clients[i].latency.counts[b];
+            }
+            latency.total += clients[i].latency.total;
+            latency.sumNs += clients[i].latency.sumNs;
+            if (clients[i].latency.maxNs > latency.maxNs)
+                latency.maxNs = clients[i].latency.maxNs;
+        }
+        double elapsed = nowSeconds() - start;
+
+        printf("%8d %12.0f %12.0f %12.0f %10.1f %10.1f %8ld\n", count, (reads + writes) / elapsed, reads / elapsed,
+               writes / elapsed, histPercentile(&latency, 0.50) / 1e3, histPercentile(&latency, 0.99) / 1e3, errors);
+        fflush(stdout);
+        if (count == maxClients)
+            break;
+    }
+    if (status)
+        printf("Error: A client lost its connection\n");
+    free(clients);
+    free(threads);
+
+    if (local)
+    {
+        // Stop accepting, then let the sessions see their clients hang up before freeing the tree
+        server.stopping = 1;
+        shutdown(server.listenFd, SHUT_RDWR);
+        pthread_join(acceptThread, NULL);
+        close(server.listenFd);
+        unlink(socketPath);
+        while (sharedCounterAdd(&server.sessions, 0))
+        {
+            sched_yield();
+        }
+        nodePoolDestroy();
+    }
+    return status;
+#endif
+}
+
+// Substring kernel and grep throughput over a synthetic text corpus of about megabytes MB
+void benchGrep(long megabytes)
+{
+    static const char *words[] = {"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "with",
+                                  "was", "on", "be", "at", "by", "this", "had", "not", "are", "but",
+                                  "from", "or", "have", "an", "they", "which", "one", "you", "were", "her",
+                                  "all", "she", "there", "would", "their", "we", "him", "been", "has"};
+    size_t wordCount = sizeof(words) / sizeof(words[0]);
+    size_t fileSize = 64 * 1024;
+    long files = megabytes > 0 ? megabytes * 16 : 16;
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    FileNode *top = createNode("corpus", "", TYPE_FOLDER);
+    char *text = (char *)malloc(fileSize + 64);
+    if (!sink || !top || !text)
+    {
+        printf("Error: Memory allocation failed\n");
+        return;
+    }
+
+    // Lines of common words; one file in 50 gets a line with "needle" in it
+    uint64_t seed = 7;
+    FileNode *dir = NULL;
+    char name[32];
+    size_t bytes = 0;
+    for (long i = 0; i < files; i++)
+    {
+        if (i % 64 == 0)
+        {
+            snprintf(name, sizeof(name), "d%ld", i / 64);
+            dir = createNode(name, "", TYPE_FOLDER);
+            if (!dir || !insertNode(top, dir))
+                break;
+        }
+        size_t used = 0;
+        size_t lineStart = 0;
+        int planted = i % 50 != 0;
+        while (used < fileSize)
+        {
+            const char *word = words[benchRandom(&seed) % wordCount];
+            if (!planted && used >= fileSize / 2)
+            {
+                word = "needle";
+                planted = 1;
+            }
+            size_t length = strlen(word);
+            memcpy(text + used, word, length);
+            used += length;
+            int lineEnd = used - lineStart > 60;
+            text[used++] = lineEnd ? '\n' : ' ';
+            if (lineEnd)
+                lineStart = used;
+        }
+        snprintf(name, sizeof(name), "f%ld", i);
+        FileNode *file = createNode(name, "", TYPE_FILE);
+        if (!file || !contentWrite(file, text, used) || !insertNode(dir, file))
+            break;
+        bytes += used;
+    }
+    printf("corpus: %ld files, %.1f MB, kernel in use: %s\n", files, bytes / 1e6, searchKernelName);
+
+    // Each kernel alone, counting every occurrence on one thread. Files are sealed into chunks, so each
+    // piece is scanned in place and the last 5 bytes before every seam are joined to the next piece's first 5.
+    ContentPieces pieces;
+    printf("%-12s %10s %10s\n", "kernel", "GB/s", "hits");
+    for (size_t k = 0; k < SEARCH_KERNEL_COUNT; k++)
+    {
+        if (!searchKernelSupported(k))
+            continue;
+        size_t hits = 0;
+        double start = nowSeconds();
+        for (FileNode *node = top; node; node = nextPreorder(top, node))
+        {
+            if (node->type != TYPE_FILE)
+                continue;
+            char seam[10];
+            size_t kept = 0;
+            size_t length;
+            const char *data;
+            contentPiecesStart(&pieces, node);
+            while ((data = contentPiecesNext(&pieces, &length)))
+            {
+                const char *end = data + length;
+                for (const char *at = data; (at = searchKernels[k].find(at, (size_t)(end - at), "needle", 6)); at++)
+                {
+                    hits++;
+                }
+                size_t joined = length < 5 ? length : 5;
+                memcpy(seam + kept, data, joined);
+                if (kept && searchKernels[k].find(seam, kept + joined, "needle", 6))
+                    hits++;
+                if (length >= 5)
+                {
+                    memcpy(seam, end - 5, 5);
+                    kept = 5;
+                }
+                else if ((kept += joined) > 5)
+                {
+                    memmove(seam, seam + kept - 5, 5);
+                    kept = 5;
+                }
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        printf("%-12s %10.2f %10zu\n", searchKernels[k].name, elapsed > 0 ? bytes / elapsed / 1e9 : 0.0, hits);
+    }
+
+    // Whole grep -rc: a literal, a regex with a required literal, and one with none
+    static const char *patterns[] = {"needle", "ne+dl[a-z]", "[0-9][0-9]"};
+    printf("%-18s %10s %10s %10s   (%d threads)\n", "grep -rc", "ms", "GB/s", "lines", walkThreads());
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        GrepOptions options = {patterns[p], 1, 0, GREP_COUNT};
+        double start = nowSeconds();
+        long lines = grepTree(top, &options, sink);
+        double elapsed = nowSeconds() - start;
+        printf("%-18s %10.1f %10.2f %10ld\n", patterns[p], elapsed * 1e3, elapsed > 0 ? bytes / elapsed / 1e9 : 0.0,
+               lines);
+    }
+
+    free(text);
+    fclose(sink);
+    freeTree(top);
+    nodePoolDestroy();
+}
+
+// find-style glob queries: a full walk testing every node vs. findGlob, which seeks the literal prefix
+// in the name order (unanchored patterns walk in both columns)
+void benchGlob(long total)
+{
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    if (!top)
+        return;
+    nameIndexAdd(top);
+
+    // Logs by year, images and temp files with unique names, and one index.html per directory
+    char name[64];
+    long created = 0;
+    FileNode *dir = NULL;
+    for (long i = 0; created < total; i++)
+    {
+        if (i % 100 == 0)
+        {
+            snprintf(name, sizeof(name), "dir_%ld", i / 100);
+            dir = createNode(name, "", TYPE_FOLDER);
+            if (!dir || !insertNode(top, dir))
+                break;
+            created++;
+        }
+        if (i % 100 == 99)
+            snprintf(name, sizeof(name), "index.html");
+        else if (i % 3 == 0)
+            snprintf(name, sizeof(name), "log_%ld_%ld.txt", 2000 + i % 25, i);
+        else if (i % 3 == 1)
+            snprintf(name, sizeof(name), "img_%ld.png", i);
+        else
+            snprintf(name, sizeof(name), "data_%ld.tmp", i);
+        FileNode *file = createNode(name, "", TYPE_FILE);
+        if (!file || !insertNode(dir, file))
+            break;
+        created++;
+    }
+    printf("%ld nodes, %zu distinct names\n", created + 1, nameOrder.count);
+
+    static const char *patterns[] = {"log_2024*", "log_2024_1?.txt", "img_99*", "*.tmp", "index.*", "*_7?.png"};
+    int rounds = 5;
+    printf("%-18s %12s %12s %10s %10s\n", "pattern", "walk ms", "indexed ms", "speedup", "matches");
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        Regex glob;
+        if (!globCompile(&glob, patterns[p]))
+        {
+            regexFree(&glob);
+            break;
+        }
+
+        size_t walked = 0;
+        double start = nowSeconds();
+        for (int r = 0; r < rounds; r++)
+        {
+            walked = 0;
+            for (FileNode *node = top; node; node = nextPreorder(top, node))
+            {
+                walked += globMatch(&glob, node->fileName);
+            }
+        }
+        double walkTime = (nowSeconds() - start) / rounds;
+
+        size_t indexed = 0;
+        start = nowSeconds();
+        for (int r = 0; r < rounds; r++)
+        {
+            indexed = findGlob(top, &glob, NULL);
+        }
+        double indexTime = (nowSeconds() - start) / rounds;
+
+        printf("%-18s %12.3f %12.3f %9.1fx %10zu%s\n", patterns[p], walkTime * 1e3, indexTime * 1e3,
+               indexTime > 0 ? walkTime / indexTime : 0.0, indexed, walked == indexed ? "" : " (mismatch!)");
+        regexFree(&glob);
+    }
+
+    freeTree(top);
+    nodePoolDestroy();
+}
+
+// Snapshot cost on a tree of total nodes: a full copy for comparison, the first snapshot, then
+// snapshots and diffs after one write each, and a restore
+void benchSnapshot(long total)
+{
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    FileNode **files = (FileNode **)malloc((size_t)(total > 0 ? total : 1) * sizeof(FileNode *));
+    if (!sink || !top || !files)
+    {
+        printf("Error: Memory allocation failed\n");
+        return;
+    }
+    nameIndexAdd(top);
+
+    // Directories of 100 files with 64 bytes each
+    char name[32];
+    char data[64];
+    memset(data, 'x', sizeof(data));
+    long fileCount = 0;
+    long created = 0;
+    FileNode *dir = NULL;
+    for (long i = 0; created < total; i++)
+    {
+        if (i % 100 == 0)
+        {
+            snprintf(name, sizeof(name), "dir_%ld", i / 100);
+            dir = createNode(name, "", TYPE_FOLDER);
+            if (!dir || !insertNode(top, dir))
+                break;
+            created++;
+        }
+        snprintf(name, sizeof(name), "file_%ld", i);
+        FileNode *file = createNode(name, "", TYPE_FILE);
+        if (!file || !contentWrite(file, data, sizeof(data)) || !insertNode(dir, file))
+            break;
+        files[fileCount++] = file;
+        created++;
+    }
+    printf("%ld nodes\n", created + 1);
+
+    double start = nowSeconds();
+    FileNode *copy = copyTree(top, "copy");
+    printf("%-28s %12.3f ms\n", "full copy (cp -r)", (nowSeconds() - start) * 1e3);
+    freeTree(copy);
+
+    start = nowSeconds();
+    Snapshot *first = snapshotCreate(top);
+    if (!first)
+        return;
+    printf("%-28s %12.3f ms   %zu versions built\n", "first snapshot", (nowSeconds() - start) * 1e3,
+           snapshots.built);
+
+    start = nowSeconds();
+    Snapshot *again = snapshotCreate(top);
+    printf("%-28s %12.3f us   %zu versions built\n", "snapshot, no changes", (nowSeconds() - start) * 1e6,
+           snapshots.built);
+    snapshotDelete(again, top);
+
+    // One write, one snapshot, one diff against the previous snapshot
+    int rounds = 1000;
+    uint64_t seed = 11;
+    double createTime = 0;
+    double diffTime = 0;
+    size_t built = 0;
+    Snapshot *previous = first;
+    for (int r = 0; r < rounds && fileCount; r++)
+    {
+        contentAppend(files[benchRandom(&seed) % (uint64_t)fileCount], data, 8);
+        start = nowSeconds();
+        Snapshot *next = snapshotCreate(top);
+        createTime += nowSeconds() - start;
+        if (!next)
+            break;
+        built += snapshots.built;
+        start = nowSeconds();
+        snapshotDiff(previous->root, next->root, sink);
+        diffTime += nowSeconds() - start;
+        previous = next;
+    }
+    printf("%-28s %12.3f us   %.1f versions built\n", "snapshot after 1 write", createTime / rounds * 1e6,
+           (double)built / rounds);
+    printf("%-28s %12.3f us\n", "diff of consecutive", diffTime / rounds * 1e6);
+
+    start = nowSeconds();
+    snapshotDiff(first->root, previous->root, sink);
+    printf("%-28s %12.3f ms\n", "diff first..last", (nowSeconds() - start) * 1e3);
+    printf("%-28s %12zu   (%zu snapshots, %zu bytes each)\n", "versions alive", snapshots.versions, snapshots.count,
+           sizeof(SnapNode));
+
+    start = nowSeconds();
+    FileNode *restored = snapshotRestore(first);
+    printf("%-28s %12.3f ms\n", "restore first", (nowSeconds() - start) * 1e3);
+    freeTree(restored);
+
+    free(files);
+    fclose(sink);
+    freeTree(top);
+    nodePoolDestroy();
+}
+
+// Startup cost and resident nodes of a lazily opened image against a full load, then a walk over random
+// directories with and without a memory budget
+void benchLazy(long total, const char *path)
+{
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    if (!top)
+        return;
+    nameIndexAdd(top);
+    long filesPerDir = 100;
+    long dirs = total / (filesPerDir + 1);
+    dirs = dirs > 0 ? dirs : 1;
+    long created = benchFillTree(top, dirs, filesPerDir) + 1;
+    int saved = saveImage(top, path);
+    freeTree(top);
+    if (!saved)
+        return;
+    printf("%ld nodes in %ld directories\n", created, dirs);
+
+    double start = nowSeconds();
+    FileNode *loaded = loadImage(path);
+    printf("%-28s %12.3f ms   %zu nodes resident\n", "full load", (nowSeconds() - start) * 1e3,
+           nodePool.liveNodes);
+    freeTree(loaded);
+
+    start = nowSeconds();
+    FileNode *root = lazyOpen(path);
+    if (!root)
+        return;
+    printf("%-28s %12.3f ms   %zu nodes resident\n", "lazy open", (nowSeconds() - start) * 1e3, nodePool.liveNodes);
+
+    // Each visit resolves one file in a random directory, as cat d<n>/f<m> would
+    int visits = 1000;
+    char name[32];
+    uint64_t seed = 7;
+    size_t nodeBytes = lazyResident() / nodePool.liveNodes;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t loads = lazy.loads;
+        size_t evictions = lazy.evictions;
+        size_t peak = 0;
+        lazy.budget = pass ? (size_t)(dirs + 20 * (filesPerDir + 1)) * nodeBytes : 0;
+        start = nowSeconds();
+        for (int v = 0; v < visits; v++)
+        {
+            snprintf(name, sizeof(name), "d%lu", (unsigned long)(benchRandom(&seed) % (uint64_t)dirs));
+            FileNode *dir = findChild(root, name);
+            snprintf(name, sizeof(name), "f%lu", (unsigned long)(benchRandom(&seed) % (uint64_t)filesPerDir));
+            if (!dir || !findChild(dir, name))
+                break;
+            lazyTrim(root, root);
+            peak = nodePool.liveNodes > peak ? nodePool.liveNodes : peak;
+        }
+        printf("%-28s %12.3f us   %zu loads, %zu evictions, peak %zu nodes\n",
+               pass ? "visit, 20-directory budget" : "visit, no budget", (nowSeconds() - start) / visits * 1e6,
+               lazy.loads - loads, lazy.evictions - evictions, peak);
+    }
+
+    // Saving copies the unloaded directories' records straight from the old image
+    char copyPath[MAX_PATH_LENGTH];
+    snprintf(copyPath, sizeof(copyPath), "%s.copy", path);
+    start = nowSeconds();
+    saveImage(root, copyPath);
+    printf("%-28s %12.3f ms   %zu nodes resident\n", "save from lazy tree", (nowSeconds() - start) * 1e3,
+           nodePool.liveNodes);
+
+    freeTree(root);
+    remove(copyPath);
+    remove(path);
+    nodePoolDestroy();
+}
+
+// Export a tree of small files to a tar file and a host directory, then import each back
+void benchTransfer(long total, const char *path)
+{
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    if (!top)
+        return;
+    nameIndexAdd(top);
+    long filesPerDir = 100;
+    long dirs = total / (filesPerDir + 1);
+    dirs = dirs > 0 ? dirs : 1;
+    long created = benchFillTree(top, dirs, filesPerDir);
+    char data[256];
+    uint64_t seed = 11;
+    for (FileNode *node = top; node; node = nextPreorder(top, node))
+    {
+        if (node->type != TYPE_FILE)
+            continue;
+        size_t length = 16 + benchRandom(&seed) % (sizeof(data) - 16);
+        memset(data, 'a' + (int)(length % 26), length);
+        contentWrite(node, data, length);
+    }
+    totalsRebuild(top);
+    printf("%ld nodes in %ld directories, %zu bytes\n", created, dirs, top->totals.bytes);
+
+    // Timings go to stdout; the commands' own summaries are not needed
+    FILE *saved = shellOut;
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    if (sink)
+        shellOut = sink;
+    char tarPath[MAX_PATH_LENGTH];
+    snprintf(tarPath, sizeof(tarPath), "%s.tar", path);
+    const char *targets[] = {tarPath, path};
+    int kinds = 2;
+#ifdef _WIN32
+    kinds = 1;
+#endif
+    for (int kind = 0; kind < kinds; kind++)
+    {
+        TransferCounts counts = {0};
+        double start = nowSeconds();
+        int ok = exportTree(top, targets[kind], &counts);
+        double exported = nowSeconds() - start;
+
+        FileNode *into = createNode("root", "", TYPE_FOLDER);
+        TransferCounts back = {0};
+        start = nowSeconds();
+        ok = ok && into && importTree(targets[kind], into, &back);
+        double imported = nowSeconds() - start;
+        if (ok)
+        {
+            printf("%-28s %12.3f ms   %zu files\n", kind ? "export, host directory" : "export, tar", exported * 1e3,
+                   counts.files);
+            printf("%-28s %12.3f ms   %zu files, %s\n", kind ? "import, host directory" : "import, tar",
+                   imported * 1e3, back.files, into->totals.bytes == top->totals.bytes ? "bytes match" : "MISMATCH");
+        }
+        else
+        {
+            printf("%-28s failed\n", targets[kind]);
+        }
+
+#ifndef _WIN32
+        // Remove the exported host tree deepest entries first
+        if (kind && into)
+        {
+            size_t count = 0;
+            FileNode **order = (FileNode **)malloc((size_t)(created + 1) * sizeof(FileNode *));
+            for (FileNode *node = into; order && node && count <= (size_t)created; node = nextPreorder(into, node))
+                order[count++] = node;
+            char hostPath[MAX_PATH_LENGTH];
+            while (order && count)
+            {
+                if (hostPathOf(path, into, order[--count], hostPath, sizeof(hostPath)) >= 0)
+                    remove(hostPath);
+            }
+            free(order);
+        }
+#endif
+        if (into)
+            freeTree(into);
+    }
+    shellOut = saved;
+    if (sink)
+        fclose(sink);
+
+    freeTree(top);
+    remove(tarPath);
+    nodePoolDestroy();
+}
+
+// Write near-identical files (one of a few templates with a per-file header) with plain extents,
+// deduplicated chunks, and chunks compressed once cold, then read them all back
+void benchDedup(long files)
+{
+    const size_t templateCount = 16;
+    const size_t templateSize = 16 * 1024;
+    char *templates = (char *)malloc(templateCount * templateSize);
+    char *buffer = (char *)malloc(templateSize + 64);
+    FileNode *top = createNode("root", "", TYPE_FOLDER);
+    if (!templates || !buffer || !top)
+    {
+        free(templates);
+        free(buffer);
+        return;
+    }
+
+    // Templates are text built from a small vocabulary, so they compress like logs or configs do
+    static const char *words[] = {"alpha", "beta", "gamma", "delta", "error", "warning", "info", "request",
+                                  "user", "session", "timeout", "retry", "connect", "close", "read", "write"};
+    uint64_t seed = 5;
+    for (size_t t = 0; t < templateCount; t++)
+    {
+        char *text = templates + t * templateSize;
+        size_t used = 0;
+        while (used < templateSize)
+        {
+            const char *word = words[benchRandom(&seed) % (sizeof(words) / sizeof(words[0]))];
+            size_t length = strlen(word);
+            for (size_t i = 0; i < length && used < templateSize; i++)
+                text[used++] = word[i];
+            if (used < templateSize)
+                text[used++] = benchRandom(&seed) % 8 ? ' ' : '\n';
+        }
+    }
+
+    char name[32];
+    for (long f = 0; f < files; f++)
+    {
+        snprintf(name, sizeof(name), "f%ld", f);
+        FileNode *file = createNode(name, "", TYPE_FILE);
+        if (!file || !insertNode(top, file))
+            return;
+    }
+
+    printf("%ld files of %zu KB from %zu templates, each with its own first line\n", files, templateSize / 1024,
+           templateCount);
+    printf("%-24s %10s %10s %12s %12s %10s\n", "mode", "write ms", "MB/s", "memory MB", "read ms", "MB/s");
+    const char *modes[] = {"extents (no dedup)", "dedup", "dedup + compression"};
+    for (int mode = 0; mode < 3; mode++)
+    {
+        chunkStore.dedup = mode > 0;
+        chunkStore.compress = mode > 1;
+        double start = nowSeconds();
+        size_t written = 0;
+        long f = 0;
+        for (FileNode *file = top->fChild; file; file = file->nSibling, f++)
+        {
+            const char *text = templates + (size_t)(f % (long)templateCount) * templateSize;
+            int header = snprintf(buffer, 64, "file %ld\n", f);
+            memcpy(buffer + header, text, templateSize);
+            contentWrite(file, buffer, (size_t)header + templateSize);
+            written += (size_t)header + templateSize;
+        }
+        double writeTime = nowSeconds() - start;
+
+        // Everything is cold here, so one pass compresses every chunk that shrinks
+        double compressTime = 0;
+        if (chunkStore.compress)
+        {
+            start = nowSeconds();
+            chunkStore.tick++;
+            chunkCompressStep(chunkStore.slotCapacity, 0);
+            compressTime = nowSeconds() - start;
+        }
+        size_t memory = contentStats.reserved + chunkStore.stored + chunkStore.count * sizeof(Chunk) +
+                        chunkStore.slotCapacity * sizeof(Chunk *);
+
+        start = nowSeconds();
+        size_t read = 0;
+        for (FileNode *file = top->fChild; file; file = file->nSibling)
+            read += contentRead(file, buffer);
+        double readTime = nowSeconds() - start;
+
+        printf("%-24s %10.1f %10.0f %12.1f %12.1f %10.0f\n", modes[mode], (writeTime + compressTime) * 1e3,
+               written / (writeTime + compressTime) / 1e6, memory / 1e6, readTime * 1e3, read / readTime / 1e6);
+        if (chunkStore.compress)
+            printf("%-24s %10.1f ms compressing %zu of %zu chunks\n", "", compressTime * 1e3, chunkStore.compressed,
+                   chunkStore.count);
+        if (chunkStore.count)
+            printf("%-24s dedup ratio %.2f, compression ratio %.2f\n", "",
+                   (double)chunkStore.logical / (double)chunkStore.unique,
+                   (double)chunkStore.unique / (double)chunkStore.stored);
+
+        for (FileNode *file = top->fChild; file; file = file->nSibling)
+            contentFree(file);
+    }
+    chunkStore.dedup = 1;
+    chunkStore.compress = 0;
+
+    free(templates);
+    free(buffer);
+    freeTree(top);
+    nodePoolDestroy();
+}
+
+// Render a synthetic tree as tree, ls -l (every node as an entry) and find (every path) did, with a formatted
+// print per line and a malloc'd timestamp per entry, then through the shared output buffer; output goes to
+// the null device so only the CPU cost is timed
+void benchRender(long total)
+{
+    long leaves = total / 10000;
+    if (leaves < 1)
+        leaves = 1;
+
+    FileNode *top = createNode("bench", "", TYPE_FOLDER);
+    if (!top)
+        return;
+    char name[32];
+    long created = 1;
+    for (long a = 0; a < 100; a++)
+    {
+        snprintf(name, sizeof(name), "d%ld", a);
+        FileNode *dir = createNode(name, "", TYPE_FOLDER);
+        if (!dir || !insertNode(top, dir))
+            break;
+        created += benchFillTree(dir, 100, leaves) + 1;
+    }
+    printf("%ld nodes\n", created);
+
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    if (!sink)
+    {
+        nodePoolDestroy();
+        return;
+    }
+    setvbuf(sink, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    FILE *saved = shellOut;
+    shellOut = sink;
+    printf("%-28s %12s %14s\n", "render", "ms", "Mlines/sec");
+
+    for (int pass = 0; pass < 6; pass++)
+    {
+        const char *labels[] = {"tree, fprintf per node", "tree, buffered", "ls -l, fprintf + malloc time",
+                                "ls -l, buffered", "find, strcat paths", "find, buffered"};
+        RenderBuffer render;
+        renderBegin(&render, sink, 0);
+        size_t lines = 0;
+        double start = nowSeconds();
+        if (pass == 1)
+        {
+            displayTree(&render, top, -1);
+            lines = render.entries;
+        }
+        for (FileNode *node = pass == 1 ? NULL : top; node; node = nextPreorder(top, node), lines++)
+        {
+            if (pass == 0)
+            {
+                int depth = 0;
+                for (FileNode *up = node; up != top; up = up->parent)
+                {
+                    depth++;
+                }
+                for (int i = 0; i < depth; i++)
+                {
+                    fprintf(sink, "  ");
+                }
+                fprintf(sink, node->type == TYPE_FOLDER ? "[DIR] %s/\n" : "     %s\n", node->fileName);
+            }
+            else if (pass == 2 || pass == 3)
+            {
+                ListEntry entry = listEntryOf(node);
+                if (pass == 3)
+                {
+                    printListEntry(&render, &entry, 1);
+                    continue;
+                }
+                char *modTime = (char *)malloc(TIME_TEXT_SIZE);
+                struct tm tm_info;
+#ifdef _WIN32
+                localtime_s(&tm_info, &entry.modified);
+#else
+                localtime_r(&entry.modified, &tm_info);
+#endif
+                strftime(modTime, TIME_TEXT_SIZE, "%b %d %H:%M", &tm_info);
+                fprintf(sink, "%c  %10zu  %s  %s\n", node->type == TYPE_FOLDER ? 'd' : '-', entry.size, modTime,
+                        node->fileName);
+                free(modTime);
+            }
+            else if (pass == 4)
+            {
+                char path[MAX_PATH_LENGTH] = "";
+                FileNode *stack[100];
+                int depth = -1;
+                for (FileNode *up = node; up && depth < 99; up = up->parent)
+                {
+                    stack[++depth] = up;
+                }
+                for (; depth >= 0; depth--)
                 {
-                    current = target;
+                    strcat(path, stack[depth]->fileName);
+                    if (depth > 0)
+                        strcat(path, "/");
                 }
-                else if (target)
+                fprintf(sink, "%s\n", path);
+            }
+            else
+            {
+                renderPath(&render, node);
+            }
+        }
+        renderEnd(&render);
+        fflush(sink);
+        double elapsed = nowSeconds() - start;
+        printf("%-28s %12.3f %14.1f\n", labels[pass], elapsed * 1e3, elapsed > 0 ? lines / elapsed / 1e6 : 0.0);
+    }
+
+    shellOut = saved;
+    fclose(sink);
+    nodePoolDestroy();
+}
+
+// Time writes, appends, creates and removes with no watch, with a watch on an untouched folder and with a
+// recursive watch on the root drained every 256 operations, to see what publishing adds to a mutation
+void benchWatch(long ops)
+{
+    Shell shell;
+    memset(&shell, 0, sizeof(shell));
+    shell.root = createNode("root", "", TYPE_FOLDER);
+#ifdef _WIN32
+    FILE *sink = fopen("NUL", "w");
+#else
+    FILE *sink = fopen("/dev/null", "w");
+#endif
+    if (!shell.root || !sink)
+    {
+        if (sink)
+            fclose(sink);
+        nodePoolDestroy();
+        return;
+    }
+    nameIndexAdd(shell.root);
+    FILE *saved = shellOut;
+    shellOut = sink;
+
+    char name[32];
+    FileNode *dirs[100];
+    for (int d = 0; d < 100; d++)
+    {
+        snprintf(name, sizeof(name), "d%d", d);
+        fsCreate(shell.root, name, TYPE_FOLDER);
+        dirs[d] = findChild(shell.root, name);
+    }
+    fsCreate(shell.root, "quiet", TYPE_FOLDER);
+    FileNode *quiet = findChild(shell.root, "quiet");
+
+    const char *labels[] = {"warm-up", "no watch", "watch on another folder", "recursive watch on /"};
+    const char data[] = "0123456789abcdef";
+    printf("%-28s %12s %10s %10s %10s\n", "mutations", "ns/op", "events", "folded", "dropped");
+    for (int pass = 0; pass < 4; pass++)
+    {
+        Watch *watch = NULL;
+        if (pass >= 2)
+            watch = watchAdd(&shell, pass == 2 ? quiet : shell.root, 1);
+        RenderBuffer render;
+        size_t events = 0;
+        double start = nowSeconds();
+        for (long i = 0; i < ops; i++)
+        {
+            FileNode *dir = dirs[(i / 4) % 100];
+            snprintf(name, sizeof(name), "f%ld", (i / 400) % 50);
+            if (i % 4 < 2)
+                fsWrite(dir, name, data, sizeof(data) - 1, i % 4);
+            else if (i % 4 == 2)
+                fsCreate(dir, "tmp", TYPE_FOLDER);
+            else
+                fsRemove(dir, "tmp", 0);
+            if (watch && i % 256 == 255 && renderBegin(&render, sink, 0))
+            {
+                events += watchDrain(watch, &render, 0);
+                renderEnd(&render);
+            }
+        }
+        if (watch && renderBegin(&render, sink, 0))
+        {
+            events += watchDrain(watch, &render, 0);
+            renderEnd(&render);
+        }
+        double elapsed = nowSeconds() - start;
+        if (pass)
+            printf("%-28s %12.1f %10zu %10zu %10zu\n", labels[pass], ops ? elapsed / ops * 1e9 : 0.0, events,
+                   watch ? watch->folded : 0, watch ? watch->dropped : 0);
+        if (watch)
+            watchRemove(&shell, watch);
+        reclaimStep(RECLAIM_BATCH);
+    }
+
+    shellOut = saved;
+    fclose(sink);
+    nodePoolDestroy();
+}
+
+// Dispatch --bench <name> [args]
+int runBenchmark(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "dir-insert";
+
+    if (strcmp(name, "dir-insert") == 0)
+    {
+        benchDirInsert(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "lazy") == 0)
+    {
+        benchLazy(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? argv[2] : "bench.img");
+        return 0;
+    }
+
+    if (strcmp(name, "dedup") == 0)
+    {
+        benchDedup(argc > 1 ? atol(argv[1]) : 20000);
+        return 0;
+    }
+
+    if (strcmp(name, "render") == 0)
+    {
+        benchRender(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "watch") == 0)
+    {
+        benchWatch(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "transfer") == 0)
+    {
+        benchTransfer(argc > 1 ? atol(argv[1]) : 300000, argc > 2 ? argv[2] : "bench.export");
+        return 0;
+    }
+
+    if (strcmp(name, "alloc") == 0)
+    {
+        benchAlloc(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "traverse") == 0)
+    {
+        benchTraverse(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "image") == 0)
+    {
+        benchImage(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? argv[2] : "bench.img");
+        return 0;
+    }
+
+    if (strcmp(name, "journal") == 0)
+    {
+        benchJournal(argc > 1 ? atol(argv[1]) : 200000, argc > 2 ? argv[2] : "bench.journal");
+        return 0;
+    }
+
+    if (strcmp(name, "parallel") == 0)
+    {
+        benchParallel(argc > 1 ? atol(argv[1]) : 2000000, argc > 2 ? atoi(argv[2]) : 0);
+        return 0;
+    }
+
+    if (strcmp(name, "glob") == 0)
+    {
+        benchGlob(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "snapshot") == 0)
+    {
+        benchSnapshot(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+
+    if (strcmp(name, "grep") == 0)
+    {
+        benchGrep(argc > 1 ? atol(argv[1]) : 256);
+        return 0;
+    }
+
+    if (strcmp(name, "paths") == 0)
+    {
+        benchPaths(argc > 1 ? atol(argv[1]) : 12, argc > 2 ? atol(argv[2]) : 2000000);
+        return 0;
+    }
+
+    if (strcmp(name, "workload") == 0 || strcmp(name, "suite") == 0)
+    {
+        return benchWorkloads(name[0] == 's', argc - 1, argv + 1);
+    }
+
+    if (strcmp(name, "server") == 0)
+    {
+        return benchServer(argc > 1 ? atoi(argv[1]) : 8, argc > 2 ? atol(argv[2]) : 100000,
+                           argc > 3 ? atoi(argv[3]) : 80, argc > 4 ? argv[4] : NULL);
+    }
+
+    printf("Unknown benchmark: %s\n", name);
+    printf("Available: dir-insert [entries], alloc [nodes], traverse [nodes], image [nodes] [path],\n"
+           "           journal [ops] [path], paths [depth] [lookups], grep [megabytes], glob [nodes],\n"
+           "           snapshot [nodes], lazy [nodes] [path], transfer [nodes] [path], dedup [files],\n"
+           "           render [nodes], watch [ops], parallel [nodes] [threads],\n"
+           "           server [clients] [ops] [read%%] [socket], workload [options], suite [options]\n"
+           "Workload options: --shape wide|deep|tree --nodes N --ops N --skew Z --seed S\n"
+           "                  --mix mkdir=5,touch=20,rm=15,mv=10,find=20,cat=20,write=10 --format text|csv|json\n");
+    return 1;
+}
+
+// Index of a command's counters, or of "other" for unknown commands
+size_t commandSlot(const char *name)
+{
+    for (size_t i = 0; i < COMMAND_COUNT - 1; i++)
+    {
+        if (name[0] == commandNames[i][0] && strcmp(name, commandNames[i]) == 0)
+            return i;
+    }
+    return COMMAND_COUNT - 1;
+}
+
+// Read the folder, file and byte counts under root from its totals, which also cover lazy stubs. With shape
+// set, walk the loaded nodes for the deepest level and the widest directory as well.
+void collectTreeGauges(FileNode *root, TreeGauges *gauges, int shape)
+{
+    memset(gauges, 0, sizeof(*gauges));
+    gauges->widest = NODE_NIL;
+    if (!root)
+        return;
+    SubtreeTotals totals = totalsRead(root);
+    gauges->folders = totals.folders + 1;
+    gauges->files = totals.files;
+    gauges->bytes = totals.bytes;
+    if (!shape)
+        return;
+
+    const NodeHot *hot = nodeTable.hot;
+    uint32_t top = root->id;
+    uint32_t id = top;
+    size_t depth = 0;
+
+    while (1)
+    {
+        if (hot[id].name & NODE_FOLDER_BIT)
+        {
+            size_t fanout = 0;
+            for (uint32_t child = hot[id].fChild; child != NODE_NIL; child = hot[child].nSibling)
+                fanout++;
+            if (fanout > gauges->maxFanout || gauges->widest == NODE_NIL)
+            {
+                gauges->maxFanout = fanout;
+                gauges->widest = id;
+            }
+        }
+        if (depth > gauges->maxDepth)
+            gauges->maxDepth = depth;
+
+        if (hot[id].fChild != NODE_NIL)
+        {
+            id = hot[id].fChild;
+            depth++;
+            continue;
+        }
+        while (id != top && hot[id].nSibling == NODE_NIL)
+        {
+            id = hot[id].parent;
+            depth--;
+        }
+        if (id == top)
+            break;
+        id = hot[id].nSibling;
+    }
+}
+
+// Per-command calls, errors and latency percentiles
+void printCommandStats(void)
+{
+    fprintf(shellOut, "Commands (latency from the first %d calls, then 1 in %d)\n", STATS_SAMPLE_ALL,
+            STATS_SAMPLE_EVERY);
+    fprintf(shellOut, "  %-11s %10s %8s %10s %10s %10s %10s\n", "command", "calls", "errors", "p50 us", "p99 us",
+            "p999 us", "max us");
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        const CommandStats *stats = &commandStats[i];
+        if (!stats->calls)
+            continue;
+        fprintf(shellOut, "  %-11s %10lu %8lu %10.2f %10.2f %10.2f %10.2f\n", commandNames[i],
+                (unsigned long)stats->calls, (unsigned long)stats->errors, histPercentile(&stats->latency, 0.50) / 1e3,
+                histPercentile(&stats->latency, 0.99) / 1e3, histPercentile(&stats->latency, 0.999) / 1e3,
+                stats->latency.maxNs / 1e3);
+    }
+}
+
+// Tree shape gauges
+void printTreeStats(FileNode *root)
+{
+    TreeGauges gauges;
+    collectTreeGauges(root, &gauges, 1);
+
+    fprintf(shellOut, "Tree\n");
+    fprintf(shellOut, "  nodes            : %zu (%zu folders, %zu files)\n", gauges.folders + gauges.files,
+            gauges.folders, gauges.files);
+    fprintf(shellOut, "  file bytes       : %zu\n", gauges.bytes);
+    fprintf(shellOut, "  max depth        : %zu\n", gauges.maxDepth);
+    fprintf(shellOut, "  widest directory : %s (%zu entries)\n",
+            gauges.widest == NODE_NIL ? "-" : nodeTableName(gauges.widest), gauges.maxFanout);
+    if (lazy.dirs)
+        fprintf(shellOut, "  (depth and width cover loaded directories only)\n");
+}
+
+// One JSON object with the tree counts, allocator usage and every command's counters. It leaves out the
+// shape gauges, so periodic dumps never walk the tree.
+void printStatsJson(FILE *out, FileNode *root)
+{
+    TreeGauges gauges;
+    collectTreeGauges(root, &gauges, 0);
+
+    fprintf(out, "{\"time\":%ld,\"nodes\":%zu,\"folders\":%zu,\"files\":%zu,\"file_bytes\":%zu,"
+                 "\"content_bytes\":%zu,\"content_reserved\":%zu,\"content_shared\":%zu,\"chunks\":%zu,"
+                 "\"chunks_compressed\":%zu,\"chunk_logical\":%zu,\"chunk_unique\":%zu,\"chunk_stored\":%zu,"
+                 "\"pool_live\":%zu,\"pool_free\":%zu,\"pool_slabs\":%zu,\"names\":%zu,\"name_bytes\":%zu,"
+                 "\"commands\":{",
+            (long)time(NULL), gauges.folders + gauges.files, gauges.folders, gauges.files, gauges.bytes,
+            contentStats.bytes, contentStats.reserved, contentStats.shared, chunkStore.count,
+            chunkStore.compressed, chunkStore.logical, chunkStore.unique, chunkStore.stored, nodePool.liveNodes,
+            nodePool.freeNodes, nodePool.slabCount, nameArena.liveNames, nameArena.bytes);
+
+    int first = 1;
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        const CommandStats *stats = &commandStats[i];
+        if (!stats->calls)
+            continue;
+        fprintf(out, "%s\"%s\":{\"calls\":%lu,\"errors\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+                     "\"max_ns\":%lu}",
+                first ? "" : ",", commandNames[i], (unsigned long)stats->calls, (unsigned long)stats->errors,
+                (unsigned long)histPercentile(&stats->latency, 0.50),
+                (unsigned long)histPercentile(&stats->latency, 0.99),
+                (unsigned long)histPercentile(&stats->latency, 0.999), (unsigned long)stats->latency.maxNs);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+}
+
+// Append a snapshot to the stats file and schedule the next one
+void statsDumpWrite(FileNode *root)
+{
+    statsDump.next = time(NULL) + statsDump.interval;
+
+    FILE *out = fopen(statsDump.path, "a");
+    if (!out)
+    {
+        fprintf(shellOut, "Error: Cannot write stats to '%s'\n", statsDump.path);
+        statsDump.path = NULL;
+        return;
+    }
+    serverLockStats();
+    printStatsJson(out, root);
+    serverUnlockStats();
+    fclose(out);
+}
+
+// Tokenize one command from *line in place, honouring quotes; stops after an unquoted ';'
+int splitCommand(char **line, char **args, int maxArgs)
+{
+    char *in = *line;
+    int argc = 0;
+
+    while (*in)
+    {
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (!*in)
+            break;
+        if (*in == ';')
+        {
+            in++;
+            break;
+        }
+
+        // Quoted and unquoted pieces are joined into one token, written over the input
+        char *out = in;
+        char *token = out;
+        while (*in && *in != ' ' && *in != '\t' && *in != ';')
+        {
+            if (*in == '"' || *in == '\'')
+            {
+                char quote = *in++;
+                while (*in && *in != quote)
                 {
-                    printf("Error: '%s' is not a directory\n", dir);
+                    if (quote == '"' && *in == '\\' && (in[1] == '"' || in[1] == '\\'))
+                        in++;
+                    *out++ = *in++;
                 }
-                else
+                if (*in)
+                    in++;
+            }
+            else
+            {
+                *out++ = *in++;
+            }
+        }
+
+        char next = *in;
+        if (next)
+            in++;
+        *out = '\0';
+        if (argc < maxArgs)
+            args[argc++] = token;
+        if (next == ';')
+            break;
+    }
+
+    *line = in;
+    return argc;
+}
+
+// Run every ';'-separated command on a line
+int runLine(Shell *shell, char *line)
+{
+    char *args[MAX_ARGS];
+    int status = CMD_OK;
+
+    while (*line)
+    {
+        int argc = splitCommand(&line, args, MAX_ARGS);
+        if (!argc || args[0][0] == '#')
+            continue;
+
+        // In server mode only one writing command runs at a time; readers skip the writer lock
+        int exclusive = !server.active || commandExclusive(argc, args);
+        if (exclusive)
+            serverLockWriter();
+        else
+            serverLockReader();
+
+        // Count every call but only time a sample, so the clock reads stay off the common path
+        CommandStats *stats = &commandStats[commandSlot(args[0])];
+        serverLockStats();
+        int timed = stats->calls < STATS_SAMPLE_ALL || stats->calls % STATS_SAMPLE_EVERY == 0;
+        serverUnlockStats();
+        uint64_t began = timed ? nowNanos() : 0;
+        int result = executeCommand(shell, argc, args);
+        uint64_t elapsed = timed ? nowNanos() - began : 0;
+        serverLockStats();
+        if (timed)
+            histRecord(&stats->latency, elapsed);
+        stats->calls++;
+        stats->errors += result == CMD_ERROR;
+        serverUnlockStats();
+
+        if (exclusive)
+        {
+            if (statsDump.path && statsDump.interval > 0 && time(NULL) >= statsDump.next)
+            {
+                statsDumpWrite(shell->root);
+            }
+
+            // Time-triggered group commit, and a checkpoint once replay would get long
+            journalCommit(0);
+            if (journal.file && shell->imagePath && (long)journal.bytes > journal.checkpointBytes)
+            {
+                checkpoint(shell->root, shell->imagePath);
+            }
+
+            // Free part of any subtree rm -r left behind, outside the command's own latency
+            reclaimStep(RECLAIM_BATCH);
+            // Evict cold directories of a lazily opened image, once nothing holds their nodes
+            lazyTrim(shell->root, shell->current);
+            // Compress a slice of the chunks that no command has touched for a while
+            if (chunkStore.compress)
+            {
+                chunkStore.tick++;
+                chunkCompressStep(CHUNK_SCAN_SLOTS, CHUNK_COLD_COMMANDS);
+            }
+            serverUnlockWriter();
+        }
+        else
+        {
+            serverUnlockReader();
+        }
+
+        if (result == CMD_EXIT)
+            return CMD_EXIT;
+        if (result == CMD_ERROR)
+        {
+            status = CMD_ERROR;
+            if (shell->stopOnError)
+                break;
+        }
+    }
+    return status;
+}
+
+// Whether a command may change the tree or walk all of it; in server mode those hold the writer lock
+int commandExclusive(int argc, char **argv)
+{
+    static const char *readers[] = {"ls", "cd",     "pwd", "cat",  "find",  "tree",
+                                    "du", "events", "man", "help", "clear", "exit"};
+
+    if (strcmp(argv[0], "echo") == 0)
+        return argc >= 3 && (strcmp(argv[argc - 2], ">") == 0 || strcmp(argv[argc - 2], ">>") == 0);
+    for (size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); i++)
+    {
+        if (strcmp(argv[0], readers[i]) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Whether stdin is an interactive terminal
+int stdinIsTerminal(void)
+{
+#ifdef _WIN32
+    return _isatty(_fileno(stdin));
+#else
+    return isatty(fileno(stdin));
+#endif
+}
+
+// Execute one tokenized command; returns CMD_OK, CMD_ERROR or CMD_EXIT
+int executeCommand(Shell *shell, int argc, char **argv)
+{
+    const char *cmd = argv[0];
+    const char *arg1 = argc > 1 ? argv[1] : NULL;
+    const char *arg2 = argc > 2 ? argv[2] : NULL;
+    FileNode *current = shell->current;
+    FileNode *root = shell->root;
+    char leaf[MAX_NAME];
+
+    if (strcmp(cmd, "exit") == 0)
+    {
+        return CMD_EXIT;
+    }
+    else if (strcmp(cmd, "man") == 0 || strcmp(cmd, "help") == 0)
+    {
+        displayHelp();
+    }
+    else if (strcmp(cmd, "clear") == 0 && server.active)
+    {
+        fprintf(shellOut, "\033[H\033[2J");
+    }
+    else if (strcmp(cmd, "clear") == 0)
+    {
+#ifdef _WIN32
+        system("cls");
+#else
+        system("clear");
+#endif
+    }
+    else if (strcmp(cmd, "ls") == 0)
+    {
+        // Any of --sort, --limit, --after or --prefix lists in order (by name unless --sort says otherwise)
+        ListOptions options = {0, LIST_BY_NAME, 0, NULL, NULL, NULL};
+        int ordered = 0;
+        const char *path = NULL;
+        for (int i = 1; i < argc; i++)
+        {
+            const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+            if (strcmp(argv[i], "-l") == 0)
+            {
+                options.details = 1;
+                continue;
+            }
+            if (strcmp(argv[i], "--sort") == 0 && value && strcmp(value, "name") == 0)
+                options.order = LIST_BY_NAME;
+            else if (strcmp(argv[i], "--sort") == 0 && value && strcmp(value, "mtime") == 0)
+                options.order = LIST_BY_MTIME;
+            else if (strcmp(argv[i], "--sort") == 0 && value && strcmp(value, "size") == 0)
+                options.order = LIST_BY_SIZE;
+            else if (strcmp(argv[i], "--limit") == 0 && value && atol(value) > 0)
+                options.limit = (size_t)atol(value);
+            else if (strcmp(argv[i], "--after") == 0 && value)
+                options.after = value;
+            else if (strcmp(argv[i], "--prefix") == 0 && value)
+                options.prefix = value;
+            else if (argv[i][0] != '-' && !path)
+            {
+                path = argv[i];
+                continue;
+            }
+            else
+            {
+                fprintf(shellOut, "Usage: ls [-l] [--sort name|mtime|size] [--limit N] [--after name] "
+                                  "[--prefix text] [path]\n");
+                return CMD_ERROR;
+            }
+            ordered = 1;
+            i++;
+        }
+
+        // A glob in the last component lists the matching entries of the directory before it, in name order
+        char dirPath[MAX_PATH_LENGTH];
+        const char *pattern = path ? strrchr(path, '/') : NULL;
+        pattern = pattern ? pattern + 1 : path;
+        Regex glob;
+        if (pattern && strpbrk(pattern, "*?["))
+        {
+            size_t length = (size_t)(pattern - path);
+            if (length >= sizeof(dirPath))
+            {
+                fprintf(shellOut, "Error: Path too long\n");
+                return CMD_ERROR;
+            }
+            memcpy(dirPath, path, length);
+            dirPath[length > 1 ? length - 1 : length] = '\0';
+            if (!globCompile(&glob, pattern))
+            {
+                regexFree(&glob);
+                return CMD_ERROR;
+            }
+            options.glob = &glob;
+            path = length ? dirPath : NULL;
+            ordered = 1;
+        }
+
+        FileNode *locked;
+        FileNode *dir = resolveShared(root, current, path, &locked);
+        if (!dir || (options.glob && dir->type != TYPE_FOLDER))
+        {
+            if (dir)
+            {
+                fprintf(shellOut, "Error: '%s' is not a directory\n", dir->fileName);
+                dirUnlockShared(locked);
+            }
+            else
+            {
+                fprintf(shellOut, "Error: '%s' not found\n", path ? path : ".");
+            }
+            if (options.glob)
+                regexFree(&glob);
+            return CMD_ERROR;
+        }
+        if (dir->type != TYPE_FOLDER)
+            fprintf(shellOut, "%s\n", dir->fileName);
+        else if (ordered)
+            listOrdered(dir, &options);
+        else
+            listDirectory(dir, options.details);
+        dirUnlockShared(locked);
+        if (options.glob)
+            regexFree(&glob);
+    }
+    else if (strcmp(cmd, "pwd") == 0)
+    {
+        serverLockNamespace();
+        printPath(current);
+        serverUnlockNamespace();
+    }
+    else if (strcmp(cmd, "cd") == 0)
+    {
+        if (!arg1)
+        {
+            fprintf(shellOut, "Usage: cd <directory>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *locked;
+        FileNode *target = resolveShared(root, current, arg1, &locked);
+        if (!target)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        if (target->type != TYPE_FOLDER)
+        {
+            fprintf(shellOut, "Error: '%s' is not a directory\n", arg1);
+            dirUnlockShared(locked);
+            return CMD_ERROR;
+        }
+
+        // A session's current directory stays pinned so another session cannot remove it
+        if (server.active)
+        {
+            nodePin(target, 1);
+            nodePin(current, -1);
+        }
+        shell->current = target;
+        dirUnlockShared(locked);
+    }
+    else if (strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "touch") == 0)
+    {
+        int folder = cmd[0] == 'm';
+        if (!arg1)
+        {
+            fprintf(shellOut, folder ? "Usage: mkdir <directory_name>\n" : "Usage: touch <filename>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *dir = resolveParent(root, current, arg1, leaf);
+        if (!dir)
+        {
+            fprintf(shellOut, "Error: No such directory for '%s'\n", arg1);
+            return CMD_ERROR;
+        }
+        return fsCreate(dir, leaf, folder ? TYPE_FOLDER : TYPE_FILE) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "rm") == 0)
+    {
+        int recursive = arg1 && strcmp(arg1, "-r") == 0;
+        if (recursive)
+            arg1 = arg2;
+        if (!arg1)
+        {
+            fprintf(shellOut, "Usage: rm [-r] <name>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *dir = resolveParent(root, current, arg1, leaf);
+        FileNode *target = dir ? findChild(dir, leaf) : NULL;
+        if (!target)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        if (isInSubtree(target, current))
+        {
+            fprintf(shellOut, "Error: Cannot remove the current directory\n");
+            return CMD_ERROR;
+        }
+        return fsRemove(dir, leaf, recursive) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "cat") == 0)
+    {
+        if (!arg1)
+        {
+            fprintf(shellOut, "Usage: cat <filename>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *locked;
+        FileNode *child = resolveShared(root, current, arg1, &locked);
+        if (!child)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        else if (child->type != TYPE_FILE)
+        {
+            fprintf(shellOut, "Error: '%s' is a directory\n", arg1);
+            dirUnlockShared(locked);
+            return CMD_ERROR;
+        }
+        contentPrint(child, shellOut);
+        dirUnlockShared(locked);
+        fprintf(shellOut, "\n");
+    }
+    else if (strcmp(cmd, "echo") == 0)
+    {
+        // echo [text...] (>|>>) <file>; without text the content comes from the next input line
+        int redirect = argc >= 3 && (strcmp(argv[argc - 2], ">") == 0 || strcmp(argv[argc - 2], ">>") == 0);
+        if (!redirect)
+        {
+            if (argc > 1 && (strcmp(argv[argc - 1], ">") == 0 || strcmp(argv[argc - 1], ">>") == 0))
+            {
+                fprintf(shellOut, "Usage: echo [text] > <filename>\n");
+                return CMD_ERROR;
+            }
+            for (int i = 1; i < argc; i++)
+            {
+                fprintf(shellOut, i > 1 ? " %s" : "%s", argv[i]);
+            }
+            fprintf(shellOut, "\n");
+            return CMD_OK;
+        }
+
+        int append = argv[argc - 2][1] == '>';
+        const char *name = argv[argc - 1];
+        int status = CMD_OK;
+        FileNode *dir = resolveParent(root, current, name, leaf);
+        if (!dir)
+        {
+            fprintf(shellOut, "Error: No such directory for '%s'\n", name);
+            return CMD_ERROR;
+        }
+
+        if (argc == 3)
+        {
+            if (!shell->input)
+            {
+                fprintf(shellOut, "Error: No content given for '%s'\n", name);
+                return CMD_ERROR;
+            }
+            if (shell->interactive)
+            {
+                fprintf(shellOut, "Enter content (press Enter to finish):\n");
+            }
+            size_t length = 0;
+            char *content = readLine(shell->input, &length);
+            if (content)
+            {
+                status = fsWrite(dir, leaf, content, length, append) ? CMD_OK : CMD_ERROR;
+                free(content);
+            }
+            return status;
+        }
+
+        // Join the inline words with single spaces
+        size_t length = 0;
+        for (int i = 1; i < argc - 2; i++)
+        {
+            length += strlen(argv[i]) + 1;
+        }
+        char *content = (char *)malloc(length);
+        if (!content)
+        {
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            return CMD_ERROR;
+        }
+        size_t used = 0;
+        for (int i = 1; i < argc - 2; i++)
+        {
+            if (i > 1)
+                content[used++] = ' ';
+            size_t part = strlen(argv[i]);
+            memcpy(content + used, argv[i], part);
+            used += part;
+        }
+        status = fsWrite(dir, leaf, content, used, append) ? CMD_OK : CMD_ERROR;
+        free(content);
+        return status;
+    }
+    else if (strcmp(cmd, "find") == 0)
+    {
+        const char *name = NULL;
+        size_t maxEntries = 0;
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--max") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+            {
+                maxEntries = (size_t)atol(argv[++i]);
+                continue;
+            }
+            if (name || (argv[i][0] == '-' && argv[i][1] == '-'))
+            {
+                name = NULL;
+                break;
+            }
+            name = argv[i];
+        }
+        if (!name)
+        {
+            fprintf(shellOut, "Usage: find [--max N] <name|glob>\n");
+            return CMD_ERROR;
+        }
+
+        // Walk only the ring of nodes carrying this name (or the names matching a glob),
+        // skipping subtrees rm -r has not freed yet
+        Regex glob;
+        int isGlob = strpbrk(name, "*?[") != NULL;
+        if (isGlob && !globCompile(&glob, name))
+        {
+            regexFree(&glob);
+            return CMD_ERROR;
+        }
+        RenderBuffer render;
+        if (!renderBegin(&render, shellOut, maxEntries))
+        {
+            if (isGlob)
+                regexFree(&glob);
+            return CMD_ERROR;
+        }
+        lazyLoadAll(root);
+        serverLockNamespace();
+        size_t matches = 0;
+        if (isGlob)
+        {
+            matches = findGlob(root, &glob, &render);
+        }
+        else
+        {
+            FileNode *head = nameIndexLookup(name);
+            for (FileNode *found = head; found; found = found->nameNext == head ? NULL : found->nameNext)
+            {
+                if (isInSubtree(root, found))
                 {
-                    printf("Error: '%s' not found\n", dir);
+                    if (!renderEntry(&render))
+                        break;
+                    renderPath(&render, found);
+                    matches++;
                 }
             }
         }
-        else if (strcmp(cmd, "mkdir") == 0)
+        serverUnlockNamespace();
+        renderEnd(&render);
+        if (isGlob)
+            regexFree(&glob);
+        if (!matches)
+        {
+            fprintf(shellOut, "'%s' not found\n", name);
+        }
+    }
+    else if (strcmp(cmd, "du") == 0)
+    {
+        int summary = arg1 && strcmp(arg1, "-s") == 0;
+        const char *path = summary ? arg2 : arg1;
+        FileNode *locked;
+        FileNode *dir = resolveShared(root, current, path, &locked);
+        if (!dir)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", path);
+            return CMD_ERROR;
+        }
+        if (dir->type != TYPE_FOLDER)
+        {
+            SubtreeTotals totals = totalsOf(dir);
+            printUsageLine(shellOut, &totals, dir->fileName, "");
+        }
+        else
+        {
+            diskUsage(dir, path ? path : ".", summary, shellOut);
+        }
+        dirUnlockShared(locked);
+    }
+    else if (strcmp(cmd, "grep") == 0)
+    {
+        // Flags may be given separately or together (-rc) before the pattern
+        GrepOptions options = {NULL, 0, 0, GREP_LINES};
+        int i = 1;
+        for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+        {
+            for (const char *flag = argv[i] + 1; *flag; flag++)
+            {
+                if (*flag == 'r')
+                    options.recursive = 1;
+                else if (*flag == 'F')
+                    options.fixed = 1;
+                else if (*flag == 'c' && options.mode != GREP_FILES)
+                    options.mode = GREP_COUNT;
+                else if (*flag == 'l')
+                    options.mode = GREP_FILES;
+                else if (*flag != 'c')
+                    i = argc;
+            }
+        }
+        if (i >= argc || !argv[i][0] || i + 2 < argc)
+        {
+            fprintf(shellOut, "Usage: grep [-r] [-c] [-l] [-F] <pattern> [path]\n");
+            return CMD_ERROR;
+        }
+        options.pattern = argv[i];
+        const char *path = i + 1 < argc ? argv[i + 1] : NULL;
+        FileNode *top = path ? resolvePath(root, current, path) : current;
+        if (!top)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", path);
+            return CMD_ERROR;
+        }
+        if (options.recursive)
+            lazyLoadAll(top);
+        else
+            lazyTouch(top);
+        if (grepTree(top, &options, shellOut) < 0)
+            return CMD_ERROR;
+    }
+    else if (strcmp(cmd, "tree") == 0)
+    {
+        const char *path = NULL;
+        int maxDepth = -1;
+        size_t maxEntries = 0;
+        for (int i = 1; i < argc; i++)
+        {
+            const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+            if (strcmp(argv[i], "-L") == 0 && value && atoi(value) > 0)
+                maxDepth = atoi(value);
+            else if (strcmp(argv[i], "--max") == 0 && value && atol(value) > 0)
+                maxEntries = (size_t)atol(value);
+            else if (argv[i][0] != '-' && !path)
+            {
+                path = argv[i];
+                continue;
+            }
+            else
+            {
+                fprintf(shellOut, "Usage: tree [-L depth] [--max N] [path]\n");
+                return CMD_ERROR;
+            }
+            i++;
+        }
+
+        FileNode *locked;
+        FileNode *top = resolveShared(root, current, path, &locked);
+        if (!top)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", path);
+            return CMD_ERROR;
+        }
+        RenderBuffer render;
+        if (renderBegin(&render, shellOut, maxEntries))
+        {
+            // A depth limit only needs the folders it opens loaded
+            if (maxDepth < 0)
+                lazyLoadAll(top);
+            else
+                lazyLoadDepth(top, maxDepth);
+            if (server.active)
+                displayTreeShared(&render, top, maxDepth);
+            else
+                displayTree(&render, top, maxDepth);
+            renderEnd(&render);
+        }
+        dirUnlockShared(locked);
+    }
+    else if (strcmp(cmd, "watch") == 0)
+    {
+        if (argc == 1)
+        {
+            watchPrint(shell);
+            return CMD_OK;
+        }
+        const char *path = NULL;
+        int recursive = 0;
+        int valid = 1;
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-r") == 0)
+                recursive = 1;
+            else if (!path && argv[i][0] != '-')
+                path = argv[i];
+            else
+                valid = 0;
+        }
+        if (!path || !valid)
+        {
+            fprintf(shellOut, "Usage: watch [<path> [-r]]\n");
+            return CMD_ERROR;
+        }
+        FileNode *target = resolvePath(root, current, path);
+        if (!target)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", path);
+            return CMD_ERROR;
+        }
+        Watch *watch = watchAdd(shell, target, recursive);
+        if (!watch)
+            return CMD_ERROR;
+        fprintf(shellOut, "Watching %s%s (id %u)\n", watch->label, recursive ? " recursively" : "", watch->id);
+    }
+    else if (strcmp(cmd, "unwatch") == 0)
+    {
+        Watch *watch = shell->watches;
+        while (watch && arg1 && strcmp(arg1, "all") != 0 && watch->id != (uint32_t)atol(arg1))
+        {
+            watch = watch->ownerNext;
+        }
+        if (!arg1 || argc > 2)
+        {
+            fprintf(shellOut, "Usage: unwatch <id|all>\n");
+            return CMD_ERROR;
+        }
+        if (strcmp(arg1, "all") == 0)
+        {
+            watchRemoveAll(shell);
+        }
+        else if (!watch)
+        {
+            fprintf(shellOut, "Error: No watch '%s'\n", arg1);
+            return CMD_ERROR;
+        }
+        else
+        {
+            watchRemove(shell, watch);
+        }
+    }
+    else if (strcmp(cmd, "events") == 0)
+    {
+        // Take a batch from each of this session's rings without any lock; other sessions keep writing
+        size_t max = 0;
+        if (argc == 3 && strcmp(arg1, "--max") == 0 && atol(arg2) > 0)
+        {
+            max = (size_t)atol(arg2);
+        }
+        else if (argc != 1)
+        {
+            fprintf(shellOut, "Usage: events [--max N]\n");
+            return CMD_ERROR;
+        }
+        RenderBuffer render;
+        if (!renderBegin(&render, shellOut, 0))
+            return CMD_ERROR;
+        size_t lines = 0;
+        for (Watch *watch = shell->watches; watch && (!max || lines < max); watch = watch->ownerNext)
+        {
+            lines += watchDrain(watch, &render, max ? max - lines : 0);
+        }
+        renderEnd(&render);
+    }
+    else if (strcmp(cmd, "save") == 0)
+    {
+        const char *path = arg1 ? arg1 : shell->imagePath;
+        if (!path)
+        {
+            fprintf(shellOut, "Usage: save <image>\n");
+            return CMD_ERROR;
+        }
+        return saveImage(shell->root, path) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "load") == 0)
+    {
+        if (!arg1)
+        {
+            fprintf(shellOut, "Usage: load <image>\n");
+            return CMD_ERROR;
+        }
+        if (journal.file && !shell->imagePath)
+        {
+            fprintf(shellOut, "Error: load needs --image when journaling\n");
+            return CMD_ERROR;
+        }
+        if (server.active)
+        {
+            fprintf(shellOut, "Error: load is not available while serving other sessions\n");
+            return CMD_ERROR;
+        }
+
+        // Build the new tree first so a bad image leaves the current one intact
+        uint64_t sequence = journal.sequence;
+        FileNode *loaded = loadImage(arg1);
+        if (!loaded)
+            return CMD_ERROR;
+        watchDetachAll();
+        freeTreeParallel(shell->root);
+        shell->root = loaded;
+        shell->current = loaded;
+        treeDirty = 1;
+
+        // Keep sequence numbers increasing and drop records for the old tree
+        if (journal.sequence < sequence)
+            journal.sequence = sequence;
+        if (journal.file)
+            return checkpoint(shell->root, shell->imagePath) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "snapshot") == 0)
+    {
+        int diff = arg1 && strcmp(arg1, "diff") == 0;
+        int byId = diff || (arg1 && (strcmp(arg1, "delete") == 0 || strcmp(arg1, "restore") == 0));
+        int plain = arg1 && (strcmp(arg1, "create") == 0 || strcmp(arg1, "list") == 0);
+        if (!(plain && argc == 2) && !(byId && (argc == 3 || (diff && argc == 4))))
+        {
+            fprintf(shellOut, "Usage: snapshot create | list | delete <id> | restore <id> | diff <id> [id]\n");
+            return CMD_ERROR;
+        }
+
+        Snapshot *snapshot = byId ? snapshotFind(arg2) : NULL;
+        Snapshot *other = argc == 4 ? snapshotFind(argv[3]) : NULL;
+        if ((byId && !snapshot) || (argc == 4 && !other))
+        {
+            fprintf(shellOut, "Error: No snapshot '%s'\n", !snapshot ? arg2 : argv[3]);
+            return CMD_ERROR;
+        }
+
+        if (strcmp(arg1, "create") == 0)
+        {
+            snapshot = snapshotCreate(root);
+            if (!snapshot)
+                return CMD_ERROR;
+            fprintf(shellOut, "Snapshot %u created (%zu versions built)\n", snapshot->id, snapshots.built);
+        }
+        else if (strcmp(arg1, "list") == 0)
+        {
+            snapshotList();
+        }
+        else if (strcmp(arg1, "delete") == 0)
+        {
+            snapshotDelete(snapshot, root);
+        }
+        else if (strcmp(arg1, "diff") == 0)
+        {
+            // Against the live tree unless a second snapshot is given
+            SnapNode *to = other ? other->root : snapFreeze(root);
+            if (!to)
+                return CMD_ERROR;
+            snapshotDiff(snapshot->root, to, shellOut);
+        }
+        else
+        {
+            if (journal.file && !shell->imagePath)
+            {
+                fprintf(shellOut, "Error: snapshot restore needs --image when journaling\n");
+                return CMD_ERROR;
+            }
+            if (server.active)
+            {
+                fprintf(shellOut, "Error: snapshot restore is not available while serving other sessions\n");
+                return CMD_ERROR;
+            }
+
+            FileNode *restored = snapshotRestore(snapshot);
+            if (!restored)
+                return CMD_ERROR;
+            watchDetachAll();
+            freeTreeParallel(shell->root);
+            shell->root = restored;
+            shell->current = restored;
+            fprintf(shellOut, "Restored snapshot %u\n", snapshot->id);
+
+            // The journal cannot replay a restore, so fold it into the image as load does
+            if (journal.file)
+                return checkpoint(shell->root, shell->imagePath) ? CMD_OK : CMD_ERROR;
+        }
+    }
+    else if (strcmp(cmd, "import") == 0)
+    {
+        if (!arg1)
+        {
+            fprintf(shellOut, "Usage: import <host-dir | file.tar> [directory]\n");
+            return CMD_ERROR;
+        }
+        if (journal.file && !shell->imagePath)
+        {
+            fprintf(shellOut, "Error: import needs --image when journaling\n");
+            return CMD_ERROR;
+        }
+        if (server.active)
+        {
+            fprintf(shellOut, "Error: import is not available while serving other sessions\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *dest = arg2 ? resolvePath(root, current, arg2) : current;
+        if (!dest || dest->type != TYPE_FOLDER)
+        {
+            fprintf(shellOut, "Error: '%s' is not a valid directory\n", arg2);
+            return CMD_ERROR;
+        }
+        TransferCounts counts = {0};
+        if (!importTree(arg1, dest, &counts))
+            return CMD_ERROR;
+
+        // Imported entries bypass the journal, so fold them into the image as load does
+        if (journal.file)
+            return checkpoint(shell->root, shell->imagePath) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "export") == 0)
+    {
+        if (!arg1 || !arg2)
+        {
+            fprintf(shellOut, "Usage: export <path> <host-dir | file.tar>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *top = resolvePath(root, current, arg1);
+        if (!top)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        TransferCounts counts = {0};
+        return exportTree(top, arg2, &counts) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "checkpoint") == 0)
+    {
+        return checkpoint(shell->root, shell->imagePath) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "stats") == 0)
+    {
+        if (arg1 && strcmp(arg1, "--json") != 0 && strcmp(arg1, "reset") != 0)
+        {
+            fprintf(shellOut, "Usage: stats [--json | reset]\n");
+            return CMD_ERROR;
+        }
+
+        serverLockStats();
+        if (arg1 && strcmp(arg1, "--json") == 0)
+        {
+            printStatsJson(shellOut, shell->root);
+        }
+        else if (arg1)
+        {
+            memset(commandStats, 0, sizeof(commandStats));
+        }
+        else
+        {
+            printCommandStats();
+            printTreeStats(shell->root);
+            printPoolStats();
+            printNameStats();
+            printPathStats();
+            printContentStats();
+            if (lazy.dirs)
+                printLazyStats();
+            if (server.active)
+                printServerStats();
+        }
+        serverUnlockStats();
+    }
+    else if (strcmp(cmd, "rename") == 0)
+    {
+        if (!arg1 || !arg2)
+        {
+            fprintf(shellOut, "Usage: rename <old_name> <new_name>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *child = resolvePath(root, current, arg1);
+        if (!child || !child->parent)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        return fsRename(child, arg2) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "mv") == 0)
+    {
+        if (!arg1 || !arg2)
+        {
+            fprintf(shellOut, "Usage: mv <source> <destination>\n");
+            return CMD_ERROR;
+        }
+
+        FileNode *srcNode = resolvePath(root, current, arg1);
+        FileNode *dstNode = resolvePath(root, current, arg2);
+        if (!srcNode || !dstNode)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", srcNode ? arg2 : arg1);
+            return CMD_ERROR;
+        }
+        return fsMove(srcNode, dstNode) ? CMD_OK : CMD_ERROR;
+    }
+    else if (strcmp(cmd, "cp") == 0)
+    {
+        int recursive = arg1 && strcmp(arg1, "-r") == 0;
+        if (recursive)
+        {
+            arg1 = arg2;
+            arg2 = argc > 3 ? argv[3] : NULL;
+        }
+        if (!arg1 || !arg2)
+        {
+            fprintf(shellOut, "Usage: cp [-r] <source> <destination>\n");
+            return CMD_ERROR;
+        }
+
+        // cp a/x b copies into directory b as x; cp a/x b/y copies as y
+        FileNode *src = resolvePath(root, current, arg1);
+        if (!src)
+        {
+            fprintf(shellOut, "Error: '%s' not found\n", arg1);
+            return CMD_ERROR;
+        }
+        FileNode *dst = resolvePath(root, current, arg2);
+        if (dst && dst->type == TYPE_FOLDER)
+            return fsCopy(src, dst, src->fileName, recursive) ? CMD_OK : CMD_ERROR;
+
+        FileNode *dir = resolveParent(root, current, arg2, leaf);
+        if (!dir)
+        {
+            fprintf(shellOut, "Error: No such directory for '%s'\n", arg2);
+            return CMD_ERROR;
+        }
+        return fsCopy(src, dir, leaf, recursive) ? CMD_OK : CMD_ERROR;
+    }
+    else
+    {
+        fprintf(shellOut, "Command not found: %s\n", cmd);
+        fprintf(shellOut, "Type 'man' for help\n");
+        return CMD_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+#ifndef _WIN32
+// Wake the accept loop on SIGINT/SIGTERM so main can checkpoint and exit
+void serverSignal(int signal)
+{
+    (void)signal;
+    server.stopping = 1;
+}
+
+// List a session for sessionInside
+void sessionListAdd(Session *session)
+{
+    serverLockWriter();
+    session->prev = NULL;
+    session->next = server.sessionList;
+    if (session->next)
+        session->next->prev = session;
+    server.sessionList = session;
+    serverUnlockWriter();
+}
+
+void sessionListRemove(Session *session)
+{
+    serverLockWriter();
+    if (session->prev)
+        session->prev->next = session->next;
+    else
+        server.sessionList = session->next;
+    if (session->next)
+        session->next->prev = session->prev;
+    serverUnlockWriter();
+}
+
+// Run one session: each input line is a command line, and a NUL byte ends its reply
+void *sessionMain(void *arg)
+{
+    Session *session = (Session *)arg;
+    shellOut = session->output;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    while (readLineBuffer(session->input, &line, &capacity, &length))
+    {
+        // Stage the reply in memory and send it once the line is done, so no command writes to the
+        // socket while it holds a lock and a slow client only ever stalls its own session
+        char *reply = NULL;
+        size_t replySize = 0;
+        shellOut = open_memstream(&reply, &replySize);
+        if (!shellOut)
+        {
+            shellOut = session->output;
+            fprintf(shellOut, "Error: Memory allocation failed\n");
+            fputc('\0', shellOut);
+            fflush(shellOut);
+            break;
+        }
+        int result = runLine(&session->shell, line);
+        fputc('\0', shellOut);
+        fclose(shellOut);
+        shellOut = session->output;
+        int sent = fwrite(reply, 1, replySize, shellOut) == replySize && fflush(shellOut) == 0;
+        free(reply);
+        if (!sent || result == CMD_EXIT)
+            break;
+    }
+
+    free(line);
+    renderRelease();
+    serverLockWriter();
+    watchRemoveAll(&session->shell);
+    serverUnlockWriter();
+    sessionListRemove(session);
+    nodePin(session->shell.current, -1);
+    fclose(session->input);
+    fclose(session->output);
+    free(session);
+    sharedCounterAdd(&server.sessions, -1);
+    return NULL;
+}
+#endif
+
+// Bind a Unix domain socket at path and set up the server locks; returns the listening socket or -1
+int serverListen(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    fprintf(shellOut, "Error: Server mode needs Unix domain sockets\n");
+    return -1;
+#else
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(shellOut, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0)
+    {
+        fprintf(shellOut, "Error: Cannot listen on '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (!server.active)
+    {
+        // Writer-preferring stripes keep a busy directory from starving writers. Readers never take a
+        // stripe twice (heldStripes) and wait only for higher stripes than they hold, so a queued
+        // writer cannot close a cycle between them (dirLockSharedOrdered)
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        for (int i = 0; i < DIR_LOCK_STRIPES; i++)
+        {
+            pthread_rwlock_init(&server.dirLocks[i], &attributes);
+        }
+        pthread_rwlock_init(&server.quiesceLock, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+        pthread_rwlock_init(&server.namespaceLock, NULL);
+        pthread_mutex_init(&server.writerLock, NULL);
+        pthread_mutex_init(&server.statsLock, NULL);
+        server.active = 1;
+    }
+    server.stopping = 0;
+    server.listenFd = fd;
+    signal(SIGPIPE, SIG_IGN);
+    return fd;
+#endif
+}
+
+// Accept connections until stopped, starting a session thread for each one
+void serverAccept(Shell *shell, int fd)
+{
+#ifdef _WIN32
+    (void)shell;
+    (void)fd;
+#else
+    while (!server.stopping)
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        Session *session = (Session *)calloc(1, sizeof(Session));
+        int copy = session ? dup(client) : -1;
+        if (session)
         {
-            char *name = strtok(NULL, " ");
-            if (!name)
-            {
-                printf("Usage: mkdir <directory_name>\n");
-            }
-            else
-            {
-                FileNode *newDir = createNode(name, "", TYPE_FOLDER);
-                if (newDir)
-                {
-                    if (!insertNode(current, newDir))
-                    {
-                        free(newDir);
-                    }
-                }
-            }
+            session->input = fdopen(client, "r");
+            session->output = copy >= 0 ? fdopen(copy, "w") : NULL;
         }
-        else if (strcmp(cmd, "touch") == 0)
+        if (!session || !session->input || !session->output)
         {
-            char *name = strtok(NULL, " ");
-            if (!name)
-            {
-                printf("Usage: touch <filename>\n");
-            }
+            if (session && session->input)
+                fclose(session->input);
             else
-            {
-                FileNode *newFile = createNode(name, "", TYPE_FILE);
-                if (newFile)
-                {
-                    if (!insertNode(current, newFile))
-                    {
-                        free(newFile);
-                    }
-                }
-            }
+                close(client);
+            if (session && session->output)
+                fclose(session->output);
+            else if (copy >= 0)
+                close(copy);
+            free(session);
+            continue;
         }
-        else if (strcmp(cmd, "rm") == 0)
+
+        // Sessions never read echo content from their input: every line there is a command line
+        setvbuf(session->output, NULL, _IOFBF, SESSION_BUFFER_SIZE);
+        session->shell = *shell;
+        session->shell.current = shell->root;
+        session->shell.input = NULL;
+        session->shell.interactive = 0;
+        session->shell.stopOnError = 0;
+        session->shell.watches = NULL;
+        nodePin(shell->root, 1);
+        sessionListAdd(session);
+
+        pthread_t thread;
+        sharedCounterAdd(&server.sessions, 1);
+        server.sessionsTotal++;
+        if (pthread_create(&thread, NULL, sessionMain, session) != 0)
         {
-            char *name = strtok(NULL, " ");
-            if (!name)
-            {
-                printf("Usage: rm <name>\n");
-            }
-            else
-            {
-                deleteNode(root, current, name);
-            }
+            sharedCounterAdd(&server.sessions, -1);
+            sessionListRemove(session);
+            nodePin(shell->root, -1);
+            fclose(session->input);
+            fclose(session->output);
+            free(session);
+            continue;
         }
-        else if (strcmp(cmd, "cat") == 0)
+        pthread_detach(thread);
+    }
+#endif
+}
+
+// Session and lock contention counters
+void printServerStats(void)
+{
+    fprintf(shellOut, "Server\n");
+    fprintf(shellOut, "  sessions         : %zu open, %zu total\n", sharedCounterAdd(&server.sessions, 0),
+            server.sessionsTotal);
+    fprintf(shellOut, "  writer back-offs : %zu\n", server.writerBackoffs);
+    fprintf(shellOut, "  reader restarts  : %zu\n", sharedCounterAdd(&server.readerRestarts, 0));
+}
+
+// Connect to a server socket; returns the socket or -1
+int serverConnect(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    return -1;
+#else
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+#endif
+}
+
+#ifndef _WIN32
+// Write all of data to a socket
+int writeAll(int fd, const char *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0)
+            return 0;
+        data += written;
+        length -= (size_t)written;
+    }
+    return 1;
+}
+#endif
+
+// Send one command line (a newline is added if missing) and copy its reply, up to the closing NUL,
+// to out if given; *error (if given) is set when the reply is an error message.
+// Returns the reply length, or -1 if the connection failed.
+long serverRequest(int fd, const char *line, FILE *out, int *error)
+{
+#ifdef _WIN32
+    (void)fd;
+    (void)line;
+    (void)out;
+    (void)error;
+    return -1;
+#else
+    size_t length = strlen(line);
+    if (!writeAll(fd, line, length) || ((!length || line[length - 1] != '\n') && !writeAll(fd, "\n", 1)))
+        return -1;
+
+    char buffer[4096];
+    long total = 0;
+    while (1)
+    {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got <= 0)
+            return -1;
+        char *end = (char *)memchr(buffer, '\0', (size_t)got);
+        size_t used = end ? (size_t)(end - buffer) : (size_t)got;
+        if (error && !total)
+            *error = used >= 6 && memcmp(buffer, "Error:", 6) == 0;
+        if (out)
+            fwrite(buffer, 1, used, out);
+        total += (long)used;
+        if (end)
+            return total;
+    }
+#endif
+}
+
+// Client for --connect: send each input line (or the -c commands) and print the replies
+int runClient(const char *path, const char *commands)
+{
+    int fd = serverConnect(path);
+    if (fd < 0)
+    {
+        fprintf(shellOut, "Error: Cannot connect to '%s'\n", path);
+        return 1;
+    }
+
+    int status = 0;
+    if (commands)
+    {
+        status = serverRequest(fd, commands, shellOut, NULL) < 0;
+    }
+    else
+    {
+        char *line = NULL;
+        size_t capacity = 0;
+        size_t length = 0;
+        int interactive = stdinIsTerminal();
+        while (1)
         {
-            char *name = strtok(NULL, " ");
-            if (!name)
+            if (interactive)
             {
-                printf("Usage: cat <filename>\n");
+                fprintf(shellOut, "%s> ", path);
+                fflush(shellOut);
             }
-            else
+            if (!readLineBuffer(stdin, &line, &capacity, &length))
+                break;
+            if (serverRequest(fd, line, shellOut, NULL) < 0)
             {
-                FileNode *child = current->fChild;
-                while (child)
-                {
-                    if (strcmp(child->fileName, name) == 0)
-                    {
-                        if (child->type == TYPE_FILE)
-                        {
-                            printf("%s\n", child->fileContent);
-                        }
-                        else
-                        {
-                            printf("Error: '%s' is a directory\n", name);
-                        }
-                        break;
-                    }
-                    child = child->nSibling;
-                }
-                if (!child)
-                {
-                    printf("Error: '%s' not found\n", name);
-                }
+                status = 1;
+                break;
             }
+            fflush(shellOut);
         }
-        else if (strcmp(cmd, "echo") == 0)
+        free(line);
+    }
+#ifndef _WIN32
+    close(fd);
+#endif
+    return status;
+}
+
+// Serve shell's tree on a Unix domain socket until SIGINT/SIGTERM. Returns with the writer lock held,
+// so the final checkpoint sees no half-applied command; sessions still connected are simply dropped.
+int runServer(Shell *shell, const char *path)
+{
+    int fd = serverListen(path);
+    if (fd < 0)
+        return 0;
+    fprintf(shellOut, "Serving on %s\n", path);
+    fflush(shellOut);
+
+#ifndef _WIN32
+    // No SA_RESTART, so a signal interrupts accept
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serverSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    serverAccept(shell, fd);
+    close(fd);
+    unlink(path);
+#endif
+    serverLockWriter();
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    shellOut = stdout;
+    searchKernelSelect();
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        return runBenchmark(argc - 2, argv + 2);
+    }
+
+    const char *imagePath = NULL;
+    const char *journalPath = NULL;
+    const char *commands = NULL;
+    const char *scriptPath = NULL;
+    const char *serverPath = NULL;
+    const char *connectPath = NULL;
+    int stopOnError = 0;
+    int lazyImage = -1;
+    long lazyMegabytes = LAZY_BUDGET_MB;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
         {
-            char *arrow = strtok(NULL, " ");
-            if (arrow && strcmp(arrow, ">") == 0)
-            {
-                char *name = strtok(NULL, " ");
-                if (!name)
-                {
-                    printf("Usage: echo > <filename>\n");
-                }
-                else
-                {
-                    printf("Enter content (press Enter to finish):\n");
-                    char content[MAX_CONTENT];
-                    if (fgets(content, MAX_CONTENT, stdin))
-                    {
-                        content[strcspn(content, "\n")] = 0;
-
-                        FileNode *child = current->fChild;
-                        while (child)
-                        {
-                            if (strcmp(child->fileName, name) == 0)
-                            {
-                                if (child->type == TYPE_FILE)
-                                {
-                                    strncpy(child->fileContent, content, MAX_CONTENT - 1);
-                                    child->modifiedTime = time(NULL);
-                                }
-                                else
-                                {
-                                    printf("Error: '%s' is a directory\n", name);
-                                }
-                                break;
-                            }
-                            child = child->nSibling;
-                        }
-
-                        if (!child)
-                        {
-                            FileNode *newFile = createNode(name, content, TYPE_FILE);
-                            if (newFile)
-                            {
-                                if (!insertNode(current, newFile))
-                                {
-                                    free(newFile);
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            else
-            {
-                printf("Usage: echo > <filename>\n");
-            }
+            imagePath = argv[++i];
         }
-        else if (strcmp(cmd, "find") == 0)
+        else if (strcmp(argv[i], "--lazy") == 0)
         {
-            char *name = strtok(NULL, " ");
-            if (!name)
-            {
-                printf("Usage: find <name>\n");
-            }
-            else
-            {
-                FileNode *found = findNode(root, name);
-                if (found)
-                {
-                    printPath(found);
-                }
-                else
-                {
-                    printf("'%s' not found\n", name);
-                }
-            }
+            lazyImage = 1;
         }
-        else if (strcmp(cmd, "tree") == 0)
+        else if (strcmp(argv[i], "--eager") == 0)
         {
-            displayTree(current, 0);
+            lazyImage = 0;
         }
-        else if (strcmp(cmd, "rename") == 0)
+        else if (strcmp(argv[i], "--lazy-mb") == 0 && i + 1 < argc)
         {
-            char *oldName = strtok(NULL, " ");
-            char *newName = strtok(NULL, " ");
-            if (!oldName || !newName)
-            {
-                printf("Usage: rename <old_name> <new_name>\n");
-            }
-            else if (!isValidName(newName))
-            {
-                printf("Error: Invalid name '%s'\n", newName);
-            }
-            else
-            {
-                FileNode *child = current->fChild;
-                while (child)
-                {
-                    if (strcmp(child->fileName, oldName) == 0)
-                    {
-                        strncpy(child->fileName, newName, MAX_NAME - 1);
-                        child->modifiedTime = time(NULL);
-                        break;
-                    }
-                    child = child->nSibling;
-                }
-                if (!child)
-                {
-                    printf("Error: '%s' not found\n", oldName);
-                }
-            }
+            lazyImage = 1;
+            lazyMegabytes = atol(argv[++i]);
         }
-        else if (strcmp(cmd, "mv") == 0)
+        else if (strcmp(argv[i], "--compress") == 0)
         {
-            char *src = strtok(NULL, " ");
-            char *dst = strtok(NULL, " ");
-            if (!src || !dst)
-            {
-                printf("Usage: mv <source> <destination>\n");
-            }
-            else
-            {
-                FileNode *srcNode = findNode(root, src);
-                FileNode *dstNode = findNode(root, dst);
+            chunkStore.compress = 1;
+        }
+        else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc)
+        {
+            journalPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sync-ops") == 0 && i + 1 < argc)
+        {
+            journal.syncEvery = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sync-ms") == 0 && i + 1 < argc)
+        {
+            journal.syncMillis = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--checkpoint-mb") == 0 && i + 1 < argc)
+        {
+            journal.checkpointBytes = atol(argv[++i]) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            commands = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            scriptPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--stop-on-error") == 0)
+        {
+            stopOnError = 1;
+        }
+        else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc)
+        {
+            statsDump.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc)
+        {
+            statsDump.interval = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            int threads = atoi(argv[++i]);
+            workerPool.threads = threads < 1 ? 1 : threads > MAX_WALK_THREADS ? MAX_WALK_THREADS : threads;
+        }
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+        {
+            serverPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+        {
+            connectPath = argv[++i];
+        }
+        else
+        {
+            fprintf(shellOut, "Usage: %s [--image <file> [--lazy | --eager] [--lazy-mb M]] [--compress]\n"
+                    "       [--journal <file> [--sync-ops N] [--sync-ms T] [--checkpoint-mb M]]\n"
+                    "       [-c \"cmd; cmd\" | -f <script>] [-e]\n"
+                    "       [--stats-file <file> [--stats-interval S]] [--threads N] [--server <socket>]\n"
+                    "       | --connect <socket> [-c \"cmd; cmd\"] | --bench <name> [args]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
 
-                if (!srcNode)
-                {
-                    printf("Error: '%s' not found\n", src);
-                }
-                else if (!dstNode || dstNode->type != TYPE_FOLDER)
-                {
-                    printf("Error: '%s' is not a valid directory\n", dst);
-                }
-                else
-                {
-                    // Remove from old location
-                    FileNode *srcParent = srcNode->parent;
-                    if (srcParent)
-                    {
-                        FileNode *child = srcParent->fChild;
-                        FileNode *prev = NULL;
-
-                        while (child)
-                        {
-                            if (child == srcNode)
-                            {
-                                if (prev)
-                                {
-                                    prev->nSibling = child->nSibling;
-                                }
-                                else
-                                {
-                                    srcParent->fChild = child->nSibling;
-                                }
-                                child->nSibling = NULL;
-                                break;
-                            }
-                            prev = child;
-                            child = child->nSibling;
-                        }
-                    }
+    if (connectPath)
+    {
+        return runClient(connectPath, commands);
+    }
+    // Loading and evicting change the tree under readers, so lazy images are for a single shell
+    if (lazyImage == 1 && serverPath)
+    {
+        fprintf(shellOut, "Error: --lazy cannot be combined with --server\n");
+        return 1;
+    }
+    // A single shell opens images lazily unless told otherwise; a server loads them in full
+    if (lazyImage < 0)
+        lazyImage = !serverPath;
+    // Compression swaps chunk buffers that server readers may be copying from
+    if (chunkStore.compress && serverPath)
+    {
+        fprintf(shellOut, "Error: --compress cannot be combined with --server\n");
+        return 1;
+    }
+    lazy.budget = lazyMegabytes > 0 ? (size_t)lazyMegabytes * 1024 * 1024 : 0;
 
-                    // Insert in new location
-                    insertNode(dstNode, srcNode);
-                }
-            }
+    // Batch mode: no prompts and block-buffered output
+    Shell shell;
+    shell.imagePath = imagePath;
+    shell.stopOnError = stopOnError;
+    shell.watches = NULL;
+    shell.input = stdin;
+    shell.interactive = !commands && !scriptPath && !serverPath && stdinIsTerminal();
+    if (!shell.interactive)
+    {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+    if (scriptPath)
+    {
+        shell.input = fopen(scriptPath, "r");
+        if (!shell.input)
+        {
+            fprintf(shellOut, "Error: Cannot open script '%s'\n", scriptPath);
+            return 1;
+        }
+    }
+    else if (commands)
+    {
+        shell.input = NULL;
+    }
+
+    // Load the image if one exists, otherwise create an empty root directory
+    FileNode *root = NULL;
+    FILE *existing = imagePath ? fopen(imagePath, "rb") : NULL;
+    if (existing)
+    {
+        fclose(existing);
+        root = lazyImage ? lazyOpen(imagePath) : loadImage(imagePath);
+        if (!root)
+            return 1;
+        treeDirty = 0;
+    }
+    else
+    {
+        root = createNode("root", "", TYPE_FOLDER);
+        if (!root)
+        {
+            fprintf(shellOut, "Failed to create root directory\n");
+            return 1;
+        }
+        nameIndexAdd(root);
+    }
+
+    // Bring the tree up to date with mutations logged since the image was written
+    if (journalPath)
+    {
+        journal.path = journalPath;
+        if (!journalReplay(root) || !journalOpen(journalPath))
+            return 1;
+    }
+
+    shell.root = root;
+    shell.current = root;
+    int status = CMD_OK;
+    statsDump.next = time(NULL) + statsDump.interval;
+
+    if (shell.interactive)
+    {
+        fprintf(shellOut, "Welcome to Enhanced File System Simulator\n");
+        fprintf(shellOut, "Type 'man' for help, 'exit' to quit\n\n");
+    }
+
+    if (serverPath)
+    {
+        if (!runServer(&shell, serverPath))
+            return 1;
+    }
+    else if (commands)
+    {
+        char *copy = strdup(commands);
+        if (copy)
+        {
+            status = runLine(&shell, copy);
+            free(copy);
         }
-        else if (strcmp(cmd, "cp") == 0)
+    }
+    else
+    {
+        char *line = NULL;
+        size_t capacity = 0;
+        size_t length = 0;
+
+        while (1)
         {
-            char *src = strtok(NULL, " ");
-            char *dst = strtok(NULL, " ");
-            if (!src || !dst)
+            if (shell.interactive)
             {
-                printf("Usage: cp <source> <destination>\n");
+                fprintf(shellOut, "user@filesystem:~/%s$ ", shell.current->fileName);
+                fflush(shellOut);
             }
-            else
+
+            if (!readLineBuffer(shell.input, &line, &capacity, &length))
             {
-                FileNode *child = current->fChild;
-                while (child)
-                {
-                    if (strcmp(child->fileName, src) == 0)
-                    {
-                        if (child->type == TYPE_FILE)
-                        {
-                            FileNode *copy = createNode(dst, child->fileContent, TYPE_FILE);
-                            if (copy)
-                            {
-                                if (!insertNode(current, copy))
-                                {
-                                    free(copy);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            printf("Error: Cannot copy directories\n");
-                        }
-                        break;
-                    }
-                    child = child->nSibling;
-                }
-                if (!child)
-                {
-                    printf("Error: '%s' not found\n", src);
-                }
+                break;
+            }
+
+            int result = runLine(&shell, line);
+            if (result == CMD_EXIT)
+                break;
+            if (result == CMD_ERROR)
+            {
+                status = CMD_ERROR;
+                if (shell.stopOnError)
+                    break;
             }
         }
-        else
-        {
-            printf("Command not found: %s\n", cmd);
-            printf("Type 'man' for help\n");
-        }
+        free(line);
     }
 
-    printf("\nCleaning up...\n");
-    freeTree(root);
-    printf("Goodbye!\n");
+    if (scriptPath)
+    {
+        fclose(shell.input);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    // A tree that nothing changed is still the image on disk
+    if (imagePath && treeDirty)
+    {
+        checkpoint(shell.root, imagePath);
+    }
+    journalClose();
+    if (statsDump.path)
+    {
+        statsDumpWrite(shell.root);
+    }
+
+    if (shell.interactive)
+    {
+        fprintf(shellOut, "\nCleaning up...\n");
+    }
+    // Sessions may still be reading the tree, so a server leaves it to process exit
+    watchRemoveAll(&shell);
+    if (!serverPath)
+        nodePoolDestroy();
+    renderRelease();
+    if (shell.interactive)
+    {
+        fprintf(shellOut, "Goodbye!\n");
+    }
+
+    return status == CMD_OK ? 0 : 1;
+}